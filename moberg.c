@@ -19,11 +19,12 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 #define _POSIX_C_SOURCE  200809L
-#define _GNU_SOURCE               /* scandirat */
+#define _GNU_SOURCE               /* asprintf */
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <basedir.h>
@@ -31,26 +32,103 @@
 #include <dirent.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 #include <moberg.h>
+#include <moberg_cache.h>
 #include <moberg_config.h>
+#include <moberg_device.h>
 #include <moberg_inline.h>
 #include <moberg_module.h>
 #include <moberg_parser.h>
+#include <moberg_reactor.h>
+#include <moberg_stats.h>
+#include <moberg_stream.h>
 
+#define CHANNEL_KINDS (chan_ENCODERIN + 1)
+
+/* Threads are spread over this many table reader counters */
+#define TABLE_READER_SLOTS 64
+#define CACHE_LINE 64
+
+/* Channels indexed by (kind, index), one compact allocation that is
+   never changed once published. Readers bracket their use with
+   table_enter/table_leave, a replaced table is released when no
+   readers remain (RCU style). Readers only look up entries and take
+   references in between, drivers are called after table_leave */
+struct channel_table {
+  struct moberg_config *config;
+  int count[CHANNEL_KINDS];
+  struct channel_entry {
+    struct channel_record *record;
+    struct moberg_device *lazy;           /* Load first (record NULL) */
+  } *entry[CHANNEL_KINDS];                /* Into slot[] */
+  struct channel_entry slot[];
+};
+
+/* The channel table is replaced by moberg_reload, lookups need no
+   locking; the counters below are updated atomically and channel
+   open/close is serialized per device */
 struct moberg {
   int should_free;
+  int freed;
   int open_channels;
-  struct moberg_config *config;
-  struct channel_list {
-    int capacity;
-    struct moberg_channel **value;
-  } analog_in, analog_out, digital_in, digital_out, encoder_in;
+  int lazy;  /* Drivers are loaded on first use (MOBERG_LAZY) */
+  unsigned long generation;
+  struct moberg_reactor *reactor;
+  struct channel_table *table;
+  /* Serializes reload, channel records and statistics */
+  pthread_mutex_t lock;
+  /* Devices dropped by moberg_reload, kept until their channels are
+     closed */
+  struct moberg_config *retired;
+  /* Table that install_channel/install_lazy fill in */
+  struct channel_table *building;
+  /* All channel records, in order of creation */
+  struct channel_record *record, **record_tail;
   struct deferred_action {
     struct deferred_action *next;
     int (*action)(void *param);
     void *param;
   } *deferred_action;
+  struct {
+    int enabled;
+  } stats;
+  /* Readers of table, by thread (see reader_slot), one per cache line */
+  struct table_reader {
+    int count;
+    char pad[CACHE_LINE - sizeof(int)];
+  } table_reader[TABLE_READER_SLOTS];
+};
+
+/* Reader slot of the calling thread, handed out round robin */
+static __thread int thread_reader_slot = -1;
+static int next_reader_slot;
 
+/* Libmoberg side of an installed channel, shared by the tables that
+   publish it. A record is kept while it is published or open, so a
+   channel that moberg_reload drops while open stays usable until it
+   is closed */
+struct channel_record {
+  struct channel_record *next;
+  enum moberg_channel_kind kind;
+  int index;
+  int refs;                             /* Tables and open handles */
+  int open;                             /* Open handles */
+  struct moberg_channel *channel;       /* Holds a reference */
+  union moberg_channel_action action;   /* Handed out by *_open */
+  struct instrument *instrument;        /* NULL if not instrumented */
+};
+
+/* Instrumented channel, the action handed out by *_open has the
+   instrument as context and calls the channel action. Channels are
+   instrumented when statistics are enabled (device != NULL) or when
+   their driver is not reentrant (locked) */
+struct instrument {
+  int locked;
+  struct moberg_channel *channel;
+  struct moberg_latency latency;
+  struct moberg_latency *device;
 };
 
 static void run_deferred_actions(struct moberg *moberg)
@@ -63,82 +141,85 @@ static void run_deferred_actions(struct moberg *moberg)
   }
 }
 
-static int channel_list_set(struct channel_list *list,
-                            int index,
-                            struct moberg_channel *value)
+static int reader_slot(void)
 {
-  if (list->capacity <= index) {
-    int capacity;
-    for (capacity = 2 ; capacity <= index ; capacity *= 2);
-    void *new = realloc(list->value, capacity * sizeof(*list->value));
-    if (!new) {
-      goto err;
-    }
-    void *p = new + list->capacity * sizeof(*list->value);
-    memset(p, 0, (capacity - list->capacity) * sizeof(*list->value));
-    list->value = new;
-    list->capacity = capacity;
+  if (thread_reader_slot < 0) {
+    thread_reader_slot = (__atomic_fetch_add(&next_reader_slot, 1,
+                                             __ATOMIC_RELAXED) &
+                          (TABLE_READER_SLOTS - 1));
   }
+  return thread_reader_slot;
+}
 
-  if (0 <= index && index < list->capacity) {
-    list->value[index] = value;
-    return 1;
+static struct channel_table *table_enter(struct moberg *moberg)
+{
+  __atomic_add_fetch(&moberg->table_reader[reader_slot()].count, 1,
+                     __ATOMIC_SEQ_CST);
+  return __atomic_load_n(&moberg->table, __ATOMIC_SEQ_CST);
+}
+
+static void table_leave(struct moberg *moberg)
+{
+  __atomic_sub_fetch(&moberg->table_reader[reader_slot()].count, 1,
+                     __ATOMIC_RELEASE);
+}
+
+static struct channel_entry *table_lookup(struct channel_table *table,
+                                          enum moberg_channel_kind kind,
+                                          int index)
+{
+  if (table && 0 <= index && index < table->count[kind] &&
+      table->entry[kind][index].record) {
+    return &table->entry[kind][index];
   }
-err:
-  return 0;
+  return NULL;
 }
-                                   
-static int channel_list_get(struct channel_list *list,
-                            int index,
-                            struct moberg_channel **value)
+
+/* Device to load before kind[index] can be used, NULL if none */
+static struct moberg_device *table_lazy(struct channel_table *table,
+                                        enum moberg_channel_kind kind,
+                                        int index)
 {
-  if (0 <= index && index < list->capacity) {
-    *value = list->value[index];
-    return 1;
+  if (table && 0 <= index && index < table->count[kind]) {
+    return table->entry[kind][index].lazy;
   }
-  return 0;
+  return NULL;
 }
 
-static void channel_list_free(struct channel_list *list)
+static struct channel_table *table_alloc(const int *count)
 {
-  for (int i = 0 ; i < list->capacity ; i++) {
-    if (list->value[i]) {
-      list->value[i]->down(list->value[i]);
+  int total = 0;
+  for (int kind = 0 ; kind < CHANNEL_KINDS ; kind++) {
+    total += count[kind];
+  }
+  struct channel_table *table = calloc(1, sizeof(*table) +
+                                       total * sizeof(table->slot[0]));
+  if (table) {
+    struct channel_entry *slot = table->slot;
+    for (int kind = 0 ; kind < CHANNEL_KINDS ; kind++) {
+      table->count[kind] = count[kind];
+      table->entry[kind] = slot;
+      slot += count[kind];
     }
   }
-  free(list->value);
+  return table;
 }
 
-static void parse_config_at(
-  struct moberg *moberg,
-  int dirfd,
-  const char *pathname)
-{
-  if (dirfd >= 0) {
-    int fd = openat(dirfd, pathname, O_RDONLY);
-    if (fd >= 0) {
-      struct stat statbuf;
-      if (fstat(fd, &statbuf) == 0) {
-        char *buf = malloc(statbuf.st_size + 1);
-        if (buf) {
-          if (read(fd, buf, statbuf.st_size) == statbuf.st_size) {
-            buf[statbuf.st_size] = 0;
-          }
-          struct moberg_config *config = moberg_parse(moberg, buf);
-          if (config) {
-            if (! moberg->config) {
-              moberg->config = config;
-            } else {
-              moberg_config_join(moberg->config, config);
-              moberg_config_free(config);
-            }
-          }
-          free(buf);
-        }
-      }
-      close(fd);
+/* Makes table visible to new readers, returns the old table once the
+   readers that might still use it have left (readers never block, so
+   this is short); must not be called between table_enter/table_leave */
+static struct channel_table *table_replace(struct moberg *moberg,
+                                           struct channel_table *table)
+{
+  struct channel_table *old = __atomic_exchange_n(&moberg->table, table,
+                                                  __ATOMIC_SEQ_CST);
+  for (int i = 0 ; i < TABLE_READER_SLOTS ; i++) {
+    while (__atomic_load_n(&moberg->table_reader[i].count,
+                           __ATOMIC_SEQ_CST) != 0) {
+      sched_yield();
     }
   }
+  return old;
 }
 
 static int conf_filter(
@@ -152,399 +233,1831 @@ static int conf_filter(
   }
 }
 
-static void parse_config_dir_at(
-  struct moberg *config,
-  int dirfd)
+struct config_sources {
+  int count;
+  int size;
+  struct moberg_cache_source *source;
+};
+
+static void config_sources_free(struct config_sources *sources)
 {
-  if (dirfd >= 0) {
-    struct dirent **entry = NULL;
-    int n = scandirat(dirfd, ".", &entry, conf_filter, alphasort);
-    for (int i = 0 ; i < n ; i++) {
-      parse_config_at(config, dirfd, entry[i]->d_name);
-      free(entry[i]);
-    }
-    free(entry);
+  for (int i = 0 ; i < sources->count ; i++) {
+    free(sources->source[i].path);
   }
-  
+  free(sources->source);
 }
 
-static struct moberg_status install_channel(
-  struct moberg *moberg,
-  int index,
-  struct moberg_device* device,
-  struct moberg_channel *channel)
+static int config_source_add(struct config_sources *sources,
+                             const char *dir,
+                             const char *name)
 {
-  if (channel) {
-    struct moberg_channel *old = NULL;
-    switch (channel->kind) {
-      case chan_ANALOGIN:
-        channel_list_get(&moberg->analog_in, index, &old);
-        break;
-      case chan_ANALOGOUT:
-        channel_list_get(&moberg->analog_out, index, &old);
-        break;
-      case chan_DIGITALIN:
-        channel_list_get(&moberg->digital_in, index, &old);
-        break;
-      case chan_DIGITALOUT:
-        channel_list_get(&moberg->digital_out, index, &old);
-        break;
-      case chan_ENCODERIN:
-        channel_list_get(&moberg->encoder_in, index, &old);
-        break;
-    }
-    if (old) {
-      old->down(old);
-    }
-    channel->up(channel);
-    /* TODO: Clean up old channel */
-    switch (channel->kind) {
-      case chan_ANALOGIN:
-        if (! channel_list_set(&moberg->analog_in, index, channel)) {
-          goto err;
-        }
-        break;
-      case chan_ANALOGOUT:
-        if (! channel_list_set(&moberg->analog_out, index, channel)) {
-          goto err;
-        }
-        break;
-      case chan_DIGITALIN:
-        if (! channel_list_set(&moberg->digital_in, index, channel)) {
-          goto err;
-        }
-        break;
-      case chan_DIGITALOUT:
-        if (! channel_list_set(&moberg->digital_out, index, channel)) {
-          goto err;
-        }
-        break;
-      case chan_ENCODERIN:
-        if (! channel_list_set(&moberg->encoder_in, index, channel)) {
-          goto err;
-        }
-        break;
+  struct stat statbuf;
+  char *path;
+  if (asprintf(&path, "%s/%s", dir, name) < 0) {
+    return 0;
+  }
+  if (stat(path, &statbuf) != 0 || ! S_ISREG(statbuf.st_mode)) {
+    free(path);
+    return 1;
+  }
+  if (sources->count == sources->size) {
+    int size = sources->size ? 2 * sources->size : 8;
+    void *source = realloc(sources->source, size * sizeof(*sources->source));
+    if (! source) {
+      free(path);
+      return 0;
     }
+    sources->source = source;
+    sources->size = size;
   }
-  return MOBERG_OK;
-err:
-  return MOBERG_ERRNO(ENOMEM);
+  struct moberg_cache_source *source = &sources->source[sources->count++];
+  source->path = path;
+  source->size = statbuf.st_size;
+  source->mtime = statbuf.st_mtim.tv_sec * 1000000000LL +
+    statbuf.st_mtim.tv_nsec;
+  source->hash = 0;
+  return 1;
 }
 
-static int install_config(struct moberg *moberg)
+/* Configuration files in the order they are parsed, moberg.conf and
+   then moberg.d/\*.conf of each xdg config directory */
+static int config_sources(struct config_sources *sources)
 {
-  struct moberg_channel_install install = {
-    .context=moberg,
-    .channel=install_channel
-  };
-  if (! moberg->config) {
-    fprintf(stderr, "No moberg configuration found\n");
-    return 0;
-  } else {
-    return moberg_config_install_channels(moberg->config, &install);
+  int ok = 1;
+  sources->count = 0;
+  sources->size = 0;
+  sources->source = NULL;
+  const char * const *config_paths = xdgSearchableConfigDirectories(NULL);
+  const char * const *path;
+  for (path = config_paths ; *path ; path++) {
+    ok = ok && config_source_add(sources, *path, "moberg.conf");
+    char *dir;
+    if (ok && asprintf(&dir, "%s/moberg.d", *path) >= 0) {
+      struct dirent **entry = NULL;
+      int n = scandir(dir, &entry, conf_filter, alphasort);
+      for (int i = 0 ; i < n ; i++) {
+        ok = ok && config_source_add(sources, dir, entry[i]->d_name);
+        free(entry[i]);
+      }
+      free(entry);
+      free(dir);
+    }
+    free((char*)*path);
+  }
+  free((const char **)config_paths);
+  if (! ok) {
+    config_sources_free(sources);
   }
+  return ok;
 }
 
-int moberg_OK(struct moberg_status status)
+/* Contents of source (also hashed), NULL if it can not be read */
+static char *config_source_read(struct moberg_cache_source *source)
 {
-  return status.result == 0;
+  char *result = NULL;
+  int fd = open(source->path, O_RDONLY);
+  if (fd >= 0) {
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) == 0) {
+      result = malloc(statbuf.st_size + 1);
+      if (result) {
+        if (read(fd, result, statbuf.st_size) == statbuf.st_size) {
+          result[statbuf.st_size] = 0;
+          source->size = statbuf.st_size;
+          source->mtime = statbuf.st_mtim.tv_sec * 1000000000LL +
+            statbuf.st_mtim.tv_nsec;
+          source->hash = moberg_cache_hash(result, statbuf.st_size);
+        } else {
+          free(result);
+          result = NULL;
+        }
+      }
+    }
+    close(fd);
+  }
+  return result;
 }
 
-struct moberg *moberg_new()
+/* Parse default configuration(s), NULL if none found. An up to date
+   compiled configuration (see moberg_compile) is used when there is
+   one */
+static struct moberg_config *parse_config(struct moberg *moberg)
 {
-  struct moberg *result = malloc(sizeof(*result));
-  if (! result) {
-    fprintf(stderr, "Failed to allocate moberg struct\n");
-    goto err;
-  }
-  memset(result, 0, sizeof(*result));
+  struct moberg_config *result = NULL;
+  struct config_sources sources;
+  char cache[PATH_MAX];
 
-  /* Parse default configuration(s) */
-  const char * const *config_paths = xdgSearchableConfigDirectories(NULL);
-  const char * const *path;
-  for (path = config_paths ; *path ; path++) {
-    int dirfd1 = open(*path, O_DIRECTORY);
-    if (dirfd >= 0) {
-      parse_config_at(result, dirfd1, "moberg.conf");
-      int dirfd2 = openat(dirfd1, "moberg.d", O_DIRECTORY);
-      if (dirfd2 >= 0) { 
-        parse_config_dir_at(result, dirfd2);
-        close(dirfd2);
+  if (! config_sources(&sources)) {
+    goto out;
+  }
+  if (moberg_cache_path(cache, sizeof(cache))) {
+    result = moberg_cache_load(moberg, cache, sources.count,
+                               sources.source, moberg->lazy);
+    if (result) {
+      goto free_sources;
+    }
+  }
+  for (int i = 0 ; i < sources.count ; i++) {
+    char *buf = config_source_read(&sources.source[i]);
+    if (buf) {
+      struct moberg_config *config = moberg_parse(moberg, buf,
+                                                  moberg->lazy);
+      if (config) {
+        if (! result) {
+          result = config;
+        } else {
+          moberg_config_join(result, config);
+          moberg_config_free(config);
+        }
       }
-      close(dirfd1);
+      free(buf);
     }
-    free((char*)*path);
   }
-  free((const char **)config_paths);
   
   /* TODO: Read & parse environment overrides */
 
-  install_config(result);
-  run_deferred_actions(result);
-  
-err:
+free_sources:
+  config_sources_free(&sources);
+out:
   return result;
 }
 
-static void free_if_unused(struct moberg *moberg)
+/* Latency statistics and serialization */
+
+static long long instrument_enter(struct instrument *instrument)
 {
-  if (moberg->should_free && moberg->open_channels == 0) {
-    moberg_config_free(moberg->config);
-    channel_list_free(&moberg->analog_in);
-    channel_list_free(&moberg->analog_out);
-    channel_list_free(&moberg->digital_in);
-    channel_list_free(&moberg->digital_out);
-    channel_list_free(&moberg->encoder_in);
-    run_deferred_actions(moberg);
-    free(moberg);
+  long long start = instrument->device ? moberg_latency_now() : 0;
+  if (instrument->locked) {
+    moberg_device_lock(instrument->channel->device);
   }
+  return start;
 }
 
-void moberg_free(struct moberg *moberg)
+static void instrument_leave(struct instrument *instrument,
+                             long long start)
 {
-  if (moberg) {
-    moberg->should_free = 1;
-    free_if_unused(moberg);
+  if (instrument->locked) {
+    moberg_device_unlock(instrument->channel->device);
+  }
+  if (instrument->device) {
+    moberg_latency_record(&instrument->latency, start);
+    moberg_latency_record(instrument->device, start);
   }
 }
 
+static struct moberg_status instrumented_analog_in_read(
+  struct moberg_channel_analog_in *analog_in,
+  double *value)
+{
+  struct instrument *instrument = (struct instrument *)analog_in;
+  struct moberg_analog_in *action = &instrument->channel->action.analog_in;
+  long long start = instrument_enter(instrument);
+  struct moberg_status result = action->read(action->context, value);
+  instrument_leave(instrument, start);
+  return result;
+}
 
-/* Input/output */
+static struct moberg_status instrumented_analog_out_write(
+  struct moberg_channel_analog_out *analog_out,
+  double desired_value,
+  double *actual_value)
+{
+  struct instrument *instrument = (struct instrument *)analog_out;
+  struct moberg_analog_out *action = &instrument->channel->action.analog_out;
+  long long start = instrument_enter(instrument);
+  struct moberg_status result = action->write(action->context,
+                                              desired_value, actual_value);
+  instrument_leave(instrument, start);
+  return result;
+}
 
-struct moberg_status moberg_analog_in_open(
-  struct moberg *moberg,
-  int index,
-  struct moberg_analog_in *analog_in)
+static struct moberg_status instrumented_digital_in_read(
+  struct moberg_channel_digital_in *digital_in,
+  int *value)
 {
-  if (! analog_in) {
-    return MOBERG_ERRNO(EINVAL);
-  }
-  struct moberg_channel *channel = NULL;
-  channel_list_get(&moberg->analog_in, index, &channel);
-  if (! channel) {
-    return MOBERG_ERRNO(ENODEV);
-  } 
-  struct moberg_status result = channel->open(channel);
-  if (! OK(result)) {
-    return result;
-  }
-  moberg->open_channels++;
-  *analog_in = channel->action.analog_in;
-  return MOBERG_OK;
+  struct instrument *instrument = (struct instrument *)digital_in;
+  struct moberg_digital_in *action = &instrument->channel->action.digital_in;
+  long long start = instrument_enter(instrument);
+  struct moberg_status result = action->read(action->context, value);
+  instrument_leave(instrument, start);
+  return result;
 }
 
-struct moberg_status moberg_analog_in_close(
-  struct moberg *moberg,
-  int index,
-  struct moberg_analog_in analog_in)
+static struct moberg_status instrumented_digital_out_write(
+  struct moberg_channel_digital_out *digital_out,
+  int desired_value,
+  int *actual_value)
 {
-  struct moberg_channel *channel = NULL;
-  channel_list_get(&moberg->analog_in, index, &channel);
-  if (! channel) {
-    return MOBERG_ERRNO(ENODEV);
-  }
-  if (channel->action.analog_in.context != analog_in.context) {
-    return MOBERG_ERRNO(EINVAL);
-  }
-  struct moberg_status result = channel->close(channel);
-  moberg->open_channels--;
-  free_if_unused(moberg);
-  if (! OK(result)) {
-    return result;
-  }
-  return MOBERG_OK;
+  struct instrument *instrument = (struct instrument *)digital_out;
+  struct moberg_digital_out *action = &instrument->channel->action.digital_out;
+  long long start = instrument_enter(instrument);
+  struct moberg_status result = action->write(action->context,
+                                              desired_value, actual_value);
+  instrument_leave(instrument, start);
+  return result;
 }
 
-struct moberg_status moberg_analog_out_open(
-  struct moberg *moberg,
-  int index,
-  struct moberg_analog_out *analog_out)
+static struct moberg_status instrumented_encoder_in_read(
+  struct moberg_channel_encoder_in *encoder_in,
+  long *value)
 {
-  if (! analog_out) {
-    return MOBERG_ERRNO(EINVAL);
-  }
-  struct moberg_channel *channel = NULL;
-  channel_list_get(&moberg->analog_out, index, &channel);
-  if (! channel) {
-    return MOBERG_ERRNO(ENODEV);
-  } 
-  struct moberg_status result = channel->open(channel);
-  if (! OK(result)) {
-    return result;
+  struct instrument *instrument = (struct instrument *)encoder_in;
+  struct moberg_encoder_in *action = &instrument->channel->action.encoder_in;
+  long long start = instrument_enter(instrument);
+  struct moberg_status result = action->read(action->context, value);
+  instrument_leave(instrument, start);
+  return result;
+}
+
+/* Instrument for channel of device, NULL if out of memory */
+static struct instrument *instrument_new(struct moberg *moberg,
+                                         struct moberg_device *device,
+                                         struct moberg_channel *channel)
+{
+  struct moberg_latency *device_latency = NULL;
+  if (moberg->stats.enabled) {
+    device_latency = moberg_device_latency(device);
+    if (! device_latency) { goto err; }
   }
-  moberg->open_channels++;
-  *analog_out = channel->action.analog_out;
-  return MOBERG_OK;
+  struct instrument *instrument = malloc(sizeof(*instrument));
+  if (! instrument) { goto err; }
+  instrument->locked = ! moberg_device_reentrant(device);
+  instrument->channel = channel;
+  instrument->device = device_latency;
+  moberg_latency_init(&instrument->latency);
+  return instrument;
+err:
+  return NULL;
 }
 
-struct moberg_status moberg_analog_out_close(
-  struct moberg *moberg,
-  int index,
-  struct moberg_analog_out analog_out)
+/* Action that calls the channel action through instrument */
+static void instrument_action(struct instrument *instrument,
+                              union moberg_channel_action *action)
 {
-  struct moberg_channel *channel = NULL;
-  channel_list_get(&moberg->analog_out, index, &channel);
-  if (! channel) {
-    return MOBERG_ERRNO(ENODEV);
+  switch (instrument->channel->kind) {
+    case chan_ANALOGIN:
+      action->analog_in.context =
+        (struct moberg_channel_analog_in *)instrument;
+      action->analog_in.read = instrumented_analog_in_read;
+      break;
+    case chan_ANALOGOUT:
+      action->analog_out.context =
+        (struct moberg_channel_analog_out *)instrument;
+      action->analog_out.write = instrumented_analog_out_write;
+      break;
+    case chan_DIGITALIN:
+      action->digital_in.context =
+        (struct moberg_channel_digital_in *)instrument;
+      action->digital_in.read = instrumented_digital_in_read;
+      break;
+    case chan_DIGITALOUT:
+      action->digital_out.context =
+        (struct moberg_channel_digital_out *)instrument;
+      action->digital_out.write = instrumented_digital_out_write;
+      break;
+    case chan_ENCODERIN:
+      action->encoder_in.context =
+        (struct moberg_channel_encoder_in *)instrument;
+      action->encoder_in.read = instrumented_encoder_in_read;
+      break;
   }
-  if (channel->action.analog_out.context != analog_out.context) {
-    return MOBERG_ERRNO(EINVAL);
+}
+
+/* Channel records */
+
+/* Record of channel installed at index by device, the record that
+   channel already has if it is kept by moberg_reload (records hold a
+   channel reference, so the channel can not have been replaced by
+   another one at the same address). NULL if out of memory. Caller
+   holds moberg->lock, or is moberg_new */
+static struct channel_record *record_get(struct moberg *moberg,
+                                         int index,
+                                         struct moberg_device *device,
+                                         struct moberg_channel *channel)
+{
+  struct channel_record *record;
+  for (record = moberg->record ; record ; record = record->next) {
+    if (record->channel == channel && record->index == index) {
+      /* Listed records are referenced, see record_put_locked */
+      __atomic_add_fetch(&record->refs, 1, __ATOMIC_ACQ_REL);
+      return record;
+    }
   }
-  struct moberg_status result = channel->close(channel);
-  moberg->open_channels--;
-  free_if_unused(moberg);
-  if (! OK(result)) {
-    return result;
+  record = malloc(sizeof(*record));
+  if (! record) { goto err; }
+  record->next = NULL;
+  record->kind = channel->kind;
+  record->index = index;
+  record->refs = 1;
+  record->open = 0;
+  record->channel = channel;
+  record->action = channel->action;
+  record->instrument = NULL;
+  if (moberg->stats.enabled || ! moberg_device_reentrant(device)) {
+    record->instrument = instrument_new(moberg, device, channel);
+    if (! record->instrument) { goto free_record; }
+    instrument_action(record->instrument, &record->action);
   }
-  return MOBERG_OK;
+  channel->up(channel);
+  *moberg->record_tail = record;
+  moberg->record_tail = &record->next;
+  return record;
+free_record:
+  free(record);
+err:
+  return NULL;
 }
 
-struct moberg_status moberg_digital_in_open(
-  struct moberg *moberg,
-  int index,
-  struct moberg_digital_in *digital_in)
+/* Drops a reference, returns non-zero if record was freed. Caller
+   holds moberg->lock, or is the last user of moberg */
+static int record_put_locked(struct moberg *moberg,
+                             struct channel_record *record)
 {
-  if (! digital_in) {
-    return MOBERG_ERRNO(EINVAL);
+  if (__atomic_sub_fetch(&record->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+    return 0;
   }
-  struct moberg_channel *channel = NULL;
-  channel_list_get(&moberg->digital_in, index, &channel);
-  if (! channel) {
-    return MOBERG_ERRNO(ENODEV);
-  } 
-  struct moberg_status result = channel->open(channel);
-  if (! OK(result)) {
-    return result;
+  struct channel_record **previous;
+  for (previous = &moberg->record ;
+       *previous != record ;
+       previous = &(*previous)->next);
+  *previous = record->next;
+  if (moberg->record_tail == &record->next) {
+    moberg->record_tail = previous;
   }
-  moberg->open_channels++;
-  *digital_in = channel->action.digital_in;
-  return MOBERG_OK;
+  record->channel->down(record->channel);
+  free(record->instrument);
+  free(record);
+  return 1;
 }
 
-struct moberg_status moberg_digital_in_close(
-  struct moberg *moberg,
-  int index,
-  struct moberg_digital_in digital_in)
+/* Drops a reference, only the last one takes moberg->lock (it can not
+   be revived meanwhile: it is neither published nor open) */
+static void record_put(struct moberg *moberg,
+                       struct channel_record *record)
 {
-  struct moberg_channel *channel = NULL;
-  channel_list_get(&moberg->digital_in, index, &channel);
-  if (! channel) {
-    return MOBERG_ERRNO(ENODEV);
-  }
-  if (channel->action.digital_in.context != digital_in.context) {
-    return MOBERG_ERRNO(EINVAL);
+  int refs = __atomic_load_n(&record->refs, __ATOMIC_ACQUIRE);
+  while (refs > 1) {
+    if (__atomic_compare_exchange_n(&record->refs, &refs, refs - 1, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      return;
+    }
   }
-  struct moberg_status result = channel->close(channel);
-  moberg->open_channels--;
-  free_if_unused(moberg);
-  if (! OK(result)) {
-    return result;
+  pthread_mutex_lock(&moberg->lock);
+  if (record_put_locked(moberg, record) && moberg->retired) {
+    /* Its device might have been dropped by moberg_reload */
+    moberg_config_prune(moberg->retired, NULL, NULL);
+    run_deferred_actions(moberg);
   }
-  return MOBERG_OK;
+  pthread_mutex_unlock(&moberg->lock);
 }
 
-struct moberg_status moberg_digital_out_open(
-  struct moberg *moberg,
-  int index,
-  struct moberg_digital_out *digital_out)
+/* Releases the records and lazy devices of entry */
+static void entry_release(struct moberg *moberg,
+                          struct channel_entry *entry)
 {
-  if (! digital_out) {
-    return MOBERG_ERRNO(EINVAL);
+  if (entry->record) {
+    record_put_locked(moberg, entry->record);
+    entry->record = NULL;
   }
-  struct moberg_channel *channel = NULL;
-  channel_list_get(&moberg->digital_out, index, &channel);
-  if (! channel) {
-    return MOBERG_ERRNO(ENODEV);
-  } 
-  struct moberg_status result = channel->open(channel);
-  if (! OK(result)) {
-    return result;
+  if (entry->lazy) {
+    moberg_device_down(entry->lazy);
+    entry->lazy = NULL;
   }
-  moberg->open_channels++;
-  *digital_out = channel->action.digital_out;
-  return MOBERG_OK;
 }
 
-struct moberg_status moberg_digital_out_close(
-  struct moberg *moberg,
-  int index,
-  struct moberg_digital_out digital_out)
+/* Releases the channels of table, not its config */
+static void table_free(struct moberg *moberg,
+                       struct channel_table *table)
 {
-  struct moberg_channel *channel = NULL;
-  channel_list_get(&moberg->digital_out, index, &channel);
-  if (! channel) {
-    return MOBERG_ERRNO(ENODEV);
-  }
-  if (channel->action.digital_out.context != digital_out.context) {
-    return MOBERG_ERRNO(EINVAL);
+  if (table) {
+    for (int kind = 0 ; kind < CHANNEL_KINDS ; kind++) {
+      for (int i = 0 ; i < table->count[kind] ; i++) {
+        entry_release(moberg, &table->entry[kind][i]);
+      }
+    }
+    free(table);
   }
-  struct moberg_status result = channel->close(channel);
-  moberg->open_channels--;
-  free_if_unused(moberg);
-  if (! OK(result)) {
-    return result;
+}
+
+/* Entry of moberg->building for kind[index], NULL if out of range */
+static struct channel_entry *building_entry(struct moberg *moberg,
+                                            enum moberg_channel_kind kind,
+                                            int index)
+{
+  struct channel_table *table = moberg->building;
+  if (0 <= index && index < table->count[kind]) {
+    return &table->entry[kind][index];
   }
-  return MOBERG_OK;
+  return NULL;
 }
 
-struct moberg_status moberg_encoder_in_open(
+static struct moberg_status install_channel(
   struct moberg *moberg,
   int index,
-  struct moberg_encoder_in *encoder_in)
+  struct moberg_device* device,
+  struct moberg_channel *channel)
 {
-  if (! encoder_in) {
-    return MOBERG_ERRNO(EINVAL);
-  }
-  struct moberg_channel *channel = NULL;
-  channel_list_get(&moberg->encoder_in, index, &channel);
-  if (! channel) {
-    return MOBERG_ERRNO(ENODEV);
-  } 
-  struct moberg_status result = channel->open(channel);
-  if (! OK(result)) {
-    return result;
+  if (channel) {
+    if (index < 0) {
+      return MOBERG_ERRNO(EINVAL);
+    }
+    struct channel_entry *entry = building_entry(moberg, channel->kind,
+                                                 index);
+    if (entry) {
+      struct channel_record *record = record_get(moberg, index, device,
+                                                 channel);
+      if (! record) {
+        return MOBERG_ERRNO(ENOMEM);
+      }
+      entry_release(moberg, entry);
+      entry->record = record;
+    }
   }
-  moberg->open_channels++;
-  *encoder_in = channel->action.encoder_in;
   return MOBERG_OK;
 }
 
-struct moberg_status moberg_encoder_in_close(
+static struct moberg_status install_lazy(
   struct moberg *moberg,
+  enum moberg_channel_kind kind,
   int index,
-  struct moberg_encoder_in encoder_in)
+  struct moberg_device* device)
 {
-  struct moberg_channel *channel = NULL;
-  channel_list_get(&moberg->encoder_in, index, &channel);
-  if (! channel) {
-    return MOBERG_ERRNO(ENODEV);
-  }
-  if (channel->action.encoder_in.context != encoder_in.context) {
+  if (index < 0) {
     return MOBERG_ERRNO(EINVAL);
   }
-  struct moberg_status result = channel->close(channel);
-  moberg->open_channels--;
-  free_if_unused(moberg);
-  if (! OK(result)) {
-    return result;
+  struct channel_entry *entry = building_entry(moberg, kind, index);
+  if (entry) {
+    entry_release(moberg, entry);
+    moberg_device_up(device);
+    entry->lazy = device;
   }
   return MOBERG_OK;
 }
 
-/* System init functionality (systemd/init/...) */
+/* Installs the channels of table->config in table (allocated with
+   the counts from moberg_config_count_channels) */
+static struct moberg_status install_config(struct moberg *moberg,
+                                           struct channel_table *table)
+{
+  struct moberg_channel_install install = {
+    .context=moberg,
+    .channel=install_channel,
+    .lazy=install_lazy
+  };
+  moberg->building = table;
+  int installed = moberg_config_install_channels(table->config, &install);
+  moberg->building = NULL;
+  return installed ? MOBERG_OK : MOBERG_ERRNO(ENOMEM);
+}
 
-struct moberg_status moberg_start(
-  struct moberg *moberg,
-  FILE *f)
+/* Table with room for the channels of config, NULL if out of memory */
+static struct channel_table *config_table(struct moberg_config *config)
 {
-  return moberg_config_start(moberg->config, f);
+  int count[CHANNEL_KINDS] = { 0 };
+  moberg_config_count_channels(config, count);
+  struct channel_table *table = table_alloc(count);
+  if (table) {
+    table->config = config;
+  }
+  return table;
 }
 
-struct moberg_status moberg_stop(
-  struct moberg *moberg,
+static struct moberg_status table_publish(struct moberg *moberg,
+                                          struct channel_table *table);
+
+int moberg_OK(struct moberg_status status)
+{
+  return status.result == 0;
+}
+
+struct moberg *moberg_new()
+{
+  struct moberg *result = malloc(sizeof(*result));
+  if (! result) {
+    fprintf(stderr, "Failed to allocate moberg struct\n");
+    goto err;
+  }
+  memset(result, 0, sizeof(*result));
+  result->record_tail = &result->record;
+  const char *stats = getenv("MOBERG_STATS");
+  result->stats.enabled = stats && *stats && strcmp(stats, "0") != 0;
+  const char *lazy = getenv("MOBERG_LAZY");
+  result->lazy = lazy && *lazy && strcmp(lazy, "0") != 0;
+  result->reactor = moberg_reactor_new();
+  pthread_mutex_init(&result->lock, NULL);
+
+  struct moberg_config *config = parse_config(result);
+  if (! config) {
+    fprintf(stderr, "No moberg configuration found\n");
+  } else {
+    struct channel_table *table = config_table(config);
+    if (! table) {
+      fprintf(stderr, "Failed to allocate channel table\n");
+      moberg_config_free(config);
+    } else if (! OK(table_publish(result, table))) {
+      fprintf(stderr, "Failed to install channels\n");
+      moberg_config_free(config);
+    }
+  }
+  
+err:
+  return result;
+}
+
+static void free_if_unused(struct moberg *moberg)
+{
+  if (__atomic_load_n(&moberg->should_free, __ATOMIC_ACQUIRE) &&
+      __atomic_load_n(&moberg->open_channels, __ATOMIC_ACQUIRE) == 0 &&
+      ! __atomic_exchange_n(&moberg->freed, 1, __ATOMIC_ACQ_REL)) {
+    if (moberg->table) {
+      moberg_config_free(moberg->table->config);
+    }
+    moberg_config_free(moberg->retired);
+    /* After the devices, which unwatch their fds */
+    moberg_reactor_free(moberg->reactor);
+    table_free(moberg, moberg->table);
+    pthread_mutex_destroy(&moberg->lock);
+    run_deferred_actions(moberg);
+    free(moberg);
+  }
+}
+
+void moberg_free(struct moberg *moberg)
+{
+  if (moberg) {
+    __atomic_store_n(&moberg->should_free, 1, __ATOMIC_RELEASE);
+    free_if_unused(moberg);
+  }
+}
+
+
+/* Configuration reload */
+
+static void *action_context(enum moberg_channel_kind kind,
+                            union moberg_channel_action *action)
+{
+  switch (kind) {
+    case chan_ANALOGIN: return action->analog_in.context;
+    case chan_ANALOGOUT: return action->analog_out.context;
+    case chan_DIGITALIN: return action->digital_in.context;
+    case chan_DIGITALOUT: return action->digital_out.context;
+    case chan_ENCODERIN: return action->encoder_in.context;
+  }
+  return NULL;
+}
+
+/* Record of a channel that is open with context, but no longer
+   published at kind[index] (removed or remapped by moberg_reload while
+   open), NULL if there is none. Caller holds moberg->lock */
+static struct channel_record *record_unpublished(
+  struct moberg *moberg,
+  enum moberg_channel_kind kind,
+  int index,
+  void *context)
+{
+  for (struct channel_record *record = moberg->record ;
+       record ;
+       record = record->next) {
+    if (record->kind == kind && record->index == index &&
+        __atomic_load_n(&record->open, __ATOMIC_ACQUIRE) > 0 &&
+        action_context(kind, &record->action) == context) {
+      return record;
+    }
+  }
+  return NULL;
+}
+
+/* Installs the channels of table->config in table and publishes it,
+   if installing fails table is freed (not its config) and the current
+   table is kept. Records are shared with the old table, the ones that
+   are open but no longer published live on until closed. Caller holds
+   moberg->lock, or is moberg_new */
+static struct moberg_status table_publish(struct moberg *moberg,
+                                          struct channel_table *table)
+{
+  struct channel_table *old = moberg->table;
+  struct moberg_status result = install_config(moberg, table);
+  if (! OK(result)) {
+    table_free(moberg, table);
+    return result;
+  }
+  if (! old || old->config != table->config) {
+    /* Unpublished, devices without channels can be dropped */
+    moberg_config_prune(table->config, NULL, NULL);
+  }
+  table_replace(moberg, table);
+  if (old) {
+    if (old->config != table->config) {
+      moberg_config_retire(old->config, moberg->retired);
+    }
+    table_free(moberg, old);
+  }
+  if (moberg->retired) {
+    moberg_config_prune(moberg->retired, NULL, NULL);
+  }
+  run_deferred_actions(moberg);
+  return MOBERG_OK;
+}
+
+struct moberg_status moberg_reload(struct moberg *moberg)
+{
+  struct moberg_status result;
+
+  if (! moberg) {
+    return MOBERG_ERRNO(EINVAL);
+  }
+  pthread_mutex_lock(&moberg->lock);
+  if (! moberg->retired) {
+    moberg->retired = moberg_config_new();
+    if (! moberg->retired) { goto err_enomem; }
+  }
+  struct moberg_config *config = parse_config(moberg);
+  if (! config) {
+    fprintf(stderr, "No moberg configuration found\n");
+    result = MOBERG_ERRNO(ENOENT);
+    goto unlock;
+  }
+  /* Everything that might fail is done before the table is replaced,
+     a failed reuse or install gives back the current devices */
+  struct channel_table *old = moberg->table;
+  struct channel_table *table = config_table(config);
+  if (! table) {
+    goto free_table;
+  }
+  if (old && old->config) {
+    result = moberg_config_reuse(config, old->config);
+    if (! OK(result)) {
+      goto free_table_config;
+    }
+  }
+  result = table_publish(moberg, table);
+  if (! OK(result)) {
+    /* The reused devices still have the current channels installed */
+    if (old && old->config) {
+      moberg_config_give_back(config, old->config);
+    }
+    goto free_config;
+  }
+  goto unlock;
+
+free_table:
+  result = MOBERG_ERRNO(ENOMEM);
+free_table_config:
+  free(table);
+free_config:
+  moberg_config_free(config);
+  goto unlock;
+err_enomem:
+  result = MOBERG_ERRNO(ENOMEM);
+unlock:
+  pthread_mutex_unlock(&moberg->lock);
+  return result;
+}
+
+struct moberg_status moberg_compile()
+{
+  struct moberg_status result = MOBERG_ERRNO(ENOMEM);
+  struct config_sources sources;
+  char cache[PATH_MAX];
+
+  if (! moberg_cache_path(cache, sizeof(cache))) {
+    return MOBERG_ERRNO(ENOENT);
+  }
+  if (! config_sources(&sources)) {
+    goto out;
+  }
+  if (sources.count == 0) {
+    fprintf(stderr, "No moberg configuration found\n");
+    result = MOBERG_ERRNO(ENOENT);
+    goto free_sources;
+  }
+  struct moberg_config **config = calloc(sources.count, sizeof(*config));
+  if (! config) {
+    goto free_sources;
+  }
+  for (int i = 0 ; i < sources.count ; i++) {
+    char *buf = config_source_read(&sources.source[i]);
+    if (! buf) {
+      result = MOBERG_ERRNO(errno ? errno : EIO);
+      goto free_config;
+    }
+    /* Only recorded, the drivers parse it when loaded */
+    config[i] = moberg_parse(NULL, buf, 1);
+    free(buf);
+  }
+  result = moberg_cache_write(cache, sources.count, sources.source, config);
+free_config:
+  for (int i = 0 ; i < sources.count ; i++) {
+    moberg_config_free(config[i]);
+  }
+  free(config);
+free_sources:
+  config_sources_free(&sources);
+out:
+  return result;
+}
+
+/* Lazy loading */
+
+/* Publishes the current table again, rebuilt from its config once
+   devices in it are loaded. Caller holds moberg->lock */
+static struct moberg_status table_republish(struct moberg *moberg)
+{
+  struct channel_table *old = moberg->table;
+  struct channel_table *table = table_alloc(old->count);
+  if (! table) {
+    return MOBERG_ERRNO(ENOMEM);
+  }
+  table->config = old->config;
+  return table_publish(moberg, table);
+}
+
+/* Loads the device that kind[index] waits for and republishes the
+   table with its channels (or without its lazy entries if loading
+   failed), unless another thread already did */
+static struct moberg_status load_device(struct moberg *moberg,
+                                        enum moberg_channel_kind kind,
+                                        int index)
+{
+  struct moberg_status result = MOBERG_OK;
+  pthread_mutex_lock(&moberg->lock);
+  /* The current table (and its lazy devices) can not change meanwhile */
+  struct moberg_device *device = table_lazy(moberg->table, kind, index);
+  if (device) {
+    result = moberg_device_load(device);
+    struct moberg_status published = table_republish(moberg);
+    if (OK(result)) {
+      result = published;
+    }
+  }
+  pthread_mutex_unlock(&moberg->lock);
+  return result;
+}
+
+/* Loads all lazy devices (for moberg_start/moberg_stop) */
+static void load_all(struct moberg *moberg)
+{
+  pthread_mutex_lock(&moberg->lock);
+  if (moberg->table && moberg_config_load(moberg->table->config) > 0) {
+    table_republish(moberg);
+  }
+  pthread_mutex_unlock(&moberg->lock);
+}
+
+/* table_enter, once the devices of kind[index[0..count-1]] are loaded
+   (or failed to load) */
+static struct channel_table *table_enter_loaded(
+  struct moberg *moberg,
+  enum moberg_channel_kind kind,
+  int count,
+  const int *index)
+{
+  for (;;) {
+    struct channel_table *table = table_enter(moberg);
+    int lazy = -1;
+    for (int i = 0 ; moberg->lazy && i < count && lazy < 0 ; i++) {
+      if (table_lazy(table, kind, index[i])) {
+        lazy = index[i];
+      }
+    }
+    if (lazy < 0) {
+      return table;
+    }
+    table_leave(moberg);
+    if (! OK(load_device(moberg, kind, lazy))) {
+      return table_enter(moberg);
+    }
+  }
+}
+
+/* Input/output */
+
+/* Opens the channel of record, the handle (action) takes over the
+   reference of the caller (dropped if open fails) */
+static struct moberg_status record_open(struct moberg *moberg,
+                                        struct channel_record *record,
+                                        union moberg_channel_action *action)
+{
+  struct moberg_channel *channel = record->channel;
+  moberg_device_lock(channel->device);
+  struct moberg_status result = channel->open(channel);
+  moberg_device_unlock(channel->device);
+  if (! OK(result)) {
+    record_put(moberg, record);
+    return result;
+  }
+  __atomic_add_fetch(&record->open, 1, __ATOMIC_ACQ_REL);
+  __atomic_add_fetch(&moberg->open_channels, 1, __ATOMIC_ACQ_REL);
+  *action = record->action;
+  return MOBERG_OK;
+}
+
+/* Opens kind[index], the handle (action) holds a reference to the
+   channel record */
+static struct moberg_status channel_open(struct moberg *moberg,
+                                         enum moberg_channel_kind kind,
+                                         int index,
+                                         union moberg_channel_action *action)
+{
+  struct channel_table *table = table_enter_loaded(moberg, kind, 1, &index);
+  struct channel_entry *entry = table_lookup(table, kind, index);
+  struct channel_record *record = entry ? entry->record : NULL;
+  if (record) {
+    __atomic_add_fetch(&record->refs, 1, __ATOMIC_ACQ_REL);
+  }
+  table_leave(moberg);
+  if (! record) {
+    return MOBERG_ERRNO(ENODEV);
+  }
+  return record_open(moberg, record, action);
+}
+
+static struct moberg_status channel_close(struct moberg *moberg,
+                                          enum moberg_channel_kind kind,
+                                          int index,
+                                          void *context)
+{
+  struct channel_table *table = table_enter(moberg);
+  struct channel_entry *entry = table_lookup(table, kind, index);
+  struct channel_record *record = NULL;
+  int mapped = entry != NULL;
+  if (entry && action_context(kind, &entry->record->action) == context &&
+      __atomic_load_n(&entry->record->open, __ATOMIC_ACQUIRE) > 0) {
+    /* Kept alive by the reference of the handle */
+    record = entry->record;
+  }
+  table_leave(moberg);
+  if (! record) {
+    pthread_mutex_lock(&moberg->lock);
+    record = record_unpublished(moberg, kind, index, context);
+    pthread_mutex_unlock(&moberg->lock);
+    if (! record) {
+      return mapped ? MOBERG_ERRNO(EINVAL) : MOBERG_ERRNO(ENODEV);
+    }
+  }
+  struct moberg_channel *channel = record->channel;
+  moberg_device_lock(channel->device);
+  struct moberg_status result = channel->close(channel);
+  moberg_device_unlock(channel->device);
+  __atomic_sub_fetch(&record->open, 1, __ATOMIC_ACQ_REL);
+  record_put(moberg, record);
+  __atomic_sub_fetch(&moberg->open_channels, 1, __ATOMIC_ACQ_REL);
+  free_if_unused(moberg);
+  return result;
+}
+
+struct moberg_status moberg_analog_in_open(
+  struct moberg *moberg,
+  int index,
+  struct moberg_analog_in *analog_in)
+{
+  if (! analog_in) {
+    return MOBERG_ERRNO(EINVAL);
+  }
+  union moberg_channel_action action;
+  struct moberg_status result = channel_open(moberg, chan_ANALOGIN, index,
+                                             &action);
+  if (OK(result)) {
+    *analog_in = action.analog_in;
+  }
+  return result;
+}
+
+struct moberg_status moberg_analog_in_close(
+  struct moberg *moberg,
+  int index,
+  struct moberg_analog_in analog_in)
+{
+  return channel_close(moberg, chan_ANALOGIN, index, analog_in.context);
+}
+
+struct moberg_status moberg_analog_out_open(
+  struct moberg *moberg,
+  int index,
+  struct moberg_analog_out *analog_out)
+{
+  if (! analog_out) {
+    return MOBERG_ERRNO(EINVAL);
+  }
+  union moberg_channel_action action;
+  struct moberg_status result = channel_open(moberg, chan_ANALOGOUT, index,
+                                             &action);
+  if (OK(result)) {
+    *analog_out = action.analog_out;
+  }
+  return result;
+}
+
+struct moberg_status moberg_analog_out_close(
+  struct moberg *moberg,
+  int index,
+  struct moberg_analog_out analog_out)
+{
+  return channel_close(moberg, chan_ANALOGOUT, index, analog_out.context);
+}
+
+struct moberg_status moberg_digital_in_open(
+  struct moberg *moberg,
+  int index,
+  struct moberg_digital_in *digital_in)
+{
+  if (! digital_in) {
+    return MOBERG_ERRNO(EINVAL);
+  }
+  union moberg_channel_action action;
+  struct moberg_status result = channel_open(moberg, chan_DIGITALIN, index,
+                                             &action);
+  if (OK(result)) {
+    *digital_in = action.digital_in;
+  }
+  return result;
+}
+
+struct moberg_status moberg_digital_in_close(
+  struct moberg *moberg,
+  int index,
+  struct moberg_digital_in digital_in)
+{
+  return channel_close(moberg, chan_DIGITALIN, index, digital_in.context);
+}
+
+struct moberg_status moberg_digital_out_open(
+  struct moberg *moberg,
+  int index,
+  struct moberg_digital_out *digital_out)
+{
+  if (! digital_out) {
+    return MOBERG_ERRNO(EINVAL);
+  }
+  union moberg_channel_action action;
+  struct moberg_status result = channel_open(moberg, chan_DIGITALOUT, index,
+                                             &action);
+  if (OK(result)) {
+    *digital_out = action.digital_out;
+  }
+  return result;
+}
+
+struct moberg_status moberg_digital_out_close(
+  struct moberg *moberg,
+  int index,
+  struct moberg_digital_out digital_out)
+{
+  return channel_close(moberg, chan_DIGITALOUT, index, digital_out.context);
+}
+
+struct moberg_status moberg_encoder_in_open(
+  struct moberg *moberg,
+  int index,
+  struct moberg_encoder_in *encoder_in)
+{
+  if (! encoder_in) {
+    return MOBERG_ERRNO(EINVAL);
+  }
+  union moberg_channel_action action;
+  struct moberg_status result = channel_open(moberg, chan_ENCODERIN, index,
+                                             &action);
+  if (OK(result)) {
+    *encoder_in = action.encoder_in;
+  }
+  return result;
+}
+
+struct moberg_status moberg_encoder_in_close(
+  struct moberg *moberg,
+  int index,
+  struct moberg_encoder_in encoder_in)
+{
+  return channel_close(moberg, chan_ENCODERIN, index, encoder_in.context);
+}
+
+/* Multi-channel input/output */
+
+/* Records (and channels) of kind[index[0..count-1]] in the entered
+   table, each with a reference taken (see release_many) so that the
+   channels can be used after table_leave. EBADF if opened is set and
+   a channel is not open */
+static struct moberg_status lookup_many(struct channel_table *table,
+                                        enum moberg_channel_kind kind,
+                                        int count,
+                                        const int *index,
+                                        int opened,
+                                        struct channel_record **record,
+                                        struct moberg_channel **channel)
+{
+  for (int i = 0 ; i < count ; i++) {
+    struct channel_entry *entry = table_lookup(table, kind, index[i]);
+    if (! entry) {
+      /* Not loaded yet, so not open */
+      return (table_lazy(table, kind, index[i]) ?
+              MOBERG_ERRNO(EBADF) : MOBERG_ERRNO(ENODEV));
+    }
+    if (opened &&
+        __atomic_load_n(&entry->record->open, __ATOMIC_ACQUIRE) == 0) {
+      return MOBERG_ERRNO(EBADF);
+    }
+    record[i] = entry->record;
+  }
+  for (int i = 0 ; i < count ; i++) {
+    __atomic_add_fetch(&record[i]->refs, 1, __ATOMIC_ACQ_REL);
+    channel[i] = record[i]->channel;
+  }
+  return MOBERG_OK;
+}
+
+static void release_many(struct moberg *moberg,
+                         int count,
+                         struct channel_record **record)
+{
+  for (int i = 0 ; i < count ; i++) {
+    record_put(moberg, record[i]);
+  }
+}
+
+/* Move all remaining channels belonging to the same device as
+   channel[first] to batch, member[] records their original positions */
+static int next_batch(int count,
+                      struct moberg_channel **channel,
+                      int first,
+                      struct moberg_channel **batch,
+                      int *member)
+{
+  struct moberg_device *device = channel[first]->device;
+  int n = 0;
+  for (int i = first ; i < count ; i++) {
+    if (channel[i] && channel[i]->device == device) {
+      batch[n] = channel[i];
+      member[n] = i;
+      channel[i] = NULL;
+      n++;
+    }
+  }
+  return n;
+}
+
+struct moberg_status moberg_analog_in_read_many(
+  struct moberg *moberg,
+  int count,
+  const int *index,
+  double *value)
+{
+  if (count <= 0) {
+    return count == 0 ? MOBERG_OK : MOBERG_ERRNO(EINVAL);
+  }
+  if (count > MOBERG_MANY_MAX || ! index || ! value) {
+    return MOBERG_ERRNO(EINVAL);
+  }
+  struct channel_record *record[count];
+  struct moberg_channel *channel[count], *batch[count];
+  int member[count];
+  double batch_value[count];
+  struct channel_table *table = table_enter(moberg);
+  struct moberg_status result = lookup_many(table, chan_ANALOGIN,
+                                            count, index, 1, record, channel);
+  table_leave(moberg);
+  if (! OK(result)) {
+    return result;
+  }
+  for (int i = 0 ; i < count ; i++) {
+    if (channel[i]) {
+      int n = next_batch(count, channel, i, batch, member);
+      result = moberg_device_analog_in_read_many(batch[0]->device, n,
+                                                 batch, batch_value);
+      if (! OK(result)) {
+        goto release;
+      }
+      for (int j = 0 ; j < n ; j++) {
+        value[member[j]] = batch_value[j];
+      }
+    }
+  }
+release:
+  release_many(moberg, count, record);
+  return result;
+}
+
+struct moberg_status moberg_digital_in_read_many(
+  struct moberg *moberg,
+  int count,
+  const int *index,
+  int *value)
+{
+  if (count <= 0) {
+    return count == 0 ? MOBERG_OK : MOBERG_ERRNO(EINVAL);
+  }
+  if (count > MOBERG_MANY_MAX || ! index || ! value) {
+    return MOBERG_ERRNO(EINVAL);
+  }
+  struct channel_record *record[count];
+  struct moberg_channel *channel[count], *batch[count];
+  int member[count];
+  int batch_value[count];
+  struct channel_table *table = table_enter(moberg);
+  struct moberg_status result = lookup_many(table, chan_DIGITALIN,
+                                            count, index, 1, record, channel);
+  table_leave(moberg);
+  if (! OK(result)) {
+    return result;
+  }
+  for (int i = 0 ; i < count ; i++) {
+    if (channel[i]) {
+      int n = next_batch(count, channel, i, batch, member);
+      result = moberg_device_digital_in_read_many(batch[0]->device, n,
+                                                  batch, batch_value);
+      if (! OK(result)) {
+        goto release;
+      }
+      for (int j = 0 ; j < n ; j++) {
+        value[member[j]] = batch_value[j];
+      }
+    }
+  }
+release:
+  release_many(moberg, count, record);
+  return result;
+}
+
+struct moberg_status moberg_encoder_in_read_many(
+  struct moberg *moberg,
+  int count,
+  const int *index,
+  long *value)
+{
+  if (count <= 0) {
+    return count == 0 ? MOBERG_OK : MOBERG_ERRNO(EINVAL);
+  }
+  if (count > MOBERG_MANY_MAX || ! index || ! value) {
+    return MOBERG_ERRNO(EINVAL);
+  }
+  struct channel_record *record[count];
+  struct moberg_channel *channel[count], *batch[count];
+  int member[count];
+  long batch_value[count];
+  struct channel_table *table = table_enter(moberg);
+  struct moberg_status result = lookup_many(table, chan_ENCODERIN,
+                                            count, index, 1, record, channel);
+  table_leave(moberg);
+  if (! OK(result)) {
+    return result;
+  }
+  for (int i = 0 ; i < count ; i++) {
+    if (channel[i]) {
+      int n = next_batch(count, channel, i, batch, member);
+      result = moberg_device_encoder_in_read_many(batch[0]->device, n,
+                                                  batch, batch_value);
+      if (! OK(result)) {
+        goto release;
+      }
+      for (int j = 0 ; j < n ; j++) {
+        value[member[j]] = batch_value[j];
+      }
+    }
+  }
+release:
+  release_many(moberg, count, record);
+  return result;
+}
+
+struct moberg_status moberg_analog_out_write_many(
+  struct moberg *moberg,
+  int count,
+  const int *index,
+  const double *desired_value,
+  double *actual_value)
+{
+  if (count <= 0) {
+    return count == 0 ? MOBERG_OK : MOBERG_ERRNO(EINVAL);
+  }
+  if (count > MOBERG_MANY_MAX || ! index || ! desired_value) {
+    return MOBERG_ERRNO(EINVAL);
+  }
+  struct channel_record *record[count];
+  struct moberg_channel *channel[count], *batch[count];
+  int member[count];
+  double batch_desired[count], batch_actual[count];
+  struct channel_table *table = table_enter(moberg);
+  struct moberg_status result = lookup_many(table, chan_ANALOGOUT,
+                                            count, index, 1, record, channel);
+  table_leave(moberg);
+  if (! OK(result)) {
+    return result;
+  }
+  for (int i = 0 ; i < count ; i++) {
+    if (channel[i]) {
+      int n = next_batch(count, channel, i, batch, member);
+      for (int j = 0 ; j < n ; j++) {
+        batch_desired[j] = desired_value[member[j]];
+      }
+      result = moberg_device_analog_out_write_many(
+        batch[0]->device, n, batch,
+        batch_desired, actual_value ? batch_actual : NULL);
+      if (! OK(result)) {
+        goto release;
+      }
+      for (int j = 0 ; actual_value && j < n ; j++) {
+        actual_value[member[j]] = batch_actual[j];
+      }
+    }
+  }
+release:
+  release_many(moberg, count, record);
+  return result;
+}
+
+struct moberg_status moberg_digital_out_write_many(
+  struct moberg *moberg,
+  int count,
+  const int *index,
+  const int *desired_value,
+  int *actual_value)
+{
+  if (count <= 0) {
+    return count == 0 ? MOBERG_OK : MOBERG_ERRNO(EINVAL);
+  }
+  if (count > MOBERG_MANY_MAX || ! index || ! desired_value) {
+    return MOBERG_ERRNO(EINVAL);
+  }
+  struct channel_record *record[count];
+  struct moberg_channel *channel[count], *batch[count];
+  int member[count];
+  int batch_desired[count], batch_actual[count];
+  struct channel_table *table = table_enter(moberg);
+  struct moberg_status result = lookup_many(table, chan_DIGITALOUT,
+                                            count, index, 1, record, channel);
+  table_leave(moberg);
+  if (! OK(result)) {
+    return result;
+  }
+  for (int i = 0 ; i < count ; i++) {
+    if (channel[i]) {
+      int n = next_batch(count, channel, i, batch, member);
+      for (int j = 0 ; j < n ; j++) {
+        batch_desired[j] = desired_value[member[j]];
+      }
+      result = moberg_device_digital_out_write_many(
+        batch[0]->device, n, batch,
+        batch_desired, actual_value ? batch_actual : NULL);
+      if (! OK(result)) {
+        goto release;
+      }
+      for (int j = 0 ; actual_value && j < n ; j++) {
+        actual_value[member[j]] = batch_actual[j];
+      }
+    }
+  }
+release:
+  release_many(moberg, count, record);
+  return result;
+}
+
+/* Digital word access */
+
+static int word_indices(int first, unsigned int mask, int *index)
+{
+  int count = 0;
+  for (int i = 0 ; i < 32 ; i++) {
+    if (mask & (1U << i)) {
+      index[count] = first + i;
+      count++;
+    }
+  }
+  return count;
+}
+
+struct moberg_status moberg_digital_in_read_word(
+  struct moberg *moberg,
+  int first,
+  unsigned int mask,
+  unsigned int *bits)
+{
+  if (! bits) {
+    return MOBERG_ERRNO(EINVAL);
+  }
+  int index[32], value[32];
+  int count = word_indices(first, mask, index);
+  struct moberg_status result = moberg_digital_in_read_many(moberg, count,
+                                                            index, value);
+  if (OK(result)) {
+    *bits = 0;
+    for (int i = 0 ; i < count ; i++) {
+      if (value[i]) {
+        *bits |= 1U << (index[i] - first);
+      }
+    }
+  }
+  return result;
+}
+
+struct moberg_status moberg_digital_out_write_word(
+  struct moberg *moberg,
+  int first,
+  unsigned int mask,
+  unsigned int bits)
+{
+  int index[32], value[32];
+  int count = word_indices(first, mask, index);
+  for (int i = 0 ; i < count ; i++) {
+    value[i] = (bits >> (index[i] - first)) & 0x1;
+  }
+  return moberg_digital_out_write_many(moberg, count, index, value, NULL);
+}
+
+/* Streaming acquisition */
+
+struct moberg_stream {
+  struct moberg *moberg;
+  struct moberg_device *device;
+  struct moberg_stream_context *context; /* Driver stream */
+  struct moberg_soft_stream *soft;       /* Fallback when context is NULL */
+  int count;
+  int opened;
+  int *index;
+  struct moberg_analog_in *analog_in;
+  double *offset;
+  double *scale;
+};
+
+static void stream_free(struct moberg_stream *stream)
+{
+  for (int i = 0 ; i < stream->opened ; i++) {
+    moberg_analog_in_close(stream->moberg,
+                           stream->index[i],
+                           stream->analog_in[i]);
+  }
+  free(stream->index);
+  free(stream->analog_in);
+  free(stream->offset);
+  free(stream->scale);
+  free(stream);
+}
+
+struct moberg_status moberg_stream_open(
+  struct moberg *moberg,
+  int count,
+  const int *analog_in_index,
+  double rate,
+  struct moberg_stream **stream)
+{
+  struct moberg_status result;
+  
+  if (count <= 0 || count > MOBERG_MANY_MAX ||
+      ! analog_in_index || rate <= 0.0 || ! stream) {
+    return MOBERG_ERRNO(EINVAL);
+  }
+  struct channel_record *record[count];
+  struct moberg_channel *channel[count];
+  struct moberg_stream *s = NULL;
+  struct channel_table *table = table_enter_loaded(moberg, chan_ANALOGIN,
+                                                   count, analog_in_index);
+  result = lookup_many(table, chan_ANALOGIN, count, analog_in_index, 0,
+                       record, channel);
+  table_leave(moberg);
+  if (! OK(result)) {
+    return result;
+  }
+  for (int i = 0 ; i < count ; i++) {
+    if (channel[i]->device != channel[0]->device) {
+      result = MOBERG_ERRNO(EXDEV);
+      goto release;
+    }
+  }
+  s = malloc(sizeof(*s));
+  if (! s) { goto err_enomem; }
+  memset(s, 0, sizeof(*s));
+  s->moberg = moberg;
+  s->device = channel[0]->device;
+  s->count = count;
+  s->index = calloc(count, sizeof(*s->index));
+  s->analog_in = calloc(count, sizeof(*s->analog_in));
+  s->offset = calloc(count, sizeof(*s->offset));
+  s->scale = calloc(count, sizeof(*s->scale));
+  if (! s->index || ! s->analog_in || ! s->offset || ! s->scale) {
+    goto err_enomem;
+  }
+  for (int i = 0 ; i < count ; i++) {
+    /* The looked up channels, even if moberg_reload remaps them */
+    union moberg_channel_action action;
+    s->index[i] = analog_in_index[i];
+    __atomic_add_fetch(&record[i]->refs, 1, __ATOMIC_ACQ_REL);
+    result = record_open(moberg, record[i], &action);
+    if (! OK(result)) { goto free_stream; }
+    s->analog_in[i] = action.analog_in;
+    s->opened++;
+  }
+  result = moberg_device_stream_open(s->device, count, channel, rate,
+                                     &s->context);
+  for (int i = 0 ; OK(result) && i < count ; i++) {
+    result = moberg_device_stream_scale(s->device, s->context, i,
+                                        &s->offset[i], &s->scale[i]);
+    if (! OK(result)) {
+      moberg_device_stream_close(s->device, s->context);
+    }
+  }
+  if (OK(result)) {
+    /* Driver stream */
+  } else if (result.result == ENOTSUP) {
+    /* No driver stream, or raw samples that are not linear in the
+       values */
+    s->context = NULL;
+    result = moberg_soft_stream_open(s->device, count, channel, rate,
+                                     &s->soft);
+    if (! OK(result)) { goto free_stream; }
+    for (int i = 0 ; i < count ; i++) {
+      s->offset[i] = 0.0;
+      s->scale[i] = 1.0;
+    }
+  } else {
+    goto free_stream;
+  }
+  *stream = s;
+  /* The open channels are held by the stream */
+  release_many(moberg, count, record);
+  return MOBERG_OK;
+err_enomem:
+  result = MOBERG_ERRNO(ENOMEM);
+free_stream:
+  if (s) {
+    stream_free(s);
+  }
+release:
+  release_many(moberg, count, record);
+  return result;
+}
+
+struct moberg_status moberg_stream_peek(
+  struct moberg_stream *stream,
+  struct moberg_stream_buffer *buffer)
+{
+  if (! stream || ! buffer) {
+    return MOBERG_ERRNO(EINVAL);
+  }
+  if (stream->context) {
+    return moberg_device_stream_peek(stream->device, stream->context, buffer);
+  } else {
+    return moberg_soft_stream_peek(stream->soft, buffer);
+  }
+}
+
+struct moberg_status moberg_stream_consume(
+  struct moberg_stream *stream,
+  int length)
+{
+  if (! stream) {
+    return MOBERG_ERRNO(EINVAL);
+  }
+  if (stream->context) {
+    return moberg_device_stream_consume(stream->device, stream->context,
+                                        length);
+  } else {
+    return moberg_soft_stream_consume(stream->soft, length);
+  }
+}
+
+struct moberg_status moberg_stream_scale(
+  struct moberg_stream *stream,
+  int channel,
+  double *offset,
+  double *scale)
+{
+  if (! stream || channel < 0 || channel >= stream->count ||
+      ! offset || ! scale) {
+    return MOBERG_ERRNO(EINVAL);
+  }
+  *offset = stream->offset[channel];
+  *scale = stream->scale[channel];
+  return MOBERG_OK;
+}
+
+static struct moberg_status stream_convert(struct moberg_stream *stream,
+                                           struct moberg_stream_buffer *buffer,
+                                           int samples,
+                                           double *value)
+{
+  switch (buffer->format) {
+    case MOBERG_SAMPLE_UINT16:
+      return moberg_convert_uint16_to_double(samples, buffer->data, value,
+                                             stream->count, buffer->channel,
+                                             stream->offset, stream->scale);
+    case MOBERG_SAMPLE_UINT32:
+      return moberg_convert_uint32_to_double(samples, buffer->data, value,
+                                             stream->count, buffer->channel,
+                                             stream->offset, stream->scale);
+    case MOBERG_SAMPLE_DOUBLE: {
+      const double *raw = buffer->data;
+      int channel = buffer->channel;
+      for (int i = 0 ; i < samples ; i++) {
+        value[i] = stream->offset[channel] + raw[i] * stream->scale[channel];
+        channel++;
+        if (channel >= stream->count) {
+          channel = 0;
+        }
+      }
+      return MOBERG_OK;
+    }
+  }
+  return MOBERG_ERRNO(EINVAL);
+}
+
+struct moberg_status moberg_stream_read(
+  struct moberg_stream *stream,
+  double *value,
+  int max_scans,
+  int *scans)
+{
+  if (! stream || ! value || max_scans <= 0 || ! scans) {
+    return MOBERG_ERRNO(EINVAL);
+  }
+  struct moberg_stream_buffer buffer;
+  struct moberg_status result = moberg_stream_peek(stream, &buffer);
+  if (! OK(result)) {
+    return result;
+  }
+  if (buffer.channel != 0) {
+    /* Partially consumed scan */
+    return MOBERG_ERRNO(EINVAL);
+  }
+  int n = buffer.available / (buffer.sample_size * stream->count);
+  if (n > max_scans) {
+    n = max_scans;
+  }
+  int total = n * stream->count;
+  for (int done = 0 ; done < total ; ) {
+    if (done > 0) {
+      /* Remaining samples are after buffer wrap */
+      result = moberg_stream_peek(stream, &buffer);
+      if (! OK(result)) {
+        return result;
+      }
+    }
+    int samples = buffer.length / buffer.sample_size;
+    if (samples > total - done) {
+      samples = total - done;
+    }
+    result = stream_convert(stream, &buffer, samples, &value[done]);
+    if (! OK(result)) {
+      return result;
+    }
+    result = moberg_stream_consume(stream, samples * buffer.sample_size);
+    if (! OK(result)) {
+      return result;
+    }
+    done += samples;
+  }
+  *scans = n;
+  return MOBERG_OK;
+}
+
+struct moberg_status moberg_stream_close(
+  struct moberg_stream *stream)
+{
+  struct moberg_status result;
+  if (! stream) {
+    return MOBERG_ERRNO(EINVAL);
+  }
+  if (stream->context) {
+    result = moberg_device_stream_close(stream->device, stream->context);
+  } else {
+    result = moberg_soft_stream_close(stream->soft);
+  }
+  stream_free(stream);
+  return result;
+}
+
+/* Latency statistics */
+
+static const char *kind_name(enum moberg_channel_kind kind)
+{
+  switch (kind) {
+    case chan_ANALOGIN: return "analog_in";
+    case chan_ANALOGOUT: return "analog_out";
+    case chan_DIGITALIN: return "digital_in";
+    case chan_DIGITALOUT: return "digital_out";
+    case chan_ENCODERIN: return "encoder_in";
+  }
+  return "unknown";
+}
+
+struct moberg_status moberg_stats_channel(
+  struct moberg *moberg,
+  int n,
+  const char **kind,
+  int *index,
+  struct moberg_stats *stats)
+{
+  if (! moberg || n < 0 || ! kind || ! index || ! stats) {
+    return MOBERG_ERRNO(EINVAL);
+  }
+  if (! moberg->stats.enabled) {
+    return MOBERG_ERRNO(ENOTSUP);
+  }
+  struct moberg_status result = MOBERG_ERRNO(ENODEV);
+  pthread_mutex_lock(&moberg->lock);
+  struct channel_record *record;
+  for (record = moberg->record ; record ; record = record->next) {
+    if (record->instrument && n-- == 0) {
+      break;
+    }
+  }
+  if (record) {
+    *kind = kind_name(record->kind);
+    *index = record->index;
+    moberg_latency_get(&record->instrument->latency, stats);
+    result = MOBERG_OK;
+  }
+  pthread_mutex_unlock(&moberg->lock);
+  return result;
+}
+
+/* The n:th loaded device, first those of the current configuration,
+   then the ones dropped by moberg_reload that are still in use. Caller
+   holds moberg->lock */
+static struct moberg_device *stats_device(struct moberg *moberg, int n)
+{
+  struct moberg_config *config[] = {
+    moberg->table ? moberg->table->config : NULL,
+    moberg->retired
+  };
+  for (int i = 0 ; i < 2 ; i++) {
+    struct moberg_device *device;
+    for (int j = 0 ;
+         config[i] && (device = moberg_config_device(config[i], j)) ;
+         j++) {
+      if (moberg_device_loaded(device) && n-- == 0) {
+        return device;
+      }
+    }
+  }
+  return NULL;
+}
+
+struct moberg_status moberg_stats_device(
+  struct moberg *moberg,
+  int n,
+  const char **name,
+  struct moberg_stats *stats)
+{
+  if (! moberg || n < 0 || ! name || ! stats) {
+    return MOBERG_ERRNO(EINVAL);
+  }
+  if (! moberg->stats.enabled) {
+    return MOBERG_ERRNO(ENOTSUP);
+  }
+  struct moberg_status result = MOBERG_ERRNO(ENODEV);
+  pthread_mutex_lock(&moberg->lock);
+  struct moberg_device *device = stats_device(moberg, n);
+  struct moberg_latency *latency = device ? moberg_device_latency(device) : NULL;
+  if (latency) {
+    *name = moberg_device_name(device);
+    moberg_latency_get(latency, stats);
+    result = MOBERG_OK;
+  }
+  pthread_mutex_unlock(&moberg->lock);
+  return result;
+}
+
+void moberg_stats_reset(struct moberg *moberg)
+{
+  if (moberg) {
+    pthread_mutex_lock(&moberg->lock);
+    for (struct channel_record *record = moberg->record ;
+         record ;
+         record = record->next) {
+      if (record->instrument) {
+        moberg_latency_init(&record->instrument->latency);
+      }
+    }
+    struct moberg_device *device;
+    for (int n = 0 ; (device = stats_device(moberg, n)) ; n++) {
+      struct moberg_latency *latency = moberg_device_latency(device);
+      if (latency) {
+        moberg_latency_init(latency);
+      }
+    }
+    pthread_mutex_unlock(&moberg->lock);
+  }
+}
+
+/* System init functionality (systemd/init/...) */
+
+/* Room for the devices of the entered table, at least one */
+static int table_devices(struct channel_table *table)
+{
+  return table ? moberg_config_device_count(table->config) + 1 : 1;
+}
+
+/* Holds the loaded devices of the entered table, so that their
+   drivers can be called after table_leave */
+static int devices_hold(struct channel_table *table,
+                        struct moberg_device **device)
+{
+  return table ? moberg_config_hold(table->config, device) : 0;
+}
+
+/* Drops the holds of devices_hold, devices that moberg_reload dropped
+   meanwhile are freed */
+static void devices_release(struct moberg *moberg,
+                            int count,
+                            struct moberg_device **device)
+{
+  int unused = 0;
+  for (int i = 0 ; i < count ; i++) {
+    unused |= moberg_device_release(device[i]);
+  }
+  if (unused) {
+    pthread_mutex_lock(&moberg->lock);
+    if (moberg->retired) {
+      moberg_config_prune(moberg->retired, NULL, NULL);
+      run_deferred_actions(moberg);
+    }
+    pthread_mutex_unlock(&moberg->lock);
+  }
+}
+
+struct moberg_status moberg_start(
+  struct moberg *moberg,
+  FILE *f)
+{
+  load_all(moberg);
+  struct channel_table *table = table_enter(moberg);
+  struct moberg_status result = table ? MOBERG_OK : MOBERG_ERRNO(ENODEV);
+  struct moberg_device *device[table_devices(table)];
+  int count = devices_hold(table, device);
+  table_leave(moberg);
+  for (int i = 0 ; i < count ; i++) {
+    moberg_device_start(device[i], f);
+  }
+  devices_release(moberg, count, device);
+  return result;
+}
+
+struct moberg_status moberg_stop(
+  struct moberg *moberg,
   FILE *f)
 {
-  return moberg_config_stop(moberg->config, f);
+  load_all(moberg);
+  struct channel_table *table = table_enter(moberg);
+  struct moberg_status result = table ? MOBERG_OK : MOBERG_ERRNO(ENODEV);
+  struct moberg_device *device[table_devices(table)];
+  int count = devices_hold(table, device);
+  table_leave(moberg);
+  for (int i = 0 ; i < count ; i++) {
+    moberg_device_stop(device[i], f);
+  }
+  devices_release(moberg, count, device);
+  return result;
+}
+
+struct moberg_status moberg_flush(struct moberg *moberg)
+{
+  struct moberg_status result = MOBERG_OK;
+  struct channel_table *table = table_enter(moberg);
+  struct moberg_device *device[table_devices(table)];
+  int count = devices_hold(table, device);
+  table_leave(moberg);
+  for (int i = 0 ; i < count ; i++) {
+    /* Flush all devices, report the first failure */
+    struct moberg_status status = moberg_device_flush(device[i]);
+    if (OK(result) && ! OK(status)) {
+      result = status;
+    }
+  }
+  devices_release(moberg, count, device);
+  return result;
+}
+
+unsigned long moberg_advance_generation(struct moberg *moberg)
+{
+  unsigned long generation =
+    __atomic_add_fetch(&moberg->generation, 1, __ATOMIC_RELEASE);
+  struct channel_table *table = table_enter(moberg);
+  struct moberg_device *device[table_devices(table)];
+  int count = devices_hold(table, device);
+  table_leave(moberg);
+  for (int i = 0 ; i < count ; i++) {
+    moberg_device_sample(device[i], generation);
+  }
+  devices_release(moberg, count, device);
+  return generation;
+}
+
+unsigned long moberg_generation(struct moberg *moberg)
+{
+  return __atomic_load_n(&moberg->generation, __ATOMIC_ACQUIRE);
+}
+
+struct moberg_status moberg_reactor_add(
+  struct moberg *moberg,
+  int fd,
+  struct moberg_status (*ready)(void *context),
+  void *context)
+{
+  return moberg_reactor_watch(moberg->reactor, fd, ready, context);
+}
+
+void moberg_reactor_remove(struct moberg *moberg,
+                           int fd)
+{
+  moberg_reactor_unwatch(moberg->reactor, fd);
 }
 
 /* Intended for final cleanup actions (dlclose so far...) */
@@ -23,6 +23,7 @@
 #define __MOBERG_H__
 
 #include <stdio.h>
+#include <stdint.h>
 
 struct moberg;
 
@@ -38,10 +39,46 @@ int moberg_OK(struct moberg_status);
 
 /* Creation & free */
 
+/* With MOBERG_LAZY=1 in the environment, moberg_new only records the
+   mappings: a driver is loaded and its channels are created by the
+   first *_open or stream that uses one of its channels (moberg_start
+   and moberg_stop load all drivers). Errors in the driver specific
+   parts of the configuration, or a missing driver, then make the
+   channels of that device fail with ENODEV instead of dropping the
+   whole configuration file. Statistics only cover loaded devices */
 struct moberg *moberg_new();
 
 void moberg_free(struct moberg *moberg);
 
+/* Parses the configuration again and swaps in the changes. Devices
+   with an unchanged driver and config block are kept (no reopen or
+   reconfiguration) and their channels that are mapped the same way
+   keep working, also when open. Channels that are open but no longer
+   mapped keep working until closed; handles remain valid for
+   *_close. Other devices are created anew; when a device's config
+   changes, close the channels of the old device before opening those
+   of the new one, since both use the same hardware. ENOENT if no
+   configuration is found, ENOMEM if the channels could not be
+   installed; the current configuration is then kept */
+struct moberg_status moberg_reload(struct moberg *moberg);
+
+/* Parses the configuration files and writes them, in a form that needs
+   no tokenizing, to $XDG_CACHE_HOME/moberg/moberg.conf.cache. As long
+   as no configuration file is added, removed or changed (size and
+   mtime, or else contents), moberg_new and moberg_reload use the
+   cache instead of parsing. ENOENT if no configuration is found */
+struct moberg_status moberg_compile();
+
+/* Threads
+
+   Channels may be opened, used and closed from several threads.
+   Calls into a driver that is not reentrant are serialized with a
+   per device lock, so threads using different devices never contend.
+   moberg_reload may be called while other threads do I/O.
+   moberg_free must not race with other calls on the same moberg; the
+   struct is released when the last channel is closed.
+*/
+
 /* Input/output */
 
 struct moberg_analog_in {
@@ -126,6 +163,358 @@ struct moberg_status moberg_encoder_in_close(
   int index,
   struct moberg_encoder_in encoder_in);
 
+/* Multi-channel input/output
+ 
+   Channels are given by their moberg index and must have been opened
+   beforehand (EBADF otherwise, ENODEV if an index is not mapped).
+   Channels belonging to the same device are handed to the driver in
+   one call, allowing it to batch the underlying I/O. At most
+   MOBERG_MANY_MAX channels (indices may repeat) are accessed per call,
+   EINVAL otherwise; the same limit applies to each kind of channel in
+   sample groups and cycles, and to streams. */
+
+#define MOBERG_MANY_MAX 256
+
+struct moberg_status moberg_analog_in_read_many(
+  struct moberg *moberg,
+  int count,
+  const int *index,
+  double *value);
+
+struct moberg_status moberg_digital_in_read_many(
+  struct moberg *moberg,
+  int count,
+  const int *index,
+  int *value);
+
+struct moberg_status moberg_encoder_in_read_many(
+  struct moberg *moberg,
+  int count,
+  const int *index,
+  long *value);
+
+/* actual_value may be NULL */
+struct moberg_status moberg_analog_out_write_many(
+  struct moberg *moberg,
+  int count,
+  const int *index,
+  const double *desired_value,
+  double *actual_value);
+
+/* actual_value may be NULL */
+struct moberg_status moberg_digital_out_write_many(
+  struct moberg *moberg,
+  int count,
+  const int *index,
+  const int *desired_value,
+  int *actual_value);
+
+/* Digital word access
+
+   Bit i of mask/bits corresponds to digital channel first + i, only
+   channels with their mask bit set are accessed; like for *_many they
+   must have been opened. */
+
+struct moberg_status moberg_digital_in_read_word(
+  struct moberg *moberg,
+  int first,
+  unsigned int mask,
+  unsigned int *bits);
+
+struct moberg_status moberg_digital_out_write_word(
+  struct moberg *moberg,
+  int first,
+  unsigned int mask,
+  unsigned int bits);
+
+/* Output flushing
+
+   Writes are synchronous, i.e. have reached the hardware when they
+   return, except for devices configured for deferred output (serial2002
+   deferred_output). Their writes are coalesced and emitted by
+   moberg_flush(), typically once at the end of each control cycle (the
+   moberg_cycle loop does this). */
+
+struct moberg_status moberg_flush(struct moberg *moberg);
+
+/* Cycle generation
+
+   Drivers that sample all inputs of a device in one batch (serial2002
+   batch_sampling) sample at most once per generation. The generation
+   is advanced by moberg_sample_group_update and by the moberg_cycle
+   loop, other callers advance it at the start of each control cycle.
+   Devices that sample through the shared I/O reactor (serial2002
+   shared_reactor) send their polls when the generation is advanced,
+   so that the round trips of all devices overlap. Returns the new
+   generation. */
+
+unsigned long moberg_advance_generation(struct moberg *moberg);
+
+/* Sample groups
+
+   A sample group opens a set of input channels and samples all of them
+   with moberg_sample_group_update(), one batch per device. Channels
+   returned by moberg_sample_group_*_in() read the latest snapshot
+   without doing any I/O, until the next update. */
+
+struct moberg_sample_group;
+
+struct moberg_status moberg_sample_group_new(
+  struct moberg *moberg,
+  int analog_in_count,
+  const int *analog_in_index,
+  int digital_in_count,
+  const int *digital_in_index,
+  int encoder_in_count,
+  const int *encoder_in_index,
+  struct moberg_sample_group **group);
+
+void moberg_sample_group_free(struct moberg_sample_group *group);
+
+struct moberg_status moberg_sample_group_update(
+  struct moberg_sample_group *group);
+
+struct moberg_status moberg_sample_group_analog_in(
+  struct moberg_sample_group *group,
+  int index,
+  struct moberg_analog_in *analog_in);
+
+struct moberg_status moberg_sample_group_digital_in(
+  struct moberg_sample_group *group,
+  int index,
+  struct moberg_digital_in *digital_in);
+
+struct moberg_status moberg_sample_group_encoder_in(
+  struct moberg_sample_group *group,
+  int index,
+  struct moberg_encoder_in *encoder_in);
+
+/* Streaming acquisition
+
+   Timed sampling of analog inputs at rate scans per second, all
+   channels must belong to the same device. Devices without hardware
+   support are sampled by a thread in libmoberg. moberg_stream_read
+   blocks until at least one scan is available and returns up to
+   max_scans scans (max_scans * count values, in channel order). */
+
+struct moberg_stream;
+
+enum moberg_sample_format {
+  MOBERG_SAMPLE_UINT16,
+  MOBERG_SAMPLE_UINT32,
+  MOBERG_SAMPLE_DOUBLE
+};
+
+struct moberg_stream_buffer {
+  enum moberg_sample_format format;
+  int sample_size;  /* Bytes per sample */
+  int channel;      /* Channel (0..count-1) of first sample in data */
+  const void *data;
+  int length;       /* Contiguous bytes at data */
+  int available;    /* Total bytes available, including after wrap */
+};
+
+struct moberg_status moberg_stream_open(
+  struct moberg *moberg,
+  int count,
+  const int *analog_in_index,
+  double rate,
+  struct moberg_stream **stream);
+
+struct moberg_status moberg_stream_read(
+  struct moberg_stream *stream,
+  double *value,
+  int max_scans,
+  int *scans);
+
+/* Zero-copy access to raw samples: moberg_stream_peek blocks until at
+   least one scan is available, converted values are
+   offset + raw * scale (see moberg_stream_scale). Samples are released
+   with moberg_stream_consume, don't mix partially consumed scans with
+   moberg_stream_read. */
+
+struct moberg_status moberg_stream_peek(
+  struct moberg_stream *stream,
+  struct moberg_stream_buffer *buffer);
+
+struct moberg_status moberg_stream_consume(
+  struct moberg_stream *stream,
+  int length);
+
+struct moberg_status moberg_stream_scale(
+  struct moberg_stream *stream,
+  int channel,
+  double *offset,
+  double *scale);
+
+struct moberg_status moberg_stream_close(
+  struct moberg_stream *stream);
+
+/* Periodic I/O
+
+   A thread (SCHED_FIFO if priority > 0) wakes every period seconds on
+   an absolute CLOCK_MONOTONIC schedule, reads all inputs, calls
+   callback and writes all outputs. Values are ordered as the index
+   arrays given to moberg_cycle_new. A callback returning non-zero
+   terminates the loop after outputs have been written. Cycles that
+   don't finish within their period are counted as overruns, and the
+   missed periods are skipped. */
+
+struct moberg_cycle;
+
+struct moberg_cycle_io {
+  long cycle;                /* Cycle number, starting at 0 */
+  double *analog_in;
+  int *digital_in;
+  long *encoder_in;
+  double *analog_out;        /* Written after callback returns */
+  int *digital_out;
+};
+
+struct moberg_cycle_stats {
+  long cycles;
+  long overruns;             /* Cycles finishing after next wakeup */
+  long missed;               /* Wakeups skipped due to overruns */
+  double jitter_mean;        /* Wakeup latency [s] */
+  double jitter_max;
+  double execution_max;      /* Input to output time [s] */
+};
+
+struct moberg_status moberg_cycle_new(
+  struct moberg *moberg,
+  double period,
+  int priority,
+  int analog_in_count,
+  const int *analog_in_index,
+  int digital_in_count,
+  const int *digital_in_index,
+  int encoder_in_count,
+  const int *encoder_in_index,
+  int analog_out_count,
+  const int *analog_out_index,
+  int digital_out_count,
+  const int *digital_out_index,
+  struct moberg_cycle **cycle);
+
+void moberg_cycle_free(struct moberg_cycle *cycle);
+
+struct moberg_status moberg_cycle_start(
+  struct moberg_cycle *cycle,
+  int (*callback)(void *data, struct moberg_cycle_io *io),
+  void *data);
+
+/* Stops the loop (if still running), returns reason for termination */
+struct moberg_status moberg_cycle_stop(
+  struct moberg_cycle *cycle);
+
+struct moberg_status moberg_cycle_stats(
+  struct moberg_cycle *cycle,
+  struct moberg_cycle_stats *stats);
+
+/* Sample conversion
+
+   Converts n interleaved samples from count channels, where the first
+   sample belongs to channel first (0..count-1), using
+   value = offset[channel] + raw * scale[channel]. Vectorized kernels
+   (AVX2 or SSE2) are selected at first use if the CPU supports them,
+   setting MOBERG_CONVERT=avx2|sse2|scalar in the environment limits
+   the choice. */
+
+struct moberg_status moberg_convert_uint16_to_double(
+  int n,
+  const uint16_t *raw,
+  double *value,
+  int count,
+  int first,
+  const double *offset,
+  const double *scale);
+
+struct moberg_status moberg_convert_uint32_to_double(
+  int n,
+  const uint32_t *raw,
+  double *value,
+  int count,
+  int first,
+  const double *offset,
+  const double *scale);
+
+struct moberg_status moberg_convert_uint16_to_float(
+  int n,
+  const uint16_t *raw,
+  float *value,
+  int count,
+  int first,
+  const double *offset,
+  const double *scale);
+
+struct moberg_status moberg_convert_uint32_to_float(
+  int n,
+  const uint32_t *raw,
+  float *value,
+  int count,
+  int first,
+  const double *offset,
+  const double *scale);
+
+/* Inverse conversion for outputs, (value - offset) / scale is clamped
+   to 0..maxdata[channel] and truncated */
+
+struct moberg_status moberg_convert_double_to_uint32(
+  int n,
+  const double *value,
+  uint32_t *raw,
+  int count,
+  int first,
+  const double *offset,
+  const double *scale,
+  const uint32_t *maxdata);
+
+/* Name of selected conversion kernel ("avx2", "sse2" or "scalar") */
+
+const char *moberg_convert_kernel(void);
+
+/* Latency statistics
+
+   Opt-in by setting MOBERG_STATS=1 in the environment before
+   moberg_new. Every call through the channel structs returned by
+   moberg_*_open is then timed per channel and per device, the
+   *_read_many and *_write_many functions are timed per device. Times
+   are in seconds. The histogram is HDR style: one bucket per ns below
+   16 ns, above that each power of two is split into 8 buckets. */
+
+#define MOBERG_STATS_BUCKETS 256
+
+struct moberg_stats {
+  long count;
+  double min;
+  double max;
+  double mean;
+  long histogram[MOBERG_STATS_BUCKETS];
+};
+
+/* Statistics for n:th instrumented channel, ENODEV when n is past
+   the last channel, ENOTSUP if statistics are not enabled */
+struct moberg_status moberg_stats_channel(
+  struct moberg *moberg,
+  int n,
+  const char **kind,
+  int *index,
+  struct moberg_stats *stats);
+
+/* Statistics for n:th device, name is valid until the next
+   moberg_reload */
+struct moberg_status moberg_stats_device(
+  struct moberg *moberg,
+  int n,
+  const char **name,
+  struct moberg_stats *stats);
+
+void moberg_stats_reset(struct moberg *moberg);
+
+/* Upper bound of latency for percentile (0..100) of calls */
+double moberg_stats_percentile(const struct moberg_stats *stats,
+                               double percentile);
+
 /* System init functionality (systemd/init/...) */
 
 struct moberg_status moberg_start(
@@ -0,0 +1,445 @@
+/*
+    moberg_cache.c -- compiled moberg configuration
+
+    Copyright (C) 2019 Anders Blomdell <anders.blomdell@gmail.com>
+
+    This file is part of Moberg.
+
+    Moberg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#define _POSIX_C_SOURCE  200809L
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <moberg.h>
+#include <moberg_cache.h>
+#include <moberg_config.h>
+#include <moberg_device.h>
+#include <moberg_inline.h>
+
+#define CACHE_MAGIC "MOBERGC1"
+
+/* Native byte order, the file is only used on the machine that wrote
+   it. Records follow the header in this order, strings are offsets
+   into the string area, which starts with an empty string (offset 0
+   is "none") */
+
+struct cache_header {
+  char magic[8];
+  uint32_t size;                /* Of the whole file */
+  uint32_t sources;
+  uint32_t devices;
+  uint32_t maps;
+  uint32_t strings;             /* File offset of the string area */
+  uint32_t unused;
+};
+
+#define PARSE_FAILED UINT32_MAX
+
+struct cache_source {
+  int64_t size;
+  int64_t mtime;
+  uint64_t hash;
+  uint32_t path;
+  uint32_t devices;             /* PARSE_FAILED if the file is dropped */
+};
+
+struct cache_device {
+  uint32_t name;
+  uint32_t config;
+  uint32_t maps;
+};
+
+struct cache_map {
+  uint32_t kind;
+  int32_t min;
+  int32_t max;
+  uint32_t source;
+};
+
+struct cache {
+  const char *base;
+  const struct cache_header *header;
+  const struct cache_source *source;
+  const struct cache_device *device;
+  const struct cache_map *map;
+  const char *strings;
+  uint32_t strings_size;
+};
+
+int moberg_cache_path(char *path, int size)
+{
+  const char *cache = getenv("XDG_CACHE_HOME");
+  int n;
+  if (cache && cache[0]) {
+    n = snprintf(path, size, "%s/moberg/moberg.conf.cache", cache);
+  } else if (getenv("HOME")) {
+    n = snprintf(path, size, "%s/.cache/moberg/moberg.conf.cache",
+                 getenv("HOME"));
+  } else {
+    return 0;
+  }
+  return n < size;
+}
+
+/* FNV-1a */
+unsigned long long moberg_cache_hash(const char *buf, long long size)
+{
+  unsigned long long hash = 0xcbf29ce484222325ULL;
+  for (long long i = 0 ; i < size ; i++) {
+    hash ^= (unsigned char)buf[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static const char *cache_string(struct cache *cache, uint32_t offset)
+{
+  if (offset >= cache->strings_size) {
+    return NULL;
+  }
+  return cache->strings + offset;
+}
+
+/* Maps the file and checks that all records are within it */
+static int cache_open(struct cache *cache, int fd, size_t *length)
+{
+  struct stat statbuf;
+  if (fstat(fd, &statbuf) != 0 ||
+      statbuf.st_size < sizeof(struct cache_header) ||
+      statbuf.st_size > UINT32_MAX) {
+    goto err;
+  }
+  void *base = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (base == MAP_FAILED) {
+    goto err;
+  }
+  *length = statbuf.st_size;
+  cache->base = base;
+  cache->header = base;
+  const struct cache_header *header = cache->header;
+  unsigned long long records =
+    sizeof(*header) +
+    (unsigned long long)header->sources * sizeof(struct cache_source) +
+    (unsigned long long)header->devices * sizeof(struct cache_device) +
+    (unsigned long long)header->maps * sizeof(struct cache_map);
+  if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->size != statbuf.st_size ||
+      header->strings != records ||
+      header->strings >= header->size ||
+      cache->base[header->size - 1] != 0) {
+    goto unmap;
+  }
+  cache->source = (const struct cache_source *)(cache->base +
+                                                sizeof(*header));
+  cache->device = (const struct cache_device *)(cache->source +
+                                                header->sources);
+  cache->map = (const struct cache_map *)(cache->device + header->devices);
+  cache->strings = cache->base + header->strings;
+  cache->strings_size = header->size - header->strings;
+  return 1;
+unmap:
+  munmap(base, statbuf.st_size);
+err:
+  return 0;
+}
+
+/* Same size and mtime, or else same size and contents */
+static int source_unchanged(struct cache *cache,
+                            const struct cache_source *cached,
+                            struct moberg_cache_source *source)
+{
+  const char *path = cache_string(cache, cached->path);
+  if (! path || strcmp(path, source->path) != 0 ||
+      cached->size != source->size) {
+    return 0;
+  }
+  if (cached->mtime == source->mtime) {
+    return 1;
+  }
+  int result = 0;
+  int fd = open(source->path, O_RDONLY);
+  if (fd < 0) {
+    goto out;
+  }
+  char *buf = malloc(source->size + 1);
+  if (buf) {
+    if (read(fd, buf, source->size) == source->size) {
+      source->hash = moberg_cache_hash(buf, source->size);
+      result = source->hash == cached->hash;
+    }
+    free(buf);
+  }
+  close(fd);
+out:
+  return result;
+}
+
+/* Devices of one file, *device and *map are advanced past them */
+static struct moberg_status file_config(struct moberg *moberg,
+                                        struct cache *cache,
+                                        uint32_t devices,
+                                        uint32_t *device,
+                                        uint32_t *map,
+                                        struct moberg_config *config)
+{
+  const struct cache_header *header = cache->header;
+  for (uint32_t i = 0 ; i < devices ; i++, (*device)++) {
+    if (*device >= header->devices) { goto err_einval; }
+    const struct cache_device *d = &cache->device[*device];
+    const char *name = cache_string(cache, d->name);
+    const char *source = cache_string(cache, d->config);
+    if (! name || ! source) { goto err_einval; }
+    struct moberg_device *dev = moberg_device_new(moberg, name, 1);
+    if (! dev) { goto err_enomem; }
+    struct moberg_status result = moberg_config_add_device(config, dev);
+    if (! OK(result)) {
+      moberg_device_free(dev);
+      return result;
+    }
+    if (d->config) {
+      result = moberg_device_record_config(dev, source);
+      if (! OK(result)) { return result; }
+    }
+    for (uint32_t j = 0 ; j < d->maps ; j++, (*map)++) {
+      if (*map >= header->maps) { goto err_einval; }
+      const struct cache_map *m = &cache->map[*map];
+      source = cache_string(cache, m->source);
+      if (! source ||
+          m->kind > chan_ENCODERIN || m->min < 0 || m->min > m->max) {
+        goto err_einval;
+      }
+      result = moberg_device_record_map(dev, m->kind, m->min, m->max, source);
+      if (! OK(result)) { return result; }
+    }
+  }
+  return MOBERG_OK;
+err_einval:
+  return MOBERG_ERRNO(EINVAL);
+err_enomem:
+  return MOBERG_ERRNO(ENOMEM);
+}
+
+static struct moberg_config *cache_config(struct moberg *moberg,
+                                          struct cache *cache,
+                                          int lazy)
+{
+  struct moberg_config *result = NULL;
+  uint32_t device = 0, map = 0;
+  for (uint32_t i = 0 ; i < cache->header->sources ; i++) {
+    const struct cache_source *source = &cache->source[i];
+    if (source->devices == PARSE_FAILED) {
+      continue;
+    }
+    struct moberg_config *config = moberg_config_new();
+    if (! config) { goto free_result; }
+    if (! OK(file_config(moberg, cache, source->devices,
+                         &device, &map, config))) {
+      moberg_config_free(config);
+      goto free_result;
+    }
+    if (! lazy) {
+      /* As when parsed, a device that fails drops its file */
+      uint32_t loaded = moberg_config_load(config);
+      if (loaded != source->devices) {
+        moberg_config_free(config);
+        continue;
+      }
+    }
+    if (! result) {
+      result = config;
+    } else {
+      moberg_config_join(result, config);
+      moberg_config_free(config);
+    }
+  }
+  if (device != cache->header->devices || map != cache->header->maps) {
+    goto free_result;
+  }
+  return result;
+free_result:
+  moberg_config_free(result);
+  return NULL;
+}
+
+struct moberg_config *moberg_cache_load(struct moberg *moberg,
+                                        const char *path,
+                                        int count,
+                                        struct moberg_cache_source *source,
+                                        int lazy)
+{
+  struct moberg_config *result = NULL;
+  struct cache cache;
+  size_t length;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    goto out;
+  }
+  if (! cache_open(&cache, fd, &length)) {
+    goto close;
+  }
+  if (count == 0 || cache.header->sources != count) {
+    goto unmap;
+  }
+  for (int i = 0 ; i < count ; i++) {
+    if (! source_unchanged(&cache, &cache.source[i], &source[i])) {
+      goto unmap;
+    }
+  }
+  result = cache_config(moberg, &cache, lazy);
+unmap:
+  munmap((void *)cache.base, length);
+close:
+  close(fd);
+out:
+  return result;
+}
+
+static uint32_t add_string(FILE *strings, const char *s)
+{
+  if (! s) {
+    return 0;
+  }
+  long offset = ftell(strings);
+  fwrite(s, strlen(s) + 1, 1, strings);
+  return offset;
+}
+
+struct moberg_status moberg_cache_write(const char *path,
+                                        int count,
+                                        struct moberg_cache_source *source,
+                                        struct moberg_config **config)
+{
+  struct moberg_status result = MOBERG_ERRNO(ENOMEM);
+  struct cache_header header;
+  uint32_t devices = 0, maps = 0;
+  enum moberg_channel_kind kind;
+  int min, max;
+  const char *map_source;
+
+  if (count <= 0) {
+    return MOBERG_ERRNO(EINVAL);
+  }
+  for (int i = 0 ; i < count ; i++) {
+    struct moberg_device *d;
+    for (int j = 0 ; config[i] && (d = moberg_config_device(config[i], j)) ;
+         j++) {
+      devices++;
+      for (int k = 0 ; moberg_device_map(d, k, &kind, &min, &max, &map_source) ;
+           k++) {
+        maps++;
+      }
+    }
+  }
+  struct cache_source *s = calloc(count, sizeof(*s));
+  struct cache_device *d = calloc(devices, sizeof(*d));
+  struct cache_map *m = calloc(maps, sizeof(*m));
+  char *strings = NULL;
+  size_t strings_size;
+  FILE *f = open_memstream(&strings, &strings_size);
+  if (! s || (devices && ! d) || (maps && ! m) || ! f) {
+    goto free;
+  }
+  fputc(0, f);
+  uint32_t device = 0, map = 0;
+  for (int i = 0 ; i < count ; i++) {
+    s[i].size = source[i].size;
+    s[i].mtime = source[i].mtime;
+    s[i].hash = source[i].hash;
+    s[i].path = add_string(f, source[i].path);
+    if (! config[i]) {
+      s[i].devices = PARSE_FAILED;
+      continue;
+    }
+    struct moberg_device *dev;
+    for (int j = 0 ; (dev = moberg_config_device(config[i], j)) ; j++) {
+      s[i].devices++;
+      d[device].name = add_string(f, moberg_device_name(dev));
+      d[device].config = add_string(f, moberg_device_config(dev));
+      for (int k = 0 ;
+           moberg_device_map(dev, k, &kind, &min, &max, &map_source) ;
+           k++) {
+        m[map].kind = kind;
+        m[map].min = min;
+        m[map].max = max;
+        m[map].source = add_string(f, map_source);
+        d[device].maps++;
+        map++;
+      }
+      device++;
+    }
+  }
+  if (fclose(f) != 0) {
+    f = NULL;
+    goto free;
+  }
+  f = NULL;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+  header.sources = count;
+  header.devices = devices;
+  header.maps = maps;
+  header.strings = sizeof(header) + count * sizeof(*s) +
+    devices * sizeof(*d) + maps * sizeof(*m);
+  if (header.strings + (unsigned long long)strings_size > UINT32_MAX) {
+    result = MOBERG_ERRNO(EFBIG);
+    goto free;
+  }
+  header.size = header.strings + strings_size;
+
+  /* Create cache directories, errors show up in fopen */
+  char dir[PATH_MAX], tmp[PATH_MAX + 16];
+  snprintf(dir, sizeof(dir), "%s", path);
+  for (char *p = strchr(dir + 1, '/') ; p ; p = strchr(p + 1, '/')) {
+    *p = 0;
+    mkdir(dir, 0755);
+    *p = '/';
+  }
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+  FILE *out = fopen(tmp, "w");
+  if (! out) {
+    result = MOBERG_ERRNO(errno);
+    goto free;
+  }
+  int ok = (fwrite(&header, sizeof(header), 1, out) == 1 &&
+            fwrite(s, sizeof(*s), count, out) == count &&
+            fwrite(d, sizeof(*d), devices, out) == devices &&
+            fwrite(m, sizeof(*m), maps, out) == maps &&
+            fwrite(strings, 1, strings_size, out) == strings_size);
+  if (fclose(out) == 0 && ok && rename(tmp, path) == 0) {
+    result = MOBERG_OK;
+  } else {
+    result = MOBERG_ERRNO(errno ? errno : EIO);
+    unlink(tmp);
+  }
+free:
+  if (f) {
+    fclose(f);
+  }
+  free(strings);
+  free(m);
+  free(d);
+  free(s);
+  return result;
+}
@@ -0,0 +1,62 @@
+/*
+    moberg_cache.h -- compiled moberg configuration
+
+    Copyright (C) 2019 Anders Blomdell <anders.blomdell@gmail.com>
+
+    This file is part of Moberg.
+
+    Moberg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef __MOBERG_CACHE_H__
+#define __MOBERG_CACHE_H__
+
+#include <moberg.h>
+#include <moberg_config.h>
+
+/* The devices, configs and maps of each configuration file, as
+   recorded by a lazy parse (see moberg_device_record_config), in a
+   file that is mmap'ed and used as long as the files are unchanged */
+
+struct moberg_cache_source {
+  char *path;
+  long long size;
+  long long mtime;              /* ns */
+  unsigned long long hash;      /* Of the contents, 0 if not read */
+};
+
+/* $XDG_CACHE_HOME/moberg/moberg.conf.cache, 0 if there is no cache
+   directory */
+int moberg_cache_path(char *path, int size);
+
+unsigned long long moberg_cache_hash(const char *buf, long long size);
+
+/* The configuration of the count files in source, NULL if the cache
+   is missing, stale or damaged. Devices are loaded unless lazy, and
+   (like a parse) the devices of a file that fails to load are
+   dropped */
+struct moberg_config *moberg_cache_load(struct moberg *moberg,
+                                        const char *path,
+                                        int count,
+                                        struct moberg_cache_source *source,
+                                        int lazy);
+
+/* Writes the lazily parsed config[i] of each source[i] (all hashed),
+   a NULL config is a file that failed to parse */
+struct moberg_status moberg_cache_write(const char *path,
+                                        int count,
+                                        struct moberg_cache_source *source,
+                                        struct moberg_config **config);
+
+#endif
@@ -32,8 +32,13 @@ enum moberg_channel_kind {
     chan_ENCODERIN
 };
 
+struct moberg_device;
+
 struct moberg_channel {
   struct moberg_channel_context *context;
+
+  /* Device that mapped the channel, filled in by libmoberg */
+  struct moberg_device *device;
   
   /* Use-count of channel, when it reaches zero, channel will be free'd */
   int (*up)(struct moberg_channel *channel);
@@ -66,6 +71,11 @@ struct moberg_channel_install {
                                   int index,
                                   struct moberg_device* device,
                                   struct moberg_channel *channel);
+  /* kind[index] is mapped by device, which is not loaded yet */
+  struct moberg_status (*lazy)(struct moberg *context,
+                               enum moberg_channel_kind kind,
+                               int index,
+                               struct moberg_device* device);
 };
 
 #endif
@@ -31,6 +31,7 @@ struct moberg_config
   struct device_entry {
     struct device_entry *next;
     struct moberg_device *device;
+    int claimed;  /* Reused by a reloaded config */
   } *device_head, **device_tail;
 };
 
@@ -53,7 +54,9 @@ void moberg_config_free(struct moberg_config *config)
     while (entry) {
       struct device_entry *tmp = entry;
       entry = entry->next;
-      moberg_device_free(tmp->device);
+      if (tmp->device) {
+        moberg_device_free(tmp->device);
+      }
       free(tmp);
     }
     free(config);
@@ -79,6 +82,16 @@ int moberg_config_join(struct moberg_config *dest,
   return 0;
 }
 
+struct moberg_device *moberg_config_device(struct moberg_config *config,
+                                           int n)
+{
+  struct device_entry *d = config->device_head;
+  for ( ; d && n > 0 ; n--) {
+    d = d->next;
+  }
+  return d ? d->device : NULL;
+}
+
 struct moberg_status moberg_config_add_device(struct moberg_config *config,
                                               struct moberg_device *device)
 {
@@ -87,6 +100,7 @@ struct moberg_status moberg_config_add_device(struct moberg_config *config,
   if (! entry) { goto err; }
   entry->next = NULL;
   entry->device = device;
+  entry->claimed = 0;
   /* TODO_ entry->started = 0; */
   *config->device_tail = entry;
   config->device_tail = &entry->next;
@@ -99,10 +113,28 @@ err:
 int moberg_config_install_channels(struct moberg_config *config,
                                    struct moberg_channel_install *install)
 {
-  int result = 1;
   for (struct device_entry *d = config->device_head ; d ; d = d->next) {
-    result &= moberg_device_install_channels(d->device, install);
+    if (! moberg_device_install_channels(d->device, install)) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+void moberg_config_count_channels(struct moberg_config *config,
+                                  int *count)
+{
+  for (struct device_entry *d = config->device_head ; d ; d = d->next) {
+    moberg_device_count_channels(d->device, count);
   }
+}
+
+void moberg_config_prune(struct moberg_config *config,
+                         void (*forget)(void *context,
+                                        struct moberg_device *device),
+                         void *context)
+{
   struct device_entry *device = config->device_head;
   struct device_entry **previous = &config->device_head;
   while (device) {
@@ -110,31 +142,112 @@ int moberg_config_install_channels(struct moberg_config *config,
     if (moberg_device_in_use(device->device)) {
       previous = &device->next;
     } else {
+      if (forget) {
+        forget(context, device->device);
+      }
       moberg_device_free(device->device);
       free(device);
       *previous = next;
     }
     device = next;
   }
+  config->device_tail = previous;
+}
 
+struct moberg_status moberg_config_reuse(struct moberg_config *config,
+                                         struct moberg_config *previous)
+{
+  struct moberg_status result = MOBERG_OK;
+  for (struct device_entry *d = config->device_head ; d ; d = d->next) {
+    for (struct device_entry *p = previous->device_head ; p ; p = p->next) {
+      if (! p->claimed && moberg_device_loaded(p->device) &&
+          moberg_device_same_config(p->device, d->device)) {
+        result = moberg_device_adopt(p->device, d->device);
+        if (! OK(result)) {
+          goto err;
+        }
+        moberg_device_free(d->device);
+        d->device = p->device;
+        d->claimed = 1;
+        p->claimed = 1;
+        break;
+      }
+    }
+  }
+  /* Only previous keeps its marks (for moberg_config_retire), config
+     is the previous one of the next reload */
+  for (struct device_entry *d = config->device_head ; d ; d = d->next) {
+    d->claimed = 0;
+  }
+  return MOBERG_OK;
+err:
+  moberg_config_give_back(config, previous);
   return result;
 }
 
-struct moberg_status moberg_config_start(struct moberg_config *config,
-                                         FILE *f)
+void moberg_config_give_back(struct moberg_config *config,
+                             struct moberg_config *previous)
+{
+  for (struct device_entry *p = previous->device_head ; p ; p = p->next) {
+    if (p->claimed) {
+      for (struct device_entry *d = config->device_head ; d ; d = d->next) {
+        if (d->device == p->device) {
+          d->device = NULL;
+        }
+      }
+      p->claimed = 0;
+    }
+  }
+}
+
+void moberg_config_retire(struct moberg_config *previous,
+                          struct moberg_config *retired)
 {
+  while (previous->device_head) {
+    struct device_entry *d = previous->device_head;
+    previous->device_head = d->next;
+    if (d->claimed) {
+      free(d);
+    } else {
+      d->next = NULL;
+      *retired->device_tail = d;
+      retired->device_tail = &d->next;
+    }
+  }
+  free(previous);
+}
+
+int moberg_config_load(struct moberg_config *config)
+{
+  int loaded = 0;
   for (struct device_entry *d = config->device_head ; d ; d = d->next) {
-    moberg_device_start(d->device, f);
+    if (! moberg_device_loaded(d->device) &&
+        OK(moberg_device_load(d->device))) {
+      loaded++;
+    }
   }
-  return MOBERG_OK;
+  return loaded;
 }
 
+int moberg_config_device_count(struct moberg_config *config)
+{
+  int count = 0;
+  for (struct device_entry *d = config->device_head ; d ; d = d->next) {
+    count++;
+  }
+  return count;
+}
 
-struct moberg_status moberg_config_stop(struct moberg_config *config,
-                                        FILE *f)
+int moberg_config_hold(struct moberg_config *config,
+                       struct moberg_device **device)
 {
+  int count = 0;
   for (struct device_entry *d = config->device_head ; d ; d = d->next) {
-    moberg_device_stop(d->device, f);
+    if (moberg_device_loaded(d->device)) {
+      moberg_device_hold(d->device);
+      device[count] = d->device;
+      count++;
+    }
   }
-  return MOBERG_OK;
+  return count;
 }
@@ -32,16 +32,54 @@ void moberg_config_free(struct moberg_config *config);
 int moberg_config_join(struct moberg_config *dest,
                        struct moberg_config *src);
 
+/* The n:th device of config, NULL if there are fewer devices */
+struct moberg_device *moberg_config_device(struct moberg_config *config,
+                                           int n);
+
 struct moberg_status moberg_config_add_device(struct moberg_config *config,
                                               struct moberg_device *device);
 
+/* Devices that are not loaded install their mapped indices as lazy,
+   returns 0 (after the first failed install) if out of memory */
 int moberg_config_install_channels(struct moberg_config *config,
                                    struct moberg_channel_install *install);
 
-struct moberg_status moberg_config_start(struct moberg_config *config,
-                                         FILE *f);
+/* Raises count[kind] above the highest index of kind mapped */
+void moberg_config_count_channels(struct moberg_config *config,
+                                  int *count);
+
+/* Frees the devices that have no channels left, forget (if non-NULL)
+   is called before each device is freed */
+void moberg_config_prune(struct moberg_config *config,
+                         void (*forget)(void *context,
+                                        struct moberg_device *device),
+                         void *context);
+
+/* Replaces the devices of config that have the same config as a loaded
+   device in previous by that device, which adopts the new maps (see
+   moberg_device_adopt). Reused devices are claimed in previous */
+struct moberg_status moberg_config_reuse(struct moberg_config *config,
+                                         struct moberg_config *previous);
+
+/* Undoes moberg_config_reuse, so config can be freed. The reused
+   devices keep the adopted maps, but their installed channels are
+   not affected */
+void moberg_config_give_back(struct moberg_config *config,
+                             struct moberg_config *previous);
+
+/* Frees previous, its unclaimed devices are moved to retired */
+void moberg_config_retire(struct moberg_config *previous,
+                          struct moberg_config *retired);
+
+/* Loads the lazy devices of config, returns the number loaded */
+int moberg_config_load(struct moberg_config *config);
+
+int moberg_config_device_count(struct moberg_config *config);
 
-struct moberg_status moberg_config_stop(struct moberg_config *config,
-                                        FILE *f);
+/* Holds (see moberg_device_hold) the loaded devices of config and
+   stores them in device (room for moberg_config_device_count), returns
+   the number held */
+int moberg_config_hold(struct moberg_config *config,
+                       struct moberg_device **device);
 
 #endif
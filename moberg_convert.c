@@ -0,0 +1,644 @@
+/*
+    moberg_convert.c -- conversion between raw samples and engineering units
+
+    Copyright (C) 2019 Anders Blomdell <anders.blomdell@gmail.com>
+
+    This file is part of Moberg.
+
+    Moberg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <moberg.h>
+#include <moberg_inline.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CONVERT_X86
+#include <immintrin.h>
+#endif
+
+/*
+  Channel parameters are expanded into a pattern that repeats with
+  lcm(count, PATTERN_ALIGN) samples, so that kernels can apply them
+  with plain vector loads regardless of the number of channels.
+  All kernels evaluate offset + raw * scale (and its inverse) without
+  fused multiply-add, results are identical for all kernels.
+*/
+#define PATTERN_ALIGN 8     /* Widest vector, in samples */
+#define PATTERN_STACK 1024  /* Larger patterns are allocated on heap */
+
+struct kernels {
+  const char *name;
+  void (*uint16_to_double)(int n, const uint16_t *raw, double *value,
+                           int period,
+                           const double *offset, const double *scale);
+  void (*uint32_to_double)(int n, const uint32_t *raw, double *value,
+                           int period,
+                           const double *offset, const double *scale);
+  void (*uint16_to_float)(int n, const uint16_t *raw, float *value,
+                          int period,
+                          const float *offset, const float *scale);
+  void (*uint32_to_float)(int n, const uint32_t *raw, float *value,
+                          int period,
+                          const float *offset, const float *scale);
+  void (*double_to_uint32)(int n, const double *value, uint32_t *raw,
+                           int period,
+                           const double *offset, const double *scale,
+                           const double *maxdata);
+};
+
+/* Scalar kernels */
+
+static void uint16_to_double_scalar(int n, const uint16_t *raw, double *value,
+                                    int period,
+                                    const double *offset, const double *scale)
+{
+  for (int i = 0 ; i < n ; i += period) {
+    int m = n - i < period ? n - i : period;
+    for (int j = 0 ; j < m ; j++) {
+      value[i + j] = offset[j] + raw[i + j] * scale[j];
+    }
+  }
+}
+
+static void uint32_to_double_scalar(int n, const uint32_t *raw, double *value,
+                                    int period,
+                                    const double *offset, const double *scale)
+{
+  for (int i = 0 ; i < n ; i += period) {
+    int m = n - i < period ? n - i : period;
+    for (int j = 0 ; j < m ; j++) {
+      value[i + j] = offset[j] + raw[i + j] * scale[j];
+    }
+  }
+}
+
+static void uint16_to_float_scalar(int n, const uint16_t *raw, float *value,
+                                   int period,
+                                   const float *offset, const float *scale)
+{
+  for (int i = 0 ; i < n ; i += period) {
+    int m = n - i < period ? n - i : period;
+    for (int j = 0 ; j < m ; j++) {
+      value[i + j] = offset[j] + (float)raw[i + j] * scale[j];
+    }
+  }
+}
+
+static void uint32_to_float_scalar(int n, const uint32_t *raw, float *value,
+                                   int period,
+                                   const float *offset, const float *scale)
+{
+  for (int i = 0 ; i < n ; i += period) {
+    int m = n - i < period ? n - i : period;
+    for (int j = 0 ; j < m ; j++) {
+      value[i + j] = offset[j] + (float)raw[i + j] * scale[j];
+    }
+  }
+}
+
+static inline uint32_t quantize(double value, double offset, double scale,
+                                double maxdata)
+{
+  double x = (value - offset) / scale;
+  if (! (x > 0.0)) {
+    /* Also catches NaN */
+    x = 0.0;
+  } else if (x > maxdata) {
+    x = maxdata;
+  }
+  return x;
+}
+
+static void double_to_uint32_scalar(int n, const double *value, uint32_t *raw,
+                                    int period,
+                                    const double *offset, const double *scale,
+                                    const double *maxdata)
+{
+  for (int i = 0 ; i < n ; i += period) {
+    int m = n - i < period ? n - i : period;
+    for (int j = 0 ; j < m ; j++) {
+      raw[i + j] = quantize(value[i + j], offset[j], scale[j], maxdata[j]);
+    }
+  }
+}
+
+static const struct kernels scalar_kernels = {
+  .name="scalar",
+  .uint16_to_double=uint16_to_double_scalar,
+  .uint32_to_double=uint32_to_double_scalar,
+  .uint16_to_float=uint16_to_float_scalar,
+  .uint32_to_float=uint32_to_float_scalar,
+  .double_to_uint32=double_to_uint32_scalar
+};
+
+#ifdef CONVERT_X86
+
+/* SSE2 kernels, 2 doubles or 4 floats per vector */
+
+__attribute__((target("sse2")))
+static void uint16_to_double_sse2(int n, const uint16_t *raw, double *value,
+                                  int period,
+                                  const double *offset, const double *scale)
+{
+  const __m128i zero = _mm_setzero_si128();
+  for (int i = 0 ; i < n ; i += period) {
+    int m = n - i < period ? n - i : period;
+    int j = 0;
+    for ( ; j + 4 <= m ; j += 4) {
+      __m128i r = _mm_loadl_epi64((const __m128i *)&raw[i + j]);
+      r = _mm_unpacklo_epi16(r, zero);
+      __m128d lo = _mm_cvtepi32_pd(r);
+      __m128d hi = _mm_cvtepi32_pd(_mm_srli_si128(r, 8));
+      lo = _mm_add_pd(_mm_loadu_pd(&offset[j]),
+                      _mm_mul_pd(lo, _mm_loadu_pd(&scale[j])));
+      hi = _mm_add_pd(_mm_loadu_pd(&offset[j + 2]),
+                      _mm_mul_pd(hi, _mm_loadu_pd(&scale[j + 2])));
+      _mm_storeu_pd(&value[i + j], lo);
+      _mm_storeu_pd(&value[i + j + 2], hi);
+    }
+    for ( ; j < m ; j++) {
+      value[i + j] = offset[j] + raw[i + j] * scale[j];
+    }
+  }
+}
+
+__attribute__((target("sse2")))
+static void uint32_to_double_sse2(int n, const uint32_t *raw, double *value,
+                                  int period,
+                                  const double *offset, const double *scale)
+{
+  const __m128i bias = _mm_set1_epi32(INT32_MIN);
+  const __m128d two31 = _mm_set1_pd(2147483648.0);
+  for (int i = 0 ; i < n ; i += period) {
+    int m = n - i < period ? n - i : period;
+    int j = 0;
+    for ( ; j + 4 <= m ; j += 4) {
+      __m128i r = _mm_loadu_si128((const __m128i *)&raw[i + j]);
+      r = _mm_xor_si128(r, bias);
+      __m128d lo = _mm_add_pd(_mm_cvtepi32_pd(r), two31);
+      __m128d hi = _mm_add_pd(_mm_cvtepi32_pd(_mm_srli_si128(r, 8)), two31);
+      lo = _mm_add_pd(_mm_loadu_pd(&offset[j]),
+                      _mm_mul_pd(lo, _mm_loadu_pd(&scale[j])));
+      hi = _mm_add_pd(_mm_loadu_pd(&offset[j + 2]),
+                      _mm_mul_pd(hi, _mm_loadu_pd(&scale[j + 2])));
+      _mm_storeu_pd(&value[i + j], lo);
+      _mm_storeu_pd(&value[i + j + 2], hi);
+    }
+    for ( ; j < m ; j++) {
+      value[i + j] = offset[j] + raw[i + j] * scale[j];
+    }
+  }
+}
+
+__attribute__((target("sse2")))
+static void uint16_to_float_sse2(int n, const uint16_t *raw, float *value,
+                                 int period,
+                                 const float *offset, const float *scale)
+{
+  const __m128i zero = _mm_setzero_si128();
+  for (int i = 0 ; i < n ; i += period) {
+    int m = n - i < period ? n - i : period;
+    int j = 0;
+    for ( ; j + 4 <= m ; j += 4) {
+      __m128i r = _mm_loadl_epi64((const __m128i *)&raw[i + j]);
+      __m128 x = _mm_cvtepi32_ps(_mm_unpacklo_epi16(r, zero));
+      x = _mm_add_ps(_mm_loadu_ps(&offset[j]),
+                     _mm_mul_ps(x, _mm_loadu_ps(&scale[j])));
+      _mm_storeu_ps(&value[i + j], x);
+    }
+    for ( ; j < m ; j++) {
+      value[i + j] = offset[j] + (float)raw[i + j] * scale[j];
+    }
+  }
+}
+
+__attribute__((target("sse2")))
+static void uint32_to_float_sse2(int n, const uint32_t *raw, float *value,
+                                 int period,
+                                 const float *offset, const float *scale)
+{
+  const __m128i bias = _mm_set1_epi32(INT32_MIN);
+  const __m128d two31 = _mm_set1_pd(2147483648.0);
+  for (int i = 0 ; i < n ; i += period) {
+    int m = n - i < period ? n - i : period;
+    int j = 0;
+    for ( ; j + 4 <= m ; j += 4) {
+      /* Go via double to round only once, like (float)raw */
+      __m128i r = _mm_loadu_si128((const __m128i *)&raw[i + j]);
+      r = _mm_xor_si128(r, bias);
+      __m128 lo = _mm_cvtpd_ps(_mm_add_pd(_mm_cvtepi32_pd(r), two31));
+      __m128 hi = _mm_cvtpd_ps(
+        _mm_add_pd(_mm_cvtepi32_pd(_mm_srli_si128(r, 8)), two31));
+      __m128 x = _mm_movelh_ps(lo, hi);
+      x = _mm_add_ps(_mm_loadu_ps(&offset[j]),
+                     _mm_mul_ps(x, _mm_loadu_ps(&scale[j])));
+      _mm_storeu_ps(&value[i + j], x);
+    }
+    for ( ; j < m ; j++) {
+      value[i + j] = offset[j] + (float)raw[i + j] * scale[j];
+    }
+  }
+}
+
+__attribute__((target("sse2")))
+static void double_to_uint32_sse2(int n, const double *value, uint32_t *raw,
+                                  int period,
+                                  const double *offset, const double *scale,
+                                  const double *maxdata)
+{
+  const __m128d zero = _mm_setzero_pd();
+  const __m128d one = _mm_set1_pd(1.0);
+  const __m128d two31 = _mm_set1_pd(2147483648.0);
+  for (int i = 0 ; i < n ; i += period) {
+    int m = n - i < period ? n - i : period;
+    int j = 0;
+    for ( ; j + 2 <= m ; j += 2) {
+      __m128d x = _mm_div_pd(_mm_sub_pd(_mm_loadu_pd(&value[i + j]),
+                                        _mm_loadu_pd(&offset[j])),
+                             _mm_loadu_pd(&scale[j]));
+      /* max returns its second operand for NaN */
+      x = _mm_max_pd(x, zero);
+      x = _mm_min_pd(x, _mm_loadu_pd(&maxdata[j]));
+      /* Only signed conversion available, handle bit 31 separately */
+      __m128d high = _mm_cmpge_pd(x, two31);
+      __m128i r = _mm_cvttpd_epi32(_mm_sub_pd(x, _mm_and_pd(high, two31)));
+      r = _mm_or_si128(
+        r, _mm_slli_epi32(_mm_cvttpd_epi32(_mm_and_pd(high, one)), 31));
+      _mm_storel_epi64((__m128i *)&raw[i + j], r);
+    }
+    for ( ; j < m ; j++) {
+      raw[i + j] = quantize(value[i + j], offset[j], scale[j], maxdata[j]);
+    }
+  }
+}
+
+static const struct kernels sse2_kernels = {
+  .name="sse2",
+  .uint16_to_double=uint16_to_double_sse2,
+  .uint32_to_double=uint32_to_double_sse2,
+  .uint16_to_float=uint16_to_float_sse2,
+  .uint32_to_float=uint32_to_float_sse2,
+  .double_to_uint32=double_to_uint32_sse2
+};
+
+/* AVX2 kernels, 4 doubles or 8 floats per vector */
+
+__attribute__((target("avx2")))
+static void uint16_to_double_avx2(int n, const uint16_t *raw, double *value,
+                                  int period,
+                                  const double *offset, const double *scale)
+{
+  for (int i = 0 ; i < n ; i += period) {
+    int m = n - i < period ? n - i : period;
+    int j = 0;
+    for ( ; j + 4 <= m ; j += 4) {
+      __m128i r = _mm_loadl_epi64((const __m128i *)&raw[i + j]);
+      __m256d x = _mm256_cvtepi32_pd(_mm_cvtepu16_epi32(r));
+      x = _mm256_add_pd(_mm256_loadu_pd(&offset[j]),
+                        _mm256_mul_pd(x, _mm256_loadu_pd(&scale[j])));
+      _mm256_storeu_pd(&value[i + j], x);
+    }
+    for ( ; j < m ; j++) {
+      value[i + j] = offset[j] + raw[i + j] * scale[j];
+    }
+  }
+}
+
+__attribute__((target("avx2")))
+static void uint32_to_double_avx2(int n, const uint32_t *raw, double *value,
+                                  int period,
+                                  const double *offset, const double *scale)
+{
+  const __m128i bias = _mm_set1_epi32(INT32_MIN);
+  const __m256d two31 = _mm256_set1_pd(2147483648.0);
+  for (int i = 0 ; i < n ; i += period) {
+    int m = n - i < period ? n - i : period;
+    int j = 0;
+    for ( ; j + 4 <= m ; j += 4) {
+      __m128i r = _mm_loadu_si128((const __m128i *)&raw[i + j]);
+      __m256d x = _mm256_add_pd(_mm256_cvtepi32_pd(_mm_xor_si128(r, bias)),
+                                two31);
+      x = _mm256_add_pd(_mm256_loadu_pd(&offset[j]),
+                        _mm256_mul_pd(x, _mm256_loadu_pd(&scale[j])));
+      _mm256_storeu_pd(&value[i + j], x);
+    }
+    for ( ; j < m ; j++) {
+      value[i + j] = offset[j] + raw[i + j] * scale[j];
+    }
+  }
+}
+
+__attribute__((target("avx2")))
+static void uint16_to_float_avx2(int n, const uint16_t *raw, float *value,
+                                 int period,
+                                 const float *offset, const float *scale)
+{
+  for (int i = 0 ; i < n ; i += period) {
+    int m = n - i < period ? n - i : period;
+    int j = 0;
+    for ( ; j + 8 <= m ; j += 8) {
+      __m128i r = _mm_loadu_si128((const __m128i *)&raw[i + j]);
+      __m256 x = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(r));
+      x = _mm256_add_ps(_mm256_loadu_ps(&offset[j]),
+                        _mm256_mul_ps(x, _mm256_loadu_ps(&scale[j])));
+      _mm256_storeu_ps(&value[i + j], x);
+    }
+    for ( ; j < m ; j++) {
+      value[i + j] = offset[j] + (float)raw[i + j] * scale[j];
+    }
+  }
+}
+
+__attribute__((target("avx2")))
+static void uint32_to_float_avx2(int n, const uint32_t *raw, float *value,
+                                 int period,
+                                 const float *offset, const float *scale)
+{
+  const __m128i bias = _mm_set1_epi32(INT32_MIN);
+  const __m256d two31 = _mm256_set1_pd(2147483648.0);
+  for (int i = 0 ; i < n ; i += period) {
+    int m = n - i < period ? n - i : period;
+    int j = 0;
+    for ( ; j + 8 <= m ; j += 8) {
+      /* Go via double to round only once, like (float)raw */
+      __m128i r0 = _mm_loadu_si128((const __m128i *)&raw[i + j]);
+      __m128i r1 = _mm_loadu_si128((const __m128i *)&raw[i + j + 4]);
+      __m128 lo = _mm256_cvtpd_ps(
+        _mm256_add_pd(_mm256_cvtepi32_pd(_mm_xor_si128(r0, bias)), two31));
+      __m128 hi = _mm256_cvtpd_ps(
+        _mm256_add_pd(_mm256_cvtepi32_pd(_mm_xor_si128(r1, bias)), two31));
+      __m256 x = _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+      x = _mm256_add_ps(_mm256_loadu_ps(&offset[j]),
+                        _mm256_mul_ps(x, _mm256_loadu_ps(&scale[j])));
+      _mm256_storeu_ps(&value[i + j], x);
+    }
+    for ( ; j < m ; j++) {
+      value[i + j] = offset[j] + (float)raw[i + j] * scale[j];
+    }
+  }
+}
+
+__attribute__((target("avx2")))
+static void double_to_uint32_avx2(int n, const double *value, uint32_t *raw,
+                                  int period,
+                                  const double *offset, const double *scale,
+                                  const double *maxdata)
+{
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d one = _mm256_set1_pd(1.0);
+  const __m256d two31 = _mm256_set1_pd(2147483648.0);
+  for (int i = 0 ; i < n ; i += period) {
+    int m = n - i < period ? n - i : period;
+    int j = 0;
+    for ( ; j + 4 <= m ; j += 4) {
+      __m256d x = _mm256_div_pd(_mm256_sub_pd(_mm256_loadu_pd(&value[i + j]),
+                                              _mm256_loadu_pd(&offset[j])),
+                                _mm256_loadu_pd(&scale[j]));
+      /* max returns its second operand for NaN */
+      x = _mm256_max_pd(x, zero);
+      x = _mm256_min_pd(x, _mm256_loadu_pd(&maxdata[j]));
+      /* Only signed conversion available, handle bit 31 separately */
+      __m256d high = _mm256_cmp_pd(x, two31, _CMP_GE_OQ);
+      __m128i r = _mm256_cvttpd_epi32(
+        _mm256_sub_pd(x, _mm256_and_pd(high, two31)));
+      r = _mm_or_si128(
+        r, _mm_slli_epi32(_mm256_cvttpd_epi32(_mm256_and_pd(high, one)), 31));
+      _mm_storeu_si128((__m128i *)&raw[i + j], r);
+    }
+    for ( ; j < m ; j++) {
+      raw[i + j] = quantize(value[i + j], offset[j], scale[j], maxdata[j]);
+    }
+  }
+}
+
+static const struct kernels avx2_kernels = {
+  .name="avx2",
+  .uint16_to_double=uint16_to_double_avx2,
+  .uint32_to_double=uint32_to_double_avx2,
+  .uint16_to_float=uint16_to_float_avx2,
+  .uint32_to_float=uint32_to_float_avx2,
+  .double_to_uint32=double_to_uint32_avx2
+};
+
+#endif
+
+/* Kernel selection, MOBERG_CONVERT in environment limits the choice */
+
+static const struct kernels *kernels;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static int allowed(const char *limit, const struct kernels *k)
+{
+  return ! limit || strcmp(limit, k->name) == 0;
+}
+
+static void select_kernels(void)
+{
+  const char *limit = getenv("MOBERG_CONVERT");
+  kernels = &scalar_kernels;
+#ifdef CONVERT_X86
+  __builtin_cpu_init();
+  if (allowed(limit, &avx2_kernels) && __builtin_cpu_supports("avx2")) {
+    kernels = &avx2_kernels;
+  } else if (allowed(limit, &sse2_kernels) && __builtin_cpu_supports("sse2")) {
+    kernels = &sse2_kernels;
+  }
+#endif
+}
+
+static const struct kernels *get_kernels(void)
+{
+  pthread_once(&kernels_once, select_kernels);
+  return kernels;
+}
+
+const char *moberg_convert_kernel(void)
+{
+  return get_kernels()->name;
+}
+
+/* Pattern handling */
+
+static int pattern_length(int n, int count)
+{
+  int a = count, b = PATTERN_ALIGN;
+  while (b) {
+    int t = a % b;
+    a = b;
+    b = t;
+  }
+  int length = count / a * PATTERN_ALIGN;
+  /* A short conversion never wraps the pattern */
+  return n < length ? n : length;
+}
+
+enum conversion {
+  uint16_to_double,
+  uint32_to_double,
+  uint16_to_float,
+  uint32_to_float,
+  double_to_uint32
+};
+
+static struct moberg_status convert(enum conversion conversion,
+                                    int n,
+                                    const void *from,
+                                    void *to,
+                                    int count,
+                                    int first,
+                                    const double *offset,
+                                    const double *scale,
+                                    const uint32_t *maxdata)
+{
+  if (n < 0 || (n && (! from || ! to)) ||
+      count <= 0 || first < 0 || first >= count || ! offset || ! scale) {
+    return MOBERG_ERRNO(EINVAL);
+  }
+  if (n == 0) {
+    return MOBERG_OK;
+  }
+  const struct kernels *k = get_kernels();
+  int length = pattern_length(n, count);
+  double on_stack[length <= PATTERN_STACK ? 3 * length : 1];
+  double *pattern = on_stack;
+  if (length > PATTERN_STACK) {
+    pattern = malloc(3 * length * sizeof(*pattern));
+    if (! pattern) {
+      return MOBERG_ERRNO(ENOMEM);
+    }
+  }
+  double *o = &pattern[0];
+  double *s = &pattern[length];
+  double *d = &pattern[2 * length];
+  float *of = (float *)o;
+  float *sf = (float *)s;
+  for (int i = 0, channel = first ; i < length ; i++) {
+    switch (conversion) {
+      case uint16_to_double:
+      case uint32_to_double:
+        o[i] = offset[channel];
+        s[i] = scale[channel];
+        break;
+      case uint16_to_float:
+      case uint32_to_float:
+        of[i] = offset[channel];
+        sf[i] = scale[channel];
+        break;
+      case double_to_uint32:
+        o[i] = offset[channel];
+        s[i] = scale[channel];
+        d[i] = maxdata[channel];
+        break;
+    }
+    channel++;
+    if (channel >= count) {
+      channel = 0;
+    }
+  }
+  switch (conversion) {
+    case uint16_to_double:
+      k->uint16_to_double(n, from, to, length, o, s);
+      break;
+    case uint32_to_double:
+      k->uint32_to_double(n, from, to, length, o, s);
+      break;
+    case uint16_to_float:
+      k->uint16_to_float(n, from, to, length, of, sf);
+      break;
+    case uint32_to_float:
+      k->uint32_to_float(n, from, to, length, of, sf);
+      break;
+    case double_to_uint32:
+      k->double_to_uint32(n, from, to, length, o, s, d);
+      break;
+  }
+  if (pattern != on_stack) {
+    free(pattern);
+  }
+  return MOBERG_OK;
+}
+
+struct moberg_status moberg_convert_uint16_to_double(
+  int n,
+  const uint16_t *raw,
+  double *value,
+  int count,
+  int first,
+  const double *offset,
+  const double *scale)
+{
+  return convert(uint16_to_double, n, raw, value,
+                 count, first, offset, scale, NULL);
+}
+
+struct moberg_status moberg_convert_uint32_to_double(
+  int n,
+  const uint32_t *raw,
+  double *value,
+  int count,
+  int first,
+  const double *offset,
+  const double *scale)
+{
+  return convert(uint32_to_double, n, raw, value,
+                 count, first, offset, scale, NULL);
+}
+
+struct moberg_status moberg_convert_uint16_to_float(
+  int n,
+  const uint16_t *raw,
+  float *value,
+  int count,
+  int first,
+  const double *offset,
+  const double *scale)
+{
+  return convert(uint16_to_float, n, raw, value,
+                 count, first, offset, scale, NULL);
+}
+
+struct moberg_status moberg_convert_uint32_to_float(
+  int n,
+  const uint32_t *raw,
+  float *value,
+  int count,
+  int first,
+  const double *offset,
+  const double *scale)
+{
+  return convert(uint32_to_float, n, raw, value,
+                 count, first, offset, scale, NULL);
+}
+
+struct moberg_status moberg_convert_double_to_uint32(
+  int n,
+  const double *value,
+  uint32_t *raw,
+  int count,
+  int first,
+  const double *offset,
+  const double *scale,
+  const uint32_t *maxdata)
+{
+  if (! maxdata) {
+    return MOBERG_ERRNO(EINVAL);
+  }
+  return convert(double_to_uint32, n, value, raw,
+                 count, first, offset, scale, maxdata);
+}
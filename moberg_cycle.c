@@ -0,0 +1,351 @@
+/*
+    moberg_cycle.c -- periodic input/callback/output loop
+
+    Copyright (C) 2019 Anders Blomdell <anders.blomdell@gmail.com>
+
+    This file is part of Moberg.
+
+    Moberg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _POSIX_C_SOURCE  200809L
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <moberg.h>
+#include <moberg_inline.h>
+#include <moberg_sample_group.h>
+
+struct moberg_cycle {
+  struct moberg *moberg;
+  long long period;  /* ns */
+  int priority;
+  struct moberg_sample_group *input; /* Snapshot handed to the callback */
+  struct {
+    int count;
+    int opened;
+    int *index;
+    struct moberg_analog_out *channel;
+  } analog_out;
+  struct {
+    int count;
+    int opened;
+    int *index;
+    struct moberg_digital_out *channel;
+  } digital_out;
+  struct moberg_cycle_io io;
+  int (*callback)(void *data, struct moberg_cycle_io *io);
+  void *data;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  int running;
+  int stop;
+  struct moberg_status status; /* Why loop terminated */
+  struct {
+    long long jitter_sum; /* ns */
+    long long jitter_max;
+    long long execution_max;
+    struct moberg_cycle_stats value;
+  } stats;
+};
+
+static long long now(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static struct timespec to_timespec(long long t)
+{
+  struct timespec result;
+  result.tv_sec = t / 1000000000LL;
+  result.tv_nsec = t % 1000000000LL;
+  return result;
+}
+
+static int *copy_index(int count, const int *index)
+{
+  int *result = calloc(count + 1, sizeof(*result));
+  if (result && count) {
+    memcpy(result, index, count * sizeof(*result));
+  }
+  return result;
+}
+
+void moberg_cycle_free(struct moberg_cycle *cycle)
+{
+  if (cycle) {
+    if (cycle->running) {
+      moberg_cycle_stop(cycle);
+    }
+    moberg_sample_group_free(cycle->input);
+    for (int i = 0 ; i < cycle->analog_out.opened ; i++) {
+      moberg_analog_out_close(cycle->moberg,
+                              cycle->analog_out.index[i],
+                              cycle->analog_out.channel[i]);
+    }
+    for (int i = 0 ; i < cycle->digital_out.opened ; i++) {
+      moberg_digital_out_close(cycle->moberg,
+                               cycle->digital_out.index[i],
+                               cycle->digital_out.channel[i]);
+    }
+    free(cycle->analog_out.index);
+    free(cycle->analog_out.channel);
+    free(cycle->digital_out.index);
+    free(cycle->digital_out.channel);
+    free(cycle->io.analog_out);
+    free(cycle->io.digital_out);
+    pthread_mutex_destroy(&cycle->lock);
+    free(cycle);
+  }
+}
+
+struct moberg_status moberg_cycle_new(
+  struct moberg *moberg,
+  double period,
+  int priority,
+  int analog_in_count,
+  const int *analog_in_index,
+  int digital_in_count,
+  const int *digital_in_index,
+  int encoder_in_count,
+  const int *encoder_in_index,
+  int analog_out_count,
+  const int *analog_out_index,
+  int digital_out_count,
+  const int *digital_out_index,
+  struct moberg_cycle **cycle)
+{
+  struct moberg_status result = MOBERG_OK;
+  struct moberg_cycle *c = NULL;
+
+  /* Inputs are checked by moberg_sample_group_new */
+  if (! moberg || ! cycle || ! (period > 0.0) ||
+      priority < 0 || priority > sched_get_priority_max(SCHED_FIFO) ||
+      analog_out_count < 0 || analog_out_count > MOBERG_MANY_MAX ||
+      (analog_out_count && ! analog_out_index) ||
+      digital_out_count < 0 || digital_out_count > MOBERG_MANY_MAX ||
+      (digital_out_count && ! digital_out_index)) {
+    result = MOBERG_ERRNO(EINVAL);
+    goto return_result;
+  }
+  c = malloc(sizeof(*c));
+  if (! c) { goto err_enomem; }
+  memset(c, 0, sizeof(*c));
+  pthread_mutex_init(&c->lock, NULL);
+  c->moberg = moberg;
+  c->period = period * 1e9;
+  c->priority = priority;
+  c->status = MOBERG_OK;
+
+  result = moberg_sample_group_new(moberg,
+                                   analog_in_count, analog_in_index,
+                                   digital_in_count, digital_in_index,
+                                   encoder_in_count, encoder_in_index,
+                                   &c->input);
+  if (! OK(result)) { goto free_cycle; }
+  c->io.analog_in = moberg_sample_group_analog_in_value(c->input);
+  c->io.digital_in = moberg_sample_group_digital_in_value(c->input);
+  c->io.encoder_in = moberg_sample_group_encoder_in_value(c->input);
+
+  c->analog_out.count = analog_out_count;
+  c->analog_out.index = copy_index(analog_out_count, analog_out_index);
+  c->analog_out.channel = calloc(analog_out_count + 1,
+                                 sizeof(struct moberg_analog_out));
+  c->io.analog_out = calloc(analog_out_count + 1, sizeof(double));
+  if (! c->analog_out.index || ! c->analog_out.channel ||
+      ! c->io.analog_out) {
+    goto err_enomem;
+  }
+  c->digital_out.count = digital_out_count;
+  c->digital_out.index = copy_index(digital_out_count, digital_out_index);
+  c->digital_out.channel = calloc(digital_out_count + 1,
+                                  sizeof(struct moberg_digital_out));
+  c->io.digital_out = calloc(digital_out_count + 1, sizeof(int));
+  if (! c->digital_out.index || ! c->digital_out.channel ||
+      ! c->io.digital_out) {
+    goto err_enomem;
+  }
+
+  for (int i = 0 ; i < analog_out_count ; i++) {
+    result = moberg_analog_out_open(moberg, analog_out_index[i],
+                                    &c->analog_out.channel[i]);
+    if (! OK(result)) { goto free_cycle; }
+    c->analog_out.opened++;
+  }
+  for (int i = 0 ; i < digital_out_count ; i++) {
+    result = moberg_digital_out_open(moberg, digital_out_index[i],
+                                     &c->digital_out.channel[i]);
+    if (! OK(result)) { goto free_cycle; }
+    c->digital_out.opened++;
+  }
+  *cycle = c;
+  return MOBERG_OK;
+
+err_enomem:
+  result = MOBERG_ERRNO(ENOMEM);
+free_cycle:
+  moberg_cycle_free(c);
+return_result:
+  return result;
+}
+
+static struct moberg_status flush(struct moberg_cycle *cycle)
+{
+  struct moberg_status result;
+  result = moberg_analog_out_write_many(cycle->moberg,
+                                        cycle->analog_out.count,
+                                        cycle->analog_out.index,
+                                        cycle->io.analog_out,
+                                        NULL);
+  if (! OK(result)) { goto return_result; }
+  result = moberg_digital_out_write_many(cycle->moberg,
+                                         cycle->digital_out.count,
+                                         cycle->digital_out.index,
+                                         cycle->io.digital_out,
+                                         NULL);
+  if (! OK(result)) { goto return_result; }
+  result = moberg_flush(cycle->moberg);
+return_result:
+  return result;
+}
+
+static void *loop(void *arg)
+{
+  struct moberg_cycle *cycle = arg;
+  struct moberg_status result = MOBERG_OK;
+  long long next = now();
+
+  for (;;) {
+    next += cycle->period;
+    struct timespec wakeup = to_timespec(next);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeup, NULL)
+           == EINTR);
+    long long start = now();
+    pthread_mutex_lock(&cycle->lock);
+    int stop = cycle->stop;
+    pthread_mutex_unlock(&cycle->lock);
+    if (stop) {
+      break;
+    }
+    result = moberg_sample_group_update(cycle->input);
+    if (! OK(result)) { break; }
+    cycle->io.cycle = cycle->stats.value.cycles;
+    stop = cycle->callback(cycle->data, &cycle->io);
+    result = flush(cycle);
+    if (! OK(result)) { break; }
+    long long end = now();
+    long long jitter = start - next;
+    long long execution = end - start;
+
+    pthread_mutex_lock(&cycle->lock);
+    struct moberg_cycle_stats *stats = &cycle->stats.value;
+    stats->cycles++;
+    cycle->stats.jitter_sum += jitter;
+    if (jitter > cycle->stats.jitter_max) {
+      cycle->stats.jitter_max = jitter;
+    }
+    if (execution > cycle->stats.execution_max) {
+      cycle->stats.execution_max = execution;
+    }
+    if (end > next + cycle->period) {
+      /* Skip missed periods instead of trying to catch up */
+      long long missed = (end - next) / cycle->period;
+      stats->overruns++;
+      stats->missed += missed;
+      next += missed * cycle->period;
+    }
+    pthread_mutex_unlock(&cycle->lock);
+    if (stop) {
+      break;
+    }
+  }
+  pthread_mutex_lock(&cycle->lock);
+  cycle->status = result;
+  pthread_mutex_unlock(&cycle->lock);
+  return NULL;
+}
+
+struct moberg_status moberg_cycle_start(
+  struct moberg_cycle *cycle,
+  int (*callback)(void *data, struct moberg_cycle_io *io),
+  void *data)
+{
+  struct moberg_status result = MOBERG_OK;
+  pthread_attr_t attr;
+  int err;
+
+  if (! cycle || ! callback || cycle->running) {
+    return MOBERG_ERRNO(EINVAL);
+  }
+  cycle->callback = callback;
+  cycle->data = data;
+  cycle->stop = 0;
+  cycle->status = MOBERG_OK;
+  memset(&cycle->stats, 0, sizeof(cycle->stats));
+  pthread_attr_init(&attr);
+  if (cycle->priority > 0) {
+    struct sched_param param = { .sched_priority=cycle->priority };
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    pthread_attr_setschedparam(&attr, &param);
+  }
+  err = pthread_create(&cycle->thread, &attr, loop, cycle);
+  if (err) {
+    /* EPERM when not allowed to use SCHED_FIFO */
+    result = MOBERG_ERRNO(err);
+  } else {
+    cycle->running = 1;
+  }
+  pthread_attr_destroy(&attr);
+  return result;
+}
+
+struct moberg_status moberg_cycle_stop(
+  struct moberg_cycle *cycle)
+{
+  if (! cycle || ! cycle->running) {
+    return MOBERG_ERRNO(EINVAL);
+  }
+  pthread_mutex_lock(&cycle->lock);
+  cycle->stop = 1;
+  pthread_mutex_unlock(&cycle->lock);
+  pthread_join(cycle->thread, NULL);
+  cycle->running = 0;
+  return cycle->status;
+}
+
+struct moberg_status moberg_cycle_stats(
+  struct moberg_cycle *cycle,
+  struct moberg_cycle_stats *stats)
+{
+  if (! cycle || ! stats) {
+    return MOBERG_ERRNO(EINVAL);
+  }
+  pthread_mutex_lock(&cycle->lock);
+  *stats = cycle->stats.value;
+  if (stats->cycles) {
+    stats->jitter_mean = cycle->stats.jitter_sum * 1e-9 / stats->cycles;
+  }
+  stats->jitter_max = cycle->stats.jitter_max * 1e-9;
+  stats->execution_max = cycle->stats.execution_max * 1e-9;
+  struct moberg_status result = cycle->status;
+  pthread_mutex_unlock(&cycle->lock);
+  return result;
+}
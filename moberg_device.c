@@ -24,18 +24,36 @@
 #include <string.h>
 #include <dlfcn.h>
 #include <errno.h>
+#include <pthread.h>
 #include <moberg_channel.h>
 #include <moberg_config.h>
 #include <moberg_device.h>
 #include <moberg_inline.h>
+#include <moberg_stats.h>
 
 struct moberg_device {
+  struct moberg *moberg;
   struct moberg_device_driver driver;
   struct moberg_device_context *device_context;
+  int loaded;                      /* Driver loaded, maps parsed */
+  int load_failed;                 /* Not retried */
+  int lazy_users;                  /* See moberg_device_up */
+  char *name;                      /* Driver name */
+  char *config;                    /* Config source, NULL if none */
+  struct moberg_latency *latency;  /* NULL unless statistics enabled */
+  pthread_mutex_t lock;            /* See moberg_device_lock */
+  struct map_source {
+    struct map_source *next;
+    enum moberg_channel_kind kind;
+    int min;
+    int max;
+    char *source;                  /* Driver specific part of map */
+  } *map_head, **map_tail;
   struct channel_list {
     struct channel_list *next;
     enum moberg_channel_kind kind;
     int index;
+    struct map_source *map;        /* Map that created the channel */
     union channel {
       struct moberg_channel_analog_in *analog_in;
       struct moberg_channel_analog_out *analog_out;
@@ -53,78 +71,300 @@ struct moberg_device {
   } *range;
 };
 
-struct moberg_device *moberg_device_new(struct moberg *moberg,
-                                        const char *driver)
+/* Loads the driver (dlopen) and creates the device context */
+static struct moberg_status load_driver(struct moberg_device *device)
 {
-  struct moberg_device *result = NULL;
+  struct moberg_status result = MOBERG_ERRNO(ENOMEM);
 
-  char *name = malloc(strlen("libmoberg_.so") + strlen(driver) + 1);
+  char *name = malloc(strlen("libmoberg_.so") + strlen(device->name) + 1);
   if (!name) { goto out; }
-  sprintf(name, "libmoberg_%s.so", driver);
+  sprintf(name, "libmoberg_%s.so", device->name);
   void *handle = dlopen(name, RTLD_LAZY | RTLD_DEEPBIND);
   if (! handle) {
     fprintf(stderr, "Could not find driver %s %s\n", name, dlerror());
+    result = MOBERG_ERRNO(ENODEV);
     goto free_name;
   }
   struct moberg_device_driver *device_driver =
     (struct moberg_device_driver *) dlsym(handle, "moberg_device_driver");
   if (! device_driver) {
     fprintf(stderr, "No moberg_device_driver in driver %s\n", name);
+    result = MOBERG_ERRNO(ENODEV);
     goto dlclose_driver;
   }
-  result = malloc(sizeof(*result));
-  if (! result) {
-    fprintf(stderr, "Could not allocate result for %s\n", name);
-    goto dlclose_driver;
-  }
-  result->driver = *device_driver;
-  result->device_context = result->driver.new(moberg, dlclose, handle);
-  if (result->device_context) {
-    result->driver.up(result->device_context);
+  device->driver = *device_driver;
+  device->device_context = device->driver.new(device->moberg,
+                                              dlclose, handle);
+  if (device->device_context) {
+    device->driver.up(device->device_context);
   } else {
     fprintf(stderr, "Could not allocate context for %s\n", name);
+    goto dlclose_driver;
+  }
+  result = MOBERG_OK;
+  goto free_name;
+  
+dlclose_driver:
+  dlclose(handle);
+free_name:
+  free(name);
+out:
+  return result;
+}
+
+struct moberg_device *moberg_device_new(struct moberg *moberg,
+                                        const char *driver,
+                                        int lazy)
+{
+  struct moberg_device *result = malloc(sizeof(*result));
+  if (! result) {
+    fprintf(stderr, "Could not allocate result for %s\n", driver);
+    goto out;
+  }
+  result->moberg = moberg;
+  result->device_context = NULL;
+  result->loaded = 0;
+  result->load_failed = 0;
+  result->lazy_users = 0;
+  result->name = strdup(driver);
+  result->latency = NULL;
+  pthread_mutex_init(&result->lock, NULL);
+  if (! result->name) {
+    fprintf(stderr, "Could not allocate name for %s\n", driver);
     goto free_result;
   }
+  result->config = NULL;
+  result->map_head = NULL;
+  result->map_tail = &result->map_head;
   result->channel_head = NULL;
   result->channel_tail = &result->channel_head;
   result->range = NULL;
-  goto free_name;
+  if (! lazy) {
+    if (! OK(load_driver(result))) {
+      goto free_device_name;
+    }
+    result->loaded = 1;
+  }
+  goto out;
   
+free_device_name:
+  free(result->name);
 free_result:
+  pthread_mutex_destroy(&result->lock);
   free(result);
-dlclose_driver:
-  dlclose(handle);
-free_name:
-  free(name);
+  result = NULL;
 out:
   return result;
 }
 
-void moberg_device_free(struct moberg_device *device)
+static void free_channel_list(struct channel_list *channel)
 {
-  struct channel_list *channel = device->channel_head;
   while (channel) {
     struct channel_list *next;
     next = channel->next;
     free(channel);
     channel = next;
   }
-  device->driver.down(device->device_context);
+}
+
+static void free_map_source(struct map_source *map)
+{
+  while (map) {
+    struct map_source *next = map->next;
+    free(map->source);
+    free(map);
+    map = next;
+  }
+}
+
+void moberg_device_free(struct moberg_device *device)
+{
+  free_channel_list(device->channel_head);
+  free_map_source(device->map_head);
+  if (device->device_context) {
+    device->driver.down(device->device_context);
+  }
+  pthread_mutex_destroy(&device->lock);
+  free(device->latency);
+  free(device->config);
+  free(device->name);
   free(device);
 }
 
+const char *moberg_device_name(struct moberg_device *device)
+{
+  return device->name;
+}
+
+int moberg_device_reentrant(struct moberg_device *device)
+{
+  return device->driver.reentrant;
+}
+
+void moberg_device_lock(struct moberg_device *device)
+{
+  pthread_mutex_lock(&device->lock);
+}
+
+void moberg_device_unlock(struct moberg_device *device)
+{
+  pthread_mutex_unlock(&device->lock);
+}
+
+/* Calls into drivers that are not reentrant are serialized */
+static void serialize(struct moberg_device *device)
+{
+  if (! device->driver.reentrant) {
+    pthread_mutex_lock(&device->lock);
+  }
+}
+
+static void unserialize(struct moberg_device *device)
+{
+  if (! device->driver.reentrant) {
+    pthread_mutex_unlock(&device->lock);
+  }
+}
+
+/* I/O entry/exit, also records latency when statistics are enabled */
+static long long device_enter(struct moberg_device *device)
+{
+  long long start = (__atomic_load_n(&device->latency, __ATOMIC_ACQUIRE) ?
+                     moberg_latency_now() : 0);
+  serialize(device);
+  return start;
+}
+
+static void device_leave(struct moberg_device *device, long long start)
+{
+  unserialize(device);
+  struct moberg_latency *latency = __atomic_load_n(&device->latency,
+                                                   __ATOMIC_ACQUIRE);
+  if (latency && start) {
+    moberg_latency_record(latency, start);
+  }
+}
+
+struct moberg_latency *moberg_device_latency(struct moberg_device *device)
+{
+  struct moberg_latency *latency = __atomic_load_n(&device->latency,
+                                                   __ATOMIC_ACQUIRE);
+  if (! latency) {
+    /* Might race with I/O on a loaded device */
+    struct moberg_latency *enabled = malloc(sizeof(*enabled));
+    if (enabled) {
+      moberg_latency_init(enabled);
+      if (__atomic_compare_exchange_n(&device->latency, &latency, enabled, 0,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        latency = enabled;
+      } else {
+        free(enabled);
+      }
+    }
+  }
+  return latency;
+}
+
 int moberg_device_in_use(struct moberg_device *device)
 {
+  if (device->lazy_users > 0) {
+    return 1;
+  }
+  if (! device->device_context) {
+    return 0;
+  }
   device->driver.up(device->device_context);
   int use = device->driver.down(device->device_context);
   return use > 1;
 }
 
+int moberg_device_loaded(struct moberg_device *device)
+{
+  return __atomic_load_n(&device->loaded, __ATOMIC_ACQUIRE);
+}
+
+void moberg_device_up(struct moberg_device *device)
+{
+  device->lazy_users++;
+}
+
+void moberg_device_down(struct moberg_device *device)
+{
+  device->lazy_users--;
+}
+
+void moberg_device_hold(struct moberg_device *device)
+{
+  device->driver.up(device->device_context);
+}
+
+int moberg_device_release(struct moberg_device *device)
+{
+  return device->driver.down(device->device_context) <= 1;
+}
+
+/* Takes ownership of source (NULL when out of memory) */
+static struct moberg_status record_config(struct moberg_device *device,
+                                          char *source)
+{
+  if (! source) { goto err_enomem; }
+  if (device->config) {
+    /* Several config blocks */
+    char *config = malloc(strlen(device->config) + strlen(source) + 2);
+    if (! config) {
+      free(source);
+      goto err_enomem;
+    }
+    sprintf(config, "%s %s", device->config, source);
+    free(source);
+    source = config;
+  }
+  free(device->config);
+  device->config = source;
+  return MOBERG_OK;
+err_enomem:
+  return MOBERG_ERRNO(ENOMEM);
+}
+
+/* Takes ownership of source (NULL when out of memory) */
+static struct map_source *record_map(struct moberg_device *device,
+                                     enum moberg_channel_kind kind,
+                                     int min,
+                                     int max,
+                                     char *source)
+{
+  if (! source) { goto err; }
+  struct map_source *result = malloc(sizeof(*result));
+  if (! result) { goto free_source; }
+  result->source = source;
+  result->next = NULL;
+  result->kind = kind;
+  result->min = min;
+  result->max = max;
+  *device->map_tail = result;
+  device->map_tail = &result->next;
+  return result;
+free_source:
+  free(source);
+err:
+  return NULL;
+}
+
 struct moberg_status moberg_device_parse_config(
   struct moberg_device *device,
   struct moberg_parser_context *parser)
 {
-  return device->driver.parse_config(device->device_context, parser);
+  const char *from = moberg_parser_position(parser);
+  struct moberg_status result;
+  if (device->device_context) {
+    result = device->driver.parse_config(device->device_context, parser);
+  } else {
+    result = moberg_parser_skip_config(parser);
+  }
+  if (OK(result)) {
+    result = record_config(device, moberg_parser_source(parser, from));
+  }
+  return result;
 }
 
 static struct moberg_status add_channel(
@@ -138,6 +378,7 @@ static struct moberg_status add_channel(
   element->next = NULL;
   element->kind = kind;
   element->index = index;
+  element->map = NULL;
   element->u = channel;
   *device->channel_tail = element;
   device->channel_tail = &element->next;
@@ -162,6 +403,7 @@ static struct moberg_status map(
             device->range->min, device->range->max);
     return MOBERG_ERRNO(ENOSPC);
   }
+  channel->device = device;
   result = add_channel(device, device->range->kind, device->range->min,
                        (union channel) { .channel=channel });
   if (! OK(result)) {
@@ -174,6 +416,52 @@ static struct moberg_status map(
   
 }
 
+struct moberg_status moberg_device_record_config(
+  struct moberg_device *device,
+  const char *source)
+{
+  return record_config(device, strdup(source));
+}
+
+struct moberg_status moberg_device_record_map(
+  struct moberg_device *device,
+  enum moberg_channel_kind kind,
+  int min,
+  int max,
+  const char *source)
+{
+  if (! record_map(device, kind, min, max, strdup(source))) {
+    return MOBERG_ERRNO(ENOMEM);
+  }
+  return MOBERG_OK;
+}
+
+const char *moberg_device_config(struct moberg_device *device)
+{
+  return device->config;
+}
+
+int moberg_device_map(struct moberg_device *device,
+                      int n,
+                      enum moberg_channel_kind *kind,
+                      int *min,
+                      int *max,
+                      const char **source)
+{
+  struct map_source *map = device->map_head;
+  for ( ; map && n > 0 ; n--) {
+    map = map->next;
+  }
+  if (! map) {
+    return 0;
+  }
+  *kind = map->kind;
+  *min = map->min;
+  *max = map->max;
+  *source = map->source;
+  return 1;
+}
+
 struct moberg_status moberg_device_parse_map(
   struct moberg_device* device,
   struct moberg_parser_context *parser,
@@ -193,38 +481,523 @@ struct moberg_status moberg_device_parse_map(
     .map=map
   };
   
-  device->range = &r;
-  result = device->driver.parse_map(device->device_context, parser,
-                                    kind, &map_channel);
-  device->range = NULL;
+  struct channel_list **first = device->channel_tail;
+  const char *from = moberg_parser_position(parser);
+  if (device->device_context) {
+    device->range = &r;
+    result = device->driver.parse_map(device->device_context, parser,
+                                      kind, &map_channel);
+    device->range = NULL;
+  } else {
+    result = moberg_parser_skip_map(parser);
+  }
+  if (OK(result)) {
+    struct map_source *source = record_map(device, kind, min, max,
+                                           moberg_parser_source(parser, from));
+    if (! source) { goto err_enomem; }
+    for (struct channel_list *channel = *first ;
+         channel ;
+         channel = channel->next) {
+      channel->map = source;
+    }
+  }
+  return result;
+err_enomem:
+  return MOBERG_ERRNO(ENOMEM);
+}
+
+void moberg_device_count_channels(struct moberg_device *device,
+                                  int *count)
+{
+  if (! device->loaded) {
+    for (struct map_source *map = device->map_head ; map ; map = map->next) {
+      if (count[map->kind] <= map->max) {
+        count[map->kind] = map->max + 1;
+      }
+    }
+    return;
+  }
+  for (struct channel_list *channel = device->channel_head ;
+       channel ;
+       channel = channel->next) {
+    if (count[channel->kind] <= channel->index) {
+      count[channel->kind] = channel->index + 1;
+    }
+  }
+}
+
+int moberg_device_same_config(struct moberg_device *device,
+                              struct moberg_device *other)
+{
+  return (strcmp(device->name, other->name) == 0 &&
+          strcmp(device->config ? device->config : "",
+                 other->config ? other->config : "") == 0);
+}
+
+/* Channel that was never installed, up/down frees it */
+static void release_channels(struct channel_list *channel)
+{
+  for ( ; channel ; channel = channel->next) {
+    channel->u.channel->up(channel->u.channel);
+    channel->u.channel->down(channel->u.channel);
+  }
+}
+
+static int same_mapping(struct channel_list *a,
+                        struct channel_list *b)
+{
+  return (a->kind == b->kind &&
+          a->index == b->index &&
+          a->map && b->map &&
+          a->index - a->map->min == b->index - b->map->min &&
+          strcmp(a->map->source, b->map->source) == 0);
+}
+
+struct moberg_status moberg_device_adopt(struct moberg_device *device,
+                                         struct moberg_device *from)
+{
+  struct moberg_status result = MOBERG_OK;
+  struct channel_list **channel_tail = device->channel_tail;
+  struct map_source **map_tail = device->map_tail;
+
+  /* Parse the maps of from in the context of device */
+  moberg_device_lock(device);
+  for (struct map_source *map = from->map_head ;
+       map && OK(result) ;
+       map = map->next) {
+    result = moberg_parse_map(device, map->kind, map->min, map->max,
+                              map->source);
+  }
+  moberg_device_unlock(device);
+  struct channel_list *added = *channel_tail;
+  *channel_tail = NULL;
+  device->channel_tail = channel_tail;
+  struct map_source *added_map = *map_tail;
+  *map_tail = NULL;
+  device->map_tail = map_tail;
+  if (! OK(result)) {
+    release_channels(added);
+    free_channel_list(added);
+    free_map_source(added_map);
+    return result;
+  }
+
+  /* Keep the channels that are mapped the same way, the others are
+     dropped from device (they live on as long as they are installed) */
+  struct channel_list *keep = NULL, **keep_tail = &keep;
+  while (added) {
+    struct channel_list *channel = added;
+    added = channel->next;
+    channel->next = NULL;
+    struct channel_list **old;
+    for (old = &device->channel_head ; *old ; old = &(*old)->next) {
+      if (same_mapping(*old, channel)) {
+        break;
+      }
+    }
+    if (*old) {
+      struct channel_list *kept = *old;
+      *old = kept->next;
+      kept->next = NULL;
+      kept->map = channel->map;
+      release_channels(channel);
+      free(channel);
+      channel = kept;
+    }
+    *keep_tail = channel;
+    keep_tail = &channel->next;
+  }
+  free_channel_list(device->channel_head);
+  device->channel_head = keep;
+  device->channel_tail = keep_tail;
+  free_map_source(device->map_head);
+  device->map_head = added_map;
+  for (device->map_tail = &device->map_head ;
+       *device->map_tail ;
+       device->map_tail = &(*device->map_tail)->next);
+
+  /* The channels of from were never installed */
+  release_channels(from->channel_head);
+  free_channel_list(from->channel_head);
+  from->channel_head = NULL;
+  from->channel_tail = &from->channel_head;
+  return MOBERG_OK;
+}
+
+struct moberg_status moberg_device_load(struct moberg_device *device)
+{
+  if (device->loaded) {
+    return MOBERG_OK;
+  }
+  if (device->load_failed) {
+    return MOBERG_ERRNO(ENODEV);
+  }
+  struct moberg_status result = load_driver(device);
+  if (! OK(result)) {
+    goto forget_maps;
+  }
+  /* Parse the recorded config and maps again, now by the driver */
+  char *config = device->config;
+  struct map_source *maps = device->map_head;
+  device->config = NULL;
+  device->map_head = NULL;
+  device->map_tail = &device->map_head;
+  if (config) {
+    result = moberg_parse_config(device, config);
+  }
+  for (struct map_source *map = maps ; map && OK(result) ; map = map->next) {
+    result = moberg_parse_map(device, map->kind, map->min, map->max,
+                              map->source);
+  }
+  free_map_source(maps);
+  if (! OK(result)) {
+    release_channels(device->channel_head);
+    free_channel_list(device->channel_head);
+    device->channel_head = NULL;
+    device->channel_tail = &device->channel_head;
+    device->driver.down(device->device_context);
+    device->device_context = NULL;
+    free(device->config);
+    device->config = config;
+    goto forget_maps;
+  }
+  free(config);
+  __atomic_store_n(&device->loaded, 1, __ATOMIC_RELEASE);
+  return MOBERG_OK;
+forget_maps:
+  /* Its channels are dropped when the table is republished */
+  fprintf(stderr, "Failed to load driver %s\n", device->name);
+  free_map_source(device->map_head);
+  device->map_head = NULL;
+  device->map_tail = &device->map_head;
+  device->load_failed = 1;
   return result;
 }
 
 int moberg_device_install_channels(struct moberg_device *device,
                                    struct moberg_channel_install *install)
 {
-  
+  if (! device->loaded) {
+    for (struct map_source *map = device->map_head ; map ; map = map->next) {
+      for (int index = map->min ; index <= map->max ; index++) {
+        if (! OK(install->lazy(install->context, map->kind, index, device))) {
+          return 0;
+        }
+      }
+    }
+    return 1;
+  }
   struct channel_list *channel = device->channel_head;
   while (channel) {
     struct channel_list *next;
     next = channel->next;
-    install->channel(install->context,
-                     channel->index,
-                     device,
-                     channel->u.channel);
+    if (! OK(install->channel(install->context,
+                              channel->index,
+                              device,
+                              channel->u.channel))) {
+      return 0;
+    }
     channel = next;
   }
   return 1;
 }
 
+static struct moberg_status analog_in_read_many(
+  struct moberg_device *device,
+  int count,
+  struct moberg_channel **channel,
+  double *value)
+{
+  if (device->driver.analog_in_read_many) {
+    struct moberg_channel_analog_in *analog_in[count];
+    for (int i = 0 ; i < count ; i++) {
+      analog_in[i] = channel[i]->action.analog_in.context;
+    }
+    return device->driver.analog_in_read_many(device->device_context,
+                                              count, analog_in, value);
+  }
+  for (int i = 0 ; i < count ; i++) {
+    struct moberg_analog_in *analog_in = &channel[i]->action.analog_in;
+    struct moberg_status result = analog_in->read(analog_in->context,
+                                                  &value[i]);
+    if (! OK(result)) {
+      return result;
+    }
+  }
+  return MOBERG_OK;
+}
+
+struct moberg_status moberg_device_analog_in_read_many(
+  struct moberg_device *device,
+  int count,
+  struct moberg_channel **channel,
+  double *value)
+{
+  long long start = device_enter(device);
+  struct moberg_status result = analog_in_read_many(device, count, channel,
+                                                    value);
+  device_leave(device, start);
+  return result;
+}
+
+static struct moberg_status digital_in_read_many(
+  struct moberg_device *device,
+  int count,
+  struct moberg_channel **channel,
+  int *value)
+{
+  if (device->driver.digital_in_read_many) {
+    struct moberg_channel_digital_in *digital_in[count];
+    for (int i = 0 ; i < count ; i++) {
+      digital_in[i] = channel[i]->action.digital_in.context;
+    }
+    return device->driver.digital_in_read_many(device->device_context,
+                                               count, digital_in, value);
+  }
+  for (int i = 0 ; i < count ; i++) {
+    struct moberg_digital_in *digital_in = &channel[i]->action.digital_in;
+    struct moberg_status result = digital_in->read(digital_in->context,
+                                                   &value[i]);
+    if (! OK(result)) {
+      return result;
+    }
+  }
+  return MOBERG_OK;
+}
+
+struct moberg_status moberg_device_digital_in_read_many(
+  struct moberg_device *device,
+  int count,
+  struct moberg_channel **channel,
+  int *value)
+{
+  long long start = device_enter(device);
+  struct moberg_status result = digital_in_read_many(device, count, channel,
+                                                     value);
+  device_leave(device, start);
+  return result;
+}
+
+static struct moberg_status encoder_in_read_many(
+  struct moberg_device *device,
+  int count,
+  struct moberg_channel **channel,
+  long *value)
+{
+  if (device->driver.encoder_in_read_many) {
+    struct moberg_channel_encoder_in *encoder_in[count];
+    for (int i = 0 ; i < count ; i++) {
+      encoder_in[i] = channel[i]->action.encoder_in.context;
+    }
+    return device->driver.encoder_in_read_many(device->device_context,
+                                               count, encoder_in, value);
+  }
+  for (int i = 0 ; i < count ; i++) {
+    struct moberg_encoder_in *encoder_in = &channel[i]->action.encoder_in;
+    struct moberg_status result = encoder_in->read(encoder_in->context,
+                                                   &value[i]);
+    if (! OK(result)) {
+      return result;
+    }
+  }
+  return MOBERG_OK;
+}
+
+struct moberg_status moberg_device_encoder_in_read_many(
+  struct moberg_device *device,
+  int count,
+  struct moberg_channel **channel,
+  long *value)
+{
+  long long start = device_enter(device);
+  struct moberg_status result = encoder_in_read_many(device, count, channel,
+                                                     value);
+  device_leave(device, start);
+  return result;
+}
+
+static struct moberg_status analog_out_write_many(
+  struct moberg_device *device,
+  int count,
+  struct moberg_channel **channel,
+  const double *desired_value,
+  double *actual_value)
+{
+  if (device->driver.analog_out_write_many) {
+    struct moberg_channel_analog_out *analog_out[count];
+    for (int i = 0 ; i < count ; i++) {
+      analog_out[i] = channel[i]->action.analog_out.context;
+    }
+    return device->driver.analog_out_write_many(device->device_context,
+                                                count, analog_out,
+                                                desired_value, actual_value);
+  }
+  for (int i = 0 ; i < count ; i++) {
+    struct moberg_analog_out *analog_out = &channel[i]->action.analog_out;
+    struct moberg_status result = analog_out->write(
+      analog_out->context,
+      desired_value[i],
+      actual_value ? &actual_value[i] : NULL);
+    if (! OK(result)) {
+      return result;
+    }
+  }
+  return MOBERG_OK;
+}
+
+struct moberg_status moberg_device_analog_out_write_many(
+  struct moberg_device *device,
+  int count,
+  struct moberg_channel **channel,
+  const double *desired_value,
+  double *actual_value)
+{
+  long long start = device_enter(device);
+  struct moberg_status result = analog_out_write_many(device, count, channel,
+                                                      desired_value, actual_value);
+  device_leave(device, start);
+  return result;
+}
+
+static struct moberg_status digital_out_write_many(
+  struct moberg_device *device,
+  int count,
+  struct moberg_channel **channel,
+  const int *desired_value,
+  int *actual_value)
+{
+  if (device->driver.digital_out_write_many) {
+    struct moberg_channel_digital_out *digital_out[count];
+    for (int i = 0 ; i < count ; i++) {
+      digital_out[i] = channel[i]->action.digital_out.context;
+    }
+    return device->driver.digital_out_write_many(device->device_context,
+                                                 count, digital_out,
+                                                 desired_value, actual_value);
+  }
+  for (int i = 0 ; i < count ; i++) {
+    struct moberg_digital_out *digital_out = &channel[i]->action.digital_out;
+    struct moberg_status result = digital_out->write(
+      digital_out->context,
+      desired_value[i],
+      actual_value ? &actual_value[i] : NULL);
+    if (! OK(result)) {
+      return result;
+    }
+  }
+  return MOBERG_OK;
+}
+
+struct moberg_status moberg_device_digital_out_write_many(
+  struct moberg_device *device,
+  int count,
+  struct moberg_channel **channel,
+  const int *desired_value,
+  int *actual_value)
+{
+  long long start = device_enter(device);
+  struct moberg_status result = digital_out_write_many(device, count, channel,
+                                                       desired_value, actual_value);
+  device_leave(device, start);
+  return result;
+}
+
+struct moberg_status moberg_device_stream_open(
+  struct moberg_device *device,
+  int count,
+  struct moberg_channel **channel,
+  double rate,
+  struct moberg_stream_context **stream)
+{
+  if (! device->driver.stream_open) {
+    return MOBERG_ERRNO(ENOTSUP);
+  }
+  struct moberg_channel_analog_in *analog_in[count];
+  for (int i = 0 ; i < count ; i++) {
+    analog_in[i] = channel[i]->action.analog_in.context;
+  }
+  serialize(device);
+  struct moberg_status result =
+    device->driver.stream_open(device->device_context,
+                               count, analog_in, rate, stream);
+  unserialize(device);
+  return result;
+}
+
+struct moberg_status moberg_device_stream_scale(
+  struct moberg_device *device,
+  struct moberg_stream_context *stream,
+  int channel,
+  double *offset,
+  double *scale)
+{
+  return device->driver.stream_scale(stream, channel, offset, scale);
+}
+
+struct moberg_status moberg_device_stream_peek(
+  struct moberg_device *device,
+  struct moberg_stream_context *stream,
+  struct moberg_stream_buffer *buffer)
+{
+  return device->driver.stream_peek(stream, buffer);
+}
+
+struct moberg_status moberg_device_stream_consume(
+  struct moberg_device *device,
+  struct moberg_stream_context *stream,
+  int length)
+{
+  return device->driver.stream_consume(stream, length);
+}
+
+struct moberg_status moberg_device_stream_close(
+  struct moberg_device *device,
+  struct moberg_stream_context *stream)
+{
+  serialize(device);
+  struct moberg_status result = device->driver.stream_close(stream);
+  unserialize(device);
+  return result;
+}
+
 struct moberg_status moberg_device_start(struct moberg_device *device,
                                          FILE *f)
 {
+  if (! moberg_device_loaded(device)) {
+    return MOBERG_ERRNO(ENODEV);
+  }
   return device->driver.start(device->device_context, f);
 }
 
 struct moberg_status moberg_device_stop(struct moberg_device *device,
                                         FILE *f)
 {
+  if (! moberg_device_loaded(device)) {
+    return MOBERG_ERRNO(ENODEV);
+  }
   return device->driver.stop(device->device_context, f);
 }
+
+struct moberg_status moberg_device_flush(struct moberg_device *device)
+{
+  if (! moberg_device_loaded(device) || ! device->driver.flush) {
+    return MOBERG_OK;
+  }
+  serialize(device);
+  struct moberg_status result = device->driver.flush(device->device_context);
+  unserialize(device);
+  return result;
+}
+
+struct moberg_status moberg_device_sample(struct moberg_device *device,
+                                          unsigned long generation)
+{
+  if (! moberg_device_loaded(device) || ! device->driver.sample) {
+    return MOBERG_OK;
+  }
+  serialize(device);
+  struct moberg_status result =
+    device->driver.sample(device->device_context, generation);
+  unserialize(device);
+  return result;
+}
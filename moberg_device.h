@@ -24,6 +24,8 @@
 
 struct moberg_device;
 struct moberg_device_context;
+struct moberg_stream_context;
+struct moberg_latency;
 
 #include <moberg.h>
 #include <moberg_config.h>
@@ -58,18 +60,122 @@ struct moberg_device_driver {
   struct moberg_status (*stop)(
     struct moberg_device_context *device,
     FILE *f);
-  
+
+  /* Optional multi-channel I/O, all channels belong to device.
+     When NULL, channels are accessed one at a time */
+  struct moberg_status (*analog_in_read_many)(
+    struct moberg_device_context *device,
+    int count,
+    struct moberg_channel_analog_in **analog_in,
+    double *value);
+  struct moberg_status (*digital_in_read_many)(
+    struct moberg_device_context *device,
+    int count,
+    struct moberg_channel_digital_in **digital_in,
+    int *value);
+  struct moberg_status (*encoder_in_read_many)(
+    struct moberg_device_context *device,
+    int count,
+    struct moberg_channel_encoder_in **encoder_in,
+    long *value);
+  struct moberg_status (*analog_out_write_many)(
+    struct moberg_device_context *device,
+    int count,
+    struct moberg_channel_analog_out **analog_out,
+    const double *desired_value,
+    double *actual_value);
+  struct moberg_status (*digital_out_write_many)(
+    struct moberg_device_context *device,
+    int count,
+    struct moberg_channel_digital_out **digital_out,
+    const int *desired_value,
+    int *actual_value);
+
+  /* Optional hardware timed acquisition of analog inputs, all channels
+     belong to device and are opened */
+  struct moberg_status (*stream_open)(
+    struct moberg_device_context *device,
+    int count,
+    struct moberg_channel_analog_in **analog_in,
+    double rate,
+    struct moberg_stream_context **stream);
+  /* value = offset + raw * scale, ENOTSUP if raw samples are not
+     linear in the value (software timing is then used instead) */
+  struct moberg_status (*stream_scale)(
+    struct moberg_stream_context *stream,
+    int channel,
+    double *offset,
+    double *scale);
+  struct moberg_status (*stream_peek)(
+    struct moberg_stream_context *stream,
+    struct moberg_stream_buffer *buffer);
+  struct moberg_status (*stream_consume)(
+    struct moberg_stream_context *stream,
+    int length);
+  struct moberg_status (*stream_close)(
+    struct moberg_stream_context *stream);
+
+  /* Optional, emit outputs deferred by the driver (see moberg_flush).
+     When NULL, all writes are synchronous */
+  struct moberg_status (*flush)(
+    struct moberg_device_context *device);
+
+  /* Optional, a new cycle generation has started (see
+     moberg_advance_generation). Drivers that sample asynchronously
+     send their polls here, so that all devices sample in parallel */
+  struct moberg_status (*sample)(
+    struct moberg_device_context *device,
+    unsigned long generation);
+
+  /* Non-zero if channel read/write, *_many, stream_open/stream_close,
+     flush and sample may be called concurrently from several threads.
+     Otherwise libmoberg serializes them with a per device lock, so
+     independent devices never contend. Channel open/close are always
+     serialized per device, a stream is only used by one thread at a
+     time */
+  int reentrant;
+
 };
 
 struct moberg_device;
 
+/* Unless lazy, the driver is loaded (and the config and maps parsed by
+   the driver) at once; otherwise the config and maps are only recorded
+   until moberg_device_load */
 struct moberg_device *moberg_device_new(struct moberg *moberg,
-                                        const char *driver);
+                                        const char *driver,
+                                        int lazy);
 
 void moberg_device_free(struct moberg_device *device);
 
+int moberg_device_reentrant(struct moberg_device *device);
+
+void moberg_device_lock(struct moberg_device *device);
+
+void moberg_device_unlock(struct moberg_device *device);
+
 int moberg_device_in_use(struct moberg_device *device);
 
+/* Non-zero when the driver is loaded and the channels created */
+int moberg_device_loaded(struct moberg_device *device);
+
+/* Loads the driver of a lazy device and creates its channels. On
+   failure the maps are dropped, and the load is not retried */
+struct moberg_status moberg_device_load(struct moberg_device *device);
+
+/* Use-count for channel table entries of a device that is not loaded
+   (they have no channel to hold), see moberg_device_in_use */
+void moberg_device_up(struct moberg_device *device);
+
+void moberg_device_down(struct moberg_device *device);
+
+/* Keeps a loaded device in use (see moberg_device_in_use) while its
+   driver is called without any of its channels held */
+void moberg_device_hold(struct moberg_device *device);
+
+/* Drops a hold, returns non-zero if device is no longer in use */
+int moberg_device_release(struct moberg_device *device);
+
 struct moberg_status moberg_device_parse_config(
   struct moberg_device* device,
   struct moberg_parser_context *context);
@@ -81,10 +187,117 @@ struct moberg_status moberg_device_parse_map(
   int min,
   int max);
 
+/* Records config and maps (as returned by moberg_parser_source) of a
+   device that is not loaded, without parsing them */
+struct moberg_status moberg_device_record_config(
+  struct moberg_device *device,
+  const char *source);
+
+struct moberg_status moberg_device_record_map(
+  struct moberg_device *device,
+  enum moberg_channel_kind kind,
+  int min,
+  int max,
+  const char *source);
+
+/* Recorded config, NULL if none */
+const char *moberg_device_config(struct moberg_device *device);
+
+/* The n:th recorded map, 0 if there are fewer maps */
+int moberg_device_map(struct moberg_device *device,
+                      int n,
+                      enum moberg_channel_kind *kind,
+                      int *min,
+                      int *max,
+                      const char **source);
+
+/* Raises count[kind] above the highest index of kind mapped */
+void moberg_device_count_channels(struct moberg_device *device,
+                                  int *count);
+
+/* Same driver and config (ignoring whitespace and comments) */
+int moberg_device_same_config(struct moberg_device *device,
+                              struct moberg_device *other);
+
+/* Reuse device for the maps of from (which must have the same config).
+   Channels of device that are mapped the same way in from are kept,
+   the others are replaced by channels created from the maps of from */
+struct moberg_status moberg_device_adopt(struct moberg_device *device,
+                                         struct moberg_device *from);
+
+/* Returns 0 (after the first failed install) if out of memory */
 int moberg_device_install_channels(
   struct moberg_device *device,
   struct moberg_channel_install *install);
 
+const char *moberg_device_name(struct moberg_device *device);
+
+/* Enables latency statistics for device (on first call), returns NULL
+   if out of memory */
+struct moberg_latency *moberg_device_latency(struct moberg_device *device);
+
+/* Batch I/O, uses per channel actions if driver lacks *_many support */
+
+struct moberg_status moberg_device_analog_in_read_many(
+  struct moberg_device *device,
+  int count,
+  struct moberg_channel **channel,
+  double *value);
+
+struct moberg_status moberg_device_digital_in_read_many(
+  struct moberg_device *device,
+  int count,
+  struct moberg_channel **channel,
+  int *value);
+
+struct moberg_status moberg_device_encoder_in_read_many(
+  struct moberg_device *device,
+  int count,
+  struct moberg_channel **channel,
+  long *value);
+
+struct moberg_status moberg_device_analog_out_write_many(
+  struct moberg_device *device,
+  int count,
+  struct moberg_channel **channel,
+  const double *desired_value,
+  double *actual_value);
+
+struct moberg_status moberg_device_digital_out_write_many(
+  struct moberg_device *device,
+  int count,
+  struct moberg_channel **channel,
+  const int *desired_value,
+  int *actual_value);
+
+struct moberg_status moberg_device_stream_open(
+  struct moberg_device *device,
+  int count,
+  struct moberg_channel **channel,
+  double rate,
+  struct moberg_stream_context **stream);
+
+struct moberg_status moberg_device_stream_scale(
+  struct moberg_device *device,
+  struct moberg_stream_context *stream,
+  int channel,
+  double *offset,
+  double *scale);
+
+struct moberg_status moberg_device_stream_peek(
+  struct moberg_device *device,
+  struct moberg_stream_context *stream,
+  struct moberg_stream_buffer *buffer);
+
+struct moberg_status moberg_device_stream_consume(
+  struct moberg_device *device,
+  struct moberg_stream_context *stream,
+  int length);
+
+struct moberg_status moberg_device_stream_close(
+  struct moberg_device *device,
+  struct moberg_stream_context *stream);
+
 struct moberg_status moberg_device_start(
   struct moberg_device *device,
   FILE *f);
@@ -93,6 +306,13 @@ struct moberg_status moberg_device_stop(
   struct moberg_device *device,
   FILE *f);
 
+struct moberg_status moberg_device_flush(
+  struct moberg_device *device);
+
+struct moberg_status moberg_device_sample(
+  struct moberg_device *device,
+  unsigned long generation);
+
 
 
 
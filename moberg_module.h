@@ -75,6 +75,26 @@ struct moberg_status moberg_parser_failed(
   struct moberg_parser_context *c,
   FILE *f);
 
+/* Current cycle generation, 0 if never advanced */
+unsigned long moberg_generation(struct moberg *moberg);
+
+/* Shared I/O reactor, one thread per moberg handle waits (epoll) on
+   the fds of all devices and calls ready(context) from that thread
+   when fd is readable. ready must not block; when it fails, fd is no
+   longer watched. Devices that sample asynchronously (see the driver
+   sample hook) thus wait for all their replies in parallel. */
+struct moberg_status moberg_reactor_add(
+  struct moberg *moberg,
+  int fd,
+  struct moberg_status (*ready)(void *context),
+  void *context);
+
+/* On return ready is not running, and will not be called again, for
+   fd. Must not be called from ready. */
+void moberg_reactor_remove(
+  struct moberg *moberg,
+  int fd);
+
 void moberg_deferred_action(
   struct moberg *moberg,
   int (*action)(void *param),
@@ -40,6 +40,7 @@ typedef struct moberg_parser_context {
   struct moberg_config *config;
   const char *buf; /* Pointer to data to be parsed */
   const char *p;   /* current parse location */
+  const char *start; /* start of current token */
   token_t token;
   struct {
     int n;
@@ -112,6 +113,7 @@ static int nextsym(context_t *c)
       c->p += 2;
       continue;
     }
+    c->start = c->p;
     switch (*c->p) {
       case ' ':
       case '\t':
@@ -180,6 +182,7 @@ static int nextsym(context_t *c)
   if (c->token.kind != tok_none) {
     return 1;
   } else {
+    c->start = c->p;
     c->token.kind = tok_EOF;
     return 0;
   }
@@ -295,6 +298,116 @@ struct moberg_status moberg_parser_failed(
   return MOBERG_ERRNO(EINVAL);
 }
 
+const char *moberg_parser_position(struct moberg_parser_context *c)
+{
+  return c->start;
+}
+
+char *moberg_parser_source(struct moberg_parser_context *c,
+                           const char *from)
+{
+  const char *to = c->start;
+  char *result = malloc(to - from + 1);
+  if (result) {
+    char *q = result;
+    for (const char *p = from ; p < to ; ) {
+      if (p[0] == '/' && p + 1 < to && p[1] == '*') {
+        /* Comment, treated as whitespace */
+        p += 2;
+        while (p + 1 < to && (p[0] != '*' || p[1] != '/')) {
+          p++;
+        }
+        p += 2;
+        if (q > result && q[-1] != ' ') { *q++ = ' '; }
+      } else if (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+        p++;
+        if (q > result && q[-1] != ' ') { *q++ = ' '; }
+      } else if (*p == '"') {
+        /* Strings are kept verbatim */
+        *q++ = *p++;
+        while (p < to && *p != '"') {
+          if (*p == '\\' && p + 1 < to) {
+            *q++ = *p++;
+          }
+          *q++ = *p++;
+        }
+        if (p < to) {
+          *q++ = *p++;
+        }
+      } else {
+        *q++ = *p++;
+      }
+    }
+    while (q > result && q[-1] == ' ') {
+      q--;
+    }
+    *q = 0;
+  }
+  return result;
+}
+
+struct moberg_status moberg_parser_skip_config(context_t *c)
+{
+  int depth = 0;
+  if (! peeksym(c, tok_LBRACE, NULL)) {
+    acceptsym(c, tok_LBRACE, NULL);
+    goto syntax_err;
+  }
+  do {
+    switch (c->token.kind) {
+      case tok_LPAREN:
+      case tok_LBRACE:
+      case tok_LBRACKET:
+        depth++;
+        break;
+      case tok_RPAREN:
+      case tok_RBRACE:
+      case tok_RBRACKET:
+        depth--;
+        break;
+      case tok_EOF:
+        goto syntax_err;
+      default:
+        break;
+    }
+    nextsym(c);
+  } while (depth > 0);
+  return MOBERG_OK;
+syntax_err:
+  return moberg_parser_failed(c, stderr);
+}
+
+struct moberg_status moberg_parser_skip_map(context_t *c)
+{
+  int depth = 0;
+  while (depth > 0 || ! peeksym(c, tok_SEMICOLON, NULL)) {
+    switch (c->token.kind) {
+      case tok_LPAREN:
+      case tok_LBRACE:
+      case tok_LBRACKET:
+        depth++;
+        break;
+      case tok_RPAREN:
+      case tok_RBRACE:
+      case tok_RBRACKET:
+        if (depth == 0) {
+          acceptsym(c, tok_SEMICOLON, NULL);
+          goto syntax_err;
+        }
+        depth--;
+        break;
+      case tok_EOF:
+        acceptsym(c, tok_SEMICOLON, NULL);
+        goto syntax_err;
+      default:
+        break;
+    }
+    nextsym(c);
+  }
+  return MOBERG_OK;
+syntax_err:
+  return moberg_parser_failed(c, stderr);
+}
 
 static int parse_map_range(context_t *c,
                            int *min,
@@ -372,7 +485,8 @@ syntax_err:
 }
 
 static struct moberg_status parse(struct moberg *moberg,
-                                  context_t *c)
+                                  context_t *c,
+                                  int lazy)
 {
   struct moberg_status result = MOBERG_OK;
   for (;;) {
@@ -394,7 +508,7 @@ static struct moberg_status parse(struct moberg *moberg,
         result = MOBERG_ERRNO(ENOMEM);
         goto err_result;
       }
-      device = moberg_device_new(moberg, name);
+      device = moberg_device_new(moberg, name, lazy);
       free(name);
       if (! device) {
         result = MOBERG_ERRNO(ENOMEM);
@@ -422,7 +536,8 @@ syntax_err:
 }
 
 struct moberg_config *moberg_parse(struct moberg *moberg,
-                                   const char *buf)
+                                   const char *buf,
+                                   int lazy)
 {
   context_t context;
 
@@ -432,7 +547,7 @@ struct moberg_config *moberg_parse(struct moberg *moberg,
     context.buf = buf;
     context.p = context.buf;
     nextsym(&context);
-    if (! OK(parse(moberg, &context))) {
+    if (! OK(parse(moberg, &context, lazy))) {
       moberg_config_free(context.config);
       context.config = NULL;
     }
@@ -440,5 +555,49 @@ struct moberg_config *moberg_parse(struct moberg *moberg,
 
   return context.config;
 }
+
+struct moberg_status moberg_parse_config(struct moberg_device *device,
+                                         const char *source)
+{
+  context_t context;
+
+  context.config = NULL;
+  context.expected.n = 0;
+  context.buf = source;
+  context.p = context.buf;
+  nextsym(&context);
+  while (! acceptsym(&context, tok_EOF, NULL)) {
+    struct moberg_status result = moberg_device_parse_config(device,
+                                                             &context);
+    if (! OK(result)) {
+      return result;
+    }
+  }
+  return MOBERG_OK;
+}
+
+struct moberg_status moberg_parse_map(struct moberg_device *device,
+                                      enum moberg_channel_kind kind,
+                                      int min,
+                                      int max,
+                                      const char *source)
+{
+  context_t context;
+
+  context.config = NULL;
+  context.expected.n = 0;
+  context.buf = source;
+  context.p = context.buf;
+  nextsym(&context);
+  struct moberg_status result = moberg_device_parse_map(device, &context,
+                                                        kind, min, max);
+  if (! OK(result)) {
+    return result;
+  }
+  if (! acceptsym(&context, tok_EOF, NULL)) {
+    return moberg_parser_failed(&context, stderr);
+  }
+  return MOBERG_OK;
+}
   
 
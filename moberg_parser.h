@@ -23,11 +23,45 @@
 #define __MOBERG_PARSER_H__
 
 #include <moberg.h>
+#include <moberg_channel.h>
 #include <moberg_config.h>
 
+struct moberg_device;
 struct moberg_parser_context;
 
+/* When lazy, no drivers are loaded: the driver specific parts are only
+   checked for balanced brackets and recorded (see moberg_device_load) */
 struct moberg_config *moberg_parse(struct moberg* moberg,
-                                   const char *buf);
+                                   const char *buf,
+                                   int lazy);
+
+/* Parses config block(s) (as returned by moberg_parser_source) again */
+struct moberg_status moberg_parse_config(struct moberg_device *device,
+                                         const char *source);
+
+/* Parses the driver specific part of a map (as returned by
+   moberg_parser_source) again, mapping kind[min:max] of device */
+struct moberg_status moberg_parse_map(struct moberg_device *device,
+                                      enum moberg_channel_kind kind,
+                                      int min,
+                                      int max,
+                                      const char *source);
+
+/* Skips the driver specific part of a config (a {...} block) or of a
+   map (up to the ';'), for devices that are not loaded */
+struct moberg_status moberg_parser_skip_config(
+  struct moberg_parser_context *c);
+
+struct moberg_status moberg_parser_skip_map(
+  struct moberg_parser_context *c);
+
+/* Start of the current token */
+const char *moberg_parser_position(struct moberg_parser_context *c);
+
+/* Source from position up to the current token, with comments and
+   whitespace collapsed to single spaces so that equivalent
+   configurations compare equal. Caller frees, NULL if out of memory */
+char *moberg_parser_source(struct moberg_parser_context *c,
+                           const char *from);
 
 #endif
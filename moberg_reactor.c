@@ -0,0 +1,229 @@
+/*
+    moberg_reactor.c -- shared I/O thread for moberg devices
+
+    Copyright (C) 2019 Anders Blomdell <anders.blomdell@gmail.com>
+
+    This file is part of Moberg.
+
+    Moberg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <moberg.h>
+#include <moberg_inline.h>
+#include <moberg_reactor.h>
+
+struct moberg_reactor {
+  pthread_mutex_t lock; /* Held while ready callbacks run */
+  int running;
+  int stop;
+  int epoll;
+  int wakeup;
+  pthread_t thread;
+  struct watch {
+    struct watch *next;
+    int fd;
+    int active;
+    struct moberg_status (*ready)(void *context);
+    void *context;
+  } *watch;
+};
+
+static struct watch *find_watch(struct moberg_reactor *reactor, int fd)
+{
+  for (struct watch *w = reactor->watch ; w ; w = w->next) {
+    if (w->fd == fd) {
+      return w;
+    }
+  }
+  return NULL;
+}
+
+/* Events are dispatched by fd under the lock, so an fd that was
+   unwatched after epoll_wait returned is never handed to a stale
+   callback */
+static void *reactor_thread(void *arg)
+{
+  struct moberg_reactor *reactor = arg;
+
+  for (;;) {
+    struct epoll_event event[16];
+    int n = epoll_wait(reactor->epoll, event, 16, -1);
+    if (n < 0 && errno != EINTR) {
+      break;
+    }
+    pthread_mutex_lock(&reactor->lock);
+    if (reactor->stop) {
+      pthread_mutex_unlock(&reactor->lock);
+      break;
+    }
+    for (int i = 0 ; i < n ; i++) {
+      if (event[i].data.fd == reactor->wakeup) {
+        eventfd_t value;
+        eventfd_read(reactor->wakeup, &value);
+        continue;
+      }
+      struct watch *w = find_watch(reactor, event[i].data.fd);
+      if (w && w->active) {
+        struct moberg_status result = w->ready(w->context);
+        if (! OK(result)) {
+          /* Don't spin on a broken fd */
+          epoll_ctl(reactor->epoll, EPOLL_CTL_DEL, w->fd, NULL);
+          w->active = 0;
+        }
+      }
+    }
+    pthread_mutex_unlock(&reactor->lock);
+  }
+  return NULL;
+}
+
+/* Called with lock held */
+static struct moberg_status reactor_start(struct moberg_reactor *reactor)
+{
+  struct moberg_status result;
+
+  reactor->epoll = epoll_create1(EPOLL_CLOEXEC);
+  if (reactor->epoll < 0) {
+    result = MOBERG_ERRNO(errno);
+    goto err;
+  }
+  reactor->wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (reactor->wakeup < 0) {
+    result = MOBERG_ERRNO(errno);
+    goto close_epoll;
+  }
+  struct epoll_event event = { .events = EPOLLIN,
+                               .data.fd = reactor->wakeup };
+  if (epoll_ctl(reactor->epoll, EPOLL_CTL_ADD, reactor->wakeup, &event)) {
+    result = MOBERG_ERRNO(errno);
+    goto close_wakeup;
+  }
+  reactor->stop = 0;
+  int err = pthread_create(&reactor->thread, NULL, reactor_thread, reactor);
+  if (err) {
+    result = MOBERG_ERRNO(err);
+    goto close_wakeup;
+  }
+  reactor->running = 1;
+  return MOBERG_OK;
+close_wakeup:
+  close(reactor->wakeup);
+close_epoll:
+  close(reactor->epoll);
+err:
+  return result;
+}
+
+struct moberg_reactor *moberg_reactor_new(void)
+{
+  struct moberg_reactor *result = calloc(1, sizeof(*result));
+  if (result) {
+    pthread_mutex_init(&result->lock, NULL);
+  }
+  return result;
+}
+
+void moberg_reactor_free(struct moberg_reactor *reactor)
+{
+  if (! reactor) {
+    return;
+  }
+  if (reactor->running) {
+    pthread_mutex_lock(&reactor->lock);
+    reactor->stop = 1;
+    pthread_mutex_unlock(&reactor->lock);
+    eventfd_write(reactor->wakeup, 1);
+    pthread_join(reactor->thread, NULL);
+    close(reactor->wakeup);
+    close(reactor->epoll);
+  }
+  while (reactor->watch) {
+    struct watch *next = reactor->watch->next;
+    free(reactor->watch);
+    reactor->watch = next;
+  }
+  pthread_mutex_destroy(&reactor->lock);
+  free(reactor);
+}
+
+struct moberg_status moberg_reactor_watch(
+  struct moberg_reactor *reactor,
+  int fd,
+  struct moberg_status (*ready)(void *context),
+  void *context)
+{
+  struct moberg_status result = MOBERG_OK;
+
+  if (! reactor) {
+    return MOBERG_ERRNO(ENOMEM);
+  }
+  pthread_mutex_lock(&reactor->lock);
+  if (find_watch(reactor, fd)) {
+    result = MOBERG_ERRNO(EEXIST);
+    goto unlock;
+  }
+  if (! reactor->running) {
+    result = reactor_start(reactor);
+    if (! OK(result)) { goto unlock; }
+  }
+  struct watch *watch = malloc(sizeof(*watch));
+  if (! watch) {
+    result = MOBERG_ERRNO(ENOMEM);
+    goto unlock;
+  }
+  struct epoll_event event = { .events = EPOLLIN, .data.fd = fd };
+  if (epoll_ctl(reactor->epoll, EPOLL_CTL_ADD, fd, &event)) {
+    result = MOBERG_ERRNO(errno);
+    free(watch);
+    goto unlock;
+  }
+  watch->fd = fd;
+  watch->active = 1;
+  watch->ready = ready;
+  watch->context = context;
+  watch->next = reactor->watch;
+  reactor->watch = watch;
+unlock:
+  pthread_mutex_unlock(&reactor->lock);
+  return result;
+}
+
+void moberg_reactor_unwatch(struct moberg_reactor *reactor,
+                            int fd)
+{
+  if (! reactor) {
+    return;
+  }
+  pthread_mutex_lock(&reactor->lock);
+  for (struct watch **w = &reactor->watch ; *w ; w = &(*w)->next) {
+    if ((*w)->fd == fd) {
+      struct watch *unwatched = *w;
+      if (unwatched->active) {
+        epoll_ctl(reactor->epoll, EPOLL_CTL_DEL, fd, NULL);
+      }
+      *w = unwatched->next;
+      free(unwatched);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&reactor->lock);
+}
@@ -0,0 +1,45 @@
+/*
+    moberg_reactor.h -- shared I/O thread for moberg devices
+
+    Copyright (C) 2019 Anders Blomdell <anders.blomdell@gmail.com>
+
+    This file is part of Moberg.
+
+    Moberg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef __MOBERG_REACTOR_H__
+#define __MOBERG_REACTOR_H__
+
+#include <moberg.h>
+
+/* One epoll thread per moberg handle, started when the first fd is
+   added (see moberg_reactor_add in moberg_module.h) */
+
+struct moberg_reactor;
+
+struct moberg_reactor *moberg_reactor_new(void);
+
+void moberg_reactor_free(struct moberg_reactor *reactor);
+
+struct moberg_status moberg_reactor_watch(
+  struct moberg_reactor *reactor,
+  int fd,
+  struct moberg_status (*ready)(void *context),
+  void *context);
+
+void moberg_reactor_unwatch(struct moberg_reactor *reactor,
+                            int fd);
+
+#endif
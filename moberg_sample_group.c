@@ -0,0 +1,347 @@
+/*
+    moberg_sample_group.c -- synchronous sampling of a group of inputs
+
+    Copyright (C) 2019 Anders Blomdell <anders.blomdell@gmail.com>
+
+    This file is part of Moberg.
+
+    Moberg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <moberg.h>
+#include <moberg_inline.h>
+#include <moberg_sample_group.h>
+
+/* Handed out as channel context by moberg_sample_group_*_in() */
+struct member {
+  struct moberg_sample_group *group;
+  int position;
+};
+
+struct moberg_sample_group {
+  struct moberg *moberg;
+  struct moberg_status status; /* Result of last update */
+  struct {
+    int count;
+    int opened;
+    int *index;
+    struct moberg_analog_in *channel;
+    struct member *member;
+    double *value;
+  } analog_in;
+  struct {
+    int count;
+    int opened;
+    int *index;
+    struct moberg_digital_in *channel;
+    struct member *member;
+    int *value;
+  } digital_in;
+  struct {
+    int count;
+    int opened;
+    int *index;
+    struct moberg_encoder_in *channel;
+    struct member *member;
+    long *value;
+  } encoder_in;
+};
+
+static struct moberg_status analog_in_read(
+  struct moberg_channel_analog_in *analog_in,
+  double *value)
+{
+  struct member *member = (struct member *)analog_in;
+  if (! value) { goto err_einval; }
+  if (! OK(member->group->status)) {
+    return member->group->status;
+  }
+  *value = member->group->analog_in.value[member->position];
+  return MOBERG_OK;
+err_einval:
+  return MOBERG_ERRNO(EINVAL);
+}
+
+static struct moberg_status digital_in_read(
+  struct moberg_channel_digital_in *digital_in,
+  int *value)
+{
+  struct member *member = (struct member *)digital_in;
+  if (! value) { goto err_einval; }
+  if (! OK(member->group->status)) {
+    return member->group->status;
+  }
+  *value = member->group->digital_in.value[member->position];
+  return MOBERG_OK;
+err_einval:
+  return MOBERG_ERRNO(EINVAL);
+}
+
+static struct moberg_status encoder_in_read(
+  struct moberg_channel_encoder_in *encoder_in,
+  long *value)
+{
+  struct member *member = (struct member *)encoder_in;
+  if (! value) { goto err_einval; }
+  if (! OK(member->group->status)) {
+    return member->group->status;
+  }
+  *value = member->group->encoder_in.value[member->position];
+  return MOBERG_OK;
+err_einval:
+  return MOBERG_ERRNO(EINVAL);
+}
+
+static int lookup(int count, int *index, int wanted)
+{
+  for (int i = 0 ; i < count ; i++) {
+    if (index[i] == wanted) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void moberg_sample_group_free(struct moberg_sample_group *group)
+{
+  if (group) {
+    for (int i = 0 ; i < group->analog_in.opened ; i++) {
+      moberg_analog_in_close(group->moberg,
+                             group->analog_in.index[i],
+                             group->analog_in.channel[i]);
+    }
+    for (int i = 0 ; i < group->digital_in.opened ; i++) {
+      moberg_digital_in_close(group->moberg,
+                              group->digital_in.index[i],
+                              group->digital_in.channel[i]);
+    }
+    for (int i = 0 ; i < group->encoder_in.opened ; i++) {
+      moberg_encoder_in_close(group->moberg,
+                              group->encoder_in.index[i],
+                              group->encoder_in.channel[i]);
+    }
+    free(group->analog_in.index);
+    free(group->analog_in.channel);
+    free(group->analog_in.member);
+    free(group->analog_in.value);
+    free(group->digital_in.index);
+    free(group->digital_in.channel);
+    free(group->digital_in.member);
+    free(group->digital_in.value);
+    free(group->encoder_in.index);
+    free(group->encoder_in.channel);
+    free(group->encoder_in.member);
+    free(group->encoder_in.value);
+    free(group);
+  }
+}
+
+struct moberg_status moberg_sample_group_new(
+  struct moberg *moberg,
+  int analog_in_count,
+  const int *analog_in_index,
+  int digital_in_count,
+  const int *digital_in_index,
+  int encoder_in_count,
+  const int *encoder_in_index,
+  struct moberg_sample_group **group)
+{
+  struct moberg_status result = MOBERG_OK;
+  struct moberg_sample_group *g = NULL;
+
+  if (! moberg || ! group ||
+      analog_in_count < 0 || analog_in_count > MOBERG_MANY_MAX ||
+      (analog_in_count && ! analog_in_index) ||
+      digital_in_count < 0 || digital_in_count > MOBERG_MANY_MAX ||
+      (digital_in_count && ! digital_in_index) ||
+      encoder_in_count < 0 || encoder_in_count > MOBERG_MANY_MAX ||
+      (encoder_in_count && ! encoder_in_index)) {
+    result = MOBERG_ERRNO(EINVAL);
+    goto return_result;
+  }
+  g = malloc(sizeof(*g));
+  if (! g) { goto err_enomem; }
+  memset(g, 0, sizeof(*g));
+  g->moberg = moberg;
+  /* No snapshot until first update */
+  g->status = MOBERG_ERRNO(ENODATA);
+
+  g->analog_in.count = analog_in_count;
+  g->analog_in.index = calloc(analog_in_count + 1, sizeof(int));
+  g->analog_in.channel = calloc(analog_in_count + 1,
+                                sizeof(struct moberg_analog_in));
+  g->analog_in.member = calloc(analog_in_count + 1, sizeof(struct member));
+  g->analog_in.value = calloc(analog_in_count + 1, sizeof(double));
+  if (! g->analog_in.index || ! g->analog_in.channel ||
+      ! g->analog_in.member || ! g->analog_in.value) {
+    goto err_enomem;
+  }
+  g->digital_in.count = digital_in_count;
+  g->digital_in.index = calloc(digital_in_count + 1, sizeof(int));
+  g->digital_in.channel = calloc(digital_in_count + 1,
+                                 sizeof(struct moberg_digital_in));
+  g->digital_in.member = calloc(digital_in_count + 1, sizeof(struct member));
+  g->digital_in.value = calloc(digital_in_count + 1, sizeof(int));
+  if (! g->digital_in.index || ! g->digital_in.channel ||
+      ! g->digital_in.member || ! g->digital_in.value) {
+    goto err_enomem;
+  }
+  g->encoder_in.count = encoder_in_count;
+  g->encoder_in.index = calloc(encoder_in_count + 1, sizeof(int));
+  g->encoder_in.channel = calloc(encoder_in_count + 1,
+                                 sizeof(struct moberg_encoder_in));
+  g->encoder_in.member = calloc(encoder_in_count + 1, sizeof(struct member));
+  g->encoder_in.value = calloc(encoder_in_count + 1, sizeof(long));
+  if (! g->encoder_in.index || ! g->encoder_in.channel ||
+      ! g->encoder_in.member || ! g->encoder_in.value) {
+    goto err_enomem;
+  }
+
+  for (int i = 0 ; i < analog_in_count ; i++) {
+    g->analog_in.index[i] = analog_in_index[i];
+    g->analog_in.member[i].group = g;
+    g->analog_in.member[i].position = i;
+    result = moberg_analog_in_open(moberg, analog_in_index[i],
+                                   &g->analog_in.channel[i]);
+    if (! OK(result)) { goto free_group; }
+    g->analog_in.opened++;
+  }
+  for (int i = 0 ; i < digital_in_count ; i++) {
+    g->digital_in.index[i] = digital_in_index[i];
+    g->digital_in.member[i].group = g;
+    g->digital_in.member[i].position = i;
+    result = moberg_digital_in_open(moberg, digital_in_index[i],
+                                    &g->digital_in.channel[i]);
+    if (! OK(result)) { goto free_group; }
+    g->digital_in.opened++;
+  }
+  for (int i = 0 ; i < encoder_in_count ; i++) {
+    g->encoder_in.index[i] = encoder_in_index[i];
+    g->encoder_in.member[i].group = g;
+    g->encoder_in.member[i].position = i;
+    result = moberg_encoder_in_open(moberg, encoder_in_index[i],
+                                    &g->encoder_in.channel[i]);
+    if (! OK(result)) { goto free_group; }
+    g->encoder_in.opened++;
+  }
+  *group = g;
+  return MOBERG_OK;
+
+err_enomem:
+  result = MOBERG_ERRNO(ENOMEM);
+free_group:
+  moberg_sample_group_free(g);
+return_result:
+  return result;
+}
+
+struct moberg_status moberg_sample_group_update(
+  struct moberg_sample_group *group)
+{
+  if (! group) {
+    return MOBERG_ERRNO(EINVAL);
+  }
+  moberg_advance_generation(group->moberg);
+  group->status = moberg_analog_in_read_many(group->moberg,
+                                             group->analog_in.count,
+                                             group->analog_in.index,
+                                             group->analog_in.value);
+  if (! OK(group->status)) { goto return_status; }
+  group->status = moberg_digital_in_read_many(group->moberg,
+                                              group->digital_in.count,
+                                              group->digital_in.index,
+                                              group->digital_in.value);
+  if (! OK(group->status)) { goto return_status; }
+  group->status = moberg_encoder_in_read_many(group->moberg,
+                                              group->encoder_in.count,
+                                              group->encoder_in.index,
+                                              group->encoder_in.value);
+return_status:
+  return group->status;
+}
+
+struct moberg_status moberg_sample_group_analog_in(
+  struct moberg_sample_group *group,
+  int index,
+  struct moberg_analog_in *analog_in)
+{
+  if (! group || ! analog_in) {
+    return MOBERG_ERRNO(EINVAL);
+  }
+  int i = lookup(group->analog_in.count, group->analog_in.index, index);
+  if (i < 0) {
+    return MOBERG_ERRNO(ENODEV);
+  }
+  analog_in->context =
+    (struct moberg_channel_analog_in *)&group->analog_in.member[i];
+  analog_in->read = analog_in_read;
+  return MOBERG_OK;
+}
+
+struct moberg_status moberg_sample_group_digital_in(
+  struct moberg_sample_group *group,
+  int index,
+  struct moberg_digital_in *digital_in)
+{
+  if (! group || ! digital_in) {
+    return MOBERG_ERRNO(EINVAL);
+  }
+  int i = lookup(group->digital_in.count, group->digital_in.index, index);
+  if (i < 0) {
+    return MOBERG_ERRNO(ENODEV);
+  }
+  digital_in->context =
+    (struct moberg_channel_digital_in *)&group->digital_in.member[i];
+  digital_in->read = digital_in_read;
+  return MOBERG_OK;
+}
+
+struct moberg_status moberg_sample_group_encoder_in(
+  struct moberg_sample_group *group,
+  int index,
+  struct moberg_encoder_in *encoder_in)
+{
+  if (! group || ! encoder_in) {
+    return MOBERG_ERRNO(EINVAL);
+  }
+  int i = lookup(group->encoder_in.count, group->encoder_in.index, index);
+  if (i < 0) {
+    return MOBERG_ERRNO(ENODEV);
+  }
+  encoder_in->context =
+    (struct moberg_channel_encoder_in *)&group->encoder_in.member[i];
+  encoder_in->read = encoder_in_read;
+  return MOBERG_OK;
+}
+
+double *moberg_sample_group_analog_in_value(
+  struct moberg_sample_group *group)
+{
+  return group->analog_in.value;
+}
+
+int *moberg_sample_group_digital_in_value(
+  struct moberg_sample_group *group)
+{
+  return group->digital_in.value;
+}
+
+long *moberg_sample_group_encoder_in_value(
+  struct moberg_sample_group *group)
+{
+  return group->encoder_in.value;
+}
@@ -0,0 +1,40 @@
+/*
+    moberg_sample_group.h -- sample group internals
+
+    Copyright (C) 2019 Anders Blomdell <anders.blomdell@gmail.com>
+
+    This file is part of Moberg.
+
+    Moberg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef __MOBERG_SAMPLE_GROUP_H__
+#define __MOBERG_SAMPLE_GROUP_H__
+
+#include <moberg.h>
+
+/* Snapshot of the last moberg_sample_group_update, one value per
+   channel in the order given to moberg_sample_group_new. Used by the
+   moberg_cycle loop to hand the inputs to its callback */
+
+double *moberg_sample_group_analog_in_value(
+  struct moberg_sample_group *group);
+
+int *moberg_sample_group_digital_in_value(
+  struct moberg_sample_group *group);
+
+long *moberg_sample_group_encoder_in_value(
+  struct moberg_sample_group *group);
+
+#endif
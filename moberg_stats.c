@@ -0,0 +1,126 @@
+/*
+    moberg_stats.c -- latency statistics for moberg channels and devices
+
+    Copyright (C) 2019 Anders Blomdell <anders.blomdell@gmail.com>
+
+    This file is part of Moberg.
+
+    Moberg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _POSIX_C_SOURCE  200809L
+
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <moberg.h>
+#include <moberg_stats.h>
+
+/*
+  HDR style histogram: values below 2 * SUB_BUCKETS ns get one bucket
+  each, above that every power of two is split into SUB_BUCKETS
+  linear buckets, i.e. a relative resolution of 1 / SUB_BUCKETS.
+*/
+#define SUB_BITS 3
+#define SUB_BUCKETS (1 << SUB_BITS)
+
+static int bucket(long long ns)
+{
+  if (ns < 2 * SUB_BUCKETS) {
+    return ns < 0 ? 0 : ns;
+  }
+  int msb = 63 - __builtin_clzll(ns);
+  int shift = msb - SUB_BITS;
+  int result = (shift + 1) * SUB_BUCKETS + (int)(ns >> shift) - SUB_BUCKETS;
+  return result < MOBERG_STATS_BUCKETS ? result : MOBERG_STATS_BUCKETS - 1;
+}
+
+/* Upper limit of bucket, in ns */
+static long long bucket_limit(int bucket)
+{
+  if (bucket < 2 * SUB_BUCKETS) {
+    return bucket + 1;
+  }
+  int shift = bucket / SUB_BUCKETS - 1;
+  long long sub = bucket % SUB_BUCKETS + SUB_BUCKETS;
+  return (sub + 1) << shift;
+}
+
+void moberg_latency_init(struct moberg_latency *latency)
+{
+  memset(latency, 0, sizeof(*latency));
+  latency->min = LLONG_MAX;
+}
+
+long long moberg_latency_now(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+void moberg_latency_record(struct moberg_latency *latency,
+                           long long start)
+{
+  long long ns = moberg_latency_now() - start;
+  long long old;
+
+  __atomic_fetch_add(&latency->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&latency->sum, ns, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&latency->histogram[bucket(ns)], 1, __ATOMIC_RELAXED);
+  old = __atomic_load_n(&latency->min, __ATOMIC_RELAXED);
+  while (ns < old &&
+         ! __atomic_compare_exchange_n(&latency->min, &old, ns, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  old = __atomic_load_n(&latency->max, __ATOMIC_RELAXED);
+  while (ns > old &&
+         ! __atomic_compare_exchange_n(&latency->max, &old, ns, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void moberg_latency_get(struct moberg_latency *latency,
+                        struct moberg_stats *stats)
+{
+  memset(stats, 0, sizeof(*stats));
+  stats->count = __atomic_load_n(&latency->count, __ATOMIC_RELAXED);
+  if (stats->count) {
+    long long sum = __atomic_load_n(&latency->sum, __ATOMIC_RELAXED);
+    stats->min = __atomic_load_n(&latency->min, __ATOMIC_RELAXED) * 1e-9;
+    stats->max = __atomic_load_n(&latency->max, __ATOMIC_RELAXED) * 1e-9;
+    stats->mean = sum * 1e-9 / stats->count;
+  }
+  for (int i = 0 ; i < MOBERG_STATS_BUCKETS ; i++) {
+    stats->histogram[i] = __atomic_load_n(&latency->histogram[i],
+                                          __ATOMIC_RELAXED);
+  }
+}
+
+double moberg_stats_percentile(const struct moberg_stats *stats,
+                               double percentile)
+{
+  long total = 0;
+  for (int i = 0 ; i < MOBERG_STATS_BUCKETS ; i++) {
+    total += stats->histogram[i];
+  }
+  long wanted = total * percentile / 100.0;
+  long seen = 0;
+  for (int i = 0 ; i < MOBERG_STATS_BUCKETS ; i++) {
+    seen += stats->histogram[i];
+    if (seen > wanted || seen == total) {
+      double limit = bucket_limit(i) * 1e-9;
+      return limit < stats->max ? limit : stats->max;
+    }
+  }
+  return 0.0;
+}
@@ -0,0 +1,48 @@
+/*
+    moberg_stats.h -- latency statistics for moberg channels and devices
+
+    Copyright (C) 2019 Anders Blomdell <anders.blomdell@gmail.com>
+
+    This file is part of Moberg.
+
+    Moberg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef __MOBERG_STATS_H__
+#define __MOBERG_STATS_H__
+
+#include <moberg.h>
+
+/* Latencies in ns, updated with atomic operations so that channels
+   may be used from several threads */
+
+struct moberg_latency {
+  long count;
+  long long sum;
+  long long min;
+  long long max;
+  long histogram[MOBERG_STATS_BUCKETS];
+};
+
+void moberg_latency_init(struct moberg_latency *latency);
+
+long long moberg_latency_now(void);
+
+void moberg_latency_record(struct moberg_latency *latency,
+                           long long start);
+
+void moberg_latency_get(struct moberg_latency *latency,
+                        struct moberg_stats *stats);
+
+#endif
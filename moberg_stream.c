@@ -0,0 +1,229 @@
+/*
+    moberg_stream.c -- software timed streaming for moberg devices
+
+    Copyright (C) 2019 Anders Blomdell <anders.blomdell@gmail.com>
+
+    This file is part of Moberg.
+
+    Moberg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _POSIX_C_SOURCE  200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <moberg.h>
+#include <moberg_inline.h>
+#include <moberg_stream.h>
+
+struct moberg_soft_stream {
+  struct moberg_device *device;
+  int count;
+  struct moberg_channel **channel;
+  struct timespec period;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int stop;
+  struct moberg_status status; /* Sampling error, stops the stream */
+  struct {
+    int capacity; /* Samples, multiple of count */
+    int head;     /* Next sample to write */
+    int tail;     /* Next sample to read */
+    int fill;
+    double *value;
+  } ring;
+};
+
+static struct timespec timespec_add(struct timespec t1, struct timespec t2)
+{
+  struct timespec result;
+  result.tv_sec = t1.tv_sec + t2.tv_sec;
+  result.tv_nsec = t1.tv_nsec + t2.tv_nsec;
+  if (result.tv_nsec >= 1000000000L) {
+    result.tv_sec++;
+    result.tv_nsec -= 1000000000L;
+  }
+  return result;
+}
+
+static void *sampler(void *arg)
+{
+  struct moberg_soft_stream *stream = arg;
+  double scan[stream->count];
+  struct timespec next;
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  for (;;) {
+    next = timespec_add(next, stream->period);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL)
+           == EINTR);
+    pthread_mutex_lock(&stream->lock);
+    int stop = stream->stop;
+    pthread_mutex_unlock(&stream->lock);
+    if (stop) {
+      break;
+    }
+    struct moberg_status result = moberg_device_analog_in_read_many(
+      stream->device, stream->count, stream->channel, scan);
+    pthread_mutex_lock(&stream->lock);
+    if (OK(result) &&
+        stream->ring.fill + stream->count > stream->ring.capacity) {
+      /* Consumer is too slow */
+      result = MOBERG_ERRNO(EPIPE);
+    }
+    if (OK(result)) {
+      for (int i = 0 ; i < stream->count ; i++) {
+        stream->ring.value[stream->ring.head] = scan[i];
+        stream->ring.head++;
+        if (stream->ring.head >= stream->ring.capacity) {
+          stream->ring.head = 0;
+        }
+      }
+      stream->ring.fill += stream->count;
+    } else {
+      stream->status = result;
+    }
+    pthread_cond_signal(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+    if (! OK(result)) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+struct moberg_status moberg_soft_stream_open(
+  struct moberg_device *device,
+  int count,
+  struct moberg_channel **channel,
+  double rate,
+  struct moberg_soft_stream **stream)
+{
+  struct moberg_status result;
+  struct moberg_soft_stream *s = malloc(sizeof(*s));
+  if (! s) { goto err_enomem; }
+  memset(s, 0, sizeof(*s));
+  s->device = device;
+  s->count = count;
+  s->status = MOBERG_OK;
+  long period = 1e9 / rate;
+  s->period.tv_sec = period / 1000000000L;
+  s->period.tv_nsec = period % 1000000000L;
+  /* Room for at least one second of data */
+  int scans = rate < 1024 ? 1024 : rate;
+  s->ring.capacity = scans * count;
+  s->ring.value = calloc(s->ring.capacity, sizeof(*s->ring.value));
+  s->channel = calloc(count, sizeof(*s->channel));
+  if (! s->ring.value || ! s->channel) { goto free_stream; }
+  memcpy(s->channel, channel, count * sizeof(*s->channel));
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_condattr_t condattr;
+  pthread_condattr_init(&condattr);
+  pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+  pthread_cond_init(&s->cond, &condattr);
+  pthread_condattr_destroy(&condattr);
+  int err = pthread_create(&s->thread, NULL, sampler, s);
+  if (err) {
+    result = MOBERG_ERRNO(err);
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->lock);
+    free(s->ring.value);
+    free(s->channel);
+    free(s);
+    return result;
+  }
+  *stream = s;
+  return MOBERG_OK;
+free_stream:
+  free(s->ring.value);
+  free(s->channel);
+  free(s);
+err_enomem:
+  return MOBERG_ERRNO(ENOMEM);
+}
+
+struct moberg_status moberg_soft_stream_peek(
+  struct moberg_soft_stream *stream,
+  struct moberg_stream_buffer *buffer)
+{
+  struct moberg_status result = MOBERG_OK;
+
+  pthread_mutex_lock(&stream->lock);
+  while (stream->ring.fill < stream->count && OK(stream->status)) {
+    struct timespec timeout;
+    clock_gettime(CLOCK_MONOTONIC, &timeout);
+    timeout.tv_sec += 1;
+    if (pthread_cond_timedwait(&stream->cond, &stream->lock, &timeout)
+        == ETIMEDOUT) {
+      result = MOBERG_ERRNO(ETIMEDOUT);
+      goto unlock;
+    }
+  }
+  if (stream->ring.fill < stream->count) {
+    result = stream->status;
+    goto unlock;
+  }
+  int contiguous = stream->ring.capacity - stream->ring.tail;
+  if (contiguous > stream->ring.fill) {
+    contiguous = stream->ring.fill;
+  }
+  buffer->format = MOBERG_SAMPLE_DOUBLE;
+  buffer->sample_size = sizeof(double);
+  buffer->channel = stream->ring.tail % stream->count;
+  buffer->data = &stream->ring.value[stream->ring.tail];
+  buffer->length = contiguous * sizeof(double);
+  buffer->available = stream->ring.fill * sizeof(double);
+unlock:
+  pthread_mutex_unlock(&stream->lock);
+  return result;
+}
+
+struct moberg_status moberg_soft_stream_consume(
+  struct moberg_soft_stream *stream,
+  int length)
+{
+  struct moberg_status result = MOBERG_OK;
+  int samples = length / sizeof(double);
+
+  pthread_mutex_lock(&stream->lock);
+  if (length < 0 || length % sizeof(double) ||
+      samples > stream->ring.fill) {
+    result = MOBERG_ERRNO(EINVAL);
+    goto unlock;
+  }
+  stream->ring.tail = (stream->ring.tail + samples) % stream->ring.capacity;
+  stream->ring.fill -= samples;
+unlock:
+  pthread_mutex_unlock(&stream->lock);
+  return result;
+}
+
+struct moberg_status moberg_soft_stream_close(
+  struct moberg_soft_stream *stream)
+{
+  pthread_mutex_lock(&stream->lock);
+  stream->stop = 1;
+  pthread_mutex_unlock(&stream->lock);
+  pthread_join(stream->thread, NULL);
+  pthread_cond_destroy(&stream->cond);
+  pthread_mutex_destroy(&stream->lock);
+  free(stream->ring.value);
+  free(stream->channel);
+  free(stream);
+  return MOBERG_OK;
+}
@@ -0,0 +1,52 @@
+/*
+    moberg_stream.h -- software timed streaming for moberg devices
+
+    Copyright (C) 2019 Anders Blomdell <anders.blomdell@gmail.com>
+
+    This file is part of Moberg.
+
+    Moberg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef __MOBERG_STREAM_H__
+#define __MOBERG_STREAM_H__
+
+#include <moberg.h>
+#include <moberg_channel.h>
+#include <moberg_device.h>
+
+/* Used for devices without stream support in their driver, samples
+   are collected by a thread into a ring buffer of doubles */
+
+struct moberg_soft_stream;
+
+struct moberg_status moberg_soft_stream_open(
+  struct moberg_device *device,
+  int count,
+  struct moberg_channel **channel,
+  double rate,
+  struct moberg_soft_stream **stream);
+
+struct moberg_status moberg_soft_stream_peek(
+  struct moberg_soft_stream *stream,
+  struct moberg_stream_buffer *buffer);
+
+struct moberg_status moberg_soft_stream_consume(
+  struct moberg_soft_stream *stream,
+  int length);
+
+struct moberg_status moberg_soft_stream_close(
+  struct moberg_soft_stream *stream);
+
+#endif
@@ -4,7 +4,85 @@
 #include <moberg.h>
 
 void usage(char *prog) {
-  fprintf(stderr, "%s [ --start | --stop | -h | --help ]\n", prog);
+  fprintf(stderr, "%s [ --start | --stop | --stats [reads] | --compile |"
+          " -h | --help ]\n", prog);
+}
+
+static void print_stats(const char *name, int index, struct moberg_stats *stats)
+{
+  if (index >= 0) {
+    printf("%-12s %4d", name, index);
+  } else {
+    printf("%-17s", name);
+  }
+  printf(" %8ld %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+         stats->count,
+         stats->min * 1e6,
+         stats->mean * 1e6,
+         moberg_stats_percentile(stats, 99.0) * 1e6,
+         moberg_stats_percentile(stats, 99.9) * 1e6,
+         stats->max * 1e6);
+}
+
+/* Time reads of all input channels, outputs are never written */
+static int stats(int reads)
+{
+  setenv("MOBERG_STATS", "1", 1);
+  /* All channels are listed, so load all drivers at once */
+  unsetenv("MOBERG_LAZY");
+  struct moberg *moberg = moberg_new(NULL);
+  const char *kind;
+  int index;
+  struct moberg_stats stats;
+
+  for (int n = 0 ;
+       moberg_OK(moberg_stats_channel(moberg, n, &kind, &index, &stats)) ;
+       n++) {
+    if (strcmp(kind, "analog_in") == 0) {
+      struct moberg_analog_in channel;
+      if (moberg_OK(moberg_analog_in_open(moberg, index, &channel))) {
+        for (int i = 0 ; i < reads ; i++) {
+          double value;
+          channel.read(channel.context, &value);
+        }
+        moberg_analog_in_close(moberg, index, channel);
+      }
+    } else if (strcmp(kind, "digital_in") == 0) {
+      struct moberg_digital_in channel;
+      if (moberg_OK(moberg_digital_in_open(moberg, index, &channel))) {
+        for (int i = 0 ; i < reads ; i++) {
+          int value;
+          channel.read(channel.context, &value);
+        }
+        moberg_digital_in_close(moberg, index, channel);
+      }
+    } else if (strcmp(kind, "encoder_in") == 0) {
+      struct moberg_encoder_in channel;
+      if (moberg_OK(moberg_encoder_in_open(moberg, index, &channel))) {
+        for (int i = 0 ; i < reads ; i++) {
+          long value;
+          channel.read(channel.context, &value);
+        }
+        moberg_encoder_in_close(moberg, index, channel);
+      }
+    }
+  }
+  printf("%-17s %8s %10s %10s %10s %10s %10s\n",
+         "channel [us]", "count", "min", "mean", "p99", "p99.9", "max");
+  for (int n = 0 ;
+       moberg_OK(moberg_stats_channel(moberg, n, &kind, &index, &stats)) ;
+       n++) {
+    if (stats.count) {
+      print_stats(kind, index, &stats);
+    }
+  }
+  for (int n = 0 ;
+       moberg_OK(moberg_stats_device(moberg, n, &kind, &stats)) ;
+       n++) {
+    print_stats(kind, -1, &stats);
+  }
+  moberg_free(moberg);
+  return 0;
 }
 
 int main(int argc, char *argv[])
@@ -18,6 +96,19 @@ int main(int argc, char *argv[])
     struct moberg *moberg = moberg_new(NULL);
     moberg_stop(moberg, stdout);
     moberg_free(moberg);    
+  } else if ((argc == 2 || argc == 3) && strcmp(argv[1], "--stats") == 0) {
+    int reads = argc == 3 ? atoi(argv[2]) : 1000;
+    if (reads <= 0) {
+      usage(argv[0]);
+      exit(1);
+    }
+    return stats(reads);
+  } else if (argc == 2 && strcmp(argv[1], "--compile") == 0) {
+    struct moberg_status status = moberg_compile();
+    if (! moberg_OK(status)) {
+      fprintf(stderr, "%s: %s\n", argv[0], strerror(status.result));
+      exit(1);
+    }
   } else if (argc == 2 && strcmp(argv[1], "-h") == 0) {
     usage(argv[0]);
   } else if (argc == 2 && strcmp(argv[1], "--help") == 0) {
@@ -19,6 +19,8 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
     
+#include <sys/mman.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -40,7 +42,14 @@ struct moberg_device_context {
   struct {
     int count;
     comedi_t *handle;
+    comedi_calibration_t *calibration; /* Parsed software calibration */
   } comedi;
+  struct {
+    enum { calibration_none,
+           calibration_hardware,
+           calibration_software } kind;
+    char *path; /* Software calibration file, NULL -> comedilib default */
+  } calibration;
   struct idstr {
     struct idstr *next;
     struct idstr *prev;
@@ -61,9 +70,27 @@ struct moberg_channel_context {
     double min;
     double max;
     double delta;
+    /* Conversion polynomials, precomputed at channel open */
+    struct polynomial {
+      double origin;
+      double coefficient[4];
+    } to_physical, from_physical;
   } descriptor;
 };
 
+struct moberg_stream_context {
+  struct moberg_device_context *device;
+  int subdevice;
+  int count;
+  struct channel_descriptor *descriptor;
+  unsigned int *chanlist;
+  int sample_size;
+  unsigned char *buffer; /* mmap'ed comedi buffer */
+  int buffer_size;
+  int offset;            /* Read position in buffer */
+  int channel;           /* Channel of sample at offset */
+};
+
 struct moberg_channel_analog_in {
   struct moberg_channel channel;
   struct moberg_channel_context channel_context;
@@ -89,6 +116,18 @@ struct moberg_channel_encoder_in {
   struct moberg_channel_context channel_context;
 };
 
+/* Calibrated and uncalibrated channels take the same path, without
+   calling into comedilib */
+static inline double polynomial(const struct polynomial *polynomial,
+                                double x)
+{
+  x -= polynomial->origin;
+  return ((polynomial->coefficient[3] * x +
+           polynomial->coefficient[2]) * x +
+          polynomial->coefficient[1]) * x +
+    polynomial->coefficient[0];
+}
+
 static struct moberg_status analog_in_read(
   struct moberg_channel_analog_in *analog_in,
   double *value)
@@ -102,7 +141,7 @@ static struct moberg_status analog_in_read(
                            0, 0, &data)) {
     goto err_errno;
   }
-  *value = descriptor.min + data * descriptor.delta;
+  *value = polynomial(&descriptor.to_physical, data);
   return MOBERG_OK;
 err_einval:
   return MOBERG_ERRNO(EINVAL);
@@ -110,25 +149,57 @@ err_errno:
   return MOBERG_ERRNO(comedi_errno());
 }
 
+static struct moberg_status analog_in_read_many(
+  struct moberg_device_context *device,
+  int count,
+  struct moberg_channel_analog_in **analog_in,
+  double *value)
+{
+  comedi_insn insn[count];
+  comedi_insnlist insnlist = { .n_insns=count, .insns=insn };
+  lsampl_t data[count];
+
+  memset(insn, 0, sizeof(insn));
+  for (int i = 0 ; i < count ; i++) {
+    struct channel_descriptor *descriptor =
+      &analog_in[i]->channel_context.descriptor;
+    insn[i].insn = INSN_READ;
+    insn[i].n = 1;
+    insn[i].data = &data[i];
+    insn[i].subdev = descriptor->subdevice;
+    insn[i].chanspec = CR_PACK(descriptor->subchannel, 0, 0);
+  }
+  if (comedi_do_insnlist(device->comedi.handle, &insnlist) != count) {
+    goto err_errno;
+  }
+  for (int i = 0 ; i < count ; i++) {
+    value[i] = polynomial(&analog_in[i]->channel_context.descriptor.to_physical,
+                          data[i]);
+  }
+  return MOBERG_OK;
+err_errno:
+  return MOBERG_ERRNO(comedi_errno());
+}
+
+static lsampl_t analog_out_data(struct channel_descriptor *descriptor,
+                                double desired_value)
+{
+  double data = polynomial(&descriptor->from_physical, desired_value);
+  if (! (data > 0.0)) {
+    data = 0.0;
+  } else if (data > descriptor->maxdata) {
+    data = descriptor->maxdata;
+  }
+  return data;
+}
+
 static struct moberg_status analog_out_write(
   struct moberg_channel_analog_out *analog_out,
   double desired_value,
   double *actual_value)
 {
   struct channel_descriptor descriptor = analog_out->channel_context.descriptor;
-  lsampl_t data;
-  if (desired_value < descriptor.min) {
-    data = 0;
-  } else if (desired_value > descriptor.max) {
-    data = descriptor.maxdata;
-  } else {
-    data = (desired_value - descriptor.min) / descriptor.delta;
-  }
-  if (data < 0) {
-    data = 0;
-  } else if (data > descriptor.maxdata) {
-    data = descriptor.maxdata;
-  }
+  lsampl_t data = analog_out_data(&descriptor, desired_value);
   if (0 > comedi_data_write(analog_out->channel_context.device->comedi.handle,
                             descriptor.subdevice,
                             descriptor.subchannel,
@@ -136,7 +207,7 @@ static struct moberg_status analog_out_write(
     goto err_errno;
   }
   if (actual_value) {
-    *actual_value = data * descriptor.delta + descriptor.min;
+    *actual_value = polynomial(&descriptor.to_physical, data);
   }
     
   return MOBERG_OK;
@@ -144,6 +215,41 @@ err_errno:
   return MOBERG_ERRNO(comedi_errno());
 }
 
+static struct moberg_status analog_out_write_many(
+  struct moberg_device_context *device,
+  int count,
+  struct moberg_channel_analog_out **analog_out,
+  const double *desired_value,
+  double *actual_value)
+{
+  comedi_insn insn[count];
+  comedi_insnlist insnlist = { .n_insns=count, .insns=insn };
+  lsampl_t data[count];
+
+  memset(insn, 0, sizeof(insn));
+  for (int i = 0 ; i < count ; i++) {
+    struct channel_descriptor *descriptor =
+      &analog_out[i]->channel_context.descriptor;
+    data[i] = analog_out_data(descriptor, desired_value[i]);
+    insn[i].insn = INSN_WRITE;
+    insn[i].n = 1;
+    insn[i].data = &data[i];
+    insn[i].subdev = descriptor->subdevice;
+    insn[i].chanspec = CR_PACK(descriptor->subchannel, 0, 0);
+  }
+  if (comedi_do_insnlist(device->comedi.handle, &insnlist) != count) {
+    goto err_errno;
+  }
+  for (int i = 0 ; actual_value && i < count ; i++) {
+    struct channel_descriptor *descriptor =
+      &analog_out[i]->channel_context.descriptor;
+    actual_value[i] = polynomial(&descriptor->to_physical, data[i]);
+  }
+  return MOBERG_OK;
+err_errno:
+  return MOBERG_ERRNO(comedi_errno());
+}
+
 static struct moberg_status digital_in_read(
   struct moberg_channel_digital_in *digital_in,
   int *value)
@@ -165,6 +271,77 @@ err_errno:
   return MOBERG_ERRNO(comedi_errno());
 }
 
+/* Digital channels on a single subdevice within one 32 bit word can
+   be accessed with a single comedi_dio_bitfield2 */
+static int dio_word(int count,
+                    struct channel_descriptor **descriptor,
+                    int *subdevice,
+                    int *base)
+{
+  if (count <= 0) {
+    return 0;
+  }
+  int min = descriptor[0]->subchannel;
+  int max = descriptor[0]->subchannel;
+  for (int i = 0 ; i < count ; i++) {
+    if (descriptor[i]->subdevice != descriptor[0]->subdevice) {
+      return 0;
+    }
+    if (descriptor[i]->subchannel < min) { min = descriptor[i]->subchannel; }
+    if (descriptor[i]->subchannel > max) { max = descriptor[i]->subchannel; }
+  }
+  *subdevice = descriptor[0]->subdevice;
+  *base = min & ~0x1f;
+  return max - *base < 32;
+}
+
+static struct moberg_status digital_in_read_many(
+  struct moberg_device_context *device,
+  int count,
+  struct moberg_channel_digital_in **digital_in,
+  int *value)
+{
+  comedi_insn insn[count];
+  comedi_insnlist insnlist = { .n_insns=count, .insns=insn };
+  lsampl_t data[count];
+  struct channel_descriptor *descriptor[count];
+  int subdevice, base;
+
+  for (int i = 0 ; i < count ; i++) {
+    descriptor[i] = &digital_in[i]->channel_context.descriptor;
+  }
+  if (dio_word(count, descriptor, &subdevice, &base)) {
+    unsigned int bits = 0;
+    if (0 > comedi_dio_bitfield2(device->comedi.handle,
+                                 subdevice, 0, &bits, base)) {
+      goto err_errno;
+    }
+    for (int i = 0 ; i < count ; i++) {
+      value[i] = (bits >> (descriptor[i]->subchannel - base)) & 0x1;
+    }
+    return MOBERG_OK;
+  }
+  memset(insn, 0, sizeof(insn));
+  for (int i = 0 ; i < count ; i++) {
+    struct channel_descriptor *descriptor =
+      &digital_in[i]->channel_context.descriptor;
+    insn[i].insn = INSN_READ;
+    insn[i].n = 1;
+    insn[i].data = &data[i];
+    insn[i].subdev = descriptor->subdevice;
+    insn[i].chanspec = CR_PACK(descriptor->subchannel, 0, 0);
+  }
+  if (comedi_do_insnlist(device->comedi.handle, &insnlist) != count) {
+    goto err_errno;
+  }
+  for (int i = 0 ; i < count ; i++) {
+    value[i] = data[i];
+  }
+  return MOBERG_OK;
+err_errno:
+  return MOBERG_ERRNO(comedi_errno());
+}
+
 static struct moberg_status digital_out_write(
   struct moberg_channel_digital_out *digital_out,
   int desired_value,
@@ -186,6 +363,62 @@ err_errno:
   return MOBERG_ERRNO(comedi_errno());
 }
 
+static struct moberg_status digital_out_write_many(
+  struct moberg_device_context *device,
+  int count,
+  struct moberg_channel_digital_out **digital_out,
+  const int *desired_value,
+  int *actual_value)
+{
+  comedi_insn insn[count];
+  comedi_insnlist insnlist = { .n_insns=count, .insns=insn };
+  lsampl_t data[count];
+  struct channel_descriptor *descriptor[count];
+  int subdevice, base;
+
+  for (int i = 0 ; i < count ; i++) {
+    descriptor[i] = &digital_out[i]->channel_context.descriptor;
+  }
+  if (dio_word(count, descriptor, &subdevice, &base)) {
+    unsigned int mask = 0, bits = 0;
+    for (int i = 0 ; i < count ; i++) {
+      unsigned int bit = 1U << (descriptor[i]->subchannel - base);
+      mask |= bit;
+      if (desired_value[i]) {
+        bits |= bit;
+      }
+    }
+    if (0 > comedi_dio_bitfield2(device->comedi.handle,
+                                 subdevice, mask, &bits, base)) {
+      goto err_errno;
+    }
+    for (int i = 0 ; actual_value && i < count ; i++) {
+      actual_value[i] = desired_value[i]==0?0:1;
+    }
+    return MOBERG_OK;
+  }
+  memset(insn, 0, sizeof(insn));
+  for (int i = 0 ; i < count ; i++) {
+    struct channel_descriptor *descriptor =
+      &digital_out[i]->channel_context.descriptor;
+    data[i] = desired_value[i]==0?0:1;
+    insn[i].insn = INSN_WRITE;
+    insn[i].n = 1;
+    insn[i].data = &data[i];
+    insn[i].subdev = descriptor->subdevice;
+    insn[i].chanspec = CR_PACK(descriptor->subchannel, 0, 0);
+  }
+  if (comedi_do_insnlist(device->comedi.handle, &insnlist) != count) {
+    goto err_errno;
+  }
+  for (int i = 0 ; actual_value && i < count ; i++) {
+    actual_value[i] = data[i];
+  }
+  return MOBERG_OK;
+err_errno:
+  return MOBERG_ERRNO(comedi_errno());
+}
+
 static struct moberg_status encoder_in_read(struct moberg_channel_encoder_in *encoder_in,
                            long *value)
 {
@@ -206,6 +439,215 @@ err_errno:
   return MOBERG_ERRNO(comedi_errno());
 }
 
+static struct moberg_status encoder_in_read_many(
+  struct moberg_device_context *device,
+  int count,
+  struct moberg_channel_encoder_in **encoder_in,
+  long *value)
+{
+  comedi_insn insn[count];
+  comedi_insnlist insnlist = { .n_insns=count, .insns=insn };
+  lsampl_t data[count];
+
+  memset(insn, 0, sizeof(insn));
+  for (int i = 0 ; i < count ; i++) {
+    struct channel_descriptor *descriptor =
+      &encoder_in[i]->channel_context.descriptor;
+    insn[i].insn = INSN_READ;
+    insn[i].n = 1;
+    insn[i].data = &data[i];
+    insn[i].subdev = descriptor->subdevice;
+    insn[i].chanspec = CR_PACK(descriptor->subchannel, 0, 0);
+  }
+  if (comedi_do_insnlist(device->comedi.handle, &insnlist) != count) {
+    goto err_errno;
+  }
+  for (int i = 0 ; i < count ; i++) {
+    struct channel_descriptor *descriptor =
+      &encoder_in[i]->channel_context.descriptor;
+    value[i] = data[i] - descriptor->maxdata / 2;
+  }
+  return MOBERG_OK;
+err_errno:
+  return MOBERG_ERRNO(comedi_errno());
+}
+
+static struct moberg_status stream_open(
+  struct moberg_device_context *device,
+  int count,
+  struct moberg_channel_analog_in **analog_in,
+  double rate,
+  struct moberg_stream_context **stream)
+{
+  struct moberg_status result;
+  comedi_t *handle = device->comedi.handle;
+  struct moberg_stream_context *s = malloc(sizeof(*s));
+  if (! s) { goto err_enomem; }
+  memset(s, 0, sizeof(*s));
+  s->device = device;
+  s->count = count;
+  s->subdevice = analog_in[0]->channel_context.descriptor.subdevice;
+  s->descriptor = calloc(count, sizeof(*s->descriptor));
+  s->chanlist = calloc(count, sizeof(*s->chanlist));
+  if (! s->descriptor || ! s->chanlist) {
+    result = MOBERG_ERRNO(ENOMEM);
+    goto free_stream;
+  }
+  for (int i = 0 ; i < count ; i++) {
+    s->descriptor[i] = analog_in[i]->channel_context.descriptor;
+    if (s->descriptor[i].subdevice != s->subdevice) {
+      fprintf(stderr, "Streamed channels must be on one subdevice %d != %d\n",
+              s->descriptor[i].subdevice, s->subdevice);
+      result = MOBERG_ERRNO(EINVAL);
+      goto free_stream;
+    }
+    s->chanlist[i] = CR_PACK(s->descriptor[i].subchannel, 0, AREF_GROUND);
+  }
+  /* The buffer is mmap'ed and polled through the file descriptor,
+     which only reaches the read subdevice; others are left to the
+     software timed stream */
+  if (comedi_get_read_subdevice(handle) != s->subdevice) {
+    result = MOBERG_ERRNO(ENOTSUP);
+    goto free_stream;
+  }
+  comedi_cmd cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  if (0 > comedi_get_cmd_generic_timed(handle, s->subdevice, &cmd,
+                                       count, 1e9 / rate)) {
+    goto free_stream_errno;
+  }
+  cmd.chanlist = s->chanlist;
+  cmd.chanlist_len = count;
+  cmd.stop_src = TRIG_NONE;
+  cmd.stop_arg = 0;
+  /* Let the driver adjust timing arguments, then verify them */
+  comedi_command_test(handle, &cmd);
+  if (0 != comedi_command_test(handle, &cmd)) {
+    fprintf(stderr, "Unable to stream %s[%d] at %f Hz\n",
+            device->name, s->subdevice, rate);
+    result = MOBERG_ERRNO(EINVAL);
+    goto free_stream;
+  }
+  int flags = comedi_get_subdevice_flags(handle, s->subdevice);
+  if (flags < 0) { goto free_stream_errno; }
+  s->sample_size = (flags & SDF_LSAMPL) ? sizeof(lsampl_t) : sizeof(sampl_t);
+  s->buffer_size = comedi_get_buffer_size(handle, s->subdevice);
+  if (s->buffer_size <= 0) { goto free_stream_errno; }
+  s->buffer = mmap(NULL, s->buffer_size, PROT_READ, MAP_SHARED,
+                   comedi_fileno(handle), 0);
+  if (s->buffer == MAP_FAILED) {
+    s->buffer = NULL;
+    goto free_stream_errno;
+  }
+  if (0 > comedi_command(handle, &cmd)) {
+    goto free_stream_errno;
+  }
+  *stream = s;
+  return MOBERG_OK;
+free_stream_errno:
+  result = MOBERG_ERRNO(comedi_errno());
+free_stream:
+  if (s->buffer) {
+    munmap(s->buffer, s->buffer_size);
+  }
+  free(s->descriptor);
+  free(s->chanlist);
+  free(s);
+  return result;
+err_enomem:
+  return MOBERG_ERRNO(ENOMEM);
+}
+
+static struct moberg_status stream_scale(
+  struct moberg_stream_context *stream,
+  int channel,
+  double *offset,
+  double *scale)
+{
+  /* Raw samples of a higher order converter are not linear in the
+     value, moberg_stream_open then falls back to software timing */
+  struct polynomial *to_physical = &stream->descriptor[channel].to_physical;
+  if (to_physical->coefficient[2] != 0.0 ||
+      to_physical->coefficient[3] != 0.0) {
+    return MOBERG_ERRNO(ENOTSUP);
+  }
+  *offset = (to_physical->coefficient[0] -
+             to_physical->coefficient[1] * to_physical->origin);
+  *scale = to_physical->coefficient[1];
+  return MOBERG_OK;
+}
+
+static struct moberg_status stream_peek(
+  struct moberg_stream_context *stream,
+  struct moberg_stream_buffer *buffer)
+{
+  comedi_t *handle = stream->device->comedi.handle;
+  int scan_size = stream->count * stream->sample_size;
+  int available;
+
+  for (;;) {
+    available = comedi_get_buffer_contents(handle, stream->subdevice);
+    if (available < 0) { goto err_errno; }
+    if (available >= scan_size) { break; }
+    struct pollfd pollfd = { .fd=comedi_fileno(handle), .events=POLLIN };
+    int err = poll(&pollfd, 1, 1000);
+    if (err == 0) {
+      return MOBERG_ERRNO(ETIMEDOUT);
+    } else if (err < 0) {
+      return MOBERG_ERRNO(errno);
+    }
+  }
+  /* Buffer size is a multiple of the page size, so samples never wrap */
+  int contiguous = stream->buffer_size - stream->offset;
+  if (contiguous > available) {
+    contiguous = available;
+  }
+  if (stream->sample_size == sizeof(lsampl_t)) {
+    buffer->format = MOBERG_SAMPLE_UINT32;
+  } else {
+    buffer->format = MOBERG_SAMPLE_UINT16;
+  }
+  buffer->sample_size = stream->sample_size;
+  buffer->channel = stream->channel;
+  buffer->data = &stream->buffer[stream->offset];
+  buffer->length = contiguous;
+  buffer->available = available;
+  return MOBERG_OK;
+err_errno:
+  return MOBERG_ERRNO(comedi_errno());
+}
+
+static struct moberg_status stream_consume(
+  struct moberg_stream_context *stream,
+  int length)
+{
+  if (length < 0 || length % stream->sample_size) {
+    return MOBERG_ERRNO(EINVAL);
+  }
+  if (0 > comedi_mark_buffer_read(stream->device->comedi.handle,
+                                  stream->subdevice, length)) {
+    return MOBERG_ERRNO(comedi_errno());
+  }
+  stream->offset = (stream->offset + length) % stream->buffer_size;
+  stream->channel = ((stream->channel + length / stream->sample_size) %
+                     stream->count);
+  return MOBERG_OK;
+}
+
+static struct moberg_status stream_close(
+  struct moberg_stream_context *stream)
+{
+  struct moberg_status result = MOBERG_OK;
+  if (0 > comedi_cancel(stream->device->comedi.handle, stream->subdevice)) {
+    result = MOBERG_ERRNO(comedi_errno());
+  }
+  munmap(stream->buffer, stream->buffer_size);
+  free(stream->descriptor);
+  free(stream->chanlist);
+  free(stream);
+  return result;
+}
+
 static struct moberg_device_context *new_context(struct moberg *moberg,
                                                  int (*dlclose)(void *dlhandle),
                                                  void *dlhandle)
@@ -226,18 +668,17 @@ static struct moberg_device_context *new_context(struct moberg *moberg,
 
 static int device_up(struct moberg_device_context *device)
 {
-  device->use_count++;
-  return device->use_count;
+  return __atomic_add_fetch(&device->use_count, 1, __ATOMIC_ACQ_REL);
 }
 
 static int device_down(struct moberg_device_context *device)
 {
-  device->use_count--;
-  int result = device->use_count;
-  if (device->use_count <= 0) {
+  int result = __atomic_sub_fetch(&device->use_count, 1, __ATOMIC_ACQ_REL);
+  if (result <= 0) {
     moberg_deferred_action(device->moberg,
                            device->dlclose, device->dlhandle);
     free(device->name);
+    free(device->calibration.path);
     struct idstr *e;
     
     e = device->modprobe_list.next;
@@ -260,6 +701,27 @@ static int device_down(struct moberg_device_context *device)
   return result;
 }
 
+static struct moberg_status load_calibration(
+  struct moberg_device_context *device)
+{
+  char *path = device->calibration.path;
+  if (! path) {
+    path = comedi_get_default_calibration_path(device->comedi.handle);
+    if (! path) { goto err_enodata; }
+  }
+  device->comedi.calibration = comedi_parse_calibration_file(path);
+  if (! device->comedi.calibration) {
+    fprintf(stderr, "Failed to parse calibration file %s\n", path);
+  }
+  if (path != device->calibration.path) {
+    free(path);
+  }
+  if (! device->comedi.calibration) { goto err_enodata; }
+  return MOBERG_OK;
+err_enodata:
+  return MOBERG_ERRNO(ENODATA);
+}
+
 static struct moberg_status device_open(struct moberg_device_context *device)
 {
   if (device->comedi.count == 0) {
@@ -267,6 +729,13 @@ static struct moberg_status device_open(struct moberg_device_context *device)
     if (device->comedi.handle == NULL) {
       goto err_errno;
     }
+    if (device->calibration.kind == calibration_software) {
+      struct moberg_status result = load_calibration(device);
+      if (! OK(result)) {
+        comedi_close(device->comedi.handle);
+        return result;
+      }
+    }
   }
   device->comedi.count++;
   return MOBERG_OK;
@@ -279,6 +748,10 @@ static struct moberg_status device_close(struct moberg_device_context *device)
 {
   device->comedi.count--;
   if (device->comedi.count == 0) {
+    if (device->comedi.calibration) {
+      comedi_cleanup_calibration(device->comedi.calibration);
+      device->comedi.calibration = NULL;
+    }
     if (comedi_close(device->comedi.handle)) {
       goto err_errno;
     }
@@ -291,19 +764,95 @@ err_errno:
 static int channel_up(struct moberg_channel *channel)
 {
   device_up(channel->context->device);
-  channel->context->use_count++;
-  return channel->context->use_count;
+  return __atomic_add_fetch(&channel->context->use_count, 1,
+                            __ATOMIC_ACQ_REL);
 }
 
 static int channel_down(struct moberg_channel *channel)
 {
   device_down(channel->context->device);
-  channel->context->use_count--;
-  if (channel->context->use_count <= 0) {
+  int use_count = __atomic_sub_fetch(&channel->context->use_count, 1,
+                                     __ATOMIC_ACQ_REL);
+  if (use_count <= 0) {
     free(channel->context->to_free);
     return 0;
   }
-  return channel->context->use_count;
+  return use_count;
+}
+
+static struct moberg_status get_converter(
+  struct moberg_channel *channel,
+  enum comedi_conversion_direction direction,
+  struct polynomial *polynomial)
+{
+  struct moberg_device_context *device = channel->context->device;
+  struct channel_descriptor *descriptor = &channel->context->descriptor;
+  comedi_polynomial_t converter;
+  int err = 0;
+
+  switch (device->calibration.kind) {
+    case calibration_none:
+      return MOBERG_OK;
+    case calibration_hardware:
+      err = comedi_get_hardcal_converter(device->comedi.handle,
+                                         descriptor->subdevice,
+                                         descriptor->subchannel,
+                                         0, direction, &converter);
+      break;
+    case calibration_software:
+      err = comedi_get_softcal_converter(descriptor->subdevice,
+                                         descriptor->subchannel,
+                                         0, direction,
+                                         device->comedi.calibration,
+                                         &converter);
+      break;
+  }
+  if (err < 0) {
+    fprintf(stderr, "Failed to get calibration for %s[%d][%d]\n",
+            device->name, descriptor->subdevice, descriptor->subchannel);
+    goto err_enodata;
+  }
+  memset(polynomial, 0, sizeof(*polynomial));
+  polynomial->origin = converter.expansion_origin;
+  for (int i = 0 ; i <= converter.order && i < 4 ; i++) {
+    polynomial->coefficient[i] = converter.coefficients[i];
+  }
+  return MOBERG_OK;
+err_enodata:
+  return MOBERG_ERRNO(ENODATA);
+}
+
+static struct moberg_status calibrate(struct moberg_channel *channel)
+{
+  struct moberg_status result = MOBERG_OK;
+  struct channel_descriptor *descriptor = &channel->context->descriptor;
+
+  /* Nominal range, outputs are truncated */
+  descriptor->to_physical = (struct polynomial) {
+    .origin=0.0,
+    .coefficient={ descriptor->min, descriptor->delta, 0.0, 0.0 }
+  };
+  descriptor->from_physical = (struct polynomial) {
+    .origin=descriptor->min,
+    .coefficient={ 0.0, 1.0 / descriptor->delta, 0.0, 0.0 }
+  };
+  if (channel->kind == chan_ANALOGIN) {
+    result = get_converter(channel, COMEDI_TO_PHYSICAL,
+                           &descriptor->to_physical);
+  } else if (channel->kind == chan_ANALOGOUT) {
+    result = get_converter(channel, COMEDI_TO_PHYSICAL,
+                           &descriptor->to_physical);
+    if (! OK(result)) { goto return_result; }
+    result = get_converter(channel, COMEDI_FROM_PHYSICAL,
+                           &descriptor->from_physical);
+    if (! OK(result)) { goto return_result; }
+    if (channel->context->device->calibration.kind != calibration_none) {
+      /* Round like comedi_from_physical */
+      descriptor->from_physical.coefficient[0] += 0.5;
+    }
+  }
+return_result:
+  return result;
 }
 
 static struct moberg_status channel_open(struct moberg_channel *channel)
@@ -340,6 +889,8 @@ static struct moberg_status channel_open(struct moberg_channel *channel)
   channel->context->descriptor.min = range->min;
   channel->context->descriptor.max = range->max;
   channel->context->descriptor.delta = (range->max - range->min) / maxdata;
+  result = calibrate(channel);
+  if (! OK(result)) { goto err_result; }
   if (channel->kind == chan_DIGITALIN) {
     if (0 > comedi_dio_config(channel->context->device->comedi.handle,
                               channel->context->descriptor.subdevice,
@@ -464,6 +1015,23 @@ static struct moberg_status parse_config(
       if (! acceptsym(c, tok_SEMICOLON, NULL)) { goto syntax_err; }
       device->name = strndup(name.u.idstr.value, name.u.idstr.length);
       if (! device->name) { goto err_enomem; }
+    } else if (acceptkeyword(c, "calibration")) {
+      token_t path;
+      if (! acceptsym(c, tok_EQUAL, NULL)) { goto syntax_err; }
+      if (acceptkeyword(c, "hardware")) {
+        device->calibration.kind = calibration_hardware;
+      } else if (acceptkeyword(c, "software")) {
+        device->calibration.kind = calibration_software;
+      } else if (acceptsym(c, tok_STRING, &path)) {
+        device->calibration.kind = calibration_software;
+        free(device->calibration.path);
+        device->calibration.path = strndup(path.u.idstr.value,
+                                           path.u.idstr.length);
+        if (! device->calibration.path) { goto err_enomem; }
+      } else {
+        goto syntax_err;
+      }
+      if (! acceptsym(c, tok_SEMICOLON, NULL)) { goto syntax_err; }
     } else if (acceptkeyword(c, "config")) {
       if (! acceptsym(c, tok_EQUAL, NULL)) { goto syntax_err; }
       if (! acceptsym(c, tok_LBRACKET, NULL)) { goto syntax_err; }
@@ -673,5 +1241,18 @@ struct moberg_device_driver moberg_device_driver = {
   .parse_config=parse_config,
   .parse_map=parse_map,
   .start=start,
-  .stop=stop
+  .stop=stop,
+  .analog_in_read_many=analog_in_read_many,
+  .digital_in_read_many=digital_in_read_many,
+  .encoder_in_read_many=encoder_in_read_many,
+  .analog_out_write_many=analog_out_write_many,
+  .digital_out_write_many=digital_out_write_many,
+  .stream_open=stream_open,
+  .stream_scale=stream_scale,
+  .stream_peek=stream_peek,
+  .stream_consume=stream_consume,
+  .stream_close=stream_close,
+  /* I/O is done with comedi ioctls on per call buffers, device state
+     is only changed by open/close */
+  .reentrant=1
 };
@@ -141,6 +141,43 @@ static struct moberg_status digital_out_write(
   return MOBERG_OK;
 }
 
+static struct moberg_status digital_in_read_many(
+  struct moberg_device_context *device,
+  int count,
+  struct moberg_channel_digital_in **digital_in,
+  int *value)
+{
+  int digital = device->digital;
+  for (int i = 0 ; i < count ; i++) {
+    int mask = (1<<digital_in[i]->channel_context.index);
+    value[i] = (digital & mask) != 0;
+  }
+  return MOBERG_OK;
+}
+
+static struct moberg_status digital_out_write_many(
+  struct moberg_device_context *device,
+  int count,
+  struct moberg_channel_digital_out **digital_out,
+  const int *desired_value,
+  int *actual_value)
+{
+  int digital = device->digital;
+  for (int i = 0 ; i < count ; i++) {
+    int mask = (1<<digital_out[i]->channel_context.index);
+    if (desired_value[i]) {
+      digital |= mask;
+    } else {
+      digital &= ~mask;
+    }
+    if (actual_value) {
+      actual_value[i] = desired_value[i];
+    }
+  }
+  device->digital = digital;
+  return MOBERG_OK;
+}
+
 static struct moberg_status encoder_in_read(
   struct moberg_channel_encoder_in *encoder_in,
   long *value)
@@ -171,20 +208,20 @@ static struct moberg_device_context *new_context(struct moberg *moberg,
 
 static int device_up(struct moberg_device_context *context)
 {
-  context->use_count++;
-  return context->use_count;
+  return __atomic_add_fetch(&context->use_count, 1, __ATOMIC_ACQ_REL);
 }
 
 static int device_down(struct moberg_device_context *context)
 {
-  context->use_count--;
-  if (context->use_count <= 0) {
+  int use_count = __atomic_sub_fetch(&context->use_count, 1,
+                                     __ATOMIC_ACQ_REL);
+  if (use_count <= 0) {
     moberg_deferred_action(context->moberg,
                            context->dlclose, context->dlhandle);
     free(context);
     return 0;
   }
-  return context->use_count;
+  return use_count;
 }
 
 static struct moberg_status device_open(struct moberg_device_context *device)
@@ -200,19 +237,20 @@ static struct moberg_status device_close(struct moberg_device_context *device)
 static int channel_up(struct moberg_channel *channel)
 {
   device_up(channel->context->device);
-  channel->context->use_count++;
-  return channel->context->use_count;
+  return __atomic_add_fetch(&channel->context->use_count, 1,
+                            __ATOMIC_ACQ_REL);
 }
 
 static int channel_down(struct moberg_channel *channel)
 {
   device_down(channel->context->device);
-  channel->context->use_count--;
-  if (channel->context->use_count <= 0) {
+  int use_count = __atomic_sub_fetch(&channel->context->use_count, 1,
+                                     __ATOMIC_ACQ_REL);
+  if (use_count <= 0) {
     free(channel->context->to_free);
     return 0;
   }
-  return channel->context->use_count;
+  return use_count;
 }
 
 static struct moberg_status channel_open(struct moberg_channel *channel)
@@ -397,5 +435,7 @@ struct moberg_device_driver moberg_device_driver = {
   .parse_config=parse_config,
   .parse_map=parse_map,
   .start=start,
-  .stop=stop
+  .stop=stop,
+  .digital_in_read_many=digital_in_read_many,
+  .digital_out_write_many=digital_out_write_many
 };
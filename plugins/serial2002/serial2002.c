@@ -28,9 +28,11 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <time.h>
 #include <errno.h>
+#include <pthread.h>
 #include <moberg.h>
 #include <moberg_config.h>
 #include <moberg_device.h>
@@ -39,6 +41,13 @@
 #include <moberg_parser.h>
 #include <serial2002_lib.h>
 
+/* Input polling state, only open inputs are polled */
+struct poll {
+  int open;       /* Number of opens of the channel */
+  int fresh;      /* Opened but not yet polled, poll regardless of decimation */
+  int decimation; /* Poll every decimation'th sweep (0 and 1 -> every) */
+};
+
 struct moberg_device_context {
   struct moberg *moberg;
   int (*dlclose)(void *dlhandle);
@@ -49,8 +58,27 @@ struct moberg_device_context {
     char *name;
     int baud;
     long timeout;
+    int depth;
+    int deferred; /* Outputs are emitted by flush */
+    int cache;    /* Keep the device configuration in a cache file */
+    int read_buffer;
+    int write_buffer;
+    int vmin;
+    int vtime;         /* 1/10 s */
+    int latency_timer; /* ms, USB serial adapters, 0 -> leave as is */
     struct serial2002_io io;
+    struct serial2002_io out; /* Separate write buffer for outputs */
   } port;
+  struct linger {
+    long timeout; /* Keep the port open this long after last close */
+    int lingering;
+    long long deadline;
+    int running;
+    int stop;
+    pthread_t thread;
+    pthread_mutex_t lock; /* Protects port open/close */
+    pthread_cond_t cond;
+  } linger;
   struct remap_analog {
     int count;
     struct analog_map {
@@ -59,20 +87,66 @@ struct moberg_device_context {
       double min;
       double max;
       double delta;
+      struct poll poll;
     } map[31];
   } analog_in, analog_out;
   struct remap_digital {
     int count;
     struct digital_map {
       unsigned char index;
+      struct poll poll;
     } map[32];
   } digital_in, digital_out, encoder_in;
   struct batch {
     int active;
-    struct timespec expires;
+    int valid;
+    unsigned long generation;
+    unsigned long sweep;
     struct serial2002_data digital[32];
     struct serial2002_data channel[32];
+    struct {
+      char digital[32];
+      char channel[32];
+    } consumed;
+    /* shared_reactor: polls are sent by the sample hook and replies
+       matched in the libmoberg reactor thread, under lock */
+    int shared;
+    int watched; /* Port fd is registered with the reactor */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct pending {
+      int active;
+      int error;
+      unsigned long generation;
+      long long deadline;
+      int count;
+      int sent;
+      int received;
+      int oldest;
+      int stray;
+      struct serial2002_data request[32 + 31];
+      struct poll *polled[32 + 31];
+      char done[32 + 31];
+    } pending;
   } batch;
+  struct reader {
+    int active;
+    long max_age;
+    unsigned long sweep;
+    pthread_t thread;
+    int stop;
+    int error;            /* Of the port, see poll_error */
+    int wake;             /* An input was opened */
+    pthread_mutex_t lock; /* Protects stop and wake */
+    pthread_cond_t cond;  /* Signals wake, stop and cleared fresh polls */
+    /* Written by the reader thread only, sequence is odd during update */
+    struct latest {
+      unsigned int sequence;
+      unsigned long value;
+      long long stamp;
+      int error;          /* Of the last poll, value and stamp are kept */
+    } digital[32], channel[32];
+  } reader;
 };
 
 struct moberg_channel_context {
@@ -107,30 +181,409 @@ struct moberg_channel_encoder_in {
   struct moberg_channel_context channel_context;
 };
 
-static struct timespec timespec_sub(struct timespec t1, struct timespec t2)
+static long long monotonic_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void latest_publish(struct latest *latest,
+                           unsigned long value,
+                           long long stamp,
+                           int error)
+{
+  unsigned int sequence = __atomic_load_n(&latest->sequence, __ATOMIC_RELAXED);
+  __atomic_store_n(&latest->sequence, sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  if (! error) {
+    __atomic_store_n(&latest->value, value, __ATOMIC_RELAXED);
+    __atomic_store_n(&latest->stamp, stamp, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&latest->error, error, __ATOMIC_RELAXED);
+  __atomic_store_n(&latest->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+static struct moberg_status latest_value(
+  struct moberg_device_context *device,
+  struct latest *latest,
+  unsigned long *value)
+{
+  unsigned int before, after;
+  long long stamp;
+  int error;
+  do {
+    before = __atomic_load_n(&latest->sequence, __ATOMIC_ACQUIRE);
+    *value = __atomic_load_n(&latest->value, __ATOMIC_RELAXED);
+    stamp = __atomic_load_n(&latest->stamp, __ATOMIC_RELAXED);
+    error = __atomic_load_n(&latest->error, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    after = __atomic_load_n(&latest->sequence, __ATOMIC_RELAXED);
+  } while ((before & 1) || before != after);
+  int port_error = __atomic_load_n(&device->reader.error, __ATOMIC_ACQUIRE);
+  if (port_error) {
+    return MOBERG_ERRNO(port_error);
+  } else if (error) {
+    return MOBERG_ERRNO(error);
+  }
+  if (device->reader.max_age &&
+      monotonic_ns() - stamp > device->reader.max_age * 1000LL) {
+    return MOBERG_ERRNO(ETIMEDOUT);
+  }
+  return MOBERG_OK;
+}
+
+static int poll_due(struct poll *poll, unsigned long sweep, int all)
+{
+  if (__atomic_load_n(&poll->open, __ATOMIC_ACQUIRE) <= 0) {
+    return 0;
+  } else if (__atomic_load_n(&poll->fresh, __ATOMIC_ACQUIRE)) {
+    return 1;
+  } else {
+    return all && (poll->decimation <= 1 || sweep % poll->decimation == 0);
+  }
+}
+
+/* Requests for the open inputs due in sweep (only fresh ones unless
+   all), polled[i] is the polling state of request[i] */
+static int poll_set(struct moberg_device_context *device,
+                    unsigned long sweep,
+                    int all,
+                    struct serial2002_data *request,
+                    struct poll **polled)
+{
+  int count = 0;
+  for (int i = 0 ; i < device->digital_in.count ; i++) {
+    struct digital_map *map = &device->digital_in.map[i];
+    if (poll_due(&map->poll, sweep, all)) {
+      request[count] = (struct serial2002_data){ is_digital, map->index, 0 };
+      polled[count] = &map->poll;
+      count++;
+    }
+  }
+  for (int i = 0 ; i < device->analog_in.count ; i++) {
+    struct analog_map *map = &device->analog_in.map[i];
+    if (poll_due(&map->poll, sweep, all)) {
+      request[count] = (struct serial2002_data){ is_channel, map->index, 0 };
+      polled[count] = &map->poll;
+      count++;
+    }
+  }
+  for (int i = 0 ; i < device->encoder_in.count ; i++) {
+    struct digital_map *map = &device->encoder_in.map[i];
+    if (poll_due(&map->poll, sweep, all)) {
+      request[count] = (struct serial2002_data){ is_channel, map->index, 0 };
+      polled[count] = &map->poll;
+      count++;
+    }
+  }
+  return count;
+}
+
+/* Lost, late or garbled replies, that only fail the polls without a
+   reply. Other errors are errors of the port */
+static int poll_error(int error)
+{
+  return (error == ETIMEDOUT || error == ECHRNG ||
+          error == EINVAL || error == EFBIG);
+}
+
+static struct moberg_status reader_sweep(struct moberg_device_context *device,
+                                         int *count)
 {
-  struct timespec result;
-  result.tv_sec = t1.tv_sec - t2.tv_sec;
-  result.tv_nsec = t1.tv_nsec - t2.tv_nsec;
-  if (result.tv_nsec < 0) {
-    result.tv_sec--;
-    result.tv_nsec += 1000000000L;
+  struct serial2002_data request[32 + 31];
+  struct poll *polled[32 + 31];
+  struct latest *latest[32 + 31];
+  *count = poll_set(device, device->reader.sweep, 1, request, polled);
+  device->reader.sweep++;
+  for (int i = 0 ; i < *count ; i++) {
+    if (request[i].kind == is_digital) {
+      latest[i] = &device->reader.digital[request[i].index];
+    } else {
+      latest[i] = &device->reader.channel[request[i].index];
+    }
+  }
+  struct moberg_status result =
+    serial2002_transact(&device->port.io, device->port.timeout,
+                        device->port.depth, *count, request);
+  if (OK(result) || poll_error(result.result)) {
+    long long stamp = monotonic_ns();
+    int cleared = 0;
+    for (int i = 0 ; i < *count ; i++) {
+      if (request[i].kind == is_invalid) {
+        /* No reply, reads fail until the next one */
+        latest_publish(latest[i], 0, 0, result.result);
+      } else {
+        latest_publish(latest[i], request[i].value, stamp, 0);
+        if (__atomic_exchange_n(&polled[i]->fresh, 0, __ATOMIC_ACQ_REL)) {
+          cleared = 1;
+        }
+      }
+    }
+    if (cleared) {
+      /* Wake reader_wait */
+      pthread_mutex_lock(&device->reader.lock);
+      pthread_cond_broadcast(&device->reader.cond);
+      pthread_mutex_unlock(&device->reader.lock);
+    }
+    __atomic_store_n(&device->reader.error, 0, __ATOMIC_RELEASE);
+  } else {
+    __atomic_store_n(&device->reader.error, result.result, __ATOMIC_RELEASE);
   }
   return result;
 }
 
-static struct timespec timespec_add(struct timespec t1, struct timespec t2)
+static void *reader_thread(void *arg)
 {
-  struct timespec result;
-  result.tv_sec = t1.tv_sec + t2.tv_sec;
-  result.tv_nsec = t1.tv_nsec + t2.tv_nsec;
-  if (result.tv_nsec > 1000000000L) {
-    result.tv_sec++;
-    result.tv_nsec -= 1000000000L;
+  struct moberg_device_context *device = arg;
+
+  pthread_mutex_lock(&device->reader.lock);
+  while (! device->reader.stop) {
+    device->reader.wake = 0;
+    pthread_mutex_unlock(&device->reader.lock);
+    int count;
+    struct moberg_status result = reader_sweep(device, &count);
+    pthread_mutex_lock(&device->reader.lock);
+    if (! OK(result) && ! poll_error(result.result)) {
+      /* Don't spin on port errors */
+      long long backoff = monotonic_ns() + device->port.timeout * 1000LL;
+      struct timespec deadline = { backoff / 1000000000LL,
+                                   backoff % 1000000000LL };
+      if (! device->reader.stop) {
+        pthread_cond_timedwait(&device->reader.cond, &device->reader.lock,
+                               &deadline);
+      }
+    } else if (count == 0) {
+      /* Nothing open, wait for reader_wake */
+      while (! device->reader.stop && ! device->reader.wake) {
+        pthread_cond_wait(&device->reader.cond, &device->reader.lock);
+      }
+    }
+  }
+  pthread_mutex_unlock(&device->reader.lock);
+  return NULL;
+}
+
+static void reader_wake(struct moberg_device_context *device, int stop)
+{
+  pthread_mutex_lock(&device->reader.lock);
+  if (stop) {
+    device->reader.stop = 1;
+  } else {
+    device->reader.wake = 1;
   }
+  pthread_cond_broadcast(&device->reader.cond);
+  pthread_mutex_unlock(&device->reader.lock);
+}
+
+/* Wait for the first sweep that includes a newly opened input */
+static struct moberg_status reader_wait(struct moberg_device_context *device,
+                                        struct poll *poll)
+{
+  struct moberg_status result = MOBERG_OK;
+  long long deadline = monotonic_ns() +
+    (32 + 31 + 1) * device->port.timeout * 1000LL;
+  struct timespec timeout = { deadline / 1000000000LL,
+                              deadline % 1000000000LL };
+  pthread_mutex_lock(&device->reader.lock);
+  while (__atomic_load_n(&poll->fresh, __ATOMIC_ACQUIRE)) {
+    if (pthread_cond_timedwait(&device->reader.cond, &device->reader.lock,
+                               &timeout) == ETIMEDOUT &&
+        __atomic_load_n(&poll->fresh, __ATOMIC_ACQUIRE)) {
+      result = MOBERG_ERRNO(ETIMEDOUT);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&device->reader.lock);
   return result;
 }
 
+/* Sends the next polls of the pending batch, keeping at most
+   port.depth in flight. Called with batch.lock held */
+static struct moberg_status shared_send(struct moberg_device_context *device)
+{
+  struct pending *pending = &device->batch.pending;
+  int depth = device->port.depth < 1 ? 1 : device->port.depth;
+  if (pending->sent >= pending->count ||
+      pending->sent - pending->received >= depth) {
+    return MOBERG_OK;
+  }
+  while (pending->sent < pending->count &&
+         pending->sent - pending->received < depth) {
+    struct serial2002_data *request = &pending->request[pending->sent];
+    struct moberg_status result;
+    if (request->kind == is_digital) {
+      result = serial2002_poll_digital(&device->port.io, request->index, 0);
+    } else {
+      result = serial2002_poll_channel(&device->port.io, request->index, 0);
+    }
+    if (! OK(result)) { return result; }
+    pending->sent++;
+  }
+  return serial2002_flush(&device->port.io);
+}
+
+/* Called with batch.lock held */
+static void shared_done(struct moberg_device_context *device, int error)
+{
+  struct pending *pending = &device->batch.pending;
+  if (! error) {
+    for (int i = 0 ; i < pending->count ; i++) {
+      if (pending->request[i].kind == is_digital) {
+        device->batch.digital[pending->request[i].index] = pending->request[i];
+      } else {
+        device->batch.channel[pending->request[i].index] = pending->request[i];
+      }
+      __atomic_store_n(&pending->polled[i]->fresh, 0, __ATOMIC_RELEASE);
+    }
+    device->batch.valid = 1;
+    device->batch.generation = pending->generation;
+  } else {
+    /* Late replies must not be matched by the next batch */
+    device->port.io.dirty = 1;
+  }
+  pending->error = error;
+  pending->active = 0;
+  pthread_cond_broadcast(&device->batch.cond);
+}
+
+/* Starts a new batch, called with batch.lock held */
+static struct moberg_status shared_start(struct moberg_device_context *device,
+                                         unsigned long generation)
+{
+  struct pending *pending = &device->batch.pending;
+  int depth = device->port.depth < 1 ? 1 : device->port.depth;
+
+  if (device->port.io.dirty) {
+    serial2002_discard(&device->port.io);
+  }
+  pending->count = poll_set(device, device->batch.sweep, 1,
+                            pending->request, pending->polled);
+  device->batch.valid = 0;
+  device->batch.sweep++;
+  memset(&device->batch.consumed, 0, sizeof(device->batch.consumed));
+  memset(pending->done, 0, sizeof(pending->done));
+  pending->generation = generation;
+  pending->deadline = monotonic_ns() +
+    (pending->count / depth + 1) * device->port.timeout * 1000LL;
+  pending->sent = 0;
+  pending->received = 0;
+  pending->oldest = 0;
+  pending->stray = 0;
+  pending->active = 1;
+  if (pending->count == 0) {
+    shared_done(device, 0);
+    return MOBERG_OK;
+  }
+  struct moberg_status result = shared_send(device);
+  if (! OK(result)) {
+    shared_done(device, result.result);
+  }
+  return result;
+}
+
+/* Reactor callback, matches replies like serial2002_transact */
+static struct moberg_status shared_ready(void *context)
+{
+  struct moberg_device_context *device = context;
+  struct pending *pending = &device->batch.pending;
+  struct moberg_status result = MOBERG_OK;
+
+  pthread_mutex_lock(&device->batch.lock);
+  for (;;) {
+    struct serial2002_data frame[32];
+    int frames;
+    result = serial2002_read_frames(&device->port.io, 0, frame, 32, &frames);
+    if (result.result == ETIMEDOUT) {
+      /* Drained */
+      result = MOBERG_OK;
+      break;
+    } else if (result.result == EINVAL || result.result == EFBIG) {
+      /* Protocol error, fail the batch but keep listening */
+      if (pending->active) {
+        shared_done(device, result.result);
+      }
+      continue;
+    } else if (! OK(result)) {
+      if (pending->active) {
+        shared_done(device, result.result);
+      }
+      break;
+    }
+    for (int f = 0 ; f < frames && pending->active ; f++) {
+      int i;
+      for (i = pending->oldest ; i < pending->sent ; i++) {
+        if (! pending->done[i] &&
+            pending->request[i].kind == frame[f].kind &&
+            pending->request[i].index == frame[f].index) {
+          break;
+        }
+      }
+      if (i < pending->sent) {
+        pending->request[i].value = frame[f].value;
+        pending->done[i] = 1;
+        pending->received++;
+        while (pending->oldest < pending->sent &&
+               pending->done[pending->oldest]) {
+          pending->oldest++;
+        }
+      } else {
+        pending->stray++;
+        if (pending->stray > pending->count) {
+          shared_done(device, ECHRNG);
+        }
+      }
+    }
+    if (pending->active) {
+      if (pending->received == pending->count) {
+        shared_done(device, 0);
+      } else {
+        struct moberg_status sent = shared_send(device);
+        if (! OK(sent)) {
+          shared_done(device, sent.result);
+        }
+      }
+    }
+  }
+  pthread_mutex_unlock(&device->batch.lock);
+  return result;
+}
+
+/* Waits for the batch of generation, starting it unless the sample
+   hook already did. Called with batch.lock held */
+static struct moberg_status shared_wait(struct moberg_device_context *device,
+                                        unsigned long generation)
+{
+  struct pending *pending = &device->batch.pending;
+
+  if (generation == 0 ||
+      (device->batch.valid && device->batch.generation == generation)) {
+    /* Never advanced (sampled on demand), or already sampled */
+    return MOBERG_OK;
+  }
+  if (! pending->active || pending->generation != generation) {
+    struct moberg_status result = shared_start(device, generation);
+    if (! OK(result)) { return result; }
+  }
+  while (pending->active) {
+    struct timespec deadline = { pending->deadline / 1000000000LL,
+                                 pending->deadline % 1000000000LL };
+    if (pthread_cond_timedwait(&device->batch.cond, &device->batch.lock,
+                               &deadline) == ETIMEDOUT) {
+      shared_done(device, ETIMEDOUT);
+    }
+  }
+  if (pending->error) {
+    return MOBERG_ERRNO(pending->error);
+  }
+  return MOBERG_OK;
+}
+
+/* A batch is sampled at most once per cycle generation (see
+   moberg_advance_generation). Callers that never advance the generation
+   get a new batch when a channel is read a second time. Only open
+   inputs that are due according to their decimation are polled, the
+   others keep their latest value. */
 static struct moberg_status batch_sampling(
   struct moberg_device_context *device,
   struct analog_map *analog,
@@ -143,85 +596,80 @@ static struct moberg_status batch_sampling(
     result = MOBERG_ERRNO(EINVAL);
     goto return_result;
   }
-  struct timespec start, diff;
-  if (clock_gettime(CLOCK_REALTIME, &start) < 0) {
-    result = MOBERG_ERRNO(errno);
+  struct serial2002_data *sample = NULL;
+  char *consumed = NULL;
+  struct poll *poll = NULL;
+  if (digital) {
+    sample = &device->batch.digital[digital->index];
+    consumed = &device->batch.consumed.digital[digital->index];
+    poll = &digital->poll;
+  } else if (analog) {
+    sample = &device->batch.channel[analog->index];
+    consumed = &device->batch.consumed.channel[analog->index];
+    poll = &analog->poll;
+  } else if (encoder) {
+    sample = &device->batch.channel[encoder->index];
+    consumed = &device->batch.consumed.channel[encoder->index];
+    poll = &encoder->poll;
+  } else {
+    result = MOBERG_ERRNO(EINVAL);
     goto return_result;
   }
-  diff = timespec_sub(device->batch.expires, start);
-  if (diff.tv_sec < 0 ||
-      (digital && device->batch.digital[digital->index].kind != is_digital) ||
-      (analog && device->batch.channel[analog->index].kind != is_channel) ||
-      (encoder && device->batch.channel[encoder->index].kind != is_channel)) {
-    /* Batch has expired */
-    int expected = 0;
-    for (int i = 0 ; i < device->digital_in.count ; i++) {
-      struct digital_map *map = &device->digital_in.map[i];
-      device->batch.digital[map->index].kind = is_invalid;
-      expected++;
-      result = serial2002_poll_digital(&device->port.io, map->index, 0);
-      if (! OK(result)) {
-        goto return_result;
-      }
-    }
-    for (int i = 0 ; i < device->analog_in.count ; i++) {
-      struct analog_map *map = &device->analog_in.map[i];
-      device->batch.channel[map->index].kind = is_invalid;
-      expected++;
-      result = serial2002_poll_channel(&device->port.io, map->index, 0);
-      if (! OK(result)) {
-        goto return_result;
-      }
+  unsigned long generation = moberg_generation(device->moberg);
+  if (device->batch.shared) {
+    pthread_mutex_lock(&device->batch.lock);
+    result = shared_wait(device, generation);
+    if (! OK(result)) { goto unlock; }
+  }
+  int all;
+  if (! device->batch.valid) {
+    all = 1;
+  } else if (generation) {
+    all = device->batch.generation != generation;
+  } else {
+    all = *consumed;
+  }
+  if (all || __atomic_load_n(&poll->fresh, __ATOMIC_ACQUIRE) ||
+      sample->kind == is_invalid) {
+    /* New batch, or only the newly opened channels */
+    struct serial2002_data request[32 + 31];
+    struct poll *polled[32 + 31];
+    int count = poll_set(device, device->batch.sweep, all, request, polled);
+    if (all) {
+      device->batch.valid = 0;
+      device->batch.sweep++;
+      memset(&device->batch.consumed, 0, sizeof(device->batch.consumed));
     }
-    for (int i = 0 ; i < device->encoder_in.count ; i++) {
-      struct digital_map *map = &device->encoder_in.map[i];
-      device->batch.channel[map->index].kind = is_invalid;
-      expected++;
-      result = serial2002_poll_channel(&device->port.io, map->index, 0);
-      if (! OK(result)) {
-        goto return_result;
-      }
+    result = serial2002_transact(&device->port.io, device->port.timeout,
+                                 device->port.depth, count, request);
+    if (! OK(result)) {
+      goto unlock;
     }
-    serial2002_flush(&device->port.io);
-    while (expected > 0) {
-      struct serial2002_data data;
-      result = serial2002_read(&device->port.io, device->port.timeout, &data);
-      if (! OK(result)) {
-        goto return_result;
-      }
-      if (data.kind == is_digital) {
-        device->batch.digital[data.index] = data;
-        expected--;
-      } else if (data.kind == is_channel) {
-        device->batch.channel[data.index] = data;
-        expected--;
+    for (int i = 0 ; i < count ; i++) {
+      if (request[i].kind == is_digital) {
+        device->batch.digital[request[i].index] = request[i];
       } else {
-        result = MOBERG_ERRNO(EINVAL);
-        goto return_result;
+        device->batch.channel[request[i].index] = request[i];
       }
+      __atomic_store_n(&polled[i]->fresh, 0, __ATOMIC_RELEASE);
     }
-    struct timespec now;
-    if (clock_gettime(CLOCK_REALTIME, &now) < 0) {
-      result = MOBERG_ERRNO(errno);
-      goto return_result;
+    if (all) {
+      device->batch.valid = 1;
+      device->batch.generation = generation;
     }
-    diff = timespec_sub(now, start);
-    device->batch.expires = timespec_add(now, diff);
   }
-  if (digital &&
-      device->batch.digital[digital->index].kind == is_digital) {
-    *data = device->batch.digital[digital->index];
-    device->batch.digital[digital->index].kind = is_invalid;
-  } else if (analog &&
-             device->batch.channel[analog->index].kind == is_channel) {
-    *data = device->batch.channel[analog->index];
-    device->batch.channel[analog->index].kind = is_invalid;
-  } else if (encoder &&
-             device->batch.channel[encoder->index].kind == is_channel) {
-    *data = device->batch.channel[encoder->index];
-    device->batch.channel[encoder->index].kind = is_invalid;
+  if (sample->kind == is_invalid) {
+    result = MOBERG_ERRNO(ECHRNG);
+    goto unlock;
   }
+  *data = *sample;
+  /* Reading it again without a new generation starts the next batch */
+  *consumed = 1;
 
+unlock:
+  if (device->batch.shared) {
+    pthread_mutex_unlock(&device->batch.lock);
+  }
 return_result:
   return result;
 }
@@ -235,56 +683,159 @@ static struct moberg_status analog_in_read(
   struct moberg_channel_context *channel = &analog_in->channel_context;
   struct moberg_device_context *device = channel->device;
   struct serial2002_data data;
-  struct analog_map map = device->analog_in.map[channel->index];
+  struct analog_map *map = &device->analog_in.map[channel->index];
   struct moberg_status result;
 
-  if (device->batch.active) {
-    result = batch_sampling(device, &map,  NULL, NULL, &data);
+  if (device->reader.active) {
+    result = latest_value(device, &device->reader.channel[map->index],
+                          &data.value);
     if (! OK(result)) { goto return_result; }
-  } else {
-    result = serial2002_poll_channel(&device->port.io, map.index, 1);
+  } else if (device->batch.active) {
+    result = batch_sampling(device, map,  NULL, NULL, &data);
     if (! OK(result)) { goto return_result; }
-    result = serial2002_read(&device->port.io, device->port.timeout, &data);
+  } else {
+    data = (struct serial2002_data){ is_channel, map->index, 0 };
+    result = serial2002_transact(&device->port.io, device->port.timeout,
+                                 device->port.depth, 1, &data);
     if (! OK(result)) { goto return_result; }
-    if ((data.kind != is_channel) || (data.index != map.index)) {
-      result = MOBERG_ERRNO(ECHRNG);
-      goto return_result;
-    }
   }
-  *value = (data.value * map.delta + map.min);
+  *value = (data.value * map->delta + map->min);
 return_result:
   return result;
 err_einval:
   return MOBERG_ERRNO(EINVAL);
 }
 
-static struct moberg_status analog_out_write(
-  struct moberg_channel_analog_out *analog_out,
-  double desired_value,
-  double *actual_value)
+static struct moberg_status analog_in_read_many(
+  struct moberg_device_context *device,
+  int count,
+  struct moberg_channel_analog_in **analog_in,
+  double *value)
+{
+  struct moberg_status result = MOBERG_OK;
+  uint32_t raw[count];
+  double offset[count], scale[count];
+
+  if (count <= 0) { goto return_result; }
+  for (int i = 0 ; i < count ; i++) {
+    struct analog_map *map =
+      &device->analog_in.map[analog_in[i]->channel_context.index];
+    offset[i] = map->min;
+    scale[i] = map->delta;
+  }
+  if (device->reader.active) {
+    for (int i = 0 ; i < count ; i++) {
+      unsigned long latest;
+      struct analog_map *map =
+        &device->analog_in.map[analog_in[i]->channel_context.index];
+      result = latest_value(device, &device->reader.channel[map->index],
+                            &latest);
+      if (! OK(result)) { goto return_result; }
+      raw[i] = latest;
+    }
+  } else if (device->batch.active) {
+    for (int i = 0 ; i < count ; i++) {
+      struct serial2002_data data;
+      struct analog_map *map =
+        &device->analog_in.map[analog_in[i]->channel_context.index];
+      result = batch_sampling(device, map,  NULL, NULL, &data);
+      if (! OK(result)) { goto return_result; }
+      raw[i] = data.value;
+    }
+  } else {
+    struct serial2002_data request[count];
+    for (int i = 0 ; i < count ; i++) {
+      struct analog_map *map =
+        &device->analog_in.map[analog_in[i]->channel_context.index];
+      request[i] = (struct serial2002_data){ is_channel, map->index, 0 };
+    }
+    result = serial2002_transact(&device->port.io, device->port.timeout,
+                                 device->port.depth, count, request);
+    if (! OK(result)) { goto return_result; }
+    for (int i = 0 ; i < count ; i++) {
+      raw[i] = request[i].value;
+    }
+  }
+  result = moberg_convert_uint32_to_double(count, raw, value,
+                                           count, 0, offset, scale);
+return_result:
+  return result;
+}
+
+static long analog_out_value(struct analog_map *map,
+                             double desired_value)
 {
-  struct moberg_channel_context *channel = &analog_out->channel_context;
-  struct moberg_device_context *device = channel->device;
-  struct analog_map map = device->analog_out.map[channel->index];
   long as_long;
-  if (desired_value < map.min) {
+  if (desired_value < map->min) {
     as_long = 0;
-  } else if (desired_value > map.max) {
-    as_long = map.maxdata;
+  } else if (desired_value > map->max) {
+    as_long = map->maxdata;
   } else {
-    as_long = (desired_value - map.min) / map.delta;
+    as_long = (desired_value - map->min) / map->delta;
   }
   if (as_long < 0) {
     as_long = 0;
-  } else if (as_long > map.maxdata) {
-    as_long = map.maxdata;
+  } else if (as_long > map->maxdata) {
+    as_long = map->maxdata;
+  }
+  return as_long;
+}
+
+static struct moberg_status analog_out_write(
+  struct moberg_channel_analog_out *analog_out,
+  double desired_value,
+  double *actual_value)
+{
+  struct moberg_channel_context *channel = &analog_out->channel_context;
+  struct moberg_device_context *device = channel->device;
+  struct analog_map *map = &device->analog_out.map[channel->index];
+  struct serial2002_data data = { is_channel, map->index,
+                                  analog_out_value(map, desired_value) };
+  struct moberg_status result = serial2002_write(&device->port.out,  data,
+                                                 ! device->port.deferred);
+  if (OK(result) && actual_value) {
+    *actual_value = data.value * map->delta + map->min;    
   }
+  return result;
+}
 
-  struct serial2002_data data = { is_channel, map.index, as_long };
-  struct moberg_status result = serial2002_write(&device->port.io,  data, 1);
+static struct moberg_status analog_out_write_many(
+  struct moberg_device_context *device,
+  int count,
+  struct moberg_channel_analog_out **analog_out,
+  const double *desired_value,
+  double *actual_value)
+{
+  struct moberg_status result = MOBERG_OK;
+  uint32_t raw[count], maxdata[count];
+  double offset[count], scale[count];
+
+  if (count <= 0) { goto return_result; }
+  for (int i = 0 ; i < count ; i++) {
+    struct analog_map *map =
+      &device->analog_out.map[analog_out[i]->channel_context.index];
+    offset[i] = map->min;
+    scale[i] = map->delta;
+    maxdata[i] = map->maxdata;
+  }
+  result = moberg_convert_double_to_uint32(count, desired_value, raw,
+                                           count, 0, offset, scale, maxdata);
+  if (! OK(result)) { goto return_result; }
+  for (int i = 0 ; i < count ; i++) {
+    struct analog_map *map =
+      &device->analog_out.map[analog_out[i]->channel_context.index];
+    struct serial2002_data data = { is_channel, map->index, raw[i] };
+    result = serial2002_write(&device->port.out,  data, 0);
+    if (! OK(result)) { goto return_result; }
+  }
+  if (! device->port.deferred) {
+    result = serial2002_flush(&device->port.out);
+  }
   if (OK(result) && actual_value) {
-    *actual_value = data.value * map.delta + map.min;    
+    result = moberg_convert_uint32_to_double(count, raw, actual_value,
+                                             count, 0, offset, scale);
   }
+return_result:
   return result;
 }
 
@@ -297,21 +848,21 @@ static struct moberg_status digital_in_read(
   struct moberg_channel_context *channel = &digital_in->channel_context;
   struct moberg_device_context *device = channel->device;
   struct serial2002_data data = { 0, 0 };
-  struct digital_map map = device->digital_in.map[channel->index];
+  struct digital_map *map = &device->digital_in.map[channel->index];
   struct moberg_status result;
 
-  if (device->batch.active) {
-    result = batch_sampling(device, NULL, &map, NULL, &data);
+  if (device->reader.active) {
+    result = latest_value(device, &device->reader.digital[map->index],
+                          &data.value);
     if (! OK(result)) { goto return_result; }
-  } else {
-    result = serial2002_poll_digital(&device->port.io, map.index, 1);
+  } else if (device->batch.active) {
+    result = batch_sampling(device, NULL, map, NULL, &data);
     if (! OK(result)) { goto return_result; }
-    result = serial2002_read(&device->port.io, device->port.timeout, &data);
+  } else {
+    data = (struct serial2002_data){ is_digital, map->index, 0 };
+    result = serial2002_transact(&device->port.io, device->port.timeout,
+                                 device->port.depth, 1, &data);
     if (! OK(result)) { goto return_result; }
-    if ((data.kind != is_digital) || (data.index != map.index)) {
-      result = MOBERG_ERRNO(ECHRNG);
-      goto return_result;
-    }
   }
   *value = data.value != 0;
 return_result:
@@ -320,6 +871,52 @@ err_einval:
   return MOBERG_ERRNO(EINVAL);
 }
 
+static struct moberg_status digital_in_read_many(
+  struct moberg_device_context *device,
+  int count,
+  struct moberg_channel_digital_in **digital_in,
+  int *value)
+{
+  struct moberg_status result = MOBERG_OK;
+
+  if (count <= 0) { goto return_result; }
+  if (device->reader.active) {
+    for (int i = 0 ; i < count ; i++) {
+      unsigned long latest;
+      struct digital_map *map =
+        &device->digital_in.map[digital_in[i]->channel_context.index];
+      result = latest_value(device, &device->reader.digital[map->index],
+                            &latest);
+      if (! OK(result)) { goto return_result; }
+      value[i] = latest != 0;
+    }
+  } else if (device->batch.active) {
+    for (int i = 0 ; i < count ; i++) {
+      struct serial2002_data data = { 0, 0 };
+      struct digital_map *map =
+        &device->digital_in.map[digital_in[i]->channel_context.index];
+      result = batch_sampling(device, NULL, map, NULL, &data);
+      if (! OK(result)) { goto return_result; }
+      value[i] = data.value != 0;
+    }
+  } else {
+    struct serial2002_data request[count];
+    for (int i = 0 ; i < count ; i++) {
+      struct digital_map *map =
+        &device->digital_in.map[digital_in[i]->channel_context.index];
+      request[i] = (struct serial2002_data){ is_digital, map->index, 0 };
+    }
+    result = serial2002_transact(&device->port.io, device->port.timeout,
+                                 device->port.depth, count, request);
+    if (! OK(result)) { goto return_result; }
+    for (int i = 0 ; i < count ; i++) {
+      value[i] = request[i].value != 0;
+    }
+  }
+return_result:
+  return result;
+}
+
 static struct moberg_status digital_out_write(
   struct moberg_channel_digital_out *digital_out,
   int desired_value,
@@ -327,15 +924,42 @@ static struct moberg_status digital_out_write(
 {
   struct moberg_channel_context *channel = &digital_out->channel_context;
   struct moberg_device_context *device = channel->device;
-  struct digital_map map = device->digital_out.map[channel->index];
-  struct serial2002_data data = { is_digital, map.index, desired_value != 0 };
-  struct moberg_status result = serial2002_write(&device->port.io,  data, 0);
+  struct digital_map *map = &device->digital_out.map[channel->index];
+  struct serial2002_data data = { is_digital, map->index, desired_value != 0 };
+  struct moberg_status result = serial2002_write(&device->port.out,  data,
+                                                 ! device->port.deferred);
   if (OK(result) && actual_value) {
     *actual_value = data.value;
   }
   return result;
 }
 
+static struct moberg_status digital_out_write_many(
+  struct moberg_device_context *device,
+  int count,
+  struct moberg_channel_digital_out **digital_out,
+  const int *desired_value,
+  int *actual_value)
+{
+  struct moberg_status result = MOBERG_OK;
+  for (int i = 0 ; i < count ; i++) {
+    struct digital_map *map =
+      &device->digital_out.map[digital_out[i]->channel_context.index];
+    struct serial2002_data data = { is_digital, map->index,
+                                    desired_value[i] != 0 };
+    result = serial2002_write(&device->port.out,  data, 0);
+    if (! OK(result)) { goto return_result; }
+    if (actual_value) {
+      actual_value[i] = data.value;
+    }
+  }
+  if (! device->port.deferred) {
+    result = serial2002_flush(&device->port.out);
+  }
+return_result:
+  return result;
+}
+
 static struct moberg_status encoder_in_read(
   struct moberg_channel_encoder_in *encoder_in,
   long *value)
@@ -345,20 +969,20 @@ static struct moberg_status encoder_in_read(
   struct moberg_channel_context *channel = &encoder_in->channel_context;
   struct moberg_device_context *device = channel->device;
   struct serial2002_data data;
-  struct digital_map map = device->encoder_in.map[channel->index];
+  struct digital_map *map = &device->encoder_in.map[channel->index];
   struct moberg_status result;
-  if (device->batch.active) {
-    result = batch_sampling(device, NULL, NULL, &map, &data);
+  if (device->reader.active) {
+    result = latest_value(device, &device->reader.channel[map->index],
+                          &data.value);
     if (! OK(result)) { goto return_result; }
-  } else {
-    result = serial2002_poll_channel(&device->port.io, map.index, 1);
+  } else if (device->batch.active) {
+    result = batch_sampling(device, NULL, NULL, map, &data);
     if (! OK(result)) { goto return_result; }
-    result = serial2002_read(&device->port.io, device->port.timeout, &data);
+  } else {
+    data = (struct serial2002_data){ is_channel, map->index, 0 };
+    result = serial2002_transact(&device->port.io, device->port.timeout,
+                                 device->port.depth, 1, &data);
     if (! OK(result)) { goto return_result; }
-    if ((data.kind != is_channel) || (data.index != map.index)) {
-      result = MOBERG_ERRNO(ECHRNG);
-      goto return_result;
-    }
   }
   *value = (data.value);
 return_result:
@@ -368,6 +992,52 @@ err_einval:
   return MOBERG_OK;
 }
 
+static struct moberg_status encoder_in_read_many(
+  struct moberg_device_context *device,
+  int count,
+  struct moberg_channel_encoder_in **encoder_in,
+  long *value)
+{
+  struct moberg_status result = MOBERG_OK;
+
+  if (count <= 0) { goto return_result; }
+  if (device->reader.active) {
+    for (int i = 0 ; i < count ; i++) {
+      unsigned long latest;
+      struct digital_map *map =
+        &device->encoder_in.map[encoder_in[i]->channel_context.index];
+      result = latest_value(device, &device->reader.channel[map->index],
+                            &latest);
+      if (! OK(result)) { goto return_result; }
+      value[i] = latest;
+    }
+  } else if (device->batch.active) {
+    for (int i = 0 ; i < count ; i++) {
+      struct serial2002_data data;
+      struct digital_map *map =
+        &device->encoder_in.map[encoder_in[i]->channel_context.index];
+      result = batch_sampling(device, NULL, NULL, map, &data);
+      if (! OK(result)) { goto return_result; }
+      value[i] = data.value;
+    }
+  } else {
+    struct serial2002_data request[count];
+    for (int i = 0 ; i < count ; i++) {
+      struct digital_map *map =
+        &device->encoder_in.map[encoder_in[i]->channel_context.index];
+      request[i] = (struct serial2002_data){ is_channel, map->index, 0 };
+    }
+    result = serial2002_transact(&device->port.io, device->port.timeout,
+                                 device->port.depth, count, request);
+    if (! OK(result)) { goto return_result; }
+    for (int i = 0 ; i < count ; i++) {
+      value[i] = request[i].value;
+    }
+  }
+return_result:
+  return result;
+}
+
 static struct moberg_device_context *new_context(struct moberg *moberg,
                                                  int (*dlclose)(void *dlhandle),
                                                  void *dlhandle)
@@ -379,27 +1049,47 @@ static struct moberg_device_context *new_context(struct moberg *moberg,
     result->dlclose = dlclose;
     result->dlhandle = dlhandle;
     result->port.timeout = 100000;
+    result->port.depth = 32;
+    result->port.read_buffer = 128;
+    result->port.write_buffer = 128;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&result->linger.cond, &attr);
+    pthread_cond_init(&result->batch.cond, &attr);
+    pthread_cond_init(&result->reader.cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&result->linger.lock, NULL);
+    pthread_mutex_init(&result->batch.lock, NULL);
+    pthread_mutex_init(&result->reader.lock, NULL);
   }
   return result;
 }
 
 static int device_up(struct moberg_device_context *context)
 {
-  context->use_count++;
-  return context->use_count;
+  return __atomic_add_fetch(&context->use_count, 1, __ATOMIC_ACQ_REL);
 }
 
+static void linger_stop(struct moberg_device_context *device);
+
 static int device_down(struct moberg_device_context *context)
 {
-  context->use_count--;
-  if (context->use_count <= 0) {
+  int use_count = __atomic_sub_fetch(&context->use_count, 1,
+                                     __ATOMIC_ACQ_REL);
+  if (use_count <= 0) {
+    linger_stop(context);
+    pthread_cond_destroy(&context->batch.cond);
+    pthread_mutex_destroy(&context->batch.lock);
+    pthread_cond_destroy(&context->reader.cond);
+    pthread_mutex_destroy(&context->reader.lock);
     moberg_deferred_action(context->moberg,
                            context->dlclose, context->dlhandle);
     free(context->port.name);
     free(context);
     return 0;
   }
-  return context->use_count;
+  return use_count;
 }
 
 static void remap_analog(
@@ -443,55 +1133,298 @@ static void remap_digital(
   }
 }
 
-static struct moberg_status device_open(struct moberg_device_context *device)
+static int read_attribute(const char *dir,
+                          const char *name,
+                          char *value,
+                          int size)
+{
+  char path[PATH_MAX];
+  if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= sizeof(path)) {
+    return 0;
+  }
+  FILE *f = fopen(path, "r");
+  if (! f) {
+    return 0;
+  }
+  int ok = fgets(value, size, f) != NULL;
+  fclose(f);
+  if (ok) {
+    value[strcspn(value, "\n")] = 0;
+  }
+  return ok;
+}
+
+/* Identity of the hardware behind port: vendor, product and serial
+   number for USB adapters, sysfs device path for others and empty when
+   unknown (e.g. pty) */
+static void device_identity(const char *port, char *identity, int size)
+{
+  char resolved[PATH_MAX], path[PATH_MAX], device[PATH_MAX];
+
+  identity[0] = 0;
+  if (! realpath(port, resolved)) {
+    return;
+  }
+  snprintf(path, sizeof(path), "/sys/class/tty/%s/device",
+           strrchr(resolved, '/') + 1);
+  if (! realpath(path, device)) {
+    return;
+  }
+  snprintf(identity, size, "%s", device);
+  for (int level = 0 ; level < 4 ; level++) {
+    char vendor[16], product[16], serial[128];
+    if (read_attribute(device, "idVendor", vendor, sizeof(vendor)) &&
+        read_attribute(device, "idProduct", product, sizeof(product))) {
+      if (! read_attribute(device, "serial", serial, sizeof(serial))) {
+        serial[0] = 0;
+      }
+      snprintf(identity, size, "usb:%s:%s:%s", vendor, product, serial);
+      break;
+    }
+    char *slash = strrchr(device, '/');
+    if (! slash || slash == device) {
+      break;
+    }
+    *slash = 0;
+  }
+}
+
+#define CONFIG_CACHE_MAGIC "S2002C1"
+
+struct config_cache {
+  char magic[8];
+  int baud;
+  char identity[PATH_MAX];
+  struct serial2002_config config;
+};
+
+/* $XDG_CACHE_HOME/moberg/serial2002<port with '/' -> '_'>.cache */
+static int cache_path(struct moberg_device_context *device,
+                      char *path,
+                      int size)
+{
+  const char *cache = getenv("XDG_CACHE_HOME");
+  char dir[PATH_MAX];
+  if (cache && cache[0]) {
+    snprintf(dir, sizeof(dir), "%s", cache);
+  } else if (getenv("HOME")) {
+    snprintf(dir, sizeof(dir), "%s/.cache", getenv("HOME"));
+  } else {
+    return 0;
+  }
+  int n = snprintf(path, size, "%s/moberg/serial2002", dir);
+  if (n < 0 || n >= size - 7) {
+    return 0;
+  }
+  for (char *p = device->port.name ; *p ; p++, n++) {
+    if (n >= size - 7) {
+      /* Truncated names of different ports could collide */
+      return 0;
+    }
+    path[n] = *p == '/' ? '_' : *p;
+  }
+  path[n] = 0;
+  strcat(path, ".cache");
+  return 1;
+}
+
+static int cache_load(struct moberg_device_context *device,
+                      const char *identity,
+                      struct serial2002_config *config)
+{
+  char path[PATH_MAX];
+  struct config_cache cache;
+  int ok = 0;
+
+  if (! cache_path(device, path, sizeof(path))) {
+    goto return_ok;
+  }
+  FILE *f = fopen(path, "r");
+  if (! f) {
+    goto return_ok;
+  }
+  if (fread(&cache, sizeof(cache), 1, f) == 1 &&
+      memcmp(cache.magic, CONFIG_CACHE_MAGIC, sizeof(cache.magic)) == 0 &&
+      cache.baud == device->port.baud &&
+      strncmp(cache.identity, identity, sizeof(cache.identity)) == 0) {
+    *config = cache.config;
+    ok = 1;
+  }
+  fclose(f);
+return_ok:
+  return ok;
+}
+
+static void cache_store(struct moberg_device_context *device,
+                        const char *identity,
+                        struct serial2002_config *config)
+{
+  char path[PATH_MAX], tmp[PATH_MAX + 16];
+  struct config_cache cache;
+
+  if (! cache_path(device, path, sizeof(path))) {
+    return;
+  }
+  /* Create cache directories, errors show up in fopen */
+  for (char *p = strchr(path + 1, '/') ; p ; p = strchr(p + 1, '/')) {
+    *p = 0;
+    mkdir(path, 0755);
+    *p = '/';
+  }
+  memset(&cache, 0, sizeof(cache));
+  memcpy(cache.magic, CONFIG_CACHE_MAGIC, sizeof(cache.magic));
+  cache.baud = device->port.baud;
+  snprintf(cache.identity, sizeof(cache.identity), "%s", identity);
+  cache.config = *config;
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+  FILE *f = fopen(tmp, "w");
+  if (f) {
+    int ok = fwrite(&cache, sizeof(cache), 1, f) == 1;
+    if (fclose(f) == 0 && ok) {
+      rename(tmp, path);
+    } else {
+      unlink(tmp);
+    }
+  }
+}
+
+/* Cheap check that a cached config still matches the device, one poll
+   of the first configured input of each kind. serial2002_transact only
+   accepts replies of the requested kind and index, a box that answers
+   differently fails with ETIMEDOUT or ECHRNG */
+static struct moberg_status cache_validate(
+  struct moberg_device_context *device,
+  struct serial2002_config *config)
+{
+  struct serial2002_data request[3];
+  int count = 0;
+
+  for (int i = 0 ; i < 32 ; i++) {
+    if (config->digital_in[i].kind == SERIAL2002_DIGITAL_IN) {
+      request[count++] = (struct serial2002_data){ is_digital, i, 0 };
+      break;
+    }
+  }
+  int kind[] = { SERIAL2002_ANALOG_IN, SERIAL2002_COUNTER_IN };
+  for (int k = 0 ; k < 2 ; k++) {
+    for (int i = 0 ; i < 31 ; i++) {
+      if (config->channel_in[i].kind == kind[k]) {
+        request[count++] = (struct serial2002_data){ is_channel, i, 0 };
+        break;
+      }
+    }
+  }
+  return serial2002_transact(&device->port.io, device->port.timeout,
+                             1, count, request);
+}
+
+static struct moberg_status device_config(
+  struct moberg_device_context *device,
+  struct serial2002_config *config)
+{
+  struct moberg_status result;
+  char identity[PATH_MAX];
+
+  if (device->port.cache) {
+    device_identity(device->port.name, identity, sizeof(identity));
+    if (cache_load(device, identity, config) &&
+        OK(cache_validate(device, config))) {
+      return MOBERG_OK;
+    }
+  }
+  result = serial2002_read_config(&device->port.io,
+                                  device->port.timeout, config);
+  if (OK(result) && device->port.cache) {
+    cache_store(device, identity, config);
+  }
+  return result;
+}
+
+/* USB serial adapters (e.g. FTDI) buffer input for latency_timer ms,
+   16 ms by default */
+static struct moberg_status set_latency_timer(
+  struct moberg_device_context *device)
+{
+  char resolved[PATH_MAX], path[PATH_MAX];
+
+  if (! realpath(device->port.name, resolved)) {
+    return MOBERG_ERRNO(errno);
+  }
+  snprintf(path, sizeof(path), "/sys/class/tty/%s/device/latency_timer",
+           strrchr(resolved, '/') + 1);
+  FILE *f = fopen(path, "w");
+  if (! f) {
+    return MOBERG_ERRNO(errno);
+  }
+  int ok = fprintf(f, "%d\n", device->port.latency_timer) > 0;
+  if (fclose(f) != 0 || ! ok) {
+    return MOBERG_ERRNO(errno ? errno : EIO);
+  }
+  return MOBERG_OK;
+}
+
+static struct moberg_status port_open(struct moberg_device_context *device)
 {
   struct moberg_status result;
   int fd = -1;
 
-  if (device->port.count == 0) {
-    fd = open(device->port.name, O_RDWR);
-    if (fd < 0) { goto err_errno; }
-    if (lockf(fd, F_TLOCK, 0)) { goto err_errno; }
-    struct termios2 termios2;
-    if (ioctl(fd, TCGETS2, &termios2) < 0) { goto err_errno; }
-    termios2.c_iflag = 0;
-    termios2.c_oflag = 0;
-    termios2.c_lflag = 0;
-    termios2.c_cflag = CLOCAL | CS8 | CREAD | BOTHER;
-    termios2.c_cc[VMIN] = 0;
-    termios2.c_cc[VTIME] = 0;
-    termios2.c_ispeed = device->port.baud;
-    termios2.c_ospeed = device->port.baud;
-    if (ioctl(fd, TCSETS2, &termios2) < 0) { goto err_errno; }
-    struct serial_struct settings; 
-    if (ioctl(fd, TIOCGSERIAL, &settings) >= 0) {
-      settings.flags |= ASYNC_LOW_LATENCY;
-      /* It's expected for this to fail for at least some USB serial adapters */
-      ioctl(fd, TIOCSSERIAL, &settings);
-    }
-    device->port.io.fd = fd;
-    device->port.io.read.pos = 0;
-    device->port.io.write.pos = 0;
-    struct serial2002_config config;
-    result = serial2002_read_config(&device->port.io,
-                                    device->port.timeout, &config);
+  fd = open(device->port.name, O_RDWR);
+  if (fd < 0) { goto err_errno; }
+  if (lockf(fd, F_TLOCK, 0)) { goto err_errno; }
+  struct termios2 termios2;
+  if (ioctl(fd, TCGETS2, &termios2) < 0) { goto err_errno; }
+  termios2.c_iflag = 0;
+  termios2.c_oflag = 0;
+  termios2.c_lflag = 0;
+  termios2.c_cflag = CLOCAL | CS8 | CREAD | BOTHER;
+  termios2.c_cc[VMIN] = device->port.vmin;
+  termios2.c_cc[VTIME] = device->port.vtime;
+  /* BOTHER gives arbitrary rates, e.g. 1000000 on USB adapters */
+  termios2.c_ispeed = device->port.baud;
+  termios2.c_ospeed = device->port.baud;
+  if (ioctl(fd, TCSETS2, &termios2) < 0) { goto err_errno; }
+  if (ioctl(fd, TCGETS2, &termios2) < 0) { goto err_errno; }
+  if (termios2.c_ospeed < device->port.baud * 0.97 ||
+      termios2.c_ospeed > device->port.baud * 1.03) {
+    fprintf(stderr, "%s: baud %d requested, got %d\n",
+            device->port.name, device->port.baud, termios2.c_ospeed);
+  }
+  struct serial_struct settings; 
+  if (ioctl(fd, TIOCGSERIAL, &settings) >= 0) {
+    settings.flags |= ASYNC_LOW_LATENCY;
+    /* It's expected for this to fail for at least some USB serial adapters */
+    ioctl(fd, TIOCSSERIAL, &settings);
+  }
+  if (device->port.latency_timer) {
+    result = set_latency_timer(device);
     if (! OK(result)) { goto err_result; }
-    remap_analog(&device->analog_in, SERIAL2002_ANALOG_IN,
-                  config.channel_in, 31);
-    remap_analog(&device->analog_out, SERIAL2002_ANALOG_OUT,
-                  config.channel_out, 31);
-    remap_digital(&device->digital_in, SERIAL2002_DIGITAL_IN,
-                  config.digital_in, 32);
-    remap_digital(&device->digital_out, SERIAL2002_DIGITAL_OUT,
-                  config.digital_out, 32);
-    remap_digital(&device->encoder_in, SERIAL2002_COUNTER_IN,
-                  config.channel_in, 31);
   }
-  device->port.count++;
+  result = serial2002_io_init(&device->port.io, fd,
+                              device->port.read_buffer,
+                              device->port.write_buffer);
+  if (! OK(result)) { goto err_result; }
+  result = serial2002_io_init(&device->port.out, fd,
+                              0, device->port.write_buffer);
+  if (! OK(result)) { goto err_result; }
+  struct serial2002_config config;
+  result = device_config(device, &config);
+  if (! OK(result)) { goto err_result; }
+  remap_analog(&device->analog_in, SERIAL2002_ANALOG_IN,
+               config.channel_in, 31);
+  remap_analog(&device->analog_out, SERIAL2002_ANALOG_OUT,
+               config.channel_out, 31);
+  remap_digital(&device->digital_in, SERIAL2002_DIGITAL_IN,
+                config.digital_in, 32);
+  remap_digital(&device->digital_out, SERIAL2002_DIGITAL_OUT,
+                config.digital_out, 32);
+  remap_digital(&device->encoder_in, SERIAL2002_COUNTER_IN,
+                config.channel_in, 31);
   return MOBERG_OK;
 err_errno:
   result = MOBERG_ERRNO(errno);
 err_result:
+  serial2002_io_free(&device->port.io);
+  serial2002_io_free(&device->port.out);
   if (fd >= 0) {
     lockf(fd, F_ULOCK, 0);
     close(fd);
@@ -499,36 +1432,190 @@ err_result:
   return result;
 }
 
+static struct moberg_status port_close(struct moberg_device_context *device)
+{
+  serial2002_io_free(&device->port.io);
+  serial2002_io_free(&device->port.out);
+  lockf(device->port.io.fd, F_ULOCK, 0);
+  if (close(device->port.io.fd) < 0) {
+    return MOBERG_ERRNO(errno);
+  }
+  return MOBERG_OK;
+}
+
+/* Closes a lingering port when its deadline has passed */
+static void *linger_thread(void *arg)
+{
+  struct moberg_device_context *device = arg;
+
+  pthread_mutex_lock(&device->linger.lock);
+  while (! device->linger.stop) {
+    if (! device->linger.lingering) {
+      pthread_cond_wait(&device->linger.cond, &device->linger.lock);
+    } else if (monotonic_ns() >= device->linger.deadline) {
+      port_close(device);
+      device->linger.lingering = 0;
+    } else {
+      struct timespec deadline = {
+        device->linger.deadline / 1000000000LL,
+        device->linger.deadline % 1000000000LL
+      };
+      pthread_cond_timedwait(&device->linger.cond, &device->linger.lock,
+                             &deadline);
+    }
+  }
+  pthread_mutex_unlock(&device->linger.lock);
+  return NULL;
+}
+
+static void linger_stop(struct moberg_device_context *device)
+{
+  if (device->linger.running) {
+    pthread_mutex_lock(&device->linger.lock);
+    device->linger.stop = 1;
+    pthread_cond_signal(&device->linger.cond);
+    pthread_mutex_unlock(&device->linger.lock);
+    pthread_join(device->linger.thread, NULL);
+    device->linger.running = 0;
+  }
+  if (device->linger.lingering) {
+    port_close(device);
+    device->linger.lingering = 0;
+  }
+  pthread_cond_destroy(&device->linger.cond);
+  pthread_mutex_destroy(&device->linger.lock);
+}
+
+static struct moberg_status device_open(struct moberg_device_context *device)
+{
+  struct moberg_status result = MOBERG_OK;
+
+  pthread_mutex_lock(&device->linger.lock);
+  if (device->port.count == 0) {
+    if (device->linger.lingering) {
+      /* Still open, reuse it */
+      device->linger.lingering = 0;
+    } else {
+      result = port_open(device);
+      if (! OK(result)) { goto unlock; }
+    }
+    if (device->reader.active) {
+      device->reader.stop = 0;
+      device->reader.wake = 0;
+      int err = pthread_create(&device->reader.thread, NULL,
+                               reader_thread, device);
+      if (err) {
+        port_close(device);
+        result = MOBERG_ERRNO(err);
+        goto unlock;
+      }
+    } else if (device->batch.shared) {
+      result = moberg_reactor_add(device->moberg, device->port.io.fd,
+                                  shared_ready, device);
+      if (! OK(result)) {
+        port_close(device);
+        goto unlock;
+      }
+      pthread_mutex_lock(&device->batch.lock);
+      device->batch.watched = 1;
+      pthread_mutex_unlock(&device->batch.lock);
+    }
+  }
+  device->port.count++;
+unlock:
+  pthread_mutex_unlock(&device->linger.lock);
+  return result;
+}
+
 static struct moberg_status device_close(struct moberg_device_context *device)
 {
-  if (device->port.count < 0) { errno = ENODEV; goto err_errno; }
+  struct moberg_status result = MOBERG_OK;
+
+  pthread_mutex_lock(&device->linger.lock);
+  if (device->port.count <= 0) {
+    result = MOBERG_ERRNO(ENODEV);
+    goto unlock;
+  }
   device->port.count--;
   if (device->port.count == 0) {
-    lockf(device->port.io.fd, F_ULOCK, 0);
-    if (close(device->port.io.fd) < 0) { goto err_errno; }
+    /* Emit deferred outputs before closing */
+    serial2002_flush(&device->port.out);
+    if (device->reader.active) {
+      reader_wake(device, 1);
+      pthread_join(device->reader.thread, NULL);
+    }
+    if (device->batch.watched) {
+      moberg_reactor_remove(device->moberg, device->port.io.fd);
+      pthread_mutex_lock(&device->batch.lock);
+      device->batch.watched = 0;
+      device->batch.pending.active = 0;
+      device->batch.valid = 0;
+      pthread_mutex_unlock(&device->batch.lock);
+    }
+    if (device->linger.timeout > 0) {
+      device->linger.lingering = 1;
+      device->linger.deadline = monotonic_ns() + device->linger.timeout * 1000LL;
+      if (device->linger.running) {
+        pthread_cond_signal(&device->linger.cond);
+      } else if (pthread_create(&device->linger.thread, NULL,
+                                linger_thread, device) == 0) {
+        device->linger.running = 1;
+      } else {
+        device->linger.lingering = 0;
+        result = port_close(device);
+      }
+    } else {
+      result = port_close(device);
+    }
   }
-  return MOBERG_OK;
-err_errno:
-  return MOBERG_ERRNO(errno);
-
+unlock:
+  pthread_mutex_unlock(&device->linger.lock);
+  return result;
 }
 
 static int channel_up(struct moberg_channel *channel)
 {
   device_up(channel->context->device);
-  channel->context->use_count++;
-  return channel->context->use_count;
+  return __atomic_add_fetch(&channel->context->use_count, 1,
+                            __ATOMIC_ACQ_REL);
 }
 
 static int channel_down(struct moberg_channel *channel)
 {
   device_down(channel->context->device);
-  channel->context->use_count--;
-  if (channel->context->use_count <= 0) {
+  int use_count = __atomic_sub_fetch(&channel->context->use_count, 1,
+                                     __ATOMIC_ACQ_REL);
+  if (use_count <= 0) {
     free(channel->context->to_free);
     return 0;
   }
-  return channel->context->use_count;
+  return use_count;
+}
+
+static struct poll *channel_poll(struct moberg_channel *channel)
+{
+  struct moberg_device_context *device = channel->context->device;
+  int index = channel->context->index;
+  switch (channel->kind) {
+    case chan_ANALOGIN:
+      return &device->analog_in.map[index].poll;
+    case chan_DIGITALIN:
+      return &device->digital_in.map[index].poll;
+    case chan_ENCODERIN:
+      return &device->encoder_in.map[index].poll;
+    default:
+      return NULL;
+  }
+}
+
+static struct moberg_status channel_close(struct moberg_channel *channel)
+{
+  struct poll *poll = channel_poll(channel);
+  if (poll) {
+    __atomic_fetch_sub(&poll->open, 1, __ATOMIC_ACQ_REL);
+  }
+  struct moberg_status result = device_close(channel->context->device);
+  return result;
 }
 
 static struct moberg_status channel_open(struct moberg_channel *channel)
@@ -558,17 +1645,26 @@ static struct moberg_status channel_open(struct moberg_channel *channel)
   if (channel->context->index >= count) {
      device_close(channel->context->device);
      result = MOBERG_ERRNO(ENODEV);
+     goto return_result;
+  }
+  struct poll *poll = channel_poll(channel);
+  if (poll) {
+    if (__atomic_fetch_add(&poll->open, 1, __ATOMIC_ACQ_REL) == 0) {
+      __atomic_store_n(&poll->fresh, 1, __ATOMIC_RELEASE);
+    }
+    if (channel->context->device->reader.active) {
+      /* Make sure the first read returns a sampled value */
+      reader_wake(channel->context->device, 0);
+      result = reader_wait(channel->context->device, poll);
+      if (! OK(result)) {
+        channel_close(channel);
+      }
+    }
   }
 return_result:
   return result;
 }
 
-static struct moberg_status channel_close(struct moberg_channel *channel)
-{
-  struct moberg_status result = device_close(channel->context->device);
-  return result;
-}
-
 static void init_channel(
   struct moberg_channel *channel,
   void *to_free,
@@ -592,6 +1688,42 @@ static void init_channel(
   channel->action = action;
 };
 
+/* "= <integer> ;" with min <= integer <= max */
+static int accept_integer(struct moberg_parser_context *c,
+                          int min,
+                          int max,
+                          int *value)
+{
+  token_t integer;
+  if (! acceptsym(c, tok_EQUAL, NULL)) { return 0; }
+  if (! acceptsym(c, tok_INTEGER, &integer)) { return 0; }
+  if (! acceptsym(c, tok_SEMICOLON, NULL)) { return 0; }
+  if (integer.u.integer.value < min || integer.u.integer.value > max) {
+    return 0;
+  }
+  *value = integer.u.integer.value;
+  return 1;
+}
+
+/* "= <integer> s|ms|us ;", value in us */
+static int accept_duration(struct moberg_parser_context *c, long *value)
+{
+  token_t duration;
+  int multiplier = 0;
+  if (! acceptsym(c, tok_EQUAL, NULL)) { return 0; }
+  if (! acceptsym(c, tok_INTEGER, &duration)) { return 0; }
+  if (acceptkeyword(c, "s")) {
+    multiplier = 1000000;
+  } else if (acceptkeyword(c, "ms")) {
+    multiplier = 1000;
+  } else if (acceptkeyword(c, "us")) {
+    multiplier = 1;
+  } 
+  if (! acceptsym(c, tok_SEMICOLON, NULL)) { return 0; }
+  *value = duration.u.integer.value * multiplier;
+  return 1;
+}
+
 static struct moberg_status parse_config(
   struct moberg_device_context *device,
   struct moberg_parser_context *c)
@@ -614,22 +1746,79 @@ static struct moberg_status parse_config(
       if (! acceptsym(c, tok_SEMICOLON, NULL)) { goto syntax_err; }
       device->port.baud = baud.u.integer.value;
     } else if (acceptkeyword(c, "timeout")) {
-      token_t timeout;
-      int multiplier = 0;
+      if (! accept_duration(c, &device->port.timeout)) { goto syntax_err; }
+    } else if (acceptkeyword(c, "pipeline_depth")) {
+      /* At most one poll per input in flight */
+      if (! accept_integer(c, 1, 32 + 31, &device->port.depth)) {
+        goto syntax_err;
+      }
+    } else if (acceptkeyword(c, "background_reader")) {
+      device->reader.active = 1;
+      if (! acceptsym(c, tok_SEMICOLON, NULL)) { goto syntax_err; }
+    } else if (acceptkeyword(c, "max_age")) {
+      if (! accept_duration(c, &device->reader.max_age)) { goto syntax_err; }
+    } else if (acceptkeyword(c, "linger")) {
+      if (! accept_duration(c, &device->linger.timeout)) { goto syntax_err; }
+    } else if (acceptkeyword(c, "read_buffer")) {
+      if (! accept_integer(c, 1, 1 << 20, &device->port.read_buffer)) {
+        goto syntax_err;
+      }
+    } else if (acceptkeyword(c, "write_buffer")) {
+      if (! accept_integer(c, 6, 1 << 20, &device->port.write_buffer)) {
+        goto syntax_err;
+      }
+    } else if (acceptkeyword(c, "vmin")) {
+      if (! accept_integer(c, 0, 255, &device->port.vmin)) { goto syntax_err; }
+    } else if (acceptkeyword(c, "vtime")) {
+      if (! accept_integer(c, 0, 255, &device->port.vtime)) { goto syntax_err; }
+    } else if (acceptkeyword(c, "latency_timer")) {
+      if (! accept_integer(c, 1, 255, &device->port.latency_timer)) {
+        goto syntax_err;
+      }
+    } else if (acceptkeyword(c, "config_cache")) {
+      device->port.cache = 1;
+      if (! acceptsym(c, tok_SEMICOLON, NULL)) { goto syntax_err; }
+    } else if (acceptkeyword(c, "decimation")) {
+      struct remap_digital *remap = NULL;
+      struct remap_analog *analog = NULL;
+      int limit = 32;
+      token_t min, max, decimation;
+      if (acceptkeyword(c, "analog_in")) { analog = &device->analog_in; limit = 31; }
+      else if (acceptkeyword(c, "digital_in")) { remap = &device->digital_in; }
+      else if (acceptkeyword(c, "encoder_in")) { remap = &device->encoder_in; limit = 31; }
+      else { goto syntax_err; }
+      if (! acceptsym(c, tok_LBRACKET, NULL)) { goto syntax_err; }
+      if (! acceptsym(c, tok_INTEGER, &min)) { goto syntax_err; }
+      if (acceptsym(c, tok_COLON, NULL)) { 
+        if (! acceptsym(c, tok_INTEGER, &max)) { goto syntax_err; }
+      } else {
+        max = min;
+      }
+      if (! acceptsym(c, tok_RBRACKET, NULL)) { goto syntax_err; }
       if (! acceptsym(c, tok_EQUAL, NULL)) { goto syntax_err; }
-      if (! acceptsym(c, tok_INTEGER, &timeout)) { goto syntax_err; }
-      if (acceptkeyword(c, "s")) {
-        multiplier = 1000000;
-      } else if (acceptkeyword(c, "ms")) {
-        multiplier = 1000;
-      } else if (acceptkeyword(c, "us")) {
-        multiplier = 1;
-      } 
+      if (! acceptsym(c, tok_INTEGER, &decimation)) { goto syntax_err; }
+      if (! acceptsym(c, tok_SEMICOLON, NULL)) { goto syntax_err; }
+      if (min.u.integer.value < 0 || max.u.integer.value >= limit ||
+          decimation.u.integer.value < 1) {
+        goto syntax_err;
+      }
+      for (int i = min.u.integer.value ; i <= max.u.integer.value ; i++) {
+        if (analog) {
+          analog->map[i].poll.decimation = decimation.u.integer.value;
+        } else {
+          remap->map[i].poll.decimation = decimation.u.integer.value;
+        }
+      }
+    } else if (acceptkeyword(c, "deferred_output")) {
+      device->port.deferred = 1;
       if (! acceptsym(c, tok_SEMICOLON, NULL)) { goto syntax_err; }
-      device->port.timeout = timeout.u.integer.value * multiplier;
     } else if (acceptkeyword(c, "batch_sampling")) {
       device->batch.active = 1;
       if (! acceptsym(c, tok_SEMICOLON, NULL)) { goto syntax_err; }
+    } else if (acceptkeyword(c, "shared_reactor")) {
+      device->batch.active = 1;
+      device->batch.shared = 1;
+      if (! acceptsym(c, tok_SEMICOLON, NULL)) { goto syntax_err; }
     } else {
       goto syntax_err;
     }
@@ -750,6 +1939,29 @@ syntax_err:
   return moberg_parser_failed(c, stderr);
 }
 
+static struct moberg_status flush(struct moberg_device_context *device)
+{
+  if (device->port.count <= 0) {
+    return MOBERG_OK;
+  }
+  return serial2002_flush(&device->port.out);
+}
+
+static struct moberg_status sample(struct moberg_device_context *device,
+                                   unsigned long generation)
+{
+  struct moberg_status result = MOBERG_OK;
+
+  if (device->batch.shared) {
+    pthread_mutex_lock(&device->batch.lock);
+    if (device->batch.watched) {
+      result = shared_start(device, generation);
+    }
+    pthread_mutex_unlock(&device->batch.lock);
+  }
+  return result;
+}
+
 static struct moberg_status start(struct moberg_device_context *device,
                                   FILE *f)
 {
@@ -769,5 +1981,12 @@ struct moberg_device_driver moberg_device_driver = {
   .parse_config=parse_config,
   .parse_map=parse_map,
   .start=start,
-  .stop=stop
+  .stop=stop,
+  .analog_in_read_many=analog_in_read_many,
+  .digital_in_read_many=digital_in_read_many,
+  .encoder_in_read_many=encoder_in_read_many,
+  .analog_out_write_many=analog_out_write_many,
+  .digital_out_write_many=digital_out_write_many,
+  .flush=flush,
+  .sample=sample
 };
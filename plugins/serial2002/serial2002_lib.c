@@ -19,8 +19,10 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE /* ppoll */
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <poll.h>
 #include <errno.h>
 #include <string.h>
@@ -28,6 +30,43 @@
 #include <moberg_inline.h>
 #include <serial2002_lib.h>
 
+struct moberg_status serial2002_io_init(struct serial2002_io *io,
+                                        int fd,
+                                        int read_size,
+                                        int write_size)
+{
+  if (write_size < 6) {
+    write_size = 6;
+  }
+  io->fd = fd;
+  io->dirty = 0;
+  io->decoder.value = 0;
+  io->decoder.length = 0;
+  io->read.data = read_size > 0 ? malloc(read_size) : NULL;
+  io->read.size = read_size > 0 ? read_size : 0;
+  io->read.pos = 0;
+  io->read.count = 0;
+  io->write.data = malloc(write_size);
+  io->write.size = write_size;
+  io->write.pos = 0;
+  io->write.count = 0;
+  if ((read_size > 0 && ! io->read.data) || ! io->write.data) {
+    serial2002_io_free(io);
+    return MOBERG_ERRNO(ENOMEM);
+  }
+  return MOBERG_OK;
+}
+
+void serial2002_io_free(struct serial2002_io *io)
+{
+  free(io->read.data);
+  io->read.data = NULL;
+  io->read.size = 0;
+  free(io->write.data);
+  io->write.data = NULL;
+  io->write.size = 0;
+}
+
 struct moberg_status serial2002_flush(struct serial2002_io *io)
 {
   int n = 0;
@@ -51,15 +90,17 @@ static struct moberg_status tty_write(struct serial2002_io *io,
 {
   struct moberg_status result = MOBERG_OK;
 
+  /* Never split a frame over two writes, since another thread might
+     write to the same fd in between (see background reader) */
+  if (io->write.pos + count > io->write.size) {
+    result = serial2002_flush(io);
+    if (! OK(result)) {
+      goto return_result;
+    }
+  }
   for (int i = 0 ; i < count ; i++) {
     io->write.data[io->write.pos] = buf[i];
     io->write.pos++;
-    if (io->write.pos >= sizeof(io->write.data)) {
-      result = serial2002_flush(io);
-      if (! OK(result)) {
-        goto return_result;
-      }
-    }
   }
   if (flush) {
     result = serial2002_flush(io);
@@ -71,49 +112,45 @@ return_result:
   return result;
 }
 
-static struct moberg_status tty_read(struct serial2002_io *io,
-                                     long timeout,
-                                     unsigned char *value)
+static struct moberg_status tty_fill(struct serial2002_io *io,
+                                     long timeout)
 {
   struct moberg_status result = MOBERG_OK;
 
-  if (io->read.pos >= io->read.count) {
-    struct pollfd pollfd;
-    pollfd.fd = io->fd;
-    pollfd.events = POLLRDNORM | POLLRDBAND | POLLIN | POLLHUP | POLLERR;
-    int err = poll(&pollfd, 1, timeout / 1000);
-    if (err == 0) {
-      result = MOBERG_ERRNO(ETIMEDOUT);
-      goto return_result;
+  struct pollfd pollfd;
+  pollfd.fd = io->fd;
+  pollfd.events = POLLRDNORM | POLLRDBAND | POLLIN | POLLHUP | POLLERR;
+  struct timespec delay = { timeout / 1000000, timeout % 1000000 * 1000 };
+  int err = ppoll(&pollfd, 1, &delay, NULL);
+  if (err == 0) {
+    result = MOBERG_ERRNO(ETIMEDOUT);
+    goto return_result;
 
-    } else if (err < 0) {
-      result = MOBERG_ERRNO(errno);
-      goto return_result;
-    }
-    int available;
-    err = ioctl(io->fd, FIONREAD, &available);
-    if (err < 0) {
-      result = MOBERG_ERRNO(errno);
-      goto return_result;
-    }
-    if (available > sizeof(io->read.data)) {
-      available = sizeof(io->read.data);
-    }
-    err = read(io->fd, &io->read.data[0], available);
-    if (err > 0) {
-      io->read.pos = 0;
-      io->read.count = err;
-    } else if (err == 0) {
-      result = MOBERG_ERRNO(ENODATA);
-      goto return_result;
-    } else if (err < 0) {
-      result = MOBERG_ERRNO(errno);
-      goto return_result;
-    }
+  } else if (err < 0) {
+    result = MOBERG_ERRNO(errno);
+    goto return_result;
+  }
+  int available;
+  err = ioctl(io->fd, FIONREAD, &available);
+  if (err < 0) {
+    result = MOBERG_ERRNO(errno);
+    goto return_result;
+  }
+  if (available > io->read.size) {
+    available = io->read.size;
+  }
+  err = read(io->fd, &io->read.data[0], available);
+  if (err > 0) {
+    io->read.pos = 0;
+    io->read.count = err;
+  } else if (err == 0) {
+    result = MOBERG_ERRNO(ENODATA);
+    goto return_result;
+  } else if (err < 0) {
+    result = MOBERG_ERRNO(errno);
+    goto return_result;
   }
 return_result:
-  *value = io->read.data[io->read.pos];
-  io->read.pos++;
   return result;
 }
 
@@ -137,64 +174,203 @@ struct moberg_status serial2002_poll_channel(struct serial2002_io *io,
   return tty_write(io, &cmd, 1, flush);
 }
 
+struct moberg_status serial2002_decode(struct serial2002_decoder *decoder,
+                                       const unsigned char *buf,
+                                       int *count,
+                                       struct serial2002_data *frame,
+                                       int *frames)
+{
+  struct moberg_status result = MOBERG_OK;
+  unsigned long value = decoder->value;
+  int length = decoder->length;
+  int i = 0, n = 0;
+
+  while (i < *count && n < *frames) {
+    unsigned char data = buf[i];
+    if (data & 0x80) {
+      /* Value bits, at most 5 bytes before the final one */
+      if (length == 5) {
+        result = MOBERG_ERRNO(EFBIG);
+        break;
+      }
+      value = (value << 7) | (data & 0x7f);
+      length++;
+    } else if (length > 0) {
+      frame[n].kind = is_channel;
+      frame[n].index = data & 0x1f;
+      frame[n].value = (value << 2) | ((data & 0x60) >> 5);
+      n++;
+      value = 0;
+      length = 0;
+    } else if ((data & 0x40) == 0) {
+      frame[n].kind = is_digital;
+      frame[n].index = data & 0x1f;
+      frame[n].value = (data & 0x20) != 0;
+      n++;
+    } else if (data != 0x5e) {
+      /* 0x5e is the FTDI USB/serial event character (get bit 30) */
+      result = MOBERG_ERRNO(EINVAL);
+      break;
+    }
+    i++;
+  }
+  if (! OK(result)) {
+    if (n > 0) {
+      /* Report the error on next call */
+      result = MOBERG_OK;
+    } else {
+      /* Consume bad byte and start over */
+      i++;
+      value = 0;
+      length = 0;
+    }
+  }
+  decoder->value = value;
+  decoder->length = length;
+  *count = i;
+  *frames = n;
+  return result;
+}
+
+struct moberg_status serial2002_read_frames(struct serial2002_io *io,
+                                            long timeout,
+                                            struct serial2002_data *frame,
+                                            int max,
+                                            int *frames)
+{
+  struct moberg_status result = MOBERG_OK;
+
+  *frames = 0;
+  while (*frames == 0) {
+    if (io->read.pos >= io->read.count) {
+      result = tty_fill(io, timeout);
+      if (! OK(result)) { goto return_result; }
+    }
+    int count = io->read.count - io->read.pos;
+    *frames = max;
+    result = serial2002_decode(&io->decoder, &io->read.data[io->read.pos],
+                               &count, frame, frames);
+    io->read.pos += count;
+    if (! OK(result)) { goto return_result; }
+  }
+return_result:
+  return result;
+}
+
 struct moberg_status serial2002_read(struct serial2002_io *io,
                                      long timeout,
                                      struct serial2002_data *value)
 {
-  int length;
+  int frames;
   
   value->kind = is_invalid;
   value->index = 0;
   value->value = 0;
-  length = 0;
-  while (value->kind == is_invalid) {
-    unsigned char data;
-    struct moberg_status result = tty_read(io, timeout, &data);
-    if (! OK(result)) {
-      return result;
-    }
-    
-    length++;
-    if (length < 6 && data & 0x80) {
-      value->value = (value->value << 7) | (data & 0x7f);
-    } else if (length == 6 && data & 0x80) {
-      value->kind = is_invalid;
-      return MOBERG_ERRNO(EFBIG);
+  return serial2002_read_frames(io, timeout, value, 1, &frames);
+}
+
+static void discard_pending(struct serial2002_io *io)
+{
+  struct pollfd pollfd;
+
+  while (1) {
+    pollfd.fd = io->fd;
+    pollfd.events = POLLRDNORM | POLLRDBAND | POLLIN | POLLHUP | POLLERR;
+    int err = poll(&pollfd, 1, 0);
+    if (err <= 0) {
       break;
     } else {
-      value->index = data & 0x1f;
-      if (length == 1) {
-        switch ((data >> 5) & 0x03) {
-          case 0:{
-            value->value = 0;
-            value->kind = is_digital;
-          } break;
-          case 1:{
-            value->value = 1;
-            value->kind = is_digital;
-          } break;
-          case 2:{
-            if (data == 0x5e) {
-              /* Ignore FTDI USB/serial event character (get bit 30) */
-              value->kind = is_invalid;
-              value->index = 0;
-              value->value = 0;
-              length = 0;
-            } else {
-              return MOBERG_ERRNO(EINVAL);
-            }
-          } break;
-          case 3:{
-            return MOBERG_ERRNO(EINVAL);
-          } break;
+      char discard;
+      err = read(io->fd, &discard, 1);
+      if (err <= 0) {
+        break;
+      }
+    }
+  }
+}
+
+void serial2002_discard(struct serial2002_io *io)
+{
+  discard_pending(io);
+  io->read.pos = 0;
+  io->read.count = 0;
+  io->decoder.value = 0;
+  io->decoder.length = 0;
+  io->dirty = 0;
+}
+
+struct moberg_status serial2002_transact(struct serial2002_io *io,
+                                         long timeout,
+                                         int depth,
+                                         int count,
+                                         struct serial2002_data *request)
+{
+  struct moberg_status result = MOBERG_OK;
+
+  if (count <= 0) { return MOBERG_OK; }
+  if (depth < 1) { depth = 1; }
+  if (io->dirty) {
+    serial2002_discard(io);
+  }
+  char done[count];
+  int sent = 0, oldest = 0, received = 0, stray = 0;
+  memset(done, 0, sizeof(done));
+  while (received < count) {
+    if (sent < count && sent - received < depth) {
+      while (sent < count && sent - received < depth) {
+        if (request[sent].kind == is_digital) {
+          result = serial2002_poll_digital(io, request[sent].index, 0);
+        } else {
+          result = serial2002_poll_channel(io, request[sent].index, 0);
+        }
+        if (! OK(result)) { goto return_result; }
+        sent++;
+      }
+      result = serial2002_flush(io);
+      if (! OK(result)) { goto return_result; }
+    }
+    struct serial2002_data frame[32];
+    int frames;
+    result = serial2002_read_frames(io, timeout, frame, 32, &frames);
+    if (! OK(result)) { goto return_result; }
+    for (int f = 0 ; f < frames ; f++) {
+      /* Replies normally arrive in order, so start at the oldest pending */
+      int i;
+      for (i = oldest ; i < sent ; i++) {
+        if (! done[i] &&
+            request[i].kind == frame[f].kind &&
+            request[i].index == frame[f].index) {
+          break;
+        }
+      }
+      if (i < sent) {
+        request[i].value = frame[f].value;
+        done[i] = 1;
+        received++;
+        while (oldest < sent && done[oldest]) {
+          oldest++;
         }
       } else {
-        value->value = (value->value << 2) | ((data & 0x60) >> 5);
-        value->kind = is_channel;
+        stray++;
+        if (stray > count) {
+          result = MOBERG_ERRNO(ECHRNG);
+          goto return_result;
+        }
       }
     }
   }
-  return MOBERG_OK;
+return_result:
+  if (! OK(result)) {
+    for (int i = 0 ; i < count ; i++) {
+      if (! done[i]) {
+        request[i].kind = is_invalid;
+      }
+    }
+    /* Unanswered polls must not be matched by the next transaction */
+    serial2002_discard(io);
+    io->dirty = 1;
+  }
+  return result;
 }
 
 struct moberg_status serial2002_write(struct serial2002_io *io,
@@ -203,7 +379,7 @@ struct moberg_status serial2002_write(struct serial2002_io *io,
 {
   if (data.kind == is_digital) {
     unsigned char ch = ((data.value << 5) & 0x20) | (data.index & 0x1f);
-    return tty_write(io, &ch, 1, 1);
+    return tty_write(io, &ch, 1, flush);
   } else {
     unsigned char ch[6];
     int i = 0;
@@ -227,7 +403,7 @@ struct moberg_status serial2002_write(struct serial2002_io *io,
     i++;
     ch[i] = ((data.value << 5) & 0x60) | (data.index & 0x1f);
     i++;
-    return tty_write(io, ch, i, 1);
+    return tty_write(io, ch, i, flush);
   }
 }
 
@@ -275,26 +451,6 @@ static struct moberg_status update_channel(struct serial2002_channel *channel,
   return MOBERG_OK;
 }
 
-static void discard_pending(struct serial2002_io *io)
-{
-  struct pollfd pollfd;
-
-  while (1) {
-    pollfd.fd = io->fd;
-    pollfd.events = POLLRDNORM | POLLRDBAND | POLLIN | POLLHUP | POLLERR;
-    int err = poll(&pollfd, 1, 0);
-    if (err <= 0) {
-      break;
-    } else {
-      char discard;
-      err = read(io->fd, &discard, 1);
-      if (err <= 0) {
-        break;
-      }
-    }
-  }
-}
-
 static struct moberg_status do_read_config(
   struct serial2002_io *io,
   long timeout,
@@ -302,7 +458,7 @@ static struct moberg_status do_read_config(
 {
   struct serial2002_data data = { 0, 0 };
 
-  discard_pending(io);
+  serial2002_discard(io);
   memset(config, 0, sizeof(*config));
   serial2002_poll_channel(io, 31, 1);
   while (1) {
@@ -49,15 +49,32 @@ struct serial2002_config {
     digital_in[32], digital_out[32];
 };
 
+/* Partial frame carried between serial2002_decode calls */
+struct serial2002_decoder {
+  unsigned long value;
+  int length;
+};
+
 struct serial2002_io {
   int fd;
+  int dirty; /* Replies of a failed transaction may still arrive */
+  struct serial2002_decoder decoder;
   struct buffer {
-    unsigned char data[128];
+    unsigned char *data;
+    int size;
     int pos;
     int count;
   } read, write;
 };
 
+/* Buffer sizes in bytes, write buffers hold at least one frame */
+struct moberg_status serial2002_io_init(struct serial2002_io *io,
+                                        int fd,
+                                        int read_size,
+                                        int write_size);
+
+void serial2002_io_free(struct serial2002_io *io);
+
 struct moberg_status serial2002_poll_digital(struct serial2002_io *io,
                                              int channel,
                                              int flush);
@@ -66,10 +83,47 @@ struct moberg_status serial2002_poll_channel(struct serial2002_io *io,
                                              int channel,
                                              int flush);
 
+/* Decodes the *count bytes in buf into at most *frames frames, a
+   partial frame at the end is kept in decoder. On return *count is
+   the number of bytes consumed and *frames the number of frames
+   decoded. The FTDI event character (0x5e) is skipped. A protocol
+   error (EINVAL, EFBIG) stops decoding; when frames precede the bad
+   byte they are returned and the error is reported by the next call. */
+struct moberg_status serial2002_decode(struct serial2002_decoder *decoder,
+                                       const unsigned char *buf,
+                                       int *count,
+                                       struct serial2002_data *frame,
+                                       int *frames);
+
 struct moberg_status serial2002_read(struct serial2002_io *io,
                                      long timeout,
                                      struct serial2002_data *data);
 
+/* Reads all frames that are available (at most max, at least one) */
+struct moberg_status serial2002_read_frames(struct serial2002_io *io,
+                                            long timeout,
+                                            struct serial2002_data *frame,
+                                            int max,
+                                            int *frames);
+
+/* Pipelined request/reply: polls every request (kind is_digital or
+   is_channel and index set), keeping at most depth polls in flight,
+   and fills in value as replies arrive. Replies are matched by kind
+   and index, so they may arrive in any order; unmatched (stray)
+   replies are discarded. On failure the requests that got no reply
+   are set to kind is_invalid, received input is discarded and
+   io is marked dirty, so input that arrived since (late replies to
+   the failed polls) is discarded before the next transaction. */
+struct moberg_status serial2002_transact(struct serial2002_io *io,
+                                         long timeout,
+                                         int depth,
+                                         int count,
+                                         struct serial2002_data *request);
+
+/* Discards all input received so far, decoded or not, and clears
+   dirty */
+void serial2002_discard(struct serial2002_io *io);
+
 struct moberg_status serial2002_write(struct serial2002_io *io,
                                       struct serial2002_data data,
                                       int flush);
@@ -0,0 +1,118 @@
+#define _POSIX_C_SOURCE  200809L
+
+#include <stdio.h>
+#include <time.h>
+#include <moberg.h>
+
+/* Conversion throughput compared to per-sample conversion, run with
+   MOBERG_CONVERT=scalar|sse2|avx2 to compare kernels */
+
+#define COUNT 6
+#define N (COUNT * 100000)
+#define ROUNDS 50
+
+static uint16_t raw16[N];
+static uint32_t raw32[N];
+static double value[N];
+static double desired[N];
+static double offset[COUNT], scale[COUNT];
+static uint32_t maxdata[COUNT];
+
+static double now(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void reference_uint16(void)
+{
+  int channel = 0;
+  for (int i = 0 ; i < N ; i++) {
+    value[i] = offset[channel] + raw16[i] * scale[channel];
+    channel++;
+    if (channel >= COUNT) {
+      channel = 0;
+    }
+  }
+}
+
+static void reference_uint32(void)
+{
+  int channel = 0;
+  for (int i = 0 ; i < N ; i++) {
+    value[i] = offset[channel] + raw32[i] * scale[channel];
+    channel++;
+    if (channel >= COUNT) {
+      channel = 0;
+    }
+  }
+}
+
+static void reference_quantize(void)
+{
+  int channel = 0;
+  for (int i = 0 ; i < N ; i++) {
+    double x = (desired[i] - offset[channel]) / scale[channel];
+    raw32[i] = x < 0 ? 0 : x > maxdata[channel] ? maxdata[channel] : x;
+    channel++;
+    if (channel >= COUNT) {
+      channel = 0;
+    }
+  }
+}
+
+static void kernel_uint16(void)
+{
+  moberg_convert_uint16_to_double(N, raw16, value, COUNT, 0, offset, scale);
+}
+
+static void kernel_uint32(void)
+{
+  moberg_convert_uint32_to_double(N, raw32, value, COUNT, 0, offset, scale);
+}
+
+static void kernel_quantize(void)
+{
+  moberg_convert_double_to_uint32(N, desired, raw32, COUNT, 0,
+                                  offset, scale, maxdata);
+}
+
+static double ns_per_sample(void (*f)(void))
+{
+  double best = 1e9;
+  for (int i = 0 ; i < ROUNDS ; i++) {
+    double t0 = now();
+    f();
+    double t = now() - t0;
+    if (t < best) {
+      best = t;
+    }
+  }
+  return best * 1e9 / N;
+}
+
+static void bench(char *name, void (*reference)(void), void (*kernel)(void))
+{
+  double r = ns_per_sample(reference);
+  double k = ns_per_sample(kernel);
+  printf("%-10s reference %6.3f ns  %-6s %6.3f ns  speedup %5.2f\n",
+         name, r, moberg_convert_kernel(), k, r / k);
+}
+
+int main(int argc, char *argv[])
+{
+  for (int i = 0 ; i < COUNT ; i++) {
+    offset[i] = -10.0;
+    scale[i] = 20.0 / 65536;
+    maxdata[i] = 65535;
+  }
+  for (int i = 0 ; i < N ; i++) {
+    raw16[i] = i;
+    desired[i] = (i % 4000) * 0.01 - 20.0;
+  }
+  bench("uint16", reference_uint16, kernel_uint16);
+  bench("quantize", reference_quantize, kernel_quantize);
+  bench("uint32", reference_uint32, kernel_uint32);
+  return 0;
+}
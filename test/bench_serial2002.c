@@ -0,0 +1,259 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <moberg.h>
+#include <serial2002_sim.h>
+
+/* Input channels per second through the serial2002 plugin against the
+   pty simulator, without and with batch_sampling, and for several
+   ports with and without shared_reactor. Each sweep writes all outputs,
+   advances the generation and reads all inputs back; unless errors are
+   injected the values read are checked against what the simulator
+   looped back */
+
+#define DIGITAL SERIAL2002_SIM_DIGITAL
+#define ANALOG SERIAL2002_SIM_ANALOG
+#define ENCODER SERIAL2002_SIM_COUNTER
+#define PORTS 4
+#define DURATION 0.5
+
+static struct mode {
+  const char *name;
+  const char *config;
+  int ports;
+  struct serial2002_sim_options sim;
+} mode[] = {
+  { "plain", "", 1, { .latency = 0 } },
+  { "batch", "batch_sampling ;", 1, { .latency = 0 } },
+  { "plain", "", 1, { .latency = 500 } },
+  { "batch", "batch_sampling ;", 1, { .latency = 500 } },
+  { "plain", "timeout = 20 ms ;", 1, { .error_rate = 1e-3, .seed = 1 } },
+  { "batch", "batch_sampling ; timeout = 20 ms ;", 1,
+    { .error_rate = 1e-3, .seed = 1 } },
+  { "batch", "batch_sampling ;", PORTS, { .latency = 500 } },
+  { "shared", "shared_reactor ;", PORTS, { .latency = 500 } },
+  { "shared", "shared_reactor ; timeout = 20 ms ;", PORTS,
+    { .error_rate = 1e-3, .seed = 1 } },
+};
+
+static char config_dir[] = "/tmp/bench_serial2002.XXXXXX";
+static char config_file[sizeof(config_dir) + 32];
+
+static double now(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* One device per simulator, port p has its channels at p * count */
+static int write_config(struct serial2002_sim **sim,
+                        int ports,
+                        const char *extra)
+{
+  FILE *f = fopen(config_file, "w");
+  if (! f) {
+    return 0;
+  }
+  for (int p = 0 ; p < ports ; p++) {
+    int a = p * ANALOG, d = p * DIGITAL, e = p * ENCODER;
+    fprintf(f,
+            "driver(serial2002) {\n"
+            "  config { device = \"%s\" ; baud = 115200 ; %s }\n"
+            "  map analog_in[%d:%d] = analog_in[0:%d] ;\n"
+            "  map analog_out[%d:%d] = analog_out[0:%d] ;\n"
+            "  map digital_in[%d:%d] = digital_in[0:%d] ;\n"
+            "  map digital_out[%d:%d] = digital_out[0:%d] ;\n"
+            "  map encoder_in[%d:%d] = encoder_in[0:%d] ;\n"
+            "}\n",
+            serial2002_sim_device(sim[p]), extra,
+            a, a + ANALOG - 1, ANALOG - 1,
+            a, a + ANALOG - 1, ANALOG - 1,
+            d, d + DIGITAL - 1, DIGITAL - 1,
+            d, d + DIGITAL - 1, DIGITAL - 1,
+            e, e + ENCODER - 1, ENCODER - 1);
+  }
+  return fclose(f) == 0;
+}
+
+static int run(struct mode *mode)
+{
+  int ok = 0;
+  struct serial2002_sim *sim[PORTS];
+  struct serial2002_sim_stats stats;
+  struct moberg *moberg;
+  const int analog = mode->ports * ANALOG;
+  const int digital = mode->ports * DIGITAL;
+  const int encoder = mode->ports * ENCODER;
+  struct moberg_analog_in ai[PORTS * ANALOG];
+  struct moberg_analog_out ao[PORTS * ANALOG];
+  struct moberg_digital_in di[PORTS * DIGITAL];
+  struct moberg_digital_out dout[PORTS * DIGITAL];
+  struct moberg_encoder_in ei[PORTS * ENCODER];
+  int check = mode->sim.error_rate == 0;
+  int started = 0;
+
+  for ( ; started < mode->ports ; started++) {
+    if (! moberg_OK(serial2002_sim_start(&mode->sim, &sim[started]))) {
+      fprintf(stderr, "Failed to start simulator\n");
+      goto stop_sim;
+    }
+  }
+  if (! write_config(sim, mode->ports, mode->config)) {
+    fprintf(stderr, "Failed to write %s\n", config_file);
+    goto stop_sim;
+  }
+  moberg = moberg_new();
+  if (! moberg) {
+    goto stop_sim;
+  }
+  int ai_open = 0, ao_open = 0, di_open = 0, do_open = 0, ei_open = 0;
+  for ( ; ai_open < analog ; ai_open++) {
+    if (! moberg_OK(moberg_analog_in_open(moberg, ai_open, &ai[ai_open]))) {
+      goto close;
+    }
+  }
+  for ( ; ao_open < analog ; ao_open++) {
+    if (! moberg_OK(moberg_analog_out_open(moberg, ao_open, &ao[ao_open]))) {
+      goto close;
+    }
+  }
+  for ( ; di_open < digital ; di_open++) {
+    if (! moberg_OK(moberg_digital_in_open(moberg, di_open, &di[di_open]))) {
+      goto close;
+    }
+  }
+  for ( ; do_open < digital ; do_open++) {
+    if (! moberg_OK(moberg_digital_out_open(moberg, do_open,
+                                            &dout[do_open]))) {
+      goto close;
+    }
+  }
+  for ( ; ei_open < encoder ; ei_open++) {
+    if (! moberg_OK(moberg_encoder_in_open(moberg, ei_open, &ei[ei_open]))) {
+      goto close;
+    }
+  }
+  long sweeps = 0, failed = 0, mismatch = 0;
+  long previous[PORTS * ENCODER];
+  for (int i = 0 ; i < encoder ; i++) {
+    previous[i] = -1;
+  }
+  double start = now(), stop;
+  do {
+    for (int i = 0 ; i < analog ; i++) {
+      double actual;
+      double desired = (((sweeps + i) % 200) - 100) * 0.1;
+      failed += ! moberg_OK(ao[i].write(ao[i].context, desired, &actual));
+    }
+    for (int i = 0 ; i < digital ; i++) {
+      int actual;
+      int desired = (sweeps + i) & 1;
+      failed += ! moberg_OK(dout[i].write(dout[i].context, desired, &actual));
+    }
+    moberg_advance_generation(moberg);
+    for (int i = 0 ; i < analog ; i++) {
+      double value;
+      double desired = (((sweeps + i) % 200) - 100) * 0.1;
+      if (! moberg_OK(ai[i].read(ai[i].context, &value))) {
+        failed++;
+      } else if (fabs(value - desired) > 20.0 / 4095) {
+        mismatch++;
+      }
+    }
+    for (int i = 0 ; i < digital ; i++) {
+      int value;
+      if (! moberg_OK(di[i].read(di[i].context, &value))) {
+        failed++;
+      } else if (value != ((sweeps + i) & 1)) {
+        mismatch++;
+      }
+    }
+    for (int i = 0 ; i < encoder ; i++) {
+      long value;
+      if (! moberg_OK(ei[i].read(ei[i].context, &value))) {
+        failed++;
+      } else {
+        if (value <= previous[i]) {
+          mismatch++;
+        }
+        previous[i] = value;
+      }
+    }
+    sweeps++;
+    stop = now();
+  } while (stop - start < DURATION);
+  int channels = analog + digital + encoder;
+  printf("%-6s ports %d  latency %4ld us  errors %-6g %9.0f channels/s  "
+         "%8.0f sweeps/s  failed %ld  mismatch %ld\n",
+         mode->name, mode->ports, mode->sim.latency, mode->sim.error_rate,
+         sweeps * channels / (stop - start), sweeps / (stop - start),
+         failed, mismatch);
+  ok = ! check || (failed == 0 && mismatch == 0);
+close:
+  if (ei_open < encoder && ! ok) {
+    fprintf(stderr, "Failed to open channels\n");
+  }
+  for (int i = 0 ; i < ai_open ; i++) {
+    moberg_analog_in_close(moberg, i, ai[i]);
+  }
+  for (int i = 0 ; i < ao_open ; i++) {
+    moberg_analog_out_close(moberg, i, ao[i]);
+  }
+  for (int i = 0 ; i < di_open ; i++) {
+    moberg_digital_in_close(moberg, i, di[i]);
+  }
+  for (int i = 0 ; i < do_open ; i++) {
+    moberg_digital_out_close(moberg, i, dout[i]);
+  }
+  for (int i = 0 ; i < ei_open ; i++) {
+    moberg_encoder_in_close(moberg, i, ei[i]);
+  }
+  moberg_free(moberg);
+stop_sim:
+  for (int p = 0 ; p < started ; p++) {
+    serial2002_sim_stop(sim[p], &stats);
+    if (! ok) {
+      fprintf(stderr, "%s[%d]: polls %ld configs %ld outputs %ld errors %ld\n",
+              mode->name, p, stats.polls, stats.configs, stats.outputs,
+              stats.errors);
+    }
+  }
+  return ok;
+}
+
+int main(int argc, char *argv[])
+{
+  int ok = 1;
+
+  if (! mkdtemp(config_dir)) {
+    fprintf(stderr, "mkdtemp: %s\n", strerror(errno));
+    return 1;
+  }
+  /* Only our own config, not the system wide ones */
+  snprintf(config_file, sizeof(config_file), "%s/home", config_dir);
+  setenv("XDG_CONFIG_HOME", config_file, 1);
+  setenv("XDG_CONFIG_DIRS", config_dir, 1);
+  mkdir(config_file, 0700);
+  snprintf(config_file, sizeof(config_file), "%s/home/moberg.d", config_dir);
+  mkdir(config_file, 0700);
+  snprintf(config_file, sizeof(config_file),
+           "%s/home/moberg.d/moberg.conf", config_dir);
+  for (unsigned int i = 0 ; i < sizeof(mode) / sizeof(mode[0]) ; i++) {
+    ok &= run(&mode[i]);
+  }
+  unlink(config_file);
+  snprintf(config_file, sizeof(config_file), "%s/home/moberg.d", config_dir);
+  rmdir(config_file);
+  snprintf(config_file, sizeof(config_file), "%s/home", config_dir);
+  rmdir(config_file);
+  rmdir(config_dir);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,126 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <serial2002_lib.h>
+
+/* Decoder throughput on a captured byte stream (file given as argument)
+   or a synthetic one, compared to byte at a time decoding */
+
+#define N (4 << 20)
+#define ROUNDS 10
+
+static unsigned char stream[N];
+static struct serial2002_data frame[N];
+
+static double now(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* The old serial2002_read loop, one call per byte */
+static int __attribute__((noinline)) next_byte(const unsigned char *buf,
+                                               int *pos,
+                                               unsigned char *value)
+{
+  *value = buf[*pos];
+  (*pos)++;
+  return 1;
+}
+
+static int bytewise(const unsigned char *buf, int count)
+{
+  int pos = 0, n = 0;
+  while (pos < count) {
+    unsigned long value = 0;
+    int length = 0;
+    while (pos < count) {
+      unsigned char data;
+      next_byte(buf, &pos, &data);
+      length++;
+      if (length < 6 && data & 0x80) {
+        value = (value << 7) | (data & 0x7f);
+      } else if (length == 6 && data & 0x80) {
+        break;
+      } else if (length > 1) {
+        frame[n++] = (struct serial2002_data){ is_channel, data & 0x1f,
+                                               (value << 2) |
+                                               ((data & 0x60) >> 5) };
+        break;
+      } else if ((data & 0x40) == 0) {
+        frame[n++] = (struct serial2002_data){ is_digital, data & 0x1f,
+                                               (data & 0x20) != 0 };
+        break;
+      } else {
+        break;
+      }
+    }
+  }
+  return n;
+}
+
+static int bulk(const unsigned char *buf, int count)
+{
+  struct serial2002_decoder decoder = { 0, 0 };
+  int pos = 0, n = 0;
+  while (pos < count) {
+    /* Same chunking as a 4096 byte read buffer */
+    int consumed = count - pos < 4096 ? count - pos : 4096;
+    int frames = N - n;
+    serial2002_decode(&decoder, &buf[pos], &consumed, &frame[n], &frames);
+    pos += consumed;
+    n += frames;
+  }
+  return n;
+}
+
+static double mbytes_per_second(int (*f)(const unsigned char *, int),
+                                 int count, int *frames)
+{
+  double best = 1e9;
+  for (int i = 0 ; i < ROUNDS ; i++) {
+    double t0 = now();
+    *frames = f(stream, count);
+    double t = now() - t0;
+    if (t < best) {
+      best = t;
+    }
+  }
+  return count / best * 1e-6;
+}
+
+int main(int argc, char *argv[])
+{
+  int count = 0;
+  if (argc > 1) {
+    FILE *f = fopen(argv[1], "r");
+    if (! f) {
+      perror(argv[1]);
+      return 1;
+    }
+    count = fread(stream, 1, N, f);
+    fclose(f);
+  } else {
+    /* Typical batch replies: 16 bit analog values and digital bits */
+    srandom(2002);
+    while (count < N - 4) {
+      if (random() % 3) {
+        unsigned long value = random() & 0xffff;
+        stream[count++] = 0x80 | ((value >> 9) & 0x7f);
+        stream[count++] = 0x80 | ((value >> 2) & 0x7f);
+        stream[count++] = ((value << 5) & 0x60) | (random() % 31);
+      } else {
+        stream[count++] = (random() & 0x3f);
+      }
+    }
+  }
+  int frames_bytewise, frames_bulk;
+  double b = mbytes_per_second(bytewise, count, &frames_bytewise);
+  double k = mbytes_per_second(bulk, count, &frames_bulk);
+  printf("decode %d bytes %d frames  bytewise %7.1f MB/s  bulk %7.1f MB/s"
+         "  speedup %5.2f\n", count, frames_bulk, b, k, k / b);
+  return frames_bytewise != frames_bulk;
+}
@@ -0,0 +1,86 @@
+/*
+    config_dir.c -- private moberg configuration directory for tests
+
+    Copyright (C) 2019 Anders Blomdell <anders.blomdell@gmail.com>
+
+    This file is part of Moberg.
+
+    Moberg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <config_dir.h>
+
+int config_dir_create(struct config_dir *dir, const char *name)
+{
+  char path[192];
+
+  if (snprintf(dir->path, sizeof(dir->path), "/tmp/%s.XXXXXX", name) >=
+      sizeof(dir->path) || ! mkdtemp(dir->path)) {
+    fprintf(stderr, "mkdtemp: %s\n", strerror(errno));
+    return 0;
+  }
+  snprintf(path, sizeof(path), "%s/home", dir->path);
+  setenv("XDG_CONFIG_HOME", path, 1);
+  setenv("XDG_CONFIG_DIRS", dir->path, 1);
+  setenv("XDG_CACHE_HOME", dir->path, 1);
+  if (mkdir(path, 0700) != 0) {
+    goto err;
+  }
+  snprintf(path, sizeof(path), "%s/home/moberg.d", dir->path);
+  if (mkdir(path, 0700) != 0) {
+    goto err;
+  }
+  snprintf(dir->file, sizeof(dir->file),
+           "%s/home/moberg.d/moberg.conf", dir->path);
+  snprintf(dir->cache, sizeof(dir->cache),
+           "%s/moberg/moberg.conf.cache", dir->path);
+  return 1;
+err:
+  fprintf(stderr, "mkdir %s: %s\n", path, strerror(errno));
+  config_dir_remove(dir);
+  return 0;
+}
+
+int config_dir_write(struct config_dir *dir, const char *config)
+{
+  FILE *f = fopen(dir->file, "w");
+  if (! f) {
+    return 0;
+  }
+  fputs(config, f);
+  return fclose(f) == 0;
+}
+
+static int remove_entry(const char *path,
+                        const struct stat *statbuf,
+                        int type,
+                        struct FTW *ftw)
+{
+  remove(path);
+  return 0;
+}
+
+void config_dir_remove(struct config_dir *dir)
+{
+  nftw(dir->path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
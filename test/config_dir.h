@@ -0,0 +1,45 @@
+/*
+    config_dir.h -- private moberg configuration directory for tests
+
+    Copyright (C) 2019 Anders Blomdell <anders.blomdell@gmail.com>
+
+    This file is part of Moberg.
+
+    Moberg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef __CONFIG_DIR_H__
+#define __CONFIG_DIR_H__
+
+/* A temporary directory that moberg uses instead of the system wide
+   and user configurations (XDG_CONFIG_HOME and XDG_CONFIG_DIRS) and
+   cache (XDG_CACHE_HOME), with a single configuration file */
+
+struct config_dir {
+  char path[128];
+  char file[192];  /* <path>/home/moberg.d/moberg.conf */
+  char cache[192]; /* <path>/moberg/moberg.conf.cache */
+};
+
+/* Creates /tmp/<name>.XXXXXX and points the environment at it, 0 on
+   failure */
+int config_dir_create(struct config_dir *dir, const char *name);
+
+/* Replaces the contents of dir->file, 0 on failure */
+int config_dir_write(struct config_dir *dir, const char *config);
+
+/* Removes the directory and everything in it */
+void config_dir_remove(struct config_dir *dir);
+
+#endif
@@ -0,0 +1,291 @@
+/*
+    serial2002_sim.c -- serial2002 device simulator on a pseudo-terminal
+
+    Copyright (C) 2019 Anders Blomdell <anders.blomdell@gmail.com>
+
+    This file is part of Moberg.
+
+    Moberg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <moberg_inline.h>
+#include <serial2002_lib.h>
+#include <serial2002_sim.h>
+
+#define COUNTER_FIRST SERIAL2002_SIM_ANALOG
+#define CHANNELS (SERIAL2002_SIM_ANALOG + SERIAL2002_SIM_COUNTER)
+
+struct serial2002_sim {
+  struct serial2002_sim_options options;
+  struct serial2002_sim_stats stats;
+  char device[64];
+  int master;
+  int slave;
+  int stop[2];
+  pthread_t thread;
+  struct serial2002_io io;
+  struct serial2002_decoder request;
+  unsigned long digital[SERIAL2002_SIM_DIGITAL];
+  unsigned long channel[CHANNELS];
+};
+
+static unsigned long config_frame(int channel, int kind, int cmd, int value)
+{
+  return channel | kind << 5 | cmd << 8 | (unsigned long)value << 10;
+}
+
+static void reply_config(struct serial2002_sim *sim)
+{
+  const int bits = 12, min = (10 << 4) | 8, max = 10 << 4;
+
+  sim->stats.configs++;
+  for (int i = 0 ; i < SERIAL2002_SIM_DIGITAL ; i++) {
+    serial2002_write(&sim->io, (struct serial2002_data){
+        is_channel, 31, config_frame(i, SERIAL2002_DIGITAL_IN, 0, 0) }, 0);
+    serial2002_write(&sim->io, (struct serial2002_data){
+        is_channel, 31, config_frame(i, SERIAL2002_DIGITAL_OUT, 0, 0) }, 0);
+  }
+  for (int i = 0 ; i < SERIAL2002_SIM_ANALOG ; i++) {
+    int kind[] = { SERIAL2002_ANALOG_IN, SERIAL2002_ANALOG_OUT };
+    for (int k = 0 ; k < 2 ; k++) {
+      serial2002_write(&sim->io, (struct serial2002_data){
+          is_channel, 31, config_frame(i, kind[k], 0, bits) }, 0);
+      serial2002_write(&sim->io, (struct serial2002_data){
+          is_channel, 31, config_frame(i, kind[k], 1, min) }, 0);
+      serial2002_write(&sim->io, (struct serial2002_data){
+          is_channel, 31, config_frame(i, kind[k], 2, max) }, 0);
+    }
+  }
+  for (int i = COUNTER_FIRST ; i < CHANNELS ; i++) {
+    serial2002_write(&sim->io, (struct serial2002_data){
+        is_channel, 31, config_frame(i, SERIAL2002_COUNTER_IN, 0, 16) }, 0);
+  }
+  serial2002_write(&sim->io, (struct serial2002_data){ is_channel, 31, 0 }, 0);
+}
+
+static void sleep_us(long us)
+{
+  struct timespec delay = { us / 1000000, us % 1000000 * 1000 };
+  while (nanosleep(&delay, &delay) != 0 && errno == EINTR) {
+  }
+}
+
+static void reply_poll(struct serial2002_sim *sim, unsigned char request)
+{
+  int index = request & 0x1f;
+  struct serial2002_data reply = { is_invalid, index, 0 };
+
+  if ((request & 0x20) == 0 && index < SERIAL2002_SIM_DIGITAL) {
+    reply.kind = is_digital;
+    reply.value = sim->digital[index];
+  } else if ((request & 0x20) && index < COUNTER_FIRST) {
+    reply.kind = is_channel;
+    reply.value = sim->channel[index];
+  } else if ((request & 0x20) && index < CHANNELS) {
+    reply.kind = is_channel;
+    reply.value = sim->channel[index]++ & 0xffff;
+  } else {
+    /* Unknown inputs are not answered */
+    return;
+  }
+  sim->stats.polls++;
+  if (reply.kind == is_channel && index + 1 == sim->options.delayed) {
+    /* Late, but after the replies before it */
+    sim->options.delayed = 0;
+    serial2002_flush(&sim->io);
+    sleep_us(sim->options.delay);
+  }
+  int start = sim->io.write.pos;
+  serial2002_write(&sim->io, reply, 0);
+  if (sim->options.error_rate > 0) {
+    for (int i = start ; i < sim->io.write.pos ; i++) {
+      if (rand_r(&sim->options.seed) <
+          sim->options.error_rate * ((double)RAND_MAX + 1)) {
+        sim->io.write.data[i] ^= 1 << (rand_r(&sim->options.seed) % 8);
+        sim->stats.errors++;
+      }
+    }
+  }
+}
+
+static void handle_output(struct serial2002_sim *sim,
+                          struct serial2002_data output)
+{
+  sim->stats.outputs++;
+  if (output.kind == is_digital && output.index < SERIAL2002_SIM_DIGITAL) {
+    sim->digital[output.index] = output.value;
+  } else if (output.kind == is_channel &&
+             output.index < SERIAL2002_SIM_ANALOG) {
+    sim->channel[output.index] = output.value;
+  }
+}
+
+/* Requests are single byte polls (0x40 digital, 0x60 channel, 0x7f
+   config) or output frames in the format sent by serial2002_write */
+static void handle_request(struct serial2002_sim *sim, unsigned char data)
+{
+  struct serial2002_decoder *request = &sim->request;
+
+  if (request->length == 0 && (data & 0xc0) == 0x40) {
+    if (data == 0x7f) {
+      reply_config(sim);
+    } else {
+      reply_poll(sim, data);
+    }
+  } else if (data & 0x80) {
+    request->value = (request->value << 7) | (data & 0x7f);
+    request->length++;
+  } else if (request->length == 0) {
+    handle_output(sim, (struct serial2002_data){
+        is_digital, data & 0x1f, (data & 0x20) != 0 });
+  } else {
+    handle_output(sim, (struct serial2002_data){
+        is_channel, data & 0x1f,
+        (request->value << 2) | ((data & 0x60) >> 5) });
+    request->value = 0;
+    request->length = 0;
+  }
+}
+
+static void *sim_thread(void *arg)
+{
+  struct serial2002_sim *sim = arg;
+
+  for (;;) {
+    struct pollfd fds[2] = {
+      { .fd = sim->master, .events = POLLIN },
+      { .fd = sim->stop[0], .events = POLLIN }
+    };
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) { continue; }
+      break;
+    }
+    if (fds[1].revents) {
+      break;
+    }
+    unsigned char buf[256];
+    int n = read(sim->master, buf, sizeof(buf));
+    if (n <= 0) {
+      if (n < 0 && (errno == EINTR || errno == EAGAIN)) { continue; }
+      break;
+    }
+    for (int i = 0 ; i < n ; i++) {
+      handle_request(sim, buf[i]);
+    }
+    if (sim->io.write.pos) {
+      long delay = sim->options.latency;
+      if (sim->options.baud) {
+        delay += sim->io.write.pos * 10000000LL / sim->options.baud;
+      }
+      if (delay) {
+        sleep_us(delay);
+      }
+      serial2002_flush(&sim->io);
+    }
+  }
+  return NULL;
+}
+
+struct moberg_status serial2002_sim_start(
+  const struct serial2002_sim_options *options,
+  struct serial2002_sim **sim)
+{
+  struct moberg_status result;
+  struct serial2002_sim *s = calloc(1, sizeof(*s));
+  if (! s) { result = MOBERG_ERRNO(ENOMEM); goto err; }
+  s->options = *options;
+  s->master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (s->master < 0) { result = MOBERG_ERRNO(errno); goto free_sim; }
+  if (grantpt(s->master) != 0 || unlockpt(s->master) != 0 ||
+      ptsname_r(s->master, s->device, sizeof(s->device)) != 0) {
+    result = MOBERG_ERRNO(errno);
+    goto close_master;
+  }
+  /* Keep the slave open (raw), so the master never sees a hangup */
+  s->slave = open(s->device, O_RDWR | O_NOCTTY);
+  if (s->slave < 0) { result = MOBERG_ERRNO(errno); goto close_master; }
+  struct termios termios;
+  if (tcgetattr(s->slave, &termios) != 0) {
+    result = MOBERG_ERRNO(errno);
+    goto close_slave;
+  }
+  cfmakeraw(&termios);
+  if (tcsetattr(s->slave, TCSANOW, &termios) != 0) {
+    result = MOBERG_ERRNO(errno);
+    goto close_slave;
+  }
+  if (pipe2(s->stop, O_CLOEXEC) != 0) {
+    result = MOBERG_ERRNO(errno);
+    goto close_slave;
+  }
+  result = serial2002_io_init(&s->io, s->master, 0, 8192);
+  if (! moberg_OK(result)) { goto close_pipe; }
+  for (int i = 0 ; i < SERIAL2002_SIM_DIGITAL ; i++) {
+    s->digital[i] = i & 1;
+  }
+  for (int i = 0 ; i < SERIAL2002_SIM_ANALOG ; i++) {
+    s->channel[i] = 1000 + i * 100;
+  }
+  int err = pthread_create(&s->thread, NULL, sim_thread, s);
+  if (err) { result = MOBERG_ERRNO(err); goto free_io; }
+  *sim = s;
+  return MOBERG_OK;
+free_io:
+  serial2002_io_free(&s->io);
+close_pipe:
+  close(s->stop[0]);
+  close(s->stop[1]);
+close_slave:
+  close(s->slave);
+close_master:
+  close(s->master);
+free_sim:
+  free(s);
+err:
+  return result;
+}
+
+const char *serial2002_sim_device(struct serial2002_sim *sim)
+{
+  return sim->device;
+}
+
+void serial2002_sim_stop(struct serial2002_sim *sim,
+                         struct serial2002_sim_stats *stats)
+{
+  char stop = 0;
+
+  while (write(sim->stop[1], &stop, 1) < 0 && errno == EINTR) {
+  }
+  pthread_join(sim->thread, NULL);
+  if (stats) {
+    *stats = sim->stats;
+  }
+  serial2002_io_free(&sim->io);
+  close(sim->stop[0]);
+  close(sim->stop[1]);
+  close(sim->slave);
+  close(sim->master);
+  free(sim);
+}
@@ -0,0 +1,65 @@
+/*
+    serial2002_sim.h -- serial2002 device simulator on a pseudo-terminal
+
+    Copyright (C) 2019 Anders Blomdell <anders.blomdell@gmail.com>
+
+    This file is part of Moberg.
+
+    Moberg is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef __SERIAL2002_SIM_H__
+#define __SERIAL2002_SIM_H__
+
+#include <moberg.h>
+
+/* The simulated device has SERIAL2002_SIM_DIGITAL digital inputs and
+   outputs, SERIAL2002_SIM_ANALOG analog inputs and outputs (12 bits,
+   -10..10) and SERIAL2002_SIM_COUNTER counters (16 bits, channels
+   following the analog inputs) that count their own polls. Outputs
+   are looped back to the inputs with the same index. */
+#define SERIAL2002_SIM_DIGITAL 8
+#define SERIAL2002_SIM_ANALOG 8
+#define SERIAL2002_SIM_COUNTER 2
+
+struct serial2002_sim_options {
+  long latency;      /* us before each burst of replies */
+  int baud;          /* when non-zero, replies are paced to this rate */
+  double error_rate; /* probability that a poll reply byte is corrupted */
+  unsigned int seed;
+  int delayed;       /* 1 + channel whose first poll is answered late */
+  long delay;        /* us */
+};
+
+struct serial2002_sim_stats {
+  long polls;
+  long configs;
+  long outputs;
+  long errors;     /* Corrupted bytes */
+};
+
+struct serial2002_sim;
+
+/* Opens a pty pair and serves it from a thread */
+struct moberg_status serial2002_sim_start(
+  const struct serial2002_sim_options *options,
+  struct serial2002_sim **sim);
+
+/* Name of the terminal to use as device in the serial2002 config */
+const char *serial2002_sim_device(struct serial2002_sim *sim);
+
+void serial2002_sim_stop(struct serial2002_sim *sim,
+                         struct serial2002_sim_stats *stats);
+
+#endif
@@ -0,0 +1,174 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <moberg.h>
+#include <config_dir.h>
+
+/* moberg_compile writes the cache, moberg_new then uses it (with and
+   without MOBERG_LAZY) as long as the configuration files are
+   unchanged: config_b has the same size as config_a, so with the
+   mtime of config_a restored the cache (and the mapping of config_a)
+   is used, with a new mtime the contents differ and config_b is
+   parsed. A damaged cache is ignored */
+
+static const char *config_a =
+  "driver(libtest) {\n"
+  "  config { }\n"
+  "  map digital_in[0:7] = digital_in[0:7] ;\n"
+  "  map digital_out[0:7] = digital_out[0:7] ;\n"
+  "  map analog_in[0:1] = analog_in[0:1] ;\n"
+  "}\n";
+
+static const char *config_b =
+  "driver(libtest) {\n"
+  "  config { }\n"
+  "  map digital_in[0:7] = digital_in[0:7] ;\n"
+  "  map digital_out[0:7] = digital_out[0:7] ;\n"
+  "  map analog_in[5:6] = analog_in[0:1] ;\n"
+  "}\n";
+
+static struct config_dir config_dir;
+
+static int set_mtime(const struct timespec *mtime)
+{
+  struct timespec times[2] = { { .tv_nsec = UTIME_OMIT }, *mtime };
+  return utimensat(AT_FDCWD, config_dir.file, times, 0) == 0;
+}
+
+/* Non-zero if analog_in[index] can be opened and read */
+static int mapped(struct moberg *moberg, int index)
+{
+  struct moberg_analog_in ai;
+  double value;
+  if (! moberg_OK(moberg_analog_in_open(moberg, index, &ai))) {
+    return 0;
+  }
+  int result = moberg_OK(ai.read(ai.context, &value));
+  moberg_analog_in_close(moberg, index, ai);
+  return result;
+}
+
+/* Checks which config moberg_new sees, eager and lazy */
+static int expect(const char *what, int index)
+{
+  int failed = 0;
+  for (int lazy = 0 ; lazy < 2 ; lazy++) {
+    setenv("MOBERG_LAZY", lazy ? "1" : "0", 1);
+    struct moberg *moberg = moberg_new();
+    if (! moberg) {
+      fprintf(stderr, "NEW failed\n");
+      return 0;
+    }
+    int other = index == 0 ? 5 : 0;
+    if (! mapped(moberg, index) || mapped(moberg, other)) {
+      fprintf(stderr, "%s%s: analog_in[%d] not mapped\n",
+              what, lazy ? " (lazy)" : "", index);
+      failed++;
+    }
+    struct moberg_digital_out dout;
+    struct moberg_digital_in din;
+    int value;
+    if (! moberg_OK(moberg_digital_out_open(moberg, 3, &dout))) {
+      fprintf(stderr, "%s: OPEN digital_out 3 failed\n", what);
+      failed++;
+    } else {
+      if (! moberg_OK(moberg_digital_in_open(moberg, 3, &din))) {
+        fprintf(stderr, "%s: OPEN digital_in 3 failed\n", what);
+        failed++;
+      } else {
+        if (! moberg_OK(dout.write(dout.context, 1, NULL)) ||
+            ! moberg_OK(din.read(din.context, &value)) || value != 1) {
+          fprintf(stderr, "%s: digital I/O failed\n", what);
+          failed++;
+        }
+        moberg_digital_in_close(moberg, 3, din);
+      }
+      moberg_digital_out_close(moberg, 3, dout);
+    }
+    moberg_free(moberg);
+  }
+  return failed == 0;
+}
+
+static int run(void)
+{
+  int failed = 0;
+  struct stat statbuf;
+
+  /* Nothing to compile */
+  struct moberg_status status = moberg_compile();
+  if (moberg_OK(status) || status.result != ENOENT) {
+    fprintf(stderr, "COMPILE without configuration did not fail\n");
+    failed++;
+  }
+
+  if (! config_dir_write(&config_dir, config_a)) {
+    fprintf(stderr, "Failed to write %s\n", config_dir.file);
+    return 0;
+  }
+  if (! moberg_OK(moberg_compile()) || stat(config_dir.cache, &statbuf) != 0) {
+    fprintf(stderr, "COMPILE failed\n");
+    return 0;
+  }
+  failed += ! expect("compiled", 0);
+
+  /* Same size and mtime, the cache is trusted */
+  if (stat(config_dir.file, &statbuf) != 0 ||
+      ! config_dir_write(&config_dir, config_b) ||
+      ! set_mtime(&statbuf.st_mtim)) {
+    fprintf(stderr, "Failed to rewrite %s\n", config_dir.file);
+    return 0;
+  }
+  failed += ! expect("same mtime", 0);
+
+  /* New mtime, the contents are compared */
+  struct timespec later = statbuf.st_mtim;
+  later.tv_sec += 10;
+  if (! set_mtime(&later)) {
+    fprintf(stderr, "Failed to touch %s\n", config_dir.file);
+    return 0;
+  }
+  failed += ! expect("changed", 5);
+
+  /* Only touched, the cache is still used */
+  if (! moberg_OK(moberg_compile())) {
+    fprintf(stderr, "COMPILE changed failed\n");
+    failed++;
+  }
+  later.tv_sec += 10;
+  if (! set_mtime(&later)) {
+    fprintf(stderr, "Failed to touch %s\n", config_dir.file);
+    return 0;
+  }
+  failed += ! expect("touched", 5);
+
+  /* A damaged cache is ignored */
+  if (truncate(config_dir.cache, 40) != 0) {
+    fprintf(stderr, "Failed to truncate %s\n", config_dir.cache);
+    failed++;
+  }
+  failed += ! expect("damaged", 5);
+  if (! moberg_OK(moberg_compile()) ||
+      ! config_dir_write(&config_dir, config_a)) {
+    fprintf(stderr, "COMPILE damaged failed\n");
+    failed++;
+  }
+  failed += ! expect("rewritten", 0);
+
+  return failed == 0;
+}
+
+int main(int argc, char *argv[])
+{
+  if (! config_dir_create(&config_dir, "test_cache")) {
+    return 1;
+  }
+  int ok = run();
+  config_dir_remove(&config_dir);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <string.h>
+#include <moberg.h>
+
+#define N 1000
+
+/* Compare against straightforward per-sample conversion, for channel
+   counts that don't match any vector width */
+int main(int argc, char *argv[])
+{
+  static uint16_t raw16[N];
+  static uint32_t raw32[N];
+  static double value[N], desired[N];
+  static float valuef[N];
+  double offset[13], scale[13];
+  uint32_t maxdata[13];
+
+  fprintf(stderr, "CONVERT kernel %s\n", moberg_convert_kernel());
+  for (int i = 0 ; i < N ; i++) {
+    raw16[i] = i * 65;
+    raw32[i] = 4294967295u - i * 4294967u;
+    desired[i] = (i - N / 2) * 0.025;
+  }
+  desired[7] = 0.0 / 0.0;
+  for (int count = 1 ; count <= 13 ; count++) {
+    for (int i = 0 ; i < count ; i++) {
+      offset[i] = -10.0 + i;
+      scale[i] = 20.0 / (65536 << (i % 3));
+      maxdata[i] = (65536u << (i % 3)) - 1;
+    }
+    for (int first = 0 ; first < count ; first++) {
+      moberg_convert_uint16_to_double(N, raw16, value, count, first,
+                                      offset, scale);
+      for (int i = 0, c = first ; i < N ; i++, c = (c + 1) % count) {
+        if (value[i] != offset[c] + raw16[i] * scale[c]) {
+          fprintf(stderr, "UINT16 %d/%d %d: %f\n", count, first, i, value[i]);
+          return 1;
+        }
+      }
+      moberg_convert_uint32_to_double(N, raw32, value, count, first,
+                                      offset, scale);
+      for (int i = 0, c = first ; i < N ; i++, c = (c + 1) % count) {
+        if (value[i] != offset[c] + raw32[i] * scale[c]) {
+          fprintf(stderr, "UINT32 %d/%d %d: %f\n", count, first, i, value[i]);
+          return 1;
+        }
+      }
+      moberg_convert_uint32_to_float(N, raw32, valuef, count, first,
+                                     offset, scale);
+      for (int i = 0, c = first ; i < N ; i++, c = (c + 1) % count) {
+        if (valuef[i] != (float)offset[c] + (float)raw32[i] * (float)scale[c]) {
+          fprintf(stderr, "FLOAT %d/%d %d: %f\n", count, first, i, valuef[i]);
+          return 1;
+        }
+      }
+      moberg_convert_double_to_uint32(N, desired, raw32, count, first,
+                                      offset, scale, maxdata);
+      for (int i = 0, c = first ; i < N ; i++, c = (c + 1) % count) {
+        double x = (desired[i] - offset[c]) / scale[c];
+        uint32_t expected = x > maxdata[c] ? maxdata[c] : x > 0 ? x : 0;
+        if (raw32[i] != expected) {
+          fprintf(stderr, "QUANTIZE %d/%d %d: %u != %u\n",
+                  count, first, i, raw32[i], expected);
+          return 1;
+        }
+      }
+    }
+  }
+  if (moberg_OK(moberg_convert_uint16_to_double(N, raw16, value, 2, 2,
+                                                offset, scale))) {
+    fprintf(stderr, "CONVERT accepted bad channel\n");
+    return 1;
+  }
+  return 0;
+}
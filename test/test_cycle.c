@@ -0,0 +1,74 @@
+#define _POSIX_C_SOURCE  200809L
+
+#include <stdio.h>
+#include <time.h>
+#include <moberg.h>
+
+#define CYCLES 50
+
+struct state {
+  int errors;
+};
+
+static int callback(void *data, struct moberg_cycle_io *io)
+{
+  struct state *state = data;
+  /* Output of previous cycle is read back on analog_in[0] */
+  if (io->cycle > 0 && io->analog_in[0] != io->cycle - 1) {
+    fprintf(stderr, "CYCLE %ld: %f\n", io->cycle, io->analog_in[0]);
+    state->errors++;
+  }
+  io->analog_out[0] = io->cycle;
+  io->digital_out[0] = io->cycle & 0x1;
+  return io->cycle >= CYCLES - 1;
+}
+
+int main(int argc, char *argv[])
+{
+  int result = 1;
+  struct moberg *moberg = moberg_new(NULL);
+  if (! moberg) {
+    fprintf(stderr, "NEW failed\n");
+    goto out;
+  }
+  struct moberg_cycle *cycle;
+  int ai[1] = { 0 }, di[1] = { 0 }, ao[1] = { 0 }, dout[1] = { 0 };
+  if (! moberg_OK(moberg_cycle_new(moberg, 0.001, 0,
+                                   1, ai, 1, di, 0, NULL,
+                                   1, ao, 1, dout,
+                                   &cycle))) {
+    fprintf(stderr, "CYCLE new failed\n");
+    goto free;
+  }
+  struct state state = { 0 };
+  if (! moberg_OK(moberg_cycle_start(cycle, callback, &state))) {
+    fprintf(stderr, "CYCLE start failed\n");
+    goto free_cycle;
+  }
+  struct moberg_cycle_stats stats;
+  for (int i = 0 ; i < 1000 ; i++) {
+    struct timespec delay = { .tv_sec=0, .tv_nsec=1000000 };
+    moberg_cycle_stats(cycle, &stats);
+    if (stats.cycles >= CYCLES) {
+      break;
+    }
+    nanosleep(&delay, NULL);
+  }
+  if (! moberg_OK(moberg_cycle_stop(cycle))) {
+    fprintf(stderr, "CYCLE terminated with error\n");
+    goto free_cycle;
+  }
+  moberg_cycle_stats(cycle, &stats);
+  fprintf(stderr, "CYCLE cycles=%ld overruns=%ld jitter=%g/%g exec=%g\n",
+          stats.cycles, stats.overruns,
+          stats.jitter_mean, stats.jitter_max, stats.execution_max);
+  if (stats.cycles == CYCLES && state.errors == 0) {
+    result = 0;
+  }
+free_cycle:
+  moberg_cycle_free(cycle);
+free:
+  moberg_free(moberg);
+out:
+  return result;
+}
@@ -0,0 +1,199 @@
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <moberg.h>
+#include <config_dir.h>
+
+/* With MOBERG_LAZY=1 no driver is loaded by moberg_new: libtest is
+   loaded by the first open that uses it (from several threads at
+   once, batch calls need open channels and load nothing), a device
+   with a missing driver only fails its own channels, and the
+   configuration can still be reloaded */
+
+#define THREADS 8
+
+static const char *config =
+  "driver(libtest) {\n"
+  "  config { }\n"
+  "  map digital_in[0:7] = digital_in[0:7] ;\n"
+  "  map digital_out[0:7] = digital_out[0:7] ;\n"
+  "  map analog_in[0:1] = analog_in[0:1] ;\n"
+  "}\n"
+  "driver(missing) {\n"
+  "  config { device = \"/dev/missing\" ; list = [ a b ] ; }\n"
+  "  map analog_in[10:11] = { subdevice[1][0:1] } ;\n"
+  "}\n";
+
+static struct config_dir config_dir;
+
+struct worker {
+  pthread_t thread;
+  struct moberg *moberg;
+  int index;
+  int failed;
+};
+
+static int libtest_loaded(void)
+{
+  void *handle = dlopen("libmoberg_libtest.so", RTLD_LAZY | RTLD_NOLOAD);
+  if (handle) {
+    dlclose(handle);
+  }
+  return handle != NULL;
+}
+
+static void *work(void *arg)
+{
+  struct worker *worker = arg;
+  struct moberg *moberg = worker->moberg;
+  int index = worker->index;
+  struct moberg_digital_out dout;
+  struct moberg_digital_in din;
+  int value;
+
+  if (! moberg_OK(moberg_digital_out_open(moberg, index, &dout))) {
+    fprintf(stderr, "OPEN digital_out %d failed\n", index);
+    worker->failed++;
+    return NULL;
+  }
+  if (! moberg_OK(moberg_digital_in_open(moberg, index, &din))) {
+    fprintf(stderr, "OPEN digital_in %d failed\n", index);
+    worker->failed++;
+  } else {
+    if (! moberg_OK(dout.write(dout.context, 1, NULL)) ||
+        ! moberg_OK(din.read(din.context, &value)) || value != 1) {
+      fprintf(stderr, "I/O %d failed\n", index);
+      worker->failed++;
+    }
+    moberg_digital_in_close(moberg, index, din);
+  }
+  moberg_digital_out_close(moberg, index, dout);
+  return NULL;
+}
+
+static int run(void)
+{
+  int failed = 0;
+
+  if (! config_dir_write(&config_dir, config)) {
+    fprintf(stderr, "Failed to write %s\n", config_dir.file);
+    return 0;
+  }
+  struct moberg *moberg = moberg_new();
+  if (! moberg) {
+    fprintf(stderr, "NEW failed\n");
+    return 0;
+  }
+  if (libtest_loaded()) {
+    fprintf(stderr, "libtest loaded by moberg_new\n");
+    failed++;
+  }
+
+  /* Only the channels of the missing driver fail, every time */
+  struct moberg_analog_in ai;
+  for (int i = 0 ; i < 2 ; i++) {
+    if (moberg_OK(moberg_analog_in_open(moberg, 10, &ai))) {
+      fprintf(stderr, "OPEN analog_in 10 (missing driver) succeeded\n");
+      moberg_analog_in_close(moberg, 10, ai);
+      failed++;
+    }
+  }
+  if (libtest_loaded()) {
+    fprintf(stderr, "libtest loaded by other device\n");
+    failed++;
+  }
+
+  /* Batch calls need open channels, so they load nothing */
+  int index[2] = { 0, 1 };
+  double value[2];
+  struct moberg_status status = moberg_analog_in_read_many(moberg, 2,
+                                                           index, value);
+  if (moberg_OK(status) || status.result != EBADF || libtest_loaded()) {
+    fprintf(stderr, "READ_MANY of unopened analog_in did not fail\n");
+    failed++;
+  }
+
+  /* First use from several threads at once */
+  struct worker worker[THREADS];
+  int started;
+  for (started = 0 ; started < THREADS ; started++) {
+    worker[started].moberg = moberg;
+    worker[started].index = started;
+    worker[started].failed = 0;
+    if (pthread_create(&worker[started].thread, NULL,
+                       work, &worker[started]) != 0) {
+      fprintf(stderr, "THREAD %d failed\n", started);
+      failed++;
+      break;
+    }
+  }
+  for (int i = 0 ; i < started ; i++) {
+    pthread_join(worker[i].thread, NULL);
+    failed += worker[i].failed;
+  }
+  if (! libtest_loaded()) {
+    fprintf(stderr, "libtest not loaded by open\n");
+    failed++;
+  }
+
+  /* Unmapped indices are still unknown, mapped ones work */
+  struct moberg_analog_in ai0, ai1;
+  if (! moberg_OK(moberg_analog_in_open(moberg, 0, &ai0))) {
+    fprintf(stderr, "OPEN analog_in 0 failed\n");
+    failed++;
+  } else {
+    if (! moberg_OK(moberg_analog_in_open(moberg, 1, &ai1))) {
+      fprintf(stderr, "OPEN analog_in 1 failed\n");
+      failed++;
+    } else {
+      if (! moberg_OK(moberg_analog_in_read_many(moberg, 2, index, value))) {
+        fprintf(stderr, "READ_MANY analog_in failed\n");
+        failed++;
+      }
+      moberg_analog_in_close(moberg, 1, ai1);
+    }
+    moberg_analog_in_close(moberg, 0, ai0);
+  }
+  if (moberg_OK(moberg_analog_in_open(moberg, 2, &ai))) {
+    fprintf(stderr, "OPEN unmapped analog_in 2 succeeded\n");
+    moberg_analog_in_close(moberg, 2, ai);
+    failed++;
+  }
+
+  /* Open channels survive a reload of the lazy configuration */
+  struct moberg_digital_in din;
+  int bit;
+  if (! moberg_OK(moberg_digital_in_open(moberg, 3, &din))) {
+    fprintf(stderr, "OPEN digital_in 3 failed\n");
+    failed++;
+  } else {
+    if (! moberg_OK(moberg_reload(moberg)) ||
+        ! moberg_OK(din.read(din.context, &bit)) || bit != 1) {
+      fprintf(stderr, "READ digital_in 3 after reload failed\n");
+      failed++;
+    }
+    moberg_digital_in_close(moberg, 3, din);
+  }
+  if (moberg_OK(moberg_analog_in_open(moberg, 11, &ai))) {
+    fprintf(stderr, "OPEN analog_in 11 after reload succeeded\n");
+    moberg_analog_in_close(moberg, 11, ai);
+    failed++;
+  }
+  moberg_free(moberg);
+  return failed == 0;
+}
+
+int main(int argc, char *argv[])
+{
+  setenv("MOBERG_LAZY", "1", 1);
+  if (! config_dir_create(&config_dir, "test_lazy")) {
+    return 1;
+  }
+  int ok = run();
+  config_dir_remove(&config_dir);
+  return ok ? 0 : 1;
+}
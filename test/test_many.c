@@ -0,0 +1,213 @@
+#include <errno.h>
+#include <stdio.h>
+#include <moberg.h>
+
+int main(int argc, char *argv[])
+{
+  int result = 1;
+  struct moberg *moberg = moberg_new(NULL);
+  if (! moberg) {
+    fprintf(stderr, "NEW failed\n");
+    goto out;
+  }
+  struct moberg_analog_in ai[4];
+  struct moberg_analog_out ao0;
+  int ai_index[4] = { 3, 0, 2, 1 };
+  double ai_value[4];
+  int opened = 0;
+  for (opened = 0 ; opened < 4 ; opened++) {
+    if (! moberg_OK(moberg_analog_in_open(moberg, ai_index[opened],
+                                          &ai[opened]))) {
+      fprintf(stderr, "OPEN analog_in %d failed\n", ai_index[opened]);
+      goto close_ai;
+    }
+  }
+  if (! moberg_OK(moberg_analog_out_open(moberg, 0, &ao0))) {
+    fprintf(stderr, "OPEN analog_out 0 failed\n");
+    goto close_ai;
+  }
+  if (! moberg_OK(ao0.write(ao0.context, 12.0, NULL))) {
+    fprintf(stderr, "WRITE failed\n");
+    goto close_ao0;
+  }
+  if (! moberg_OK(moberg_analog_in_read_many(moberg, 4, ai_index, ai_value))) {
+    fprintf(stderr, "READ_MANY failed\n");
+    goto close_ao0;
+  }
+  for (int i = 0 ; i < 4 ; i++) {
+    double single;
+    if (! moberg_OK(ai[i].read(ai[i].context, &single))) {
+      fprintf(stderr, "READ failed\n");
+      goto close_ao0;
+    }
+    fprintf(stderr, "READ_MANY ai%d: %f %f\n", ai_index[i], ai_value[i], single);
+    if (ai_value[i] != single) {
+      goto close_ao0;
+    }
+  }
+  /* Indices may repeat, up to MOBERG_MANY_MAX of them */
+  int many_index[MOBERG_MANY_MAX + 1];
+  double many_value[MOBERG_MANY_MAX + 1];
+  for (int i = 0 ; i <= MOBERG_MANY_MAX ; i++) {
+    many_index[i] = ai_index[0];
+  }
+  if (! moberg_OK(moberg_analog_in_read_many(moberg, MOBERG_MANY_MAX,
+                                             many_index, many_value))) {
+    fprintf(stderr, "READ_MANY %d failed\n", MOBERG_MANY_MAX);
+    goto close_ao0;
+  }
+  struct moberg_status too_many =
+    moberg_analog_in_read_many(moberg, MOBERG_MANY_MAX + 1,
+                               many_index, many_value);
+  if (moberg_OK(too_many) || too_many.result != EINVAL) {
+    fprintf(stderr, "READ_MANY %d did not fail\n", MOBERG_MANY_MAX + 1);
+    goto close_ao0;
+  }
+  int ao_index[1] = { 0 };
+  double ao_desired[1] = { 3.0 }, ao_actual[1];
+  if (! moberg_OK(moberg_analog_out_write_many(moberg, 1, ao_index,
+                                               ao_desired, ao_actual))) {
+    fprintf(stderr, "WRITE_MANY analog_out failed\n");
+    goto close_ao0;
+  }
+  fprintf(stderr, "WRITE_MANY ao0: %f %f\n", ao_desired[0], ao_actual[0]);
+  if (ao_actual[0] != ao_desired[0]) {
+    goto close_ao0;
+  }
+  struct moberg_digital_out do_[3];
+  struct moberg_digital_in di;
+  int do_index[3] = { 2, 0, 1 };
+  int do_desired[3] = { 1, 1, 0 };
+  int do_opened;
+  for (do_opened = 0 ; do_opened < 3 ; do_opened++) {
+    if (! moberg_OK(moberg_digital_out_open(moberg, do_index[do_opened],
+                                            &do_[do_opened]))) {
+      fprintf(stderr, "OPEN digital_out %d failed\n", do_index[do_opened]);
+      goto close_do;
+    }
+  }
+  if (! moberg_OK(moberg_digital_out_write_many(moberg, 3, do_index,
+                                                do_desired, NULL))) {
+    fprintf(stderr, "WRITE_MANY digital_out failed\n");
+    goto close_do;
+  }
+  for (int i = 0 ; i < 3 ; i++) {
+    int value;
+    if (! moberg_OK(moberg_digital_in_open(moberg, do_index[i], &di))) {
+      fprintf(stderr, "OPEN digital_in %d failed\n", do_index[i]);
+      goto close_do;
+    }
+    struct moberg_status status = di.read(di.context, &value);
+    moberg_digital_in_close(moberg, do_index[i], di);
+    if (! moberg_OK(status)) {
+      fprintf(stderr, "READ failed\n");
+      goto close_do;
+    }
+    fprintf(stderr, "WRITE_MANY do%d: %d %d\n",
+            do_index[i], do_desired[i], value);
+    if (value != do_desired[i]) {
+      goto close_do;
+    }
+  }
+  unsigned int word;
+  if (! moberg_OK(moberg_digital_out_write_word(moberg, 0, 0x7, 0x2))) {
+    fprintf(stderr, "WORD write failed\n");
+    goto close_do;
+  }
+  /* Like *_many, only opened channels */
+  struct moberg_status status = moberg_digital_in_read_word(moberg, 0, 0x7,
+                                                            &word);
+  if (moberg_OK(status) || status.result != EBADF) {
+    fprintf(stderr, "WORD read of unopened channels did not fail\n");
+    goto close_do;
+  }
+  struct moberg_digital_in di_word[3];
+  int di_opened;
+  for (di_opened = 0 ; di_opened < 3 ; di_opened++) {
+    if (! moberg_OK(moberg_digital_in_open(moberg, di_opened,
+                                           &di_word[di_opened]))) {
+      break;
+    }
+  }
+  int word_read = (di_opened == 3 &&
+                   moberg_OK(moberg_digital_in_read_word(moberg, 0, 0x7,
+                                                         &word)));
+  for (int i = 0 ; i < di_opened ; i++) {
+    moberg_digital_in_close(moberg, i, di_word[i]);
+  }
+  if (! word_read) {
+    fprintf(stderr, "WORD read failed\n");
+    goto close_do;
+  }
+  fprintf(stderr, "WORD di[0:2]: 0x%02x\n", word);
+  if (word != 0x2) {
+    goto close_do;
+  }
+  moberg_digital_out_write_many(moberg, 3, do_index, do_desired, NULL);
+  struct moberg_sample_group *group;
+  int group_ai[2] = { 0, 1 }, group_di[2] = { 0, 2 }, group_ei[1] = { 1 };
+  struct moberg_analog_in gai1;
+  struct moberg_digital_in gdi2;
+  struct moberg_encoder_in gei1;
+  double gai1_value;
+  int gdi2_value;
+  long gei1_value;
+  if (! moberg_OK(moberg_sample_group_new(moberg, 2, group_ai, 2, group_di,
+                                          1, group_ei, &group))) {
+    fprintf(stderr, "SAMPLE_GROUP new failed\n");
+    goto close_do;
+  }
+  if (! moberg_OK(moberg_sample_group_analog_in(group, 1, &gai1)) ||
+      ! moberg_OK(moberg_sample_group_digital_in(group, 2, &gdi2)) ||
+      ! moberg_OK(moberg_sample_group_encoder_in(group, 1, &gei1))) {
+    fprintf(stderr, "SAMPLE_GROUP member failed\n");
+    goto free_group;
+  }
+  if (moberg_OK(gai1.read(gai1.context, &gai1_value))) {
+    fprintf(stderr, "SAMPLE_GROUP read before update succeeded\n");
+    goto free_group;
+  }
+  if (! moberg_OK(moberg_sample_group_update(group))) {
+    fprintf(stderr, "SAMPLE_GROUP update failed\n");
+    goto free_group;
+  }
+  /* Snapshot is kept until next update */
+  ao0.write(ao0.context, 8.0, NULL);
+  gai1.read(gai1.context, &gai1_value);
+  gdi2.read(gdi2.context, &gdi2_value);
+  gei1.read(gei1.context, &gei1_value);
+  fprintf(stderr, "SAMPLE_GROUP ai1=%f di2=%d ei1=%ld\n",
+          gai1_value, gdi2_value, gei1_value);
+  if (gai1_value != 1.5 || gdi2_value != 1 || gei1_value != 10) {
+    goto free_group;
+  }
+  moberg_sample_group_update(group);
+  gai1.read(gai1.context, &gai1_value);
+  fprintf(stderr, "SAMPLE_GROUP ai1=%f\n", gai1_value);
+  if (gai1_value != 4.0) {
+    goto free_group;
+  }
+  /* Each update is a new cycle generation */
+  unsigned long generation = moberg_advance_generation(moberg);
+  moberg_sample_group_update(group);
+  if (moberg_advance_generation(moberg) != generation + 2) {
+    fprintf(stderr, "GENERATION not advanced by update\n");
+    goto free_group;
+  }
+  result = 0;
+free_group:
+  moberg_sample_group_free(group);
+close_do:
+  for (int i = 0 ; i < do_opened ; i++) {
+    moberg_digital_out_close(moberg, do_index[i], do_[i]);
+  }
+close_ao0:
+  moberg_analog_out_close(moberg, 0, ao0);
+close_ai:
+  for (int i = 0 ; i < opened ; i++) {
+    moberg_analog_in_close(moberg, ai_index[i], ai[i]);
+  }
+  moberg_free(moberg);
+out:
+  return result;
+}
@@ -0,0 +1,306 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <moberg.h>
+#include <config_dir.h>
+
+/* Reloads the (libtest) configuration while channels are open: the
+   digital channels are unchanged and must keep the device state and
+   keep working from another thread during the reloads, analog_in[2]
+   is remapped (the open handle is retired but stays usable until
+   closed), analog_in[3] disappears and analog_in[4] is added. The
+   statistics of recycled channels must not be mixed up */
+
+#define RELOADS 20
+
+static const char *config_a =
+  "driver(libtest) {\n"
+  "  config { }\n"
+  "  map digital_in[0:7] = digital_in[0:7] ;\n"
+  "  map digital_out[0:7] = digital_out[0:7] ;\n"
+  "  map analog_in[0:1] = analog_in[0:1] ;\n"
+  "  map analog_in[2:3] = analog_in[2:3] ;\n"
+  "}\n";
+
+/* Same device, comments and whitespace in the config do not matter */
+static const char *config_b =
+  "driver(libtest) {\n"
+  "  config {  /* unchanged */ }\n"
+  "  map digital_in[0:7] = digital_in[0:7] ;\n"
+  "  map digital_out[0:7]   =   digital_out[0:7] ;\n"
+  "  map analog_in[0:1] = analog_in[0:1] ;\n"
+  "  map analog_in[2] = analog_in[4] ;\n"
+  "  map analog_in[4] = analog_in[5] ;\n"
+  "}\n";
+
+/* Alternated with MOBERG_STATS=1, the channels of one are freed when
+   the other is loaded, so their addresses are likely to be recycled */
+static const char *config_analog =
+  "driver(libtest) {\n"
+  "  config { }\n"
+  "  map analog_in[0:3] = analog_in[0:3] ;\n"
+  "}\n";
+
+static const char *config_digital =
+  "driver(libtest) {\n"
+  "  config { }\n"
+  "  map digital_in[0:3] = digital_in[0:3] ;\n"
+  "}\n";
+
+static struct config_dir config_dir;
+
+struct reader {
+  struct moberg *moberg;
+  struct moberg_digital_in din;
+  int stop;
+  long reads;
+  long failed;
+};
+
+static void *read_digital(void *arg)
+{
+  struct reader *reader = arg;
+
+  while (! __atomic_load_n(&reader->stop, __ATOMIC_ACQUIRE)) {
+    int value;
+    if (! moberg_OK(reader->din.read(reader->din.context, &value)) ||
+        value != 1) {
+      reader->failed++;
+    }
+    /* Batch and device wide calls, concurrently with moberg_reload */
+    int index = 2;
+    if (! moberg_OK(moberg_digital_in_read_many(reader->moberg, 1,
+                                                &index, &value)) ||
+        value != 1 ||
+        ! moberg_OK(moberg_flush(reader->moberg))) {
+      reader->failed++;
+    }
+    moberg_advance_generation(reader->moberg);
+    reader->reads++;
+  }
+  return NULL;
+}
+
+static int run(void)
+{
+  int failed = 0;
+  struct moberg_digital_out dout;
+  struct moberg_digital_in din;
+  struct moberg_analog_in ai1, ai2, ai3, ai4;
+  double analog;
+  int value;
+
+  if (! config_dir_write(&config_dir, config_a)) {
+    fprintf(stderr, "Failed to write %s\n", config_dir.file);
+    return 0;
+  }
+  struct moberg *moberg = moberg_new();
+  if (! moberg) {
+    fprintf(stderr, "NEW failed\n");
+    return 0;
+  }
+  if (! moberg_OK(moberg_digital_out_open(moberg, 2, &dout)) ||
+      ! moberg_OK(moberg_digital_in_open(moberg, 2, &din)) ||
+      ! moberg_OK(moberg_analog_in_open(moberg, 1, &ai1)) ||
+      ! moberg_OK(moberg_analog_in_open(moberg, 2, &ai2))) {
+    fprintf(stderr, "OPEN failed\n");
+    failed++;
+    goto free;
+  }
+  if (! moberg_OK(moberg_analog_in_open(moberg, 3, &ai3)) ||
+      ! moberg_OK(moberg_analog_in_close(moberg, 3, ai3))) {
+    fprintf(stderr, "OPEN analog_in 3 failed\n");
+    failed++;
+  }
+  if (! moberg_OK(dout.write(dout.context, 1, NULL))) {
+    fprintf(stderr, "WRITE digital_out 2 failed\n");
+    failed++;
+  }
+
+  if (! config_dir_write(&config_dir, config_b) ||
+      ! moberg_OK(moberg_reload(moberg))) {
+    fprintf(stderr, "RELOAD failed\n");
+    failed++;
+    goto close;
+  }
+  /* The libtest device context (and its digital state) is kept */
+  struct moberg_digital_in fresh;
+  if (! moberg_OK(din.read(din.context, &value)) || value != 1) {
+    fprintf(stderr, "READ digital_in 2 after reload failed\n");
+    failed++;
+  }
+  if (! moberg_OK(moberg_digital_in_open(moberg, 2, &fresh)) ||
+      ! moberg_OK(fresh.read(fresh.context, &value)) || value != 1 ||
+      ! moberg_OK(moberg_digital_in_close(moberg, 2, fresh))) {
+    fprintf(stderr, "READ reopened digital_in 2 after reload failed\n");
+    failed++;
+  }
+  if (! moberg_OK(ai1.read(ai1.context, &analog))) {
+    fprintf(stderr, "READ analog_in 1 after reload failed\n");
+    failed++;
+  }
+  /* Retired, but still usable */
+  if (! moberg_OK(ai2.read(ai2.context, &analog))) {
+    fprintf(stderr, "READ retired analog_in 2 failed\n");
+    failed++;
+  }
+  if (moberg_OK(moberg_analog_in_open(moberg, 3, &ai3))) {
+    fprintf(stderr, "OPEN removed analog_in 3 succeeded\n");
+    moberg_analog_in_close(moberg, 3, ai3);
+    failed++;
+  }
+  if (! moberg_OK(moberg_analog_in_open(moberg, 4, &ai4)) ||
+      ! moberg_OK(ai4.read(ai4.context, &analog)) ||
+      ! moberg_OK(moberg_analog_in_close(moberg, 4, ai4))) {
+    fprintf(stderr, "OPEN added analog_in 4 failed\n");
+    failed++;
+  }
+  if (! moberg_OK(moberg_analog_in_close(moberg, 2, ai2))) {
+    fprintf(stderr, "CLOSE retired analog_in 2 failed\n");
+    failed++;
+  }
+  if (! moberg_OK(moberg_analog_in_open(moberg, 2, &ai2)) ||
+      ! moberg_OK(moberg_analog_in_close(moberg, 2, ai2))) {
+    fprintf(stderr, "OPEN remapped analog_in 2 failed\n");
+    failed++;
+  }
+
+  /* No I/O gap for unchanged channels */
+  struct reader reader = { .moberg = moberg, .din = din, .stop = 0 };
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, read_digital, &reader) != 0) {
+    fprintf(stderr, "THREAD failed\n");
+    failed++;
+    goto close;
+  }
+  for (int i = 0 ; i < RELOADS ; i++) {
+    if (! config_dir_write(&config_dir, i & 1 ? config_b : config_a) ||
+        ! moberg_OK(moberg_reload(moberg))) {
+      fprintf(stderr, "RELOAD %d failed\n", i);
+      failed++;
+    }
+    if (! moberg_OK(moberg_digital_in_open(moberg, 2, &fresh)) ||
+        ! moberg_OK(fresh.read(fresh.context, &value)) || value != 1 ||
+        ! moberg_OK(moberg_digital_in_close(moberg, 2, fresh))) {
+      fprintf(stderr, "READ reopened digital_in 2 after reload %d failed\n",
+              i);
+      failed++;
+    }
+  }
+  __atomic_store_n(&reader.stop, 1, __ATOMIC_RELEASE);
+  pthread_join(thread, NULL);
+  if (reader.failed) {
+    fprintf(stderr, "%ld of %ld reads failed during reload\n",
+            reader.failed, reader.reads);
+    failed++;
+  }
+
+  /* Without any configuration the old one is kept */
+  unlink(config_dir.file);
+  struct moberg_status status = moberg_reload(moberg);
+  if (moberg_OK(status) || status.result != ENOENT) {
+    fprintf(stderr, "RELOAD without configuration did not fail\n");
+    failed++;
+  }
+  if (! moberg_OK(din.read(din.context, &value)) || value != 1) {
+    fprintf(stderr, "READ digital_in 2 after failed reload failed\n");
+    failed++;
+  }
+
+close:
+  moberg_analog_in_close(moberg, 1, ai1);
+  moberg_digital_in_close(moberg, 2, din);
+  moberg_digital_out_close(moberg, 2, dout);
+free:
+  moberg_free(moberg);
+  return failed == 0;
+}
+
+/* Statistics follow the channels of the current configuration */
+static int run_stats(void)
+{
+  int failed = 0;
+
+  if (! config_dir_write(&config_dir, config_analog)) {
+    fprintf(stderr, "Failed to write %s\n", config_dir.file);
+    return 0;
+  }
+  setenv("MOBERG_STATS", "1", 1);
+  struct moberg *moberg = moberg_new();
+  unsetenv("MOBERG_STATS");
+  if (! moberg) {
+    fprintf(stderr, "NEW failed\n");
+    return 0;
+  }
+  for (int i = 0 ; i < RELOADS ; i++) {
+    int analog = (i & 1) == 0;
+    const char *config = analog ? config_analog : config_digital;
+    if (i > 0 && (! config_dir_write(&config_dir, config) ||
+                  ! moberg_OK(moberg_reload(moberg)))) {
+      fprintf(stderr, "RELOAD %d failed\n", i);
+      failed++;
+      continue;
+    }
+    moberg_stats_reset(moberg);
+    if (analog) {
+      struct moberg_analog_in ai;
+      double value;
+      if (! moberg_OK(moberg_analog_in_open(moberg, 0, &ai)) ||
+          ! moberg_OK(ai.read(ai.context, &value)) ||
+          ! moberg_OK(moberg_analog_in_close(moberg, 0, ai))) {
+        fprintf(stderr, "READ analog_in 0 after reload %d failed\n", i);
+        failed++;
+      }
+    } else {
+      struct moberg_digital_in din;
+      int value;
+      if (! moberg_OK(moberg_digital_in_open(moberg, 0, &din)) ||
+          ! moberg_OK(din.read(din.context, &value)) ||
+          ! moberg_OK(moberg_digital_in_close(moberg, 0, din))) {
+        fprintf(stderr, "READ digital_in 0 after reload %d failed\n", i);
+        failed++;
+      }
+    }
+    const char *expected = analog ? "analog_in" : "digital_in";
+    const char *kind;
+    int index;
+    struct moberg_stats stats;
+    int counted = 0;
+    for (int n = 0 ;
+         moberg_OK(moberg_stats_channel(moberg, n, &kind, &index, &stats)) ;
+         n++) {
+      if (stats.count == 0) {
+        continue;
+      }
+      counted++;
+      if (strcmp(kind, expected) != 0 || index != 0 || stats.count != 1) {
+        fprintf(stderr, "STATS after reload %d: %s[%d] count %ld\n",
+                i, kind, index, stats.count);
+        failed++;
+      }
+    }
+    if (counted != 1) {
+      fprintf(stderr, "STATS after reload %d: %d channels counted\n",
+              i, counted);
+      failed++;
+    }
+  }
+  moberg_free(moberg);
+  return failed == 0;
+}
+
+int main(int argc, char *argv[])
+{
+  if (! config_dir_create(&config_dir, "test_reload")) {
+    return 1;
+  }
+  int ok = run();
+  ok = run_stats() && ok;
+  config_dir_remove(&config_dir);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <serial2002_lib.h>
+
+/* Compare the bulk decoder against byte at a time decoding (as
+   serial2002_read used to do) on random streams with FTDI event
+   characters and garbage, split at random buffer boundaries */
+
+#define N 100000
+
+struct event {
+  int error;
+  struct serial2002_data data;
+};
+
+static unsigned char stream[N];
+static struct event expected[N], actual[N];
+
+/* Same encoding as serial2002_write */
+static int encode(unsigned char *buf, struct serial2002_data data)
+{
+  int i = 0;
+  if (data.kind == is_digital) {
+    buf[i++] = ((data.value << 5) & 0x20) | (data.index & 0x1f);
+  } else {
+    if (data.value >= (1L << 30)) {
+      buf[i++] = 0x80 | ((data.value >> 30) & 0x03);
+    }
+    if (data.value >= (1L << 23)) {
+      buf[i++] = 0x80 | ((data.value >> 23) & 0x7f);
+    }
+    if (data.value >= (1L << 16)) {
+      buf[i++] = 0x80 | ((data.value >> 16) & 0x7f);
+    }
+    if (data.value >= (1L << 9)) {
+      buf[i++] = 0x80 | ((data.value >> 9) & 0x7f);
+    }
+    buf[i++] = 0x80 | ((data.value >> 2) & 0x7f);
+    buf[i++] = ((data.value << 5) & 0x60) | (data.index & 0x1f);
+  }
+  return i;
+}
+
+static int reference(const unsigned char *buf, int count, struct event *event)
+{
+  int n = 0, length = 0;
+  unsigned long value = 0;
+  for (int i = 0 ; i < count ; i++) {
+    unsigned char data = buf[i];
+    length++;
+    if (length < 6 && data & 0x80) {
+      value = (value << 7) | (data & 0x7f);
+    } else if (length == 6 && data & 0x80) {
+      event[n++] = (struct event){ EFBIG };
+      length = 0;
+      value = 0;
+    } else if (length > 1) {
+      event[n++] = (struct event){ 0, { is_channel, data & 0x1f,
+                                        (value << 2) | ((data & 0x60) >> 5) } };
+      length = 0;
+      value = 0;
+    } else if ((data & 0x60) == 0x00 || (data & 0x60) == 0x20) {
+      event[n++] = (struct event){ 0, { is_digital, data & 0x1f,
+                                        (data & 0x20) != 0 } };
+      length = 0;
+    } else {
+      if (data != 0x5e) {
+        event[n++] = (struct event){ EINVAL };
+      }
+      length = 0;
+    }
+  }
+  return n;
+}
+
+int main(int argc, char *argv[])
+{
+  srandom(2002);
+  int count = 0;
+  while (count < N - 8) {
+    int r = random() % 100;
+    if (r < 40) {
+      struct serial2002_data data = { is_channel, random() % 32,
+                                      random() >> (random() % 31) };
+      count += encode(&stream[count], data);
+    } else if (r < 80) {
+      struct serial2002_data data = { is_digital, random() % 32, random() & 1 };
+      count += encode(&stream[count], data);
+    } else if (r < 95) {
+      stream[count++] = 0x5e;
+    } else {
+      stream[count++] = random();
+    }
+  }
+  int n_expected = reference(stream, count, expected);
+  for (int round = 0 ; round < 20 ; round++) {
+    struct serial2002_decoder decoder = { 0, 0 };
+    int n_actual = 0, pos = 0;
+    while (pos < count) {
+      int chunk = 1 + random() % 64;
+      if (chunk > count - pos) {
+        chunk = count - pos;
+      }
+      int end = pos + chunk;
+      while (pos < end) {
+        struct serial2002_data frame[8];
+        int consumed = end - pos;
+        int frames = 1 + random() % 8;
+        struct moberg_status status =
+          serial2002_decode(&decoder, &stream[pos], &consumed, frame, &frames);
+        for (int i = 0 ; i < frames ; i++) {
+          actual[n_actual++] = (struct event){ 0, frame[i] };
+        }
+        if (! moberg_OK(status)) {
+          actual[n_actual++] = (struct event){ status.result };
+        }
+        pos += consumed;
+      }
+    }
+    if (n_actual != n_expected) {
+      fprintf(stderr, "DECODE round %d: %d events, expected %d\n",
+              round, n_actual, n_expected);
+      return 1;
+    }
+    for (int i = 0 ; i < n_expected ; i++) {
+      if (actual[i].error != expected[i].error ||
+          actual[i].data.kind != expected[i].data.kind ||
+          actual[i].data.index != expected[i].data.index ||
+          actual[i].data.value != expected[i].data.value) {
+        fprintf(stderr, "DECODE round %d event %d differs\n", round, i);
+        return 1;
+      }
+    }
+  }
+  fprintf(stderr, "DECODE %d bytes %d events\n", count, n_expected);
+  return 0;
+}
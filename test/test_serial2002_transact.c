@@ -0,0 +1,73 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <serial2002_lib.h>
+#include <serial2002_sim.h>
+
+/* A reply that arrives after serial2002_transact has given up on it
+   must not be taken as the reply to the next poll of the same
+   channel. The simulated counters reply with the number of earlier
+   polls, so a late reply shows up as a repeated value */
+
+#define COUNTER SERIAL2002_SIM_ANALOG
+#define TIMEOUT 20000 /* us */
+
+static void sleep_us(long us)
+{
+  struct timespec delay = { us / 1000000, us % 1000000 * 1000 };
+  while (nanosleep(&delay, &delay) != 0 && errno == EINTR) {
+  }
+}
+
+static int poll_counter(struct serial2002_io *io,
+                        int expected_result,
+                        unsigned long expected_value)
+{
+  struct serial2002_data request = { is_channel, COUNTER, ~0UL };
+  struct moberg_status result =
+    serial2002_transact(io, TIMEOUT, 4, 1, &request);
+  if (result.result != expected_result) {
+    fprintf(stderr, "TRANSACT returned %d, expected %d\n",
+            result.result, expected_result);
+    return 0;
+  }
+  if (moberg_OK(result) && request.value != expected_value) {
+    fprintf(stderr, "TRANSACT read %lu, expected %lu\n",
+            request.value, expected_value);
+    return 0;
+  }
+  return 1;
+}
+
+int main(int argc, char *argv[])
+{
+  struct serial2002_sim_options options = {
+    .delayed = COUNTER + 1,
+    .delay = 5 * TIMEOUT
+  };
+  struct serial2002_sim *sim;
+  struct serial2002_io io;
+  int ok = 1;
+
+  if (! moberg_OK(serial2002_sim_start(&options, &sim))) {
+    fprintf(stderr, "Failed to start simulator\n");
+    return 1;
+  }
+  int fd = open(serial2002_sim_device(sim), O_RDWR | O_NOCTTY);
+  if (fd < 0 || ! moberg_OK(serial2002_io_init(&io, fd, 128, 128))) {
+    fprintf(stderr, "Failed to open %s\n", serial2002_sim_device(sim));
+    serial2002_sim_stop(sim, NULL);
+    return 1;
+  }
+  /* The reply to poll 0 arrives after the timeout */
+  ok &= poll_counter(&io, ETIMEDOUT, 0);
+  sleep_us(2 * options.delay);
+  ok &= poll_counter(&io, 0, 1);
+  ok &= poll_counter(&io, 0, 2);
+  serial2002_io_free(&io);
+  close(fd);
+  serial2002_sim_stop(sim, NULL);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,62 @@
+#define _POSIX_C_SOURCE  200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <moberg.h>
+
+int main(int argc, char *argv[])
+{
+  int result = 1;
+  setenv("MOBERG_STATS", "1", 1);
+  struct moberg *moberg = moberg_new(NULL);
+  if (! moberg) {
+    fprintf(stderr, "NEW failed\n");
+    goto out;
+  }
+  struct moberg_analog_in ai0;
+  if (! moberg_OK(moberg_analog_in_open(moberg, 0, &ai0))) {
+    fprintf(stderr, "OPEN failed\n");
+    goto free;
+  }
+  for (int i = 0 ; i < 10 ; i++) {
+    double value;
+    ai0.read(ai0.context, &value);
+  }
+  int index[1] = { 0 };
+  double value[1];
+  moberg_analog_in_read_many(moberg, 1, index, value);
+  const char *kind;
+  int n, channel;
+  struct moberg_stats stats;
+  for (n = 0 ;
+       moberg_OK(moberg_stats_channel(moberg, n, &kind, &channel, &stats)) ;
+       n++) {
+    if (strcmp(kind, "analog_in") == 0 && channel == 0) {
+      break;
+    }
+  }
+  if (stats.count != 10 || stats.min > stats.mean || stats.mean > stats.max ||
+      moberg_stats_percentile(&stats, 50.0) > stats.max) {
+    fprintf(stderr, "STATS analog_in[0] count=%ld\n", stats.count);
+    goto close;
+  }
+  if (! moberg_OK(moberg_stats_device(moberg, 0, &kind, &stats)) ||
+      stats.count != 11) {
+    fprintf(stderr, "STATS device count=%ld\n", stats.count);
+    goto close;
+  }
+  fprintf(stderr, "STATS %s count=%ld mean=%g max=%g\n",
+          kind, stats.count, stats.mean, stats.max);
+  moberg_stats_reset(moberg);
+  moberg_stats_device(moberg, 0, &kind, &stats);
+  if (stats.count == 0) {
+    result = 0;
+  }
+close:
+  moberg_analog_in_close(moberg, 0, ai0);
+free:
+  moberg_free(moberg);
+out:
+  return result;
+}
@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <moberg.h>
+
+int main(int argc, char *argv[])
+{
+  int result = 1;
+  struct moberg *moberg = moberg_new(NULL);
+  if (! moberg) {
+    fprintf(stderr, "NEW failed\n");
+    goto out;
+  }
+  struct moberg_analog_out ao0;
+  if (! moberg_OK(moberg_analog_out_open(moberg, 0, &ao0))) {
+    fprintf(stderr, "OPEN failed\n");
+    goto free;
+  }
+  ao0.write(ao0.context, 2.0, NULL);
+
+  struct moberg_stream *stream;
+  int index[2] = { 0, 1 };
+  if (! moberg_OK(moberg_stream_open(moberg, 2, index, 1000.0, &stream))) {
+    fprintf(stderr, "STREAM open failed\n");
+    goto close_ao0;
+  }
+  double value[2 * 10];
+  int total = 0;
+  while (total < 10) {
+    int scans;
+    if (! moberg_OK(moberg_stream_read(stream, &value[2 * total],
+                                       10 - total, &scans))) {
+      fprintf(stderr, "STREAM read failed\n");
+      goto close_stream;
+    }
+    total += scans;
+  }
+  for (int i = 0 ; i < 10 ; i++) {
+    if (value[2 * i] != 2.0 || value[2 * i + 1] != 1.0) {
+      fprintf(stderr, "STREAM scan %d: %f %f\n",
+              i, value[2 * i], value[2 * i + 1]);
+      goto close_stream;
+    }
+  }
+  fprintf(stderr, "STREAM read %d scans\n", total);
+
+  struct moberg_stream_buffer buffer;
+  if (! moberg_OK(moberg_stream_peek(stream, &buffer))) {
+    fprintf(stderr, "STREAM peek failed\n");
+    goto close_stream;
+  }
+  double offset, scale;
+  moberg_stream_scale(stream, buffer.channel, &offset, &scale);
+  fprintf(stderr, "STREAM peek channel=%d length=%d available=%d\n",
+          buffer.channel, buffer.length, buffer.available);
+  if (buffer.format != MOBERG_SAMPLE_DOUBLE ||
+      offset + ((const double *)buffer.data)[0] * scale != 2.0) {
+    goto close_stream;
+  }
+  if (! moberg_OK(moberg_stream_consume(stream, buffer.length))) {
+    fprintf(stderr, "STREAM consume failed\n");
+    goto close_stream;
+  }
+  result = 0;
+close_stream:
+  moberg_stream_close(stream);
+close_ao0:
+  moberg_analog_out_close(moberg, 0, ao0);
+free:
+  moberg_free(moberg);
+out:
+  return result;
+}
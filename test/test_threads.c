@@ -0,0 +1,107 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <moberg.h>
+
+/* Each thread toggles its own bit of the (shared) libtest digital
+   word and checks that it reads back, while all threads open and close
+   the same analog input; a lost update or refcount shows up as a
+   mismatch, an open/close failure or (under valgrind) a leak */
+
+#define THREADS 8
+#define ITERATIONS 200
+
+struct worker {
+  pthread_t thread;
+  struct moberg *moberg;
+  int index;
+  int failed;
+};
+
+static void *work(void *arg)
+{
+  struct worker *worker = arg;
+  struct moberg *moberg = worker->moberg;
+  int index = worker->index;
+  struct moberg_digital_out dout;
+  struct moberg_digital_in din;
+
+  if (! moberg_OK(moberg_digital_out_open(moberg, index, &dout))) {
+    fprintf(stderr, "OPEN digital_out %d failed\n", index);
+    goto err;
+  }
+  if (! moberg_OK(moberg_digital_in_open(moberg, index, &din))) {
+    fprintf(stderr, "OPEN digital_in %d failed\n", index);
+    goto close_out;
+  }
+  for (int i = 0 ; i < ITERATIONS ; i++) {
+    struct moberg_analog_in ai;
+    double analog;
+    int desired = i & 1, value;
+    if (! moberg_OK(moberg_analog_in_open(moberg, 0, &ai))) {
+      fprintf(stderr, "OPEN analog_in 0 failed\n");
+      worker->failed++;
+      continue;
+    }
+    if (! moberg_OK(dout.write(dout.context, desired, NULL)) ||
+        ! moberg_OK(ai.read(ai.context, &analog)) ||
+        ! moberg_OK(din.read(din.context, &value))) {
+      fprintf(stderr, "I/O %d failed\n", index);
+      worker->failed++;
+    } else if (value != desired) {
+      fprintf(stderr, "digital %d: %d != %d\n", index, value, desired);
+      worker->failed++;
+    }
+    if (! moberg_OK(moberg_digital_out_write_many(moberg, 1, &index,
+                                                  &desired, NULL)) ||
+        ! moberg_OK(moberg_digital_in_read_many(moberg, 1, &index,
+                                                &value)) ||
+        value != desired) {
+      fprintf(stderr, "MANY %d failed\n", index);
+      worker->failed++;
+    }
+    if (! moberg_OK(moberg_analog_in_close(moberg, 0, ai))) {
+      fprintf(stderr, "CLOSE analog_in 0 failed\n");
+      worker->failed++;
+    }
+  }
+  moberg_digital_in_close(moberg, index, din);
+close_out:
+  moberg_digital_out_close(moberg, index, dout);
+  return NULL;
+err:
+  worker->failed++;
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  int result = 1;
+  struct moberg *moberg = moberg_new(NULL);
+  if (! moberg) {
+    fprintf(stderr, "NEW failed\n");
+    goto out;
+  }
+  struct worker worker[THREADS];
+  int started;
+  for (started = 0 ; started < THREADS ; started++) {
+    worker[started].moberg = moberg;
+    worker[started].index = started;
+    worker[started].failed = 0;
+    if (pthread_create(&worker[started].thread, NULL,
+                       work, &worker[started]) != 0) {
+      fprintf(stderr, "THREAD %d failed\n", started);
+      break;
+    }
+  }
+  int failed = started < THREADS;
+  for (int i = 0 ; i < started ; i++) {
+    pthread_join(worker[i].thread, NULL);
+    failed += worker[i].failed;
+  }
+  if (! failed) {
+    result = 0;
+  }
+  moberg_free(moberg);
+out:
+  return result;
+}